@@ -0,0 +1,432 @@
+/*
+ * Listener - Listens for specific directories events and take actions
+ * based on rules specified by the user.
+ *
+ * Copyright (c) 2005-2017 Lucas C. Villa Real <lucasvr@gobolinux.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#include "listener.h"
+#include "publisher.h"
+#include "forwarder.h"
+#include "aggregator.h"
+#include "logger.h"
+#include <endian.h>
+#include <netdb.h>
+#include <openssl/crypto.h>
+#include <openssl/rand.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <zlib.h>
+
+struct session {
+	char host[HOST_NAME_MAX+1];
+	uint64_t id;
+	uint64_t last_seq;			/* last batch taken */
+};
+
+struct stream {
+	int fd;						/* -1 if the slot is free */
+	struct session *session;	/* NULL until the hello is read */
+	unsigned char nonce[FORWARD_NONCE_LEN];	/* of the challenge the hello answers */
+	unsigned char key[FORWARD_MAC_LEN];		/* of the batches, see forward_batch_key() */
+	char *buf;
+	size_t len;
+	size_t size;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	int listen_fd;				/* -1 if not aggregating */
+	pthread_t thread;
+	void (*deliver)(const struct aggregate_event *ev);
+	struct stream streams[AGGREGATE_MAX_STREAMS];
+	struct session *sessions;
+	size_t nsessions;
+	size_t next_evicted;
+	char raw[FORWARD_MAX_BATCH];	/* records of the batch being inflated */
+	struct aggregate_stats stats;	/* under @lock */
+} agg = { .lock = PTHREAD_MUTEX_INITIALIZER, .listen_fd = -1 };
+
+static uint64_t
+realtime_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+close_stream(struct stream *s, const char *why)
+{
+	if (why)
+		log_printf(LOG_LEVEL_WARNING, "aggregate: stream of %s closed: %s",
+			s->session ? s->session->host : "unknown host", why);
+	close(s->fd);
+	free(s->buf);
+	memset(s, 0, sizeof(*s));
+	s->fd = -1;
+	pthread_mutex_lock(&agg.lock);
+	agg.stats.streams--;
+	pthread_mutex_unlock(&agg.lock);
+}
+
+/* host names are made of letters, digits, dots, dashes and underscores */
+static int
+valid_host(const char *host)
+{
+	if (! host[0])
+		return 0;
+	for (; *host; ++host) {
+		if (! isalnum((unsigned char) *host) && ! strchr(".-_", *host))
+			return 0;
+	}
+	return 1;
+}
+
+/* takes a connection and challenges it, see forwarder.h */
+static void
+accept_stream(void)
+{
+	struct forward_challenge challenge = { .magic = htole32(FORWARD_MAGIC) };
+	int fd = accept4(agg.listen_fd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC);
+
+	if (fd < 0)
+		return;
+	if (RAND_bytes(challenge.nonce, sizeof(challenge.nonce)) != 1 ||
+		send(fd, &challenge, sizeof(challenge), MSG_NOSIGNAL|MSG_DONTWAIT) != sizeof(challenge)) {
+		close(fd);
+		return;
+	}
+	for (int i=0; i<AGGREGATE_MAX_STREAMS; ++i) {
+		if (agg.streams[i].fd < 0) {
+			agg.streams[i].fd = fd;
+			memcpy(agg.streams[i].nonce, challenge.nonce, sizeof(challenge.nonce));
+			pthread_mutex_lock(&agg.lock);
+			agg.stats.streams++;
+			pthread_mutex_unlock(&agg.lock);
+			return;
+		}
+	}
+	log_printf(LOG_LEVEL_WARNING, "aggregate: too many streams");
+	close(fd);
+}
+
+/* the session of @host with id @id, a new one if it isn't known */
+static struct session *
+find_session(const char *host, uint64_t id)
+{
+	struct session *s;
+
+	for (size_t i=0; i<agg.nsessions; ++i) {
+		if (agg.sessions[i].id == id && ! strcmp(agg.sessions[i].host, host))
+			return &agg.sessions[i];
+	}
+	if (! agg.sessions && ! (agg.sessions = (struct session *) calloc(AGGREGATE_MAX_SESSIONS, sizeof(struct session))))
+		return NULL;
+	if (agg.nsessions < AGGREGATE_MAX_SESSIONS) {
+		s = &agg.sessions[agg.nsessions++];
+	} else {
+		s = &agg.sessions[agg.next_evicted];
+		agg.next_evicted = (agg.next_evicted + 1) % AGGREGATE_MAX_SESSIONS;
+		for (int i=0; i<AGGREGATE_MAX_STREAMS; ++i) {
+			if (agg.streams[i].session == s)
+				close_stream(&agg.streams[i], "session forgotten");
+		}
+	}
+	snprintf(s->host, sizeof(s->host), "%s", host);
+	s->id = id;
+	s->last_seq = 0;
+	return s;
+}
+
+static void
+send_ack(struct stream *s)
+{
+	uint64_t seq = htole64(s->session->last_seq);
+
+	/* acknowledgements are cumulative, a lost one is covered by the next */
+	if (send(s->fd, &seq, sizeof(seq), MSG_NOSIGNAL|MSG_DONTWAIT) < 0 && errno != EAGAIN && errno != EINTR)
+		close_stream(s, strerror(errno));
+}
+
+/* hands the records of a batch to the hook, returns -1 if they are malformed */
+static int
+deliver_records(struct stream *s, const char *records, size_t len)
+{
+	char dir[PATH_MAX], name[PATH_MAX], old_entry[PATH_MAX], summary[256];
+	uint64_t now = realtime_ns();
+
+	for (size_t off=0; off<len; ) {
+		struct publish_record rec;
+		const char *p = records + off + sizeof(rec);
+		struct aggregate_event ev = {
+			.host = s->session->host, .dir = dir, .name = name, .old_entry = old_entry, .summary = summary
+		};
+		uint64_t lag;
+
+		if (len - off < sizeof(rec))
+			return -1;
+		memcpy(&rec, records + off, sizeof(rec));
+		forward_record_order(&rec, 0);
+		if (rec.length < sizeof(rec) || rec.length > len - off || rec.dir_len >= sizeof(dir) ||
+			rec.name_len >= sizeof(name) || rec.old_len >= sizeof(old_entry) || rec.summary_len >= sizeof(summary) ||
+			sizeof(rec) + rec.dir_len + rec.name_len + rec.old_len + rec.summary_len > rec.length)
+			return -1;
+		off += rec.length;
+		if (! rec.rule_id)
+			continue;
+
+		snprintf(dir, sizeof(dir), "%.*s", (int) rec.dir_len, p);
+		snprintf(name, sizeof(name), "%.*s", (int) rec.name_len, p += rec.dir_len);
+		snprintf(old_entry, sizeof(old_entry), "%.*s", (int) rec.old_len, p += rec.name_len);
+		snprintf(summary, sizeof(summary), "%.*s", (int) rec.summary_len, p += rec.old_len);
+		ev.mask = rec.mask;
+		ev.cookie = rec.cookie;
+		ev.time = rec.time;
+		agg.deliver(&ev);
+
+		lag = now > rec.time ? (now - rec.time) / 1000000 : 0;
+		pthread_mutex_lock(&agg.lock);
+		agg.stats.events++;
+		agg.stats.lag_sum += lag;
+		if (lag > agg.stats.lag_max)
+			agg.stats.lag_max = lag;
+		pthread_mutex_unlock(&agg.lock);
+	}
+	return 0;
+}
+
+/*
+ * Takes the complete messages read from @s, returns -1 on protocol errors
+ * and -2 if the hello doesn't answer the challenge or a batch fails its MAC.
+ */
+static int
+parse_stream(struct stream *s)
+{
+	size_t off = 0;
+	int ack = 0;
+
+	while (2) {
+		char *p = s->buf + off;
+		size_t left = s->len - off;
+
+		if (! s->session) {
+			struct forward_hello h;
+			char host[HOST_NAME_MAX+1];
+			unsigned char mac[FORWARD_MAC_LEN];
+
+			if (left < sizeof(h))
+				break;
+			memcpy(&h, p, sizeof(h));
+			if (le32toh(h.magic) != FORWARD_MAGIC || le32toh(h.host_len) >= sizeof(host))
+				return -1;
+			if (left < sizeof(h) + le32toh(h.host_len))
+				break;
+			snprintf(host, sizeof(host), "%.*s", (int) le32toh(h.host_len), p + sizeof(h));
+			forward_mac(s->nonce, &h, host, mac);
+			if (CRYPTO_memcmp(mac, h.mac, sizeof(mac)) != 0)
+				return -2;
+			if (! valid_host(host) || ! (s->session = find_session(host, le64toh(h.session))))
+				return -1;
+			forward_batch_key(h.mac, s->key);
+			log_printf(LOG_LEVEL_INFO, "aggregate: stream of %s, batch %llu taken so far", host,
+				(unsigned long long) s->session->last_seq);
+			off += sizeof(h) + le32toh(h.host_len);
+			ack = 1;
+		} else {
+			struct forward_batch b;
+			unsigned char mac[FORWARD_MAC_LEN];
+			uint32_t len, raw_len;
+			uint64_t seq;
+
+			if (left < sizeof(b))
+				break;
+			memcpy(&b, p, sizeof(b));
+			len = le32toh(b.len);
+			raw_len = le32toh(b.raw_len);
+			seq = le64toh(b.seq);
+			if (le32toh(b.magic) != FORWARD_MAGIC || len > FORWARD_MAX_BATCH || raw_len > FORWARD_MAX_BATCH)
+				return -1;
+			if (left < sizeof(b) + len)
+				break;
+			forward_batch_mac(s->key, &b, p + sizeof(b), mac);
+			if (CRYPTO_memcmp(mac, b.mac, sizeof(mac)) != 0)
+				return -2;
+			off += sizeof(b) + len;
+			ack = 1;
+
+			pthread_mutex_lock(&agg.lock);
+			agg.stats.wire_bytes += sizeof(b) + len;
+			if (seq <= s->session->last_seq)
+				agg.stats.duplicates++;
+			else
+				agg.stats.batches++;
+			pthread_mutex_unlock(&agg.lock);
+			if (seq <= s->session->last_seq)
+				continue;
+
+			if (le32toh(b.flags) & FORWARD_COMPRESSED) {
+				uLongf got = raw_len;
+				if (uncompress((Bytef *) agg.raw, &got, (Bytef *) (p + sizeof(b)), len) != Z_OK || got != raw_len)
+					return -1;
+				if (deliver_records(s, agg.raw, raw_len) < 0)
+					return -1;
+			} else if (deliver_records(s, p + sizeof(b), len) < 0) {
+				return -1;
+			}
+			s->session->last_seq = seq;
+		}
+	}
+	if (off) {
+		memmove(s->buf, s->buf + off, s->len - off);
+		s->len -= off;
+	}
+	if (ack)
+		send_ack(s);
+	return 0;
+}
+
+static void
+read_stream(struct stream *s)
+{
+	ssize_t n;
+	int ret;
+
+	if (s->size - s->len < 16384) {
+		size_t size = s->size ? s->size * 2 : 65536;
+		char *buf;
+		if (size > 2 * (sizeof(struct forward_batch) + FORWARD_MAX_BATCH) ||
+			! (buf = (char *) realloc(s->buf, size))) {
+			close_stream(s, "message too long");
+			return;
+		}
+		s->buf = buf;
+		s->size = size;
+	}
+	n = recv(s->fd, s->buf + s->len, s->size - s->len, MSG_DONTWAIT);
+	if (n == 0) {
+		close_stream(s, NULL);
+		return;
+	}
+	if (n < 0) {
+		if (errno != EAGAIN && errno != EINTR)
+			close_stream(s, strerror(errno));
+		return;
+	}
+	s->len += n;
+	if ((ret = parse_stream(s)) < 0)
+		close_stream(s, ret == -2 ? "authentication failed" : "malformed data");
+}
+
+static void *
+aggregate_events(void *data)
+{
+	struct pollfd pfds[AGGREGATE_MAX_STREAMS+1];
+	struct stream *polled[AGGREGATE_MAX_STREAMS+1];
+
+	while (2) {
+		int n = 1;
+
+		pfds[0] = (struct pollfd) { .fd = agg.listen_fd, .events = POLLIN };
+		for (int i=0; i<AGGREGATE_MAX_STREAMS; ++i) {
+			if (agg.streams[i].fd >= 0) {
+				polled[n] = &agg.streams[i];
+				pfds[n++] = (struct pollfd) { .fd = agg.streams[i].fd, .events = POLLIN };
+			}
+		}
+		if (poll(pfds, n, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			log_printf(LOG_LEVEL_ERROR, "poll: %s", strerror(errno));
+			return NULL;
+		}
+		if (pfds[0].revents & POLLIN)
+			accept_stream();
+		for (int i=1; i<n; ++i) {
+			if (polled[i]->fd == pfds[i].fd && (pfds[i].revents & (POLLIN|POLLHUP|POLLERR)))
+				read_stream(polled[i]);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * @address is [HOST:]PORT, the socket is opened before daemonizing. Without
+ * HOST, only 127.0.0.1 is listened on; a HOST of '*' stands for every
+ * interface.
+ */
+int
+aggregator_init(const char *address)
+{
+	struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM }, *res, *ai;
+	const char *colon = strrchr(address, ':');
+	char *host = colon ? strndup(address, colon - address) : NULL;
+	int fd = -1, one = 1, ret;
+
+	if (host && host[0] == '[' && host[strlen(host)-1] == ']') {
+		memmove(host, host + 1, strlen(host));
+		host[strlen(host)-1] = '\0';
+	}
+	if (host && ! strcmp(host, "*")) {
+		hints.ai_flags = AI_PASSIVE;
+		host[0] = '\0';
+	}
+	ret = getaddrinfo(host && host[0] ? host : hints.ai_flags ? NULL : "127.0.0.1", colon ? colon + 1 : address, &hints, &res);
+	free(host);
+	if (ret != 0) {
+		fprintf(stderr, "%s: %s\n", address, gai_strerror(ret));
+		return -1;
+	}
+	for (ai=res; ai; ai=ai->ai_next) {
+		if ((fd = socket(ai->ai_family, ai->ai_socktype|SOCK_NONBLOCK|SOCK_CLOEXEC, ai->ai_protocol)) < 0)
+			continue;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 16) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	if (fd < 0) {
+		perror(address);
+		return -1;
+	}
+	for (int i=0; i<AGGREGATE_MAX_STREAMS; ++i)
+		agg.streams[i].fd = -1;
+	agg.listen_fd = fd;
+	return 0;
+}
+
+int
+aggregator_start(void (*deliver)(const struct aggregate_event *ev))
+{
+	if (agg.listen_fd < 0)
+		return 0;
+	agg.deliver = deliver;
+	if (pthread_create(&agg.thread, NULL, aggregate_events, NULL) != 0) {
+		perror("pthread_create");
+		return -1;
+	}
+	return 0;
+}
+
+void
+aggregator_get_stats(struct aggregate_stats *stats)
+{
+	pthread_mutex_lock(&agg.lock);
+	*stats = agg.stats;
+	pthread_mutex_unlock(&agg.lock);
+}
@@ -0,0 +1,64 @@
+/*
+ * Listener - Listens for specific directories events and take actions
+ * based on rules specified by the user.
+ *
+ * Copyright (c) 2005-2017 Lucas C. Villa Real <lucasvr@gobolinux.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#ifndef LISTENER_AGGREGATOR_H
+#define LISTENER_AGGREGATOR_H 1
+
+/*
+ * Receiving end of forwarding, see forwarder.h. Takes the streams of up to
+ * AGGREGATE_MAX_STREAMS forwarders on a TCP socket and hands every event
+ * they send to a hook, which runs the rules using the REMOTE backend. The
+ * last sequence number taken from each session is remembered, so batches
+ * sent again after a reconnection are only acknowledged.
+ *
+ * Forwarders are trusted once they prove they know the shared secret, see
+ * forwarder.h, and every batch they send is authenticated. The names they
+ * send are quoted for the shell when they reach command lines, see rules.c.
+ */
+
+#define AGGREGATE_MAX_STREAMS   64
+#define AGGREGATE_MAX_SESSIONS  1024	/* the oldest are forgotten past this */
+
+struct aggregate_event {
+	const char *host;			/* as told by the forwarder */
+	uint32_t mask;
+	uint32_t cookie;
+	uint64_t time;				/* ns since the epoch, on the forwarder */
+	const char *dir;
+	const char *name;
+	const char *old_entry;
+	const char *summary;
+};
+
+struct aggregate_stats {
+	size_t streams;
+	unsigned long long batches;
+	unsigned long long events;
+	unsigned long long duplicates;	/* batches received again */
+	unsigned long long wire_bytes;
+	uint64_t lag_sum;				/* ms from the reading of events to their arrival */
+	uint64_t lag_max;
+};
+
+int  aggregator_init(const char *address);
+int  aggregator_start(void (*deliver)(const struct aggregate_event *ev));
+void aggregator_get_stats(struct aggregate_stats *stats);
+
+#endif /* LISTENER_AGGREGATOR_H */
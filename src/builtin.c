@@ -0,0 +1,146 @@
+/*
+ * Listener - Listens for specific directories events and take actions
+ * based on rules specified by the user.
+ *
+ * Copyright (c) 2005-2017 Lucas C. Villa Real <lucasvr@gobolinux.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#include "listener.h"
+#include "builtin.h"
+#include "linkindex.h"
+#include "logger.h"
+
+#define BUILTIN_MAX_ARGS 32
+
+struct builtin_type {
+	const char *name;
+	void *(*create)(char **argv, int argc);
+	int   (*start)(void *data);
+	int   (*run)(void *data, const char *path);
+};
+
+static void *
+remove_broken_create(char **argv, int argc)
+{
+	char *defaults[] = { "/System/Index", "/System/Settings" };
+
+	if (argc == 0)
+		return linkindex_create(defaults, 2);
+	return linkindex_create(argv, argc);
+}
+
+static int
+remove_broken_start(void *data)
+{
+	return linkindex_start((struct linkindex *) data);
+}
+
+static int
+remove_broken_run(void *data, const char *path)
+{
+	return linkindex_remove_broken((struct linkindex *) data, path);
+}
+
+static const struct builtin_type builtin_types[] = {
+	{ "RemoveBroken", remove_broken_create, remove_broken_start, remove_broken_run },
+	{ NULL,           NULL,                 NULL,                NULL }
+};
+
+static struct builtin *builtin_list;
+
+struct builtin *
+builtin_load(const char *spec)
+{
+	const struct builtin_type *type;
+	struct builtin *builtin;
+	char *argv[BUILTIN_MAX_ARGS], *saveptr, *token;
+	char buf[LINE_MAX];
+	int argc = 0;
+
+	snprintf(buf, sizeof(buf), "%s", spec);
+	for (token=strtok_r(buf, " \t", &saveptr); token; token=strtok_r(NULL, " \t", &saveptr)) {
+		if (argc == BUILTIN_MAX_ARGS) {
+			fprintf(stderr, "%s: too many arguments\n", spec);
+			return NULL;
+		}
+		argv[argc++] = token;
+	}
+	if (argc == 0) {
+		fprintf(stderr, "Config file error: empty 'builtin' option\n");
+		return NULL;
+	}
+
+	for (type=builtin_types; type->name; type++) {
+		if (! strcmp(type->name, argv[0]))
+			break;
+	}
+	if (! type->name) {
+		fprintf(stderr, "%s: unknown builtin action\n", argv[0]);
+		return NULL;
+	}
+
+	builtin = (struct builtin *) calloc(1, sizeof(struct builtin));
+	if (! builtin) {
+		perror("calloc");
+		return NULL;
+	}
+	snprintf(builtin->spec, sizeof(builtin->spec), "%s", spec);
+	builtin->type = type;
+	builtin->data = type->create(&argv[1], argc-1);
+	if (! builtin->data) {
+		free(builtin);
+		return NULL;
+	}
+
+	builtin->next = builtin_list;
+	builtin_list = builtin;
+	return builtin;
+}
+
+/* runs in the daemon process, once the configuration has been read */
+int
+builtin_init_all(void)
+{
+	for (struct builtin *builtin=builtin_list; builtin != NULL; builtin=builtin->next) {
+		if (builtin->type->start && builtin->type->start(builtin->data) < 0) {
+			fprintf(stderr, "%s: failed to start\n", builtin->spec);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void
+builtin_dispatch(struct thread_info *list)
+{
+	char path[PATH_MAX];
+
+	for (struct thread_info *info=list; info != NULL; info=info->next) {
+		struct builtin *builtin = info->rule->builtin;
+
+		if (info->offending_name[0] == '/')
+			snprintf(path, sizeof(path), "%s", info->offending_name);
+		else if (snprintf(path, sizeof(path), "%s/%s", info->dir, info->offending_name) >= (int) sizeof(path)) {
+			info->status = -1;
+			log_printf(LOG_LEVEL_ERROR, "%s/%s: path too long", info->dir, info->offending_name);
+			continue;
+		}
+
+		info->status = builtin->type->run(builtin->data, path) < 0 ? -1 : 0;
+		if (info->status != 0)
+			log_printf(LOG_LEVEL_ERROR, "%s: failed on %s", builtin->spec, path);
+	}
+}
@@ -0,0 +1,46 @@
+/*
+ * Listener - Listens for specific directories events and take actions
+ * based on rules specified by the user.
+ *
+ * Copyright (c) 2005-2017 Lucas C. Villa Real <lucasvr@gobolinux.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#ifndef LISTENER_BUILTIN_H
+#define LISTENER_BUILTIN_H 1
+
+/*
+ * Actions implemented by the daemon itself. A rule using
+ *
+ *     "builtin": "RemoveBroken /System/Index /System/Settings"
+ *
+ * runs the named action with the given arguments on every matched event,
+ * without spawning a process.
+ */
+
+struct builtin_type;
+
+struct builtin {
+	const struct builtin_type *type;
+	void *data;					/* state created from the arguments */
+	char spec[LINE_MAX];		/* as given in the config */
+	struct builtin *next;
+};
+
+struct builtin *builtin_load(const char *spec);
+int             builtin_init_all(void);
+void            builtin_dispatch(struct thread_info *list);
+
+#endif /* LISTENER_BUILTIN_H */
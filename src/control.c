@@ -0,0 +1,286 @@
+/*
+ * Listener - Listens for specific directories events and take actions
+ * based on rules specified by the user.
+ *
+ * Copyright (c) 2005-2017 Lucas C. Villa Real <lucasvr@gobolinux.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#include "listener.h"
+#include "control.h"
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/signalfd.h>
+
+struct client {
+	int fd;						/* -1 if the slot is free */
+	int pending;				/* the reply is completed by the pending hook */
+	int eof;					/* closed for writing, closed once the replies are sent */
+	size_t in_len;
+	char in[CONTROL_MAX_LINE];	/* partial command lines */
+	char *out;					/* reply bytes not sent yet */
+	size_t out_len;
+	size_t out_sent;
+};
+
+static struct client clients[CONTROL_MAX_CLIENTS];
+
+/*
+ * Listens on the Unix stream socket @path, replacing any stale one, with
+ * access restricted to the owner. @what names the socket in error messages.
+ */
+int
+control_listen(const char *path, const char *what)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "%s: %s socket path is too long\n", path, what);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("socket");
+		return -1;
+	}
+	unlink(path);
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || chmod(path, 0600) < 0 || listen(fd, 8) < 0) {
+		perror(path);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void
+close_client(struct client *c)
+{
+	close(c->fd);
+	free(c->out);
+	memset(c, 0, sizeof(*c));
+	c->fd = -1;
+}
+
+static void
+accept_client(int listen_fd)
+{
+	int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC);
+
+	if (fd < 0)
+		return;
+	for (int i=0; i<CONTROL_MAX_CLIENTS; ++i) {
+		if (clients[i].fd < 0) {
+			clients[i].fd = fd;
+			return;
+		}
+	}
+	close(fd);
+}
+
+static void
+append_reply(struct client *c, const char *data, size_t len)
+{
+	char *out = (char *) realloc(c->out, c->out_len + len);
+
+	if (! out) {
+		perror("realloc");
+		return;
+	}
+	memcpy(out + c->out_len, data, len);
+	c->out = out;
+	c->out_len += len;
+}
+
+/* runs @hook with a stream whose content is queued as the reply of @c */
+static int
+run_hook(struct client *c, const struct control_ops *ops, int argc, char **argv)
+{
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *out = open_memstream(&buf, &len);
+	int ret;
+
+	if (! out) {
+		perror("open_memstream");
+		return CONTROL_DONE;
+	}
+	ret = c->pending ? ops->pending(out) : ops->command(argc, argv, out);
+	fclose(out);
+	append_reply(c, buf, len);
+	free(buf);
+	c->pending = ret == CONTROL_PENDING;
+	return ret;
+}
+
+/* runs the complete lines received from @c */
+static int
+run_commands(struct client *c, const struct control_ops *ops)
+{
+	char *eol, *argv[CONTROL_MAX_ARGS+1], *saveptr;
+	int argc, ret = CONTROL_DONE;
+
+	while (! c->pending && ret != CONTROL_EXIT && (eol = memchr(c->in, '\n', c->in_len))) {
+		size_t line_len = eol - c->in + 1;
+
+		*eol = '\0';
+		argc = 0;
+		for (char *word = strtok_r(c->in, " \t\r", &saveptr); word && argc < CONTROL_MAX_ARGS;
+				word = strtok_r(NULL, " \t\r", &saveptr))
+			argv[argc++] = word;
+		argv[argc] = NULL;
+		if (argc)
+			ret = run_hook(c, ops, argc, argv);
+
+		memmove(c->in, c->in + line_len, c->in_len - line_len);
+		c->in_len -= line_len;
+	}
+	return ret;
+}
+
+static int
+read_client(struct client *c, const struct control_ops *ops)
+{
+	ssize_t n;
+
+	if (c->in_len == sizeof(c->in)) {
+		static const char error[] = "error: line too long\n";
+		append_reply(c, error, sizeof(error)-1);
+		c->in_len = 0;
+	}
+	n = recv(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len, 0);
+	if (n == 0)
+		c->eof = 1;
+	if (n < 0 && errno != EAGAIN && errno != EINTR) {
+		close_client(c);
+		return CONTROL_DONE;
+	}
+	if (n > 0)
+		c->in_len += n;
+	return run_commands(c, ops);
+}
+
+static void
+write_client(struct client *c)
+{
+	ssize_t n = send(c->fd, c->out + c->out_sent, c->out_len - c->out_sent, MSG_NOSIGNAL|MSG_DONTWAIT);
+
+	if (n < 0 && errno != EAGAIN && errno != EINTR) {
+		close_client(c);
+		return;
+	}
+	if (n > 0)
+		c->out_sent += n;
+	if (c->out_sent == c->out_len) {
+		free(c->out);
+		c->out = NULL;
+		c->out_len = c->out_sent = 0;
+	}
+}
+
+/* sends what is left of the replies before the daemon goes away */
+static void
+flush_clients(void)
+{
+	for (int i=0; i<CONTROL_MAX_CLIENTS; ++i) {
+		struct client *c = &clients[i];
+		if (c->fd < 0)
+			continue;
+		fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) & ~O_NONBLOCK);
+		while (c->fd >= 0 && c->out_len)
+			write_client(c);
+		if (c->fd >= 0)
+			close_client(c);
+	}
+}
+
+/*
+ * Serves the control socket at @path, if set, and the @signals, which must
+ * be blocked in every thread. Returns once a command asked the daemon to
+ * stop, or -1 if the socket can't be created.
+ */
+int
+control_loop(const char *path, const struct control_ops *ops, const sigset_t *signals)
+{
+	struct pollfd pfds[CONTROL_MAX_CLIENTS+2];
+	int listen_fd = -1, signal_fd, ret = CONTROL_DONE;
+
+	for (int i=0; i<CONTROL_MAX_CLIENTS; ++i)
+		clients[i].fd = -1;
+	if (path && (listen_fd = control_listen(path, "control")) < 0)
+		return -1;
+	signal_fd = signalfd(-1, signals, SFD_NONBLOCK|SFD_CLOEXEC);
+	if (signal_fd < 0) {
+		perror("signalfd");
+		return -1;
+	}
+
+	while (ret != CONTROL_EXIT) {
+		int npending = 0, n = 2;
+
+		pfds[0] = (struct pollfd) { .fd = signal_fd, .events = POLLIN };
+		pfds[1] = (struct pollfd) { .fd = listen_fd, .events = POLLIN };
+		for (int i=0; i<CONTROL_MAX_CLIENTS; ++i) {
+			struct client *c = &clients[i];
+			if (c->fd < 0)
+				continue;
+			npending += c->pending;
+			if (! c->eof || c->out_len)
+				pfds[n++] = (struct pollfd) { .fd = c->fd, .events = (c->eof ? 0 : POLLIN) | (c->out_len ? POLLOUT : 0) };
+		}
+		if (poll(pfds, n, npending ? CONTROL_TICK : -1) < 0 && errno != EINTR) {
+			perror("poll");
+			break;
+		}
+
+		if (pfds[0].revents & POLLIN) {
+			struct signalfd_siginfo si;
+			while (read(signal_fd, &si, sizeof(si)) == sizeof(si)) {
+				if (ops->signal(si.ssi_signo) == CONTROL_EXIT)
+					ret = CONTROL_EXIT;
+			}
+		}
+		if (pfds[1].revents & POLLIN)
+			accept_client(listen_fd);
+
+		for (int i=0, k=2; i<CONTROL_MAX_CLIENTS && ret != CONTROL_EXIT; ++i) {
+			struct client *c = &clients[i];
+			short revents;
+
+			if (c->fd < 0)
+				continue;
+			/* clients accepted above have no entry in @pfds yet */
+			revents = k < n && pfds[k].fd == c->fd ? pfds[k++].revents : 0;
+			if (c->pending && (ret = run_hook(c, ops, 0, NULL)) == CONTROL_DONE)
+				ret = run_commands(c, ops);
+			if (ret != CONTROL_EXIT && (revents & (POLLIN|POLLHUP|POLLERR)))
+				ret = read_client(c, ops);
+			if (c->fd >= 0 && c->out_len && ret != CONTROL_EXIT)
+				write_client(c);
+			if (c->fd >= 0 && c->eof && ! c->pending && ! c->out_len)
+				close_client(c);
+		}
+	}
+
+	flush_clients();
+	close(signal_fd);
+	if (listen_fd >= 0) {
+		close(listen_fd);
+		unlink(path);
+	}
+	return 0;
+}
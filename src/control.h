@@ -0,0 +1,53 @@
+/*
+ * Listener - Listens for specific directories events and take actions
+ * based on rules specified by the user.
+ *
+ * Copyright (c) 2005-2017 Lucas C. Villa Real <lucasvr@gobolinux.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#ifndef LISTENER_CONTROL_H
+#define LISTENER_CONTROL_H 1
+
+/*
+ * Control socket of the daemon. Clients connect to a Unix stream socket and
+ * send one command per line; the words of the line are handed to the command
+ * hook, whose output is sent back. The loop runs on the main thread, so the
+ * readers, dispatchers and workers keep processing events meanwhile.
+ *
+ * Commands that can't complete at once (such as draining the executor)
+ * return CONTROL_PENDING, and the pending hook is then polled every
+ * CONTROL_TICK ms until it completes the reply.
+ */
+
+#define CONTROL_DONE        0	/* the reply is complete */
+#define CONTROL_PENDING     1	/* call the pending hook later */
+#define CONTROL_EXIT        2	/* the reply is complete and the daemon stops */
+
+#define CONTROL_MAX_CLIENTS 16
+#define CONTROL_MAX_LINE    1024
+#define CONTROL_MAX_ARGS    8
+#define CONTROL_TICK        100
+
+struct control_ops {
+	int  (*command)(int argc, char **argv, FILE *out);
+	int  (*pending)(FILE *out);
+	int  (*signal)(int signum);	/* for the signals given to control_loop() */
+};
+
+int control_loop(const char *path, const struct control_ops *ops, const sigset_t *signals);
+int control_listen(const char *path, const char *what);
+
+#endif /* LISTENER_CONTROL_H */
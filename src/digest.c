@@ -0,0 +1,406 @@
+/*
+ * Listener - Listens for specific directories events and take actions
+ * based on rules specified by the user.
+ *
+ * Copyright (c) 2005-2017 Lucas C. Villa Real <lucasvr@gobolinux.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#include "listener.h"
+#include "digest.h"
+#include <time.h>
+#include <openssl/evp.h>
+#include <openssl/lhash.h>
+
+#define DIGEST_LENGTH     32		/* SHA-256 */
+#define DIGEST_READ_SIZE  (256 << 10)
+
+struct digest_entry {
+	char *path;
+	int rule_id;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+	unsigned char md[DIGEST_LENGTH];
+	struct digest_entry *prev;	/* LRU list, most recently used first */
+	struct digest_entry *next;
+};
+
+/* chunks of a large file, hashed by the pool and by the thread waiting for them */
+struct chunk_batch {
+	int fd;
+	off_t size;
+	int pending;
+	int failed;
+	unsigned char *mds;
+};
+
+struct chunk_job {
+	struct chunk_batch *batch;
+	off_t offset;
+	size_t length;
+	unsigned char *md;
+	struct chunk_job *next;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	_LHASH *entries;			/* (rule, path) -> struct digest_entry */
+	struct digest_entry *head;
+	struct digest_entry *tail;
+	size_t count;
+	struct digest_stats stats;
+} cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static struct {
+	pthread_once_t once;
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+	struct chunk_job *head;
+	struct chunk_job *tail;
+} pool = {
+	.once = PTHREAD_ONCE_INIT,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+};
+
+static unsigned long
+entry_hash(const void *data)
+{
+	const struct digest_entry *entry = (const struct digest_entry *) data;
+	return lh_strhash(entry->path) ^ (unsigned long) entry->rule_id;
+}
+
+static int
+entry_compare(const void *a, const void *b)
+{
+	const struct digest_entry *x = (const struct digest_entry *) a;
+	const struct digest_entry *y = (const struct digest_entry *) b;
+	return x->rule_id != y->rule_id ? x->rule_id - y->rule_id : strcmp(x->path, y->path);
+}
+
+static unsigned long long
+monotonic_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* hashes @length bytes of @fd from @offset into @md */
+static int
+hash_range(int fd, off_t offset, size_t length, unsigned char *md)
+{
+	EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+	unsigned char *buf = (unsigned char *) malloc(DIGEST_READ_SIZE);
+	int ret = -1;
+
+	if (! ctx || ! buf || ! EVP_DigestInit_ex(ctx, EVP_sha256(), NULL))
+		goto out;
+	while (length) {
+		ssize_t n = pread(fd, buf, length < DIGEST_READ_SIZE ? length : DIGEST_READ_SIZE, offset);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;	/* truncated meanwhile, the size in the cache won't match next time */
+		EVP_DigestUpdate(ctx, buf, n);
+		offset += n;
+		length -= n;
+	}
+	if (EVP_DigestFinal_ex(ctx, md, NULL))
+		ret = 0;
+out:
+	EVP_MD_CTX_free(ctx);
+	free(buf);
+	return ret;
+}
+
+static void
+run_chunk(struct chunk_job *job)
+{
+	int ret = hash_range(job->batch->fd, job->offset, job->length, job->md);
+
+	pthread_mutex_lock(&pool.lock);
+	if (ret < 0)
+		job->batch->failed = 1;
+	if (--job->batch->pending == 0)
+		pthread_cond_broadcast(&pool.done);
+	pthread_mutex_unlock(&pool.lock);
+}
+
+/* pops a chunk, pool.lock held */
+static struct chunk_job *
+next_chunk(void)
+{
+	struct chunk_job *job = pool.head;
+
+	if (job) {
+		pool.head = job->next;
+		if (! pool.head)
+			pool.tail = NULL;
+	}
+	return job;
+}
+
+static void *
+pool_main(void *data)
+{
+	pthread_mutex_lock(&pool.lock);
+	while (1) {
+		struct chunk_job *job = next_chunk();
+		if (! job) {
+			pthread_cond_wait(&pool.work, &pool.lock);
+			continue;
+		}
+		pthread_mutex_unlock(&pool.lock);
+		run_chunk(job);
+		pthread_mutex_lock(&pool.lock);
+	}
+	return NULL;
+}
+
+static void
+start_pool(void)
+{
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int nthreads = ncpus > 1 ? ncpus - 1 : 1;
+	pthread_t tid;
+
+	if (nthreads > DIGEST_MAX_THREADS)
+		nthreads = DIGEST_MAX_THREADS;
+	/* without threads, the waiting thread hashes every chunk itself */
+	for (int i=0; i<nthreads; ++i) {
+		if (pthread_create(&tid, NULL, pool_main, NULL) != 0) {
+			perror("pthread_create");
+			break;
+		}
+		pthread_detach(tid);
+	}
+}
+
+/* hashes the digests of the chunks of a large file */
+static int
+hash_parallel(int fd, off_t size, unsigned char *md)
+{
+	size_t nchunks = (size + DIGEST_CHUNK_SIZE - 1) / DIGEST_CHUNK_SIZE;
+	struct chunk_batch batch = { .fd = fd, .size = size, .pending = nchunks };
+	struct chunk_job *jobs;
+	int ret = -1;
+
+	pthread_once(&pool.once, start_pool);
+	jobs = (struct chunk_job *) calloc(nchunks, sizeof(struct chunk_job));
+	batch.mds = (unsigned char *) malloc(nchunks * DIGEST_LENGTH);
+	if (! jobs || ! batch.mds)
+		goto out;
+
+	pthread_mutex_lock(&pool.lock);
+	for (size_t i=0; i<nchunks; ++i) {
+		jobs[i].batch = &batch;
+		jobs[i].offset = (off_t) i * DIGEST_CHUNK_SIZE;
+		jobs[i].length = i == nchunks-1 ? size - jobs[i].offset : DIGEST_CHUNK_SIZE;
+		jobs[i].md = &batch.mds[i * DIGEST_LENGTH];
+		if (pool.tail)
+			pool.tail->next = &jobs[i];
+		else
+			pool.head = &jobs[i];
+		pool.tail = &jobs[i];
+	}
+	pthread_cond_broadcast(&pool.work);
+
+	/* help rather than sleep while chunks are queued */
+	while (batch.pending) {
+		struct chunk_job *job = next_chunk();
+		if (! job) {
+			pthread_cond_wait(&pool.done, &pool.lock);
+			continue;
+		}
+		pthread_mutex_unlock(&pool.lock);
+		run_chunk(job);
+		pthread_mutex_lock(&pool.lock);
+	}
+	pthread_mutex_unlock(&pool.lock);
+
+	if (! batch.failed && EVP_Digest(batch.mds, nchunks * DIGEST_LENGTH, md, NULL, EVP_sha256(), NULL))
+		ret = 0;
+out:
+	free(jobs);
+	free(batch.mds);
+	return ret;
+}
+
+static void
+lru_unlink(struct digest_entry *entry)
+{
+	if (entry->prev)
+		entry->prev->next = entry->next;
+	else
+		cache.head = entry->next;
+	if (entry->next)
+		entry->next->prev = entry->prev;
+	else
+		cache.tail = entry->prev;
+	entry->prev = entry->next = NULL;
+}
+
+static void
+lru_push(struct digest_entry *entry)
+{
+	entry->next = cache.head;
+	if (cache.head)
+		cache.head->prev = entry;
+	else
+		cache.tail = entry;
+	cache.head = entry;
+}
+
+static void
+free_entry(struct digest_entry *entry)
+{
+	lh_delete(cache.entries, entry);
+	lru_unlink(entry);
+	cache.count--;
+	free(entry->path);
+	free(entry);
+}
+
+/* cache.lock held */
+static struct digest_entry *
+lookup(int rule_id, const char *path)
+{
+	struct digest_entry key = { .path = (char *) path, .rule_id = rule_id };
+
+	if (! cache.entries && ! (cache.entries = lh_new(entry_hash, entry_compare)))
+		return NULL;
+	return (struct digest_entry *) lh_retrieve(cache.entries, &key);
+}
+
+/* cache.lock held */
+static struct digest_entry *
+insert(int rule_id, const char *path)
+{
+	struct digest_entry *entry = (struct digest_entry *) calloc(1, sizeof(struct digest_entry));
+
+	if (! entry || ! cache.entries || ! (entry->path = strdup(path))) {
+		free(entry);
+		return NULL;
+	}
+	entry->rule_id = rule_id;
+	lh_insert(cache.entries, entry);
+	lru_push(entry);
+	if (++cache.count > DIGEST_CACHE_SIZE) {
+		free_entry(cache.tail);
+		cache.stats.evictions++;
+	}
+	return entry;
+}
+
+static int
+same_file(const struct digest_entry *entry, const struct stat *st)
+{
+	return entry->dev == st->st_dev && entry->ino == st->st_ino && entry->size == st->st_size &&
+		entry->mtime.tv_sec == st->st_mtim.tv_sec && entry->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/*
+ * Tells if the content of @path differs from the last time it was seen by
+ * rule @rule_id. Files never seen before, and anything that can't be read as
+ * a regular file, count as changed.
+ */
+int
+digest_changed(int rule_id, const char *path)
+{
+	struct digest_entry *entry;
+	unsigned char md[DIGEST_LENGTH];
+	unsigned long long start;
+	struct stat st;
+	int fd, ret, changed;
+
+	fd = open(path, O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+	if (fd < 0)
+		return 1;
+	if (fstat(fd, &st) < 0 || ! S_ISREG(st.st_mode)) {
+		close(fd);
+		return 1;
+	}
+
+	pthread_mutex_lock(&cache.lock);
+	entry = lookup(rule_id, path);
+	if (entry && same_file(entry, &st)) {
+		lru_unlink(entry);
+		lru_push(entry);
+		cache.stats.hits++;
+		pthread_mutex_unlock(&cache.lock);
+		close(fd);
+		return 0;
+	}
+	pthread_mutex_unlock(&cache.lock);
+
+	start = monotonic_us();
+	if (st.st_size >= DIGEST_PARALLEL_SIZE)
+		ret = hash_parallel(fd, st.st_size, md);
+	else
+		ret = hash_range(fd, 0, st.st_size, md);
+	close(fd);
+	if (ret < 0)
+		return 1;
+
+	pthread_mutex_lock(&cache.lock);
+	cache.stats.usecs += monotonic_us() - start;
+	cache.stats.bytes += st.st_size;
+	cache.stats.hashed++;
+	if (st.st_size >= DIGEST_PARALLEL_SIZE)
+		cache.stats.parallel++;
+
+	/* looked up again, the entry may have been evicted while hashing */
+	entry = lookup(rule_id, path);
+	changed = ! entry || memcmp(entry->md, md, DIGEST_LENGTH);
+	if (! changed)
+		cache.stats.unchanged++;
+	if (entry || (entry = insert(rule_id, path))) {
+		entry->dev = st.st_dev;
+		entry->ino = st.st_ino;
+		entry->size = st.st_size;
+		entry->mtime = st.st_mtim;
+		memcpy(entry->md, md, DIGEST_LENGTH);
+		lru_unlink(entry);
+		lru_push(entry);
+	}
+	pthread_mutex_unlock(&cache.lock);
+	return changed;
+}
+
+/* drops the digest of a removed or renamed file */
+void
+digest_forget(int rule_id, const char *path)
+{
+	struct digest_entry *entry;
+
+	pthread_mutex_lock(&cache.lock);
+	if ((entry = lookup(rule_id, path)))
+		free_entry(entry);
+	pthread_mutex_unlock(&cache.lock);
+}
+
+void
+digest_get_stats(struct digest_stats *stats)
+{
+	pthread_mutex_lock(&cache.lock);
+	*stats = cache.stats;
+	stats->entries = cache.count;
+	pthread_mutex_unlock(&cache.lock);
+}
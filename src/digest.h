@@ -0,0 +1,53 @@
+/*
+ * Listener - Listens for specific directories events and take actions
+ * based on rules specified by the user.
+ *
+ * Copyright (c) 2005-2017 Lucas C. Villa Real <lucasvr@gobolinux.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#ifndef LISTENER_DIGEST_H
+#define LISTENER_DIGEST_H 1
+
+/*
+ * Content digests of the files seen by rules using 'on_content_change_only'.
+ * The digest of each (rule, path) is kept in a bounded LRU cache together
+ * with the inode, size and mtime of the file it was computed from. When those
+ * still match, the file is taken as unchanged without reading it; otherwise
+ * it is read again with pread() and hashed, large files in chunks spread
+ * over a small pool of threads.
+ */
+
+#define DIGEST_CACHE_SIZE     8192		/* (rule, path) digests remembered */
+#define DIGEST_CHUNK_SIZE     (4 << 20)	/* bytes hashed by one pool job */
+#define DIGEST_PARALLEL_SIZE  (16 << 20)	/* files this large are hashed in chunks */
+#define DIGEST_MAX_THREADS    8
+
+struct digest_stats {
+	size_t entries;					/* digests in the cache */
+	unsigned long long hits;		/* files taken as unchanged from their inode, size and mtime */
+	unsigned long long hashed;		/* files read and hashed */
+	unsigned long long parallel;	/* ... of which in chunks by the pool */
+	unsigned long long unchanged;	/* ... of which had the digest already known */
+	unsigned long long evictions;
+	unsigned long long bytes;		/* bytes hashed */
+	unsigned long long usecs;		/* time spent hashing them */
+};
+
+int  digest_changed(int rule_id, const char *path);
+void digest_forget(int rule_id, const char *path);
+void digest_get_stats(struct digest_stats *stats);
+
+#endif /* LISTENER_DIGEST_H */
@@ -0,0 +1,197 @@
+/*
+ * Listener - Listens for specific directories events and take actions
+ * based on rules specified by the user.
+ *
+ * Copyright (c) 2005-2017 Lucas C. Villa Real <lucasvr@gobolinux.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#include "listener.h"
+#include "dirgraph.h"
+#include <openssl/lhash.h>
+
+/* an entry of a rule on the directory */
+struct dref {
+	const void *owner;
+	uint32_t mask;
+	int depth;					/* levels below the directory still within the rule */
+};
+
+struct dnode {
+	dev_t dev;
+	ino_t ino;
+	uint32_t mask;				/* union of the masks of @refs */
+	int nrefs;
+	int size;
+	struct dref *refs;
+};
+
+struct dirgraph {
+	_LHASH *nodes;				/* (dev, ino) -> struct dnode */
+	size_t count;
+	size_t refs;
+	size_t shared;
+};
+
+static unsigned long
+dnode_hash(const void *data)
+{
+	const struct dnode *node = (const struct dnode *) data;
+	return (unsigned long) node->ino * 2654435761UL ^ (unsigned long) node->dev;
+}
+
+static int
+dnode_compare(const void *a, const void *b)
+{
+	const struct dnode *x = (const struct dnode *) a;
+	const struct dnode *y = (const struct dnode *) b;
+	return x->dev != y->dev ? (x->dev < y->dev ? -1 : 1) : x->ino != y->ino ? (x->ino < y->ino ? -1 : 1) : 0;
+}
+
+struct dirgraph *
+dirgraph_create(void)
+{
+	struct dirgraph *graph = (struct dirgraph *) calloc(1, sizeof(struct dirgraph));
+
+	if (! graph || ! (graph->nodes = lh_new(dnode_hash, dnode_compare))) {
+		free(graph);
+		return NULL;
+	}
+	return graph;
+}
+
+static struct dnode *
+lookup(struct dirgraph *graph, dev_t dev, ino_t ino)
+{
+	struct dnode key = { .dev = dev, .ino = ino };
+	return (struct dnode *) lh_retrieve(graph->nodes, &key);
+}
+
+/* mask of the entries already watching the directory, 0 if none */
+uint32_t
+dirgraph_mask(struct dirgraph *graph, dev_t dev, ino_t ino)
+{
+	struct dnode *node = lookup(graph, dev, ino);
+	return node ? node->mask : 0;
+}
+
+/* number of entries watching the directory, 0 if none */
+int
+dirgraph_entries(struct dirgraph *graph, dev_t dev, ino_t ino)
+{
+	struct dnode *node = lookup(graph, dev, ino);
+	return node ? node->nrefs : 0;
+}
+
+/* largest depth left below the directory, -1 if it isn't watched */
+int
+dirgraph_depth(struct dirgraph *graph, dev_t dev, ino_t ino)
+{
+	struct dnode *node = lookup(graph, dev, ino);
+	int depth = -1;
+
+	for (int i=0; node && i<node->nrefs; ++i) {
+		if (node->refs[i].depth > depth)
+			depth = node->refs[i].depth;
+	}
+	return depth;
+}
+
+/* returns the number of entries on the directory, or -1 on allocation failures */
+int
+dirgraph_add(struct dirgraph *graph, dev_t dev, ino_t ino, const void *owner, uint32_t mask, int depth)
+{
+	struct dnode *node = lookup(graph, dev, ino);
+
+	if (! node) {
+		if (! (node = (struct dnode *) calloc(1, sizeof(struct dnode))))
+			return -1;
+		node->dev = dev;
+		node->ino = ino;
+		lh_insert(graph->nodes, node);
+		graph->count++;
+	}
+	if (node->nrefs == node->size) {
+		int size = node->size ? node->size * 2 : 1;
+		struct dref *refs = (struct dref *) realloc(node->refs, size * sizeof(struct dref));
+		if (! refs)
+			return -1;
+		node->refs = refs;
+		node->size = size;
+	}
+	node->refs[node->nrefs].owner = owner;
+	node->refs[node->nrefs].mask = mask;
+	node->refs[node->nrefs].depth = depth;
+	node->mask |= mask;
+	if (++node->nrefs == 2)
+		graph->shared++;
+	graph->refs++;
+	return node->nrefs;
+}
+
+/* returns the number of entries left on the directory, -1 if @owner wasn't one */
+int
+dirgraph_remove(struct dirgraph *graph, dev_t dev, ino_t ino, const void *owner)
+{
+	struct dnode *node = lookup(graph, dev, ino);
+	int found = 0;
+
+	if (! node)
+		return -1;
+	node->mask = 0;
+	for (int i=0; i<node->nrefs; ++i) {
+		if (! found && node->refs[i].owner == owner) {
+			node->refs[i--] = node->refs[--node->nrefs];
+			found = 1;
+			continue;
+		}
+		node->mask |= node->refs[i].mask;
+	}
+	if (! found)
+		return -1;
+	graph->refs--;
+	if (node->nrefs == 1)
+		graph->shared--;
+	if (node->nrefs)
+		return node->nrefs;
+	lh_delete(graph->nodes, node);
+	graph->count--;
+	free(node->refs);
+	free(node);
+	return 0;
+}
+
+/* the entry @old_owner was copied to @new_owner, as when renamed */
+int
+dirgraph_replace(struct dirgraph *graph, dev_t dev, ino_t ino, const void *old_owner, const void *new_owner)
+{
+	struct dnode *node = lookup(graph, dev, ino);
+
+	for (int i=0; node && i<node->nrefs; ++i) {
+		if (node->refs[i].owner == old_owner) {
+			node->refs[i].owner = new_owner;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+void
+dirgraph_get_stats(struct dirgraph *graph, struct dirgraph_stats *stats)
+{
+	stats->nodes = graph->count;
+	stats->refs = graph->refs;
+	stats->shared = graph->shared;
+}
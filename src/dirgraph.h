@@ -0,0 +1,52 @@
+/*
+ * Listener - Listens for specific directories events and take actions
+ * based on rules specified by the user.
+ *
+ * Copyright (c) 2005-2017 Lucas C. Villa Real <lucasvr@gobolinux.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#ifndef LISTENER_DIRGRAPH_H
+#define LISTENER_DIRGRAPH_H 1
+
+/*
+ * Directories watched through the inotify instance of a shard, keyed by
+ * device and inode, so that a directory reached by several rules, through
+ * bind mounts or symlinked targets is a single node. Inotify keeps one watch
+ * per inode, whose mask is replaced by every inotify_add_watch(). Each node
+ * holds the entries of the rules watching it, with the mask they want and
+ * the depth left below it, so that the union is found in O(1) and the watch
+ * only goes away with its last entry. Writers of the shard only, under its
+ * write_lock.
+ */
+
+struct dirgraph;
+
+struct dirgraph_stats {
+	size_t nodes;				/* directories */
+	size_t refs;				/* entries of rules on them */
+	size_t shared;				/* directories watched by several rules */
+};
+
+struct dirgraph *dirgraph_create(void);
+uint32_t         dirgraph_mask(struct dirgraph *graph, dev_t dev, ino_t ino);
+int              dirgraph_entries(struct dirgraph *graph, dev_t dev, ino_t ino);
+int              dirgraph_depth(struct dirgraph *graph, dev_t dev, ino_t ino);
+int              dirgraph_add(struct dirgraph *graph, dev_t dev, ino_t ino, const void *owner, uint32_t mask, int depth);
+int              dirgraph_remove(struct dirgraph *graph, dev_t dev, ino_t ino, const void *owner);
+int              dirgraph_replace(struct dirgraph *graph, dev_t dev, ino_t ino, const void *old_owner, const void *new_owner);
+void             dirgraph_get_stats(struct dirgraph *graph, struct dirgraph_stats *stats);
+
+#endif /* LISTENER_DIRGRAPH_H */
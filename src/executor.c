@@ -0,0 +1,212 @@
+/*
+ * Listener - Listens for specific directories events and take actions
+ * based on rules specified by the user.
+ *
+ * Copyright (c) 2005-2017 Lucas C. Villa Real <lucasvr@gobolinux.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#include "listener.h"
+#include "executor.h"
+#include "plugin.h"
+#include "publisher.h"
+
+#define IOPRIO_CLASS_SHIFT  13
+#define IOPRIO_CLASS_BE     2
+#define IOPRIO_CLASS_IDLE   3
+#define IOPRIO_WHO_PROCESS  1
+#define IOPRIO_VALUE(class, data) (((class) << IOPRIO_CLASS_SHIFT) | (data))
+
+/* scheduling parameters applied to the actions spawned from each lane */
+static const struct lane_sched {
+	int nice;
+	int ioprio;
+} lane_sched[NUM_PRIORITIES] = {
+	[PRIORITY_NORMAL] = {  0, IOPRIO_VALUE(IOPRIO_CLASS_BE, 4) },
+	[PRIORITY_HIGH]   = { -5, IOPRIO_VALUE(IOPRIO_CLASS_BE, 0) },
+	[PRIORITY_LOW]    = { 10, IOPRIO_VALUE(IOPRIO_CLASS_IDLE, 0) },
+};
+
+struct shard {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct thread_info *head;	/* oldest pending job */
+	struct thread_info *tail;	/* newest pending job */
+	pthread_t tid;
+};
+
+struct lane {
+	struct shard *shards;
+	int nshards;
+};
+
+static struct lane lanes[NUM_PRIORITIES];
+static void (*run_job)(struct thread_info *info);
+static unsigned long pending;	/* jobs submitted and not run yet */
+
+/* FNV-1a, seeded with the previous hash so that fields can be chained */
+static inline uint32_t
+hash_bytes(uint32_t hash, const void *data, size_t len)
+{
+	const unsigned char *ptr = (const unsigned char *) data;
+	while (len--) {
+		hash ^= *ptr++;
+		hash *= 16777619;
+	}
+	return hash;
+}
+
+/*
+ * The key identifies the (rule, entry) pair. Self events carry the watched
+ * directory itself as their entry name, hence the absolute path check.
+ */
+static uint32_t
+job_key(const struct thread_info *info)
+{
+	uint32_t hash = 2166136261U;
+
+	hash = hash_bytes(hash, &info->rule, sizeof(info->rule));
+	if (info->offending_name[0] != '/') {
+		hash = hash_bytes(hash, info->dir, strlen(info->dir));
+		hash = hash_bytes(hash, "/", 1);
+	}
+	return hash_bytes(hash, info->offending_name, strlen(info->offending_name));
+}
+
+/*
+ * Jobs of a plugin rule with a batch hook, or of a rule that only publishes
+ * or forwards its events, are handed out together with the jobs of the same rule that
+ * immediately follow them in the queue.
+ */
+static struct thread_info *
+shard_dequeue(struct shard *shard)
+{
+	struct thread_info *info = shard->head, *last = info;
+	watch_t *rule = info->rule;
+	int count = 1, max = 1;
+
+	if (rule->plugin && rule->plugin->batch)
+		max = PLUGIN_MAX_BATCH;
+	else if ((rule->publish || rule->forward) && ! rule->plugin && ! rule->builtin && ! rule->spawn[0])
+		max = PUBLISH_MAX_BATCH;
+	if (max > 1) {
+		while (last->next && last->next->rule == rule && count < max) {
+			last = last->next;
+			count++;
+		}
+	}
+
+	shard->head = last->next;
+	if (shard->head == NULL)
+		shard->tail = NULL;
+	last->next = NULL;
+	return info;
+}
+
+static void *
+executor_worker(void *data)
+{
+	struct shard *shard = (struct shard *) data;
+	struct thread_info *info;
+	unsigned long count;
+
+	while (2) {
+		pthread_mutex_lock(&shard->lock);
+		while (shard->head == NULL)
+			pthread_cond_wait(&shard->cond, &shard->lock);
+		info = shard_dequeue(shard);
+		pthread_mutex_unlock(&shard->lock);
+
+		count = 0;
+		for (struct thread_info *job=info; job; job=job->next)
+			count++;
+		run_job(info);
+		__atomic_sub_fetch(&pending, count, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+int
+executor_init(int nworkers, void (*run)(struct thread_info *info))
+{
+	if (nworkers < 1 || nworkers > EXECUTOR_MAX_WORKERS) {
+		fprintf(stderr, "%d: invalid number of workers\n", nworkers);
+		return -1;
+	}
+	run_job = run;
+
+	for (int p=0; p<NUM_PRIORITIES; ++p) {
+		struct lane *lane = &lanes[p];
+
+		lane->shards = (struct shard *) calloc(nworkers, sizeof(struct shard));
+		if (! lane->shards) {
+			perror("calloc");
+			return -1;
+		}
+		lane->nshards = nworkers;
+
+		for (int i=0; i<lane->nshards; ++i) {
+			struct shard *shard = &lane->shards[i];
+			pthread_mutex_init(&shard->lock, NULL);
+			pthread_cond_init(&shard->cond, NULL);
+			if (pthread_create(&shard->tid, NULL, executor_worker, shard) != 0) {
+				perror("pthread_create");
+				return -1;
+			}
+			pthread_detach(shard->tid);
+		}
+	}
+	return 0;
+}
+
+void
+executor_submit(struct thread_info *info)
+{
+	struct lane *lane = &lanes[info->rule->priority];
+	struct shard *shard = &lane->shards[job_key(info) % lane->nshards];
+
+	info->next = NULL;
+	__atomic_add_fetch(&pending, 1, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&shard->lock);
+	if (shard->tail)
+		shard->tail->next = info;
+	else
+		shard->head = info;
+	shard->tail = info;
+	pthread_cond_signal(&shard->cond);
+	pthread_mutex_unlock(&shard->lock);
+}
+
+/* jobs queued or running, see the drain command of the control socket */
+unsigned long
+executor_pending(void)
+{
+	return __atomic_load_n(&pending, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Called by the spawned child before exec. Failures are not fatal: raising
+ * the priority of the high lane requires privileges we may not have.
+ */
+void
+executor_set_priority(int priority)
+{
+	const struct lane_sched *sched = &lane_sched[priority];
+
+	if (setpriority(PRIO_PROCESS, 0, sched->nice) < 0 && errno != EACCES && errno != EPERM)
+		perror("setpriority");
+	if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, sched->ioprio) < 0 && errno != EPERM)
+		perror("ioprio_set");
+}
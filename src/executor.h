@@ -0,0 +1,48 @@
+/*
+ * Listener - Listens for specific directories events and take actions
+ * based on rules specified by the user.
+ *
+ * Copyright (c) 2005-2017 Lucas C. Villa Real <lucasvr@gobolinux.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#ifndef LISTENER_EXECUTOR_H
+#define LISTENER_EXECUTOR_H 1
+
+/*
+ * The executor runs actions on a fixed pool of worker threads. Each job is
+ * assigned to a shard by hashing its rule and entry path, and every shard is
+ * drained in FIFO order by a single worker. Events for the same entry are thus
+ * processed in the order they were read, while unrelated entries run in parallel.
+ *
+ * Every rule priority has its own lane of shards and workers, so a flood of
+ * low priority work never holds back urgent rules. Spawned actions inherit
+ * the nice level and I/O class of their lane.
+ *
+ * Jobs are passed to the run callback as a list linked through their next
+ * member. The list only holds more than one job for plugins that accept
+ * batches (up to PLUGIN_MAX_BATCH) and for rules that only publish or
+ * forward their events (up to PUBLISH_MAX_BATCH), see perform_action().
+ */
+
+#define EXECUTOR_DEFAULT_WORKERS 4
+#define EXECUTOR_MAX_WORKERS     256
+
+int  executor_init(int nworkers, void (*run)(struct thread_info *info));
+void executor_submit(struct thread_info *info);
+void executor_set_priority(int priority);
+unsigned long executor_pending(void);
+
+#endif /* LISTENER_EXECUTOR_H */
@@ -0,0 +1,439 @@
+/*
+ * Listener - Listens for specific directories events and take actions
+ * based on rules specified by the user.
+ *
+ * Copyright (c) 2005-2017 Lucas C. Villa Real <lucasvr@gobolinux.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#include "listener.h"
+#include "feedback.h"
+#include <time.h>
+#include <sys/fanotify.h>
+#include <sys/statfs.h>
+#include <openssl/lhash.h>
+
+#define FEEDBACK_MASK (FAN_CREATE|FAN_DELETE|FAN_MODIFY|FAN_ATTRIB|FAN_CLOSE_WRITE| \
+	FAN_MOVED_FROM|FAN_MOVED_TO|FAN_EVENT_ON_CHILD|FAN_ONDIR)
+#define MAX_HANDLE_SIZE 128
+#define GC_INTERVAL     1024	/* insertions between sweeps of the expired entries */
+
+/* the entry of an action, or a path changed by an action if @rule_id is 0 */
+struct own_entry {
+	char *path;
+	int rule_id;
+	int active;					/* actions running on the entry */
+	uint64_t expires;			/* ms, monotonic */
+};
+
+/* a directory marked for fanotify, keyed by its fsid and file handle */
+struct marked_dir {
+	size_t len;
+	unsigned char key[sizeof(fsid_t) + sizeof(struct file_handle) + MAX_HANDLE_SIZE];
+	char *path;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	_LHASH *entries;			/* (rule, path) -> struct own_entry */
+	_LHASH *dirs;				/* handle -> struct marked_dir */
+	int fd;						/* fanotify, -1 if unused */
+	pid_t self;
+	pid_t *pids;				/* running actions, each the leader of its process group */
+	size_t npids;
+	size_t pids_size;
+	unsigned int inserts;
+	struct feedback_stats stats;
+} fb = { .lock = PTHREAD_MUTEX_INITIALIZER, .fd = -1 };
+
+static unsigned long
+entry_hash(const void *data)
+{
+	const struct own_entry *entry = (const struct own_entry *) data;
+	return lh_strhash(entry->path) ^ (unsigned long) entry->rule_id;
+}
+
+static int
+entry_compare(const void *a, const void *b)
+{
+	const struct own_entry *x = (const struct own_entry *) a;
+	const struct own_entry *y = (const struct own_entry *) b;
+	return x->rule_id != y->rule_id ? x->rule_id - y->rule_id : strcmp(x->path, y->path);
+}
+
+static unsigned long
+dir_hash(const void *data)
+{
+	const struct marked_dir *dir = (const struct marked_dir *) data;
+	unsigned long hash = 2166136261UL;
+
+	for (size_t i=0; i<dir->len; ++i)
+		hash = (hash ^ dir->key[i]) * 16777619UL;
+	return hash;
+}
+
+static int
+dir_compare(const void *a, const void *b)
+{
+	const struct marked_dir *x = (const struct marked_dir *) a;
+	const struct marked_dir *y = (const struct marked_dir *) b;
+	return x->len != y->len ? 1 : memcmp(x->key, y->key, x->len);
+}
+
+static uint64_t
+monotonic_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* fills the key of @dir from a file handle as found in fanotify events */
+static int
+make_key(struct marked_dir *dir, const void *fsid, const struct file_handle *handle)
+{
+	if (handle->handle_bytes > MAX_HANDLE_SIZE)
+		return -1;
+	memcpy(dir->key, fsid, sizeof(fsid_t));
+	memcpy(dir->key + sizeof(fsid_t), handle, sizeof(struct file_handle) + handle->handle_bytes);
+	dir->len = sizeof(fsid_t) + sizeof(struct file_handle) + handle->handle_bytes;
+	return 0;
+}
+
+static int
+path_key(struct marked_dir *dir, const char *path)
+{
+	char buf[sizeof(struct file_handle) + MAX_HANDLE_SIZE] __attribute__((aligned(8)));
+	struct file_handle *handle = (struct file_handle *) buf;
+	struct statfs st;
+	int mount_id;
+
+	handle->handle_bytes = MAX_HANDLE_SIZE;
+	if (name_to_handle_at(AT_FDCWD, path, handle, &mount_id, 0) < 0 || statfs(path, &st) < 0)
+		return -1;
+	return make_key(dir, &st.f_fsid, handle);
+}
+
+/* fb.lock held */
+static struct own_entry *
+lookup(int rule_id, const char *path, int create)
+{
+	struct own_entry key = { .path = (char *) path, .rule_id = rule_id }, *entry;
+
+	entry = (struct own_entry *) lh_retrieve(fb.entries, &key);
+	if (entry || ! create)
+		return entry;
+	entry = (struct own_entry *) calloc(1, sizeof(struct own_entry));
+	if (! entry || ! (entry->path = strdup(path))) {
+		free(entry);
+		return NULL;
+	}
+	entry->rule_id = rule_id;
+	lh_insert(fb.entries, entry);
+
+	/* expired entries are swept every now and then */
+	if (++fb.inserts % GC_INTERVAL == 0) {
+		uint64_t now = monotonic_ms();
+		size_t count = 0, size = 0;
+		struct own_entry **victims = NULL;
+
+		/* without memory, the entries collected so far go and the rest waits for the next round */
+		void collect(void *data) {
+			struct own_entry *e = (struct own_entry *) data;
+			if (e->active || e->expires > now || e == entry)
+				return;
+			if (count == size) {
+				size_t n = size ? size * 2 : 64;
+				struct own_entry **more = (struct own_entry **) realloc(victims, n * sizeof(struct own_entry *));
+				if (! more)
+					return;
+				victims = more;
+				size = n;
+			}
+			victims[count++] = e;
+		}
+
+		lh_doall(fb.entries, collect);
+		for (size_t i=0; i<count; ++i) {
+			lh_delete(fb.entries, victims[i]);
+			free(victims[i]->path);
+			free(victims[i]);
+		}
+		free(victims);
+	}
+	return entry;
+}
+
+/* fb.lock held */
+static int
+own_pid(pid_t pid)
+{
+	pid_t pgid = getpgid(pid);
+
+	if (pid == fb.self)
+		return 1;
+	for (size_t i=0; i<fb.npids; ++i) {
+		if (fb.pids[i] == pid || fb.pids[i] == pgid)
+			return 1;
+	}
+	return 0;
+}
+
+/* records the paths changed by the actions; fb.lock held */
+static void
+drain_fanotify(void)
+{
+	char buf[8192] __attribute__((aligned(__alignof__(struct fanotify_event_metadata))));
+	ssize_t n;
+
+	while ((n = read(fb.fd, buf, sizeof(buf))) > 0) {
+		struct fanotify_event_metadata *md = (struct fanotify_event_metadata *) buf;
+		uint64_t expires = monotonic_ms() + FEEDBACK_WINDOW;
+
+		for (; FAN_EVENT_OK(md, n); md = FAN_EVENT_NEXT(md, n)) {
+			struct fanotify_event_info_fid *fid = (struct fanotify_event_info_fid *) (md + 1);
+			struct file_handle *handle = (struct file_handle *) fid->handle;
+			struct marked_dir key, *dir;
+			struct own_entry *entry;
+			char path[PATH_MAX];
+			const char *name;
+
+			if (md->vers != FANOTIFY_METADATA_VERSION || md->event_len <= md->metadata_len ||
+				fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME || ! own_pid(md->pid))
+				continue;
+			if (make_key(&key, &fid->fsid, handle) < 0 || ! (dir = (struct marked_dir *) lh_retrieve(fb.dirs, &key)))
+				continue;
+			name = (const char *) handle->f_handle + handle->handle_bytes;
+			if (! strcmp(name, "."))
+				snprintf(path, sizeof(path), "%s", dir->path);
+			else
+				snprintf(path, sizeof(path), "%s/%s", dir->path, name);
+			if ((entry = lookup(0, path, 1)))
+				entry->expires = expires;
+			fb.stats.fanotify_events++;
+		}
+	}
+}
+
+/* attributes the changes while the processes that made them still exist */
+static void *
+fanotify_main(void *data)
+{
+	struct pollfd pfd = { .fd = fb.fd, .events = POLLIN };
+
+	while (2) {
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+			break;
+		pthread_mutex_lock(&fb.lock);
+		drain_fanotify();
+		pthread_mutex_unlock(&fb.lock);
+	}
+	return NULL;
+}
+
+/* returns -1 if fanotify was asked for and can't be used */
+int
+feedback_init(int fanotify)
+{
+	fb.entries = lh_new(entry_hash, entry_compare);
+	fb.dirs = lh_new(dir_hash, dir_compare);
+	if (! fb.entries || ! fb.dirs)
+		return -1;
+	if (! fanotify)
+		return 0;
+
+	fb.fd = fanotify_init(FAN_CLASS_NOTIF|FAN_REPORT_DFID_NAME|FAN_NONBLOCK|FAN_CLOEXEC, O_RDONLY);
+	if (fb.fd < 0) {
+		perror("fanotify_init");
+		return -1;
+	}
+	return 0;
+}
+
+/* threads don't survive fork(), so this runs in the process that performs the actions */
+int
+feedback_start(void)
+{
+	pthread_t tid;
+
+	fb.self = getpid();
+	if (fb.fd < 0)
+		return 0;
+	if (pthread_create(&tid, NULL, fanotify_main, NULL) != 0) {
+		perror("pthread_create");
+		return -1;
+	}
+	pthread_detach(tid);
+	return 0;
+}
+
+/* marks a directory of a rule ignoring its own events */
+void
+feedback_watch_dir(const char *path)
+{
+	struct marked_dir *dir, *old;
+
+	if (fb.fd < 0)
+		return;
+	dir = (struct marked_dir *) calloc(1, sizeof(struct marked_dir));
+	if (! dir || path_key(dir, path) < 0 || ! (dir->path = strdup(path)) ||
+		fanotify_mark(fb.fd, FAN_MARK_ADD|FAN_MARK_ONLYDIR, FEEDBACK_MASK, AT_FDCWD, path) < 0) {
+		if (dir)
+			free(dir->path);
+		free(dir);
+		return;
+	}
+	pthread_mutex_lock(&fb.lock);
+	if (! (old = (struct marked_dir *) lh_insert(fb.dirs, dir)))
+		fb.stats.dirs++;
+	pthread_mutex_unlock(&fb.lock);
+	if (old) {
+		free(old->path);
+		free(old);
+	}
+}
+
+void
+feedback_unwatch_dir(const char *path)
+{
+	struct marked_dir key, *dir = NULL;
+	int known = 0;
+
+	if (fb.fd < 0)
+		return;
+	if (path_key(&key, path) == 0) {
+		fanotify_mark(fb.fd, FAN_MARK_REMOVE|FAN_MARK_ONLYDIR, FEEDBACK_MASK, AT_FDCWD, path);
+		known = 1;
+	}
+	pthread_mutex_lock(&fb.lock);
+	if (known) {
+		dir = (struct marked_dir *) lh_delete(fb.dirs, &key);
+	} else {
+		/* the directory is gone, and its mark with it */
+		void find(void *data) {
+			struct marked_dir *d = (struct marked_dir *) data;
+			if (! dir && ! strcmp(d->path, path))
+				dir = d;
+		}
+		lh_doall(fb.dirs, find);
+		if (dir)
+			lh_delete(fb.dirs, dir);
+	}
+	if (dir)
+		fb.stats.dirs--;
+	pthread_mutex_unlock(&fb.lock);
+	if (dir) {
+		free(dir->path);
+		free(dir);
+	}
+}
+
+/* an action of rule @rule_id starts running on @entry */
+void
+feedback_begin(int rule_id, const char *entry)
+{
+	struct own_entry *own;
+
+	pthread_mutex_lock(&fb.lock);
+	if ((own = lookup(rule_id, entry, 1)))
+		own->active++;
+	pthread_mutex_unlock(&fb.lock);
+}
+
+void
+feedback_end(int rule_id, const char *entry)
+{
+	struct own_entry *own;
+
+	pthread_mutex_lock(&fb.lock);
+	if ((own = lookup(rule_id, entry, 0)) && own->active) {
+		own->active--;
+		own->expires = monotonic_ms() + FEEDBACK_WINDOW;
+	}
+	pthread_mutex_unlock(&fb.lock);
+}
+
+/* @pid leads the process group of a spawned action */
+void
+feedback_add_pid(pid_t pid)
+{
+	if (fb.fd < 0)
+		return;
+	pthread_mutex_lock(&fb.lock);
+	if (fb.npids == fb.pids_size) {
+		size_t size = fb.pids_size ? fb.pids_size * 2 : 64;
+		pid_t *pids = (pid_t *) realloc(fb.pids, size * sizeof(pid_t));
+		if (pids) {
+			fb.pids = pids;
+			fb.pids_size = size;
+		}
+	}
+	if (fb.npids < fb.pids_size)
+		fb.pids[fb.npids++] = pid;
+	pthread_mutex_unlock(&fb.lock);
+}
+
+/* the changes of the action must have been queued by now, see feedback_own_event() */
+void
+feedback_remove_pid(pid_t pid)
+{
+	if (fb.fd < 0)
+		return;
+	pthread_mutex_lock(&fb.lock);
+	drain_fanotify();
+	for (size_t i=0; i<fb.npids; ++i) {
+		if (fb.pids[i] == pid) {
+			fb.pids[i] = fb.pids[--fb.npids];
+			break;
+		}
+	}
+	pthread_mutex_unlock(&fb.lock);
+}
+
+/*
+ * Tells if the event on @path seen by rule @rule_id was caused by an action.
+ * Fanotify queues its events along with inotify, so any change behind an
+ * inotify event being dispatched can be read here already.
+ */
+int
+feedback_own_event(int rule_id, const char *path)
+{
+	uint64_t now = monotonic_ms();
+	struct own_entry *own;
+	int ret = 0;
+
+	pthread_mutex_lock(&fb.lock);
+	if (fb.fd >= 0) {
+		drain_fanotify();
+		if ((own = lookup(0, path, 0)) && own->expires > now) {
+			fb.stats.fanotify_drops++;
+			ret = 1;
+		}
+	}
+	if (! ret && (own = lookup(rule_id, path, 0)) && (own->active || own->expires > now)) {
+		fb.stats.window_drops++;
+		ret = 1;
+	}
+	pthread_mutex_unlock(&fb.lock);
+	return ret;
+}
+
+void
+feedback_get_stats(struct feedback_stats *stats)
+{
+	pthread_mutex_lock(&fb.lock);
+	*stats = fb.stats;
+	pthread_mutex_unlock(&fb.lock);
+}
@@ -0,0 +1,52 @@
+/*
+ * Listener - Listens for specific directories events and take actions
+ * based on rules specified by the user.
+ *
+ * Copyright (c) 2005-2017 Lucas C. Villa Real <lucasvr@gobolinux.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#ifndef LISTENER_FEEDBACK_H
+#define LISTENER_FEEDBACK_H 1
+
+/*
+ * Recognition of the events caused by the daemon's own actions, for rules
+ * using 'ignore_own_events'. The entry an action runs on is its own while the
+ * action runs and for FEEDBACK_WINDOW ms after it ends. With fanotify, which
+ * reports the process behind each change, any change made by the daemon or
+ * by the process group of a spawned action is recognised, whatever its path.
+ */
+
+#define FEEDBACK_WINDOW  250	/* ms during which the changes of an action come back */
+
+struct feedback_stats {
+	unsigned long long window_drops;	/* events on the entry of a running or recent action */
+	unsigned long long fanotify_drops;	/* events on paths changed by an action */
+	unsigned long long fanotify_events;	/* fanotify events attributed to an action */
+	size_t dirs;						/* directories marked for fanotify */
+};
+
+int  feedback_init(int fanotify);
+int  feedback_start(void);
+void feedback_watch_dir(const char *path);
+void feedback_unwatch_dir(const char *path);
+void feedback_begin(int rule_id, const char *entry);
+void feedback_end(int rule_id, const char *entry);
+void feedback_add_pid(pid_t pid);
+void feedback_remove_pid(pid_t pid);
+int  feedback_own_event(int rule_id, const char *path);
+void feedback_get_stats(struct feedback_stats *stats);
+
+#endif /* LISTENER_FEEDBACK_H */
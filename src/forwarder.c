@@ -0,0 +1,650 @@
+/*
+ * Listener - Listens for specific directories events and take actions
+ * based on rules specified by the user.
+ *
+ * Copyright (c) 2005-2017 Lucas C. Villa Real <lucasvr@gobolinux.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#include "listener.h"
+#include "publisher.h"
+#include "forwarder.h"
+#include "logger.h"
+#include <endian.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/hmac.h>
+#include <openssl/sha.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <zlib.h>
+
+#define FORWARD_IOV 64			/* batches sent by a single sendmsg() */
+
+/* shared by the forwarder and the aggregator, see forward_mac() */
+static unsigned char secret[4096];
+static size_t secret_len;
+
+/* a batch waiting for its acknowledgement */
+struct batch {
+	struct batch *next;
+	uint64_t seq;
+	uint32_t count;
+	uint64_t first_ns;			/* when its first event was read */
+	size_t len;
+	char data[];				/* struct forward_batch and the records */
+};
+
+static struct {
+	pthread_mutex_t lock;
+	char *host;
+	char *port;
+	char hostname[HOST_NAME_MAX+1];
+	uint64_t session;
+	int compress;
+	size_t spool_size;
+	int wake_fd;				/* -1 if not forwarding */
+	pthread_t thread;
+
+	/* records not batched yet, under @lock */
+	char *pending;
+	size_t pending_len;
+	size_t pending_size;
+	uint32_t pending_count;
+	uint64_t pending_since;		/* ms */
+
+	/* connection and spool, forwarder thread only */
+	int fd;						/* -1 while disconnected */
+	int ready;					/* the hello was answered */
+	unsigned char key[FORWARD_MAC_LEN];	/* of the batches, see forward_batch_key() */
+	uint64_t retry_at;
+	uint64_t connected_since;	/* ms, 0 until first connected */
+	int failing;				/* the last attempt to connect failed, already logged */
+	unsigned char ack[8];
+	size_t ack_len;
+	struct batch *head;
+	struct batch *tail;
+	struct batch *unsent;		/* first batch not sent entirely */
+	size_t unsent_off;
+	uint64_t next_seq;
+
+	struct forward_stats stats;	/* under @lock */
+} fwd = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake_fd = -1, .fd = -1, .next_seq = 1 };
+
+static uint64_t
+monotonic_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t
+realtime_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* converts the header of @rec to little endian if @to_wire, from it otherwise */
+void
+forward_record_order(struct publish_record *rec, int to_wire)
+{
+#if __BYTE_ORDER != __LITTLE_ENDIAN
+	rec->length = to_wire ? htole32(rec->length) : le32toh(rec->length);
+	rec->rule_id = to_wire ? htole32(rec->rule_id) : le32toh(rec->rule_id);
+	rec->time = to_wire ? htole64(rec->time) : le64toh(rec->time);
+	rec->mask = to_wire ? htole32(rec->mask) : le32toh(rec->mask);
+	rec->cookie = to_wire ? htole32(rec->cookie) : le32toh(rec->cookie);
+	rec->dropped = to_wire ? htole32(rec->dropped) : le32toh(rec->dropped);
+	rec->dir_len = to_wire ? htole16(rec->dir_len) : le16toh(rec->dir_len);
+	rec->name_len = to_wire ? htole16(rec->name_len) : le16toh(rec->name_len);
+	rec->old_len = to_wire ? htole16(rec->old_len) : le16toh(rec->old_len);
+	rec->summary_len = to_wire ? htole16(rec->summary_len) : le16toh(rec->summary_len);
+#endif
+}
+
+/*
+ * Reads the secret shared with the aggregator or the forwarders from @path,
+ * trailing blanks and newlines excluded. The file must not be readable by
+ * other users.
+ */
+int
+forward_read_secret(const char *path)
+{
+	struct stat st;
+	ssize_t n;
+	int fd = open(path, O_RDONLY|O_CLOEXEC);
+
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		perror(path);
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	if (st.st_mode & (S_IRWXG|S_IRWXO)) {
+		fprintf(stderr, "%s: must not be accessible by group or others\n", path);
+		close(fd);
+		return -1;
+	}
+	n = read(fd, secret, sizeof(secret));
+	close(fd);
+	if (n < 0) {
+		perror(path);
+		return -1;
+	}
+	while (n > 0 && isspace(secret[n-1]))
+		n--;
+	if (n < FORWARD_MIN_SECRET) {
+		fprintf(stderr, "%s: the secret must be at least %d bytes long\n", path, FORWARD_MIN_SECRET);
+		return -1;
+	}
+	secret_len = n;
+	return 0;
+}
+
+/* HMAC-SHA256 of @nonce, the session of @h and @host, keyed with the secret */
+void
+forward_mac(const unsigned char *nonce, const struct forward_hello *h, const char *host, unsigned char *mac)
+{
+	size_t host_len = strlen(host);
+	unsigned char data[FORWARD_NONCE_LEN + sizeof(h->session) + HOST_NAME_MAX+1];
+	unsigned int len = FORWARD_MAC_LEN;
+
+	memcpy(data, nonce, FORWARD_NONCE_LEN);
+	memcpy(data + FORWARD_NONCE_LEN, &h->session, sizeof(h->session));
+	memcpy(data + FORWARD_NONCE_LEN + sizeof(h->session), host, host_len);
+	if (! HMAC(EVP_sha256(), secret, secret_len, data, FORWARD_NONCE_LEN + sizeof(h->session) + host_len, mac, &len))
+		memset(mac, 0, FORWARD_MAC_LEN);
+}
+
+/* key of the batches of a connection, from the MAC of its hello */
+void
+forward_batch_key(const unsigned char *hello_mac, unsigned char *key)
+{
+	unsigned int len = FORWARD_MAC_LEN;
+
+	if (! HMAC(EVP_sha256(), secret, secret_len, hello_mac, FORWARD_MAC_LEN, key, &len))
+		memset(key, 0, FORWARD_MAC_LEN);
+}
+
+/* HMAC-SHA256 of the header of @b up to its MAC and of the digest of @data */
+void
+forward_batch_mac(const unsigned char *key, const struct forward_batch *b, const char *data, unsigned char *mac)
+{
+	unsigned char buf[offsetof(struct forward_batch, mac) + SHA256_DIGEST_LENGTH];
+	unsigned int len = FORWARD_MAC_LEN;
+
+	memcpy(buf, b, offsetof(struct forward_batch, mac));
+	SHA256((const unsigned char *) data, le32toh(b->len), buf + offsetof(struct forward_batch, mac));
+	if (! HMAC(EVP_sha256(), key, FORWARD_MAC_LEN, buf, sizeof(buf), mac, &len))
+		memset(mac, 0, FORWARD_MAC_LEN);
+}
+
+/* queues a record per job of @list for the next batch */
+void
+forwarder_post(struct thread_info *list)
+{
+	int wake = 0;
+
+	if (fwd.wake_fd < 0)
+		return;
+	pthread_mutex_lock(&fwd.lock);
+	for (struct thread_info *info=list; info; info=info->next) {
+		size_t len, was = fwd.pending_len;
+
+		if (fwd.pending_size - fwd.pending_len < PUBLISH_MAX_RECORD) {
+			size_t size = fwd.pending_size ? fwd.pending_size * 2 : 2 * FORWARD_BATCH_SIZE;
+			char *pending;
+			if (fwd.pending_len + PUBLISH_MAX_RECORD > fwd.spool_size ||
+				! (pending = (char *) realloc(fwd.pending, size))) {
+				fwd.stats.dropped++;
+				continue;
+			}
+			fwd.pending = pending;
+			fwd.pending_size = size;
+		}
+		if (! (len = publish_encode(info, fwd.pending + was, fwd.pending_size - was)))
+			continue;
+		if (! was) {
+			fwd.pending_since = monotonic_ms();
+			wake = 1;
+		}
+		fwd.pending_len += len;
+		fwd.pending_count++;
+		fwd.stats.events++;
+		if (was < FORWARD_BATCH_SIZE && fwd.pending_len >= FORWARD_BATCH_SIZE)
+			wake = 1;
+	}
+	pthread_mutex_unlock(&fwd.lock);
+	if (wake) {
+		uint64_t one = 1;
+		if (write(fwd.wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+			log_printf(LOG_LEVEL_WARNING, "forward: %s", strerror(errno));
+	}
+}
+
+/* removes @b, which follows @prev in the spool, without touching the stats */
+static void
+unlink_batch(struct batch *prev, struct batch *b)
+{
+	if (prev)
+		prev->next = b->next;
+	else
+		fwd.head = b->next;
+	if (fwd.tail == b)
+		fwd.tail = prev;
+	if (fwd.unsent == b) {
+		fwd.unsent = b->next;
+		fwd.unsent_off = 0;
+	}
+	pthread_mutex_lock(&fwd.lock);
+	fwd.stats.spooled -= b->len;
+	pthread_mutex_unlock(&fwd.lock);
+	free(b);
+}
+
+/* makes room for @len bytes, losing the oldest batches that aren't being sent */
+static void
+trim_spool(size_t len)
+{
+	while (fwd.head && fwd.stats.spooled + len > fwd.spool_size) {
+		struct batch *prev = NULL, *b = fwd.head;
+
+		if (b == fwd.unsent && fwd.unsent_off) {
+			prev = b;
+			b = b->next;
+		}
+		if (! b)
+			break;
+		pthread_mutex_lock(&fwd.lock);
+		fwd.stats.dropped += b->count;
+		pthread_mutex_unlock(&fwd.lock);
+		log_printf(LOG_LEVEL_WARNING, "forward: spool full, %u events of batch %llu lost",
+			b->count, (unsigned long long) b->seq);
+		unlink_batch(prev, b);
+	}
+}
+
+/* turns @count records of @len bytes into a batch at the end of the spool */
+static void
+spool_batch(char *records, size_t len, uint32_t count, uint64_t first_ns)
+{
+	size_t bound = fwd.compress ? compressBound(len) : len;
+	struct batch *b = (struct batch *) malloc(sizeof(struct batch) + sizeof(struct forward_batch) + bound);
+	struct forward_batch *hdr;
+	uLongf zlen = bound;
+
+	if (! b) {
+		log_printf(LOG_LEVEL_ERROR, "forward: %s", strerror(errno));
+		pthread_mutex_lock(&fwd.lock);
+		fwd.stats.dropped += count;
+		pthread_mutex_unlock(&fwd.lock);
+		return;
+	}
+	hdr = (struct forward_batch *) b->data;
+	memset(hdr, 0, sizeof(*hdr));
+	if (fwd.compress && compress2((Bytef *) (hdr + 1), &zlen, (Bytef *) records, len, 1) == Z_OK && zlen < len) {
+		hdr->flags = htole32(FORWARD_COMPRESSED);
+		hdr->len = htole32(zlen);
+	} else {
+		memcpy(hdr + 1, records, len);
+		zlen = len;
+		hdr->len = htole32(len);
+	}
+	b->next = NULL;
+	b->seq = fwd.next_seq++;
+	b->count = count;
+	b->first_ns = first_ns;
+	b->len = sizeof(*hdr) + zlen;
+	hdr->magic = htole32(FORWARD_MAGIC);
+	hdr->seq = htole64(b->seq);
+	hdr->count = htole32(count);
+	hdr->raw_len = htole32(len);
+	/* done again for every connection, see connect_aggregator() */
+	forward_batch_mac(fwd.key, hdr, (char *) (hdr + 1), hdr->mac);
+
+	trim_spool(b->len);
+	if (fwd.tail)
+		fwd.tail->next = b;
+	else
+		fwd.head = b;
+	fwd.tail = b;
+	if (! fwd.unsent) {
+		fwd.unsent = b;
+		fwd.unsent_off = 0;
+	}
+	pthread_mutex_lock(&fwd.lock);
+	fwd.stats.batches++;
+	fwd.stats.raw_bytes += len;
+	fwd.stats.spooled += b->len;
+	pthread_mutex_unlock(&fwd.lock);
+}
+
+/* cuts the pending records into batches of up to FORWARD_BATCH_SIZE bytes */
+static void
+seal_pending(void)
+{
+	char *records;
+	size_t len, start = 0, off = 0;
+	uint32_t count = 0;
+	uint64_t first_ns = 0;
+
+	pthread_mutex_lock(&fwd.lock);
+	records = fwd.pending;
+	len = fwd.pending_len;
+	fwd.pending = NULL;
+	fwd.pending_len = fwd.pending_size = 0;
+	fwd.pending_count = 0;
+	pthread_mutex_unlock(&fwd.lock);
+
+	while (off < len) {
+		struct publish_record *rec = (struct publish_record *) (records + off);
+		size_t rec_len = rec->length;
+
+		if (off > start && off + rec_len - start > FORWARD_BATCH_SIZE) {
+			spool_batch(records + start, off - start, count, first_ns);
+			start = off;
+			count = 0;
+		}
+		if (! count)
+			first_ns = rec->time;
+		forward_record_order(rec, 1);
+		off += rec_len;
+		count++;
+	}
+	if (count)
+		spool_batch(records + start, off - start, count, first_ns);
+	free(records);
+}
+
+static void
+disconnect_aggregator(const char *why)
+{
+	uint64_t now = monotonic_ms();
+
+	log_printf(LOG_LEVEL_WARNING, "forward: connection to %s:%s lost: %s", fwd.host, fwd.port, why);
+	close(fwd.fd);
+	fwd.fd = -1;
+	fwd.ready = 0;
+	fwd.ack_len = 0;
+	fwd.retry_at = now + FORWARD_RETRY_MS;
+	pthread_mutex_lock(&fwd.lock);
+	fwd.stats.connected = 0;
+	fwd.stats.active_ms += now - fwd.connected_since;
+	pthread_mutex_unlock(&fwd.lock);
+}
+
+/* connects and answers the challenge; batches not acknowledged yet are sent again */
+static void
+connect_aggregator(void)
+{
+	struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM }, *res, *ai;
+	struct timeval timeout = { .tv_sec = FORWARD_HELLO_MS / 1000, .tv_usec = FORWARD_HELLO_MS % 1000 * 1000 };
+	size_t host_len = strlen(fwd.hostname);
+	char hello[sizeof(struct forward_hello) + sizeof(fwd.hostname)];
+	struct forward_hello *h = (struct forward_hello *) hello;
+	struct forward_challenge challenge;
+	unsigned long long resent = 0;
+	int fd = -1, one = 1, ret;
+
+	fwd.retry_at = monotonic_ms() + FORWARD_RETRY_MS;
+	if ((ret = getaddrinfo(fwd.host, fwd.port, &hints, &res)) != 0) {
+		if (! fwd.failing)
+			log_printf(LOG_LEVEL_WARNING, "forward: %s: %s", fwd.host, gai_strerror(ret));
+		fwd.failing = 1;
+		return;
+	}
+	for (ai=res; ai; ai=ai->ai_next) {
+		if ((fd = socket(ai->ai_family, ai->ai_socktype|SOCK_CLOEXEC, ai->ai_protocol)) < 0)
+			continue;
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+
+	if (fd >= 0) {
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		if ((ret = recv(fd, &challenge, sizeof(challenge), MSG_WAITALL)) != sizeof(challenge) ||
+			le32toh(challenge.magic) != FORWARD_MAGIC) {
+			if (ret >= 0)
+				errno = EPROTO;
+			close(fd);
+			fd = -1;
+		}
+	}
+	h->magic = htole32(FORWARD_MAGIC);
+	h->host_len = htole32(host_len);
+	h->session = htole64(fwd.session);
+	if (fd >= 0) {
+		forward_mac(challenge.nonce, h, fwd.hostname, h->mac);
+		forward_batch_key(h->mac, fwd.key);
+	}
+	memcpy(hello + sizeof(*h), fwd.hostname, host_len);
+	if (fd < 0 || send(fd, hello, sizeof(*h) + host_len, MSG_NOSIGNAL) != (ssize_t) (sizeof(*h) + host_len)) {
+		if (! fwd.failing)
+			log_printf(LOG_LEVEL_WARNING, "forward: can't reach %s:%s: %s", fwd.host, fwd.port, strerror(errno));
+		fwd.failing = 1;
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	log_printf(LOG_LEVEL_INFO, "forward: connected to %s:%s", fwd.host, fwd.port);
+
+	for (struct batch *b=fwd.head; b && (b != fwd.unsent || fwd.unsent_off); b=b->next) {
+		resent++;
+		if (b == fwd.unsent)
+			break;
+	}
+	/* the spool is sent again under the key of this connection */
+	for (struct batch *b=fwd.head; b; b=b->next) {
+		struct forward_batch *hdr = (struct forward_batch *) b->data;
+		forward_batch_mac(fwd.key, hdr, (char *) (hdr + 1), hdr->mac);
+	}
+	fwd.fd = fd;
+	fwd.failing = 0;
+	fwd.unsent = fwd.head;
+	fwd.unsent_off = 0;
+	pthread_mutex_lock(&fwd.lock);
+	if (fwd.connected_since)
+		fwd.stats.reconnects++;
+	fwd.connected_since = monotonic_ms();
+	fwd.stats.connected = 1;
+	fwd.stats.resent += resent;
+	pthread_mutex_unlock(&fwd.lock);
+}
+
+/* the aggregator took the batches up to @seq */
+static void
+acknowledge(uint64_t seq)
+{
+	uint64_t now = realtime_ns();
+
+	while (fwd.head && fwd.head->seq <= seq) {
+		struct batch *b = fwd.head;
+		uint64_t lag = now > b->first_ns ? (now - b->first_ns) / 1000000 : 0;
+
+		pthread_mutex_lock(&fwd.lock);
+		fwd.stats.acked += b->count;
+		fwd.stats.lag_sum += lag * b->count;
+		if (lag > fwd.stats.lag_max)
+			fwd.stats.lag_max = lag;
+		pthread_mutex_unlock(&fwd.lock);
+		unlink_batch(NULL, b);
+	}
+}
+
+static void
+read_acks(void)
+{
+	ssize_t n;
+
+	while ((n = recv(fwd.fd, fwd.ack + fwd.ack_len, sizeof(fwd.ack) - fwd.ack_len, MSG_DONTWAIT)) > 0) {
+		uint64_t seq;
+
+		fwd.ack_len += n;
+		if (fwd.ack_len < sizeof(fwd.ack))
+			continue;
+		memcpy(&seq, fwd.ack, sizeof(seq));
+		fwd.ack_len = 0;
+		fwd.ready = 1;
+		acknowledge(le64toh(seq));
+	}
+	if (n == 0)
+		disconnect_aggregator("closed by the aggregator");
+	else if (errno != EAGAIN && errno != EINTR)
+		disconnect_aggregator(strerror(errno));
+}
+
+/* sends as many spooled batches as the socket takes */
+static void
+send_batches(void)
+{
+	while (fwd.unsent) {
+		struct iovec iov[FORWARD_IOV];
+		struct msghdr msg = { .msg_iov = iov };
+		struct batch *b = fwd.unsent;
+		size_t off = fwd.unsent_off;
+		ssize_t n;
+
+		for (msg.msg_iovlen=0; b && msg.msg_iovlen<FORWARD_IOV; b=b->next, off=0) {
+			iov[msg.msg_iovlen].iov_base = b->data + off;
+			iov[msg.msg_iovlen++].iov_len = b->len - off;
+		}
+		if ((n = sendmsg(fwd.fd, &msg, MSG_NOSIGNAL|MSG_DONTWAIT)) < 0) {
+			if (errno != EAGAIN && errno != EINTR)
+				disconnect_aggregator(strerror(errno));
+			return;
+		}
+		pthread_mutex_lock(&fwd.lock);
+		fwd.stats.wire_bytes += n;
+		pthread_mutex_unlock(&fwd.lock);
+		while (fwd.unsent && n >= (ssize_t) (fwd.unsent->len - fwd.unsent_off)) {
+			n -= fwd.unsent->len - fwd.unsent_off;
+			fwd.unsent = fwd.unsent->next;
+			fwd.unsent_off = 0;
+		}
+		if (fwd.unsent)
+			fwd.unsent_off += n;
+		if (n)
+			return;
+	}
+}
+
+static void *
+forward_events(void *data)
+{
+	while (2) {
+		struct pollfd pfds[2];
+		uint64_t now = monotonic_ms(), since;
+		int timeout = -1, n = 1;
+		size_t pending;
+
+		if (fwd.fd < 0 && now >= fwd.retry_at)
+			connect_aggregator();
+
+		pthread_mutex_lock(&fwd.lock);
+		pending = fwd.pending_len;
+		since = fwd.pending_since;
+		pthread_mutex_unlock(&fwd.lock);
+		if (pending >= FORWARD_BATCH_SIZE || (pending && now >= since + FORWARD_BATCH_MS))
+			seal_pending();
+		else if (pending)
+			timeout = since + FORWARD_BATCH_MS - now;
+		if (fwd.fd >= 0 && fwd.ready && fwd.unsent)
+			send_batches();
+		if (fwd.fd < 0) {
+			int retry = fwd.retry_at > now ? fwd.retry_at - now : 0;
+			timeout = timeout < 0 || retry < timeout ? retry : timeout;
+		}
+
+		pfds[0] = (struct pollfd) { .fd = fwd.wake_fd, .events = POLLIN };
+		if (fwd.fd >= 0)
+			pfds[n++] = (struct pollfd) { .fd = fwd.fd, .events = POLLIN | (fwd.ready && fwd.unsent ? POLLOUT : 0) };
+		if (poll(pfds, n, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			log_printf(LOG_LEVEL_ERROR, "poll: %s", strerror(errno));
+			return NULL;
+		}
+		if (pfds[0].revents & POLLIN) {
+			uint64_t count;
+			if (read(fwd.wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+				log_printf(LOG_LEVEL_WARNING, "forward: %s", strerror(errno));
+		}
+		if (n > 1 && (pfds[1].revents & (POLLIN|POLLHUP|POLLERR)))
+			read_acks();
+	}
+	return NULL;
+}
+
+/* @address is HOST:PORT, the aggregator is reached once the threads run */
+int
+forwarder_init(const char *address, size_t spool_size, int compress)
+{
+	const char *colon = strrchr(address, ':');
+
+	if (! colon || colon == address || ! colon[1]) {
+		fprintf(stderr, "%s: expected HOST:PORT\n", address);
+		return -1;
+	}
+	fwd.host = strndup(address, colon - address);
+	fwd.port = strdup(colon + 1);
+	if (fwd.host[0] == '[' && fwd.host[strlen(fwd.host)-1] == ']') {
+		memmove(fwd.host, fwd.host + 1, strlen(fwd.host));
+		fwd.host[strlen(fwd.host)-1] = '\0';
+	}
+	if (gethostname(fwd.hostname, sizeof(fwd.hostname)) < 0)
+		snprintf(fwd.hostname, sizeof(fwd.hostname), "localhost");
+	fwd.hostname[sizeof(fwd.hostname)-1] = '\0';
+	fwd.session = realtime_ns() ^ ((uint64_t) getpid() << 48);
+	fwd.spool_size = spool_size;
+	fwd.compress = compress;
+	fwd.wake_fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	if (fwd.wake_fd < 0) {
+		perror("eventfd");
+		return -1;
+	}
+	return 0;
+}
+
+int
+forwarder_start(void)
+{
+	if (fwd.wake_fd < 0)
+		return 0;
+	if (pthread_create(&fwd.thread, NULL, forward_events, NULL) != 0) {
+		perror("pthread_create");
+		return -1;
+	}
+	return 0;
+}
+
+void
+forwarder_get_stats(struct forward_stats *stats)
+{
+	pthread_mutex_lock(&fwd.lock);
+	*stats = fwd.stats;
+	if (stats->connected)
+		stats->active_ms += monotonic_ms() - fwd.connected_since;
+	pthread_mutex_unlock(&fwd.lock);
+}
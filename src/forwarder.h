@@ -0,0 +1,110 @@
+/*
+ * Listener - Listens for specific directories events and take actions
+ * based on rules specified by the user.
+ *
+ * Copyright (c) 2005-2017 Lucas C. Villa Real <lucasvr@gobolinux.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#ifndef LISTENER_FORWARDER_H
+#define LISTENER_FORWARDER_H 1
+
+/*
+ * Forwarding of matched events to an aggregator over TCP, for the rules
+ * using 'forward'. Events are encoded as in the event stream, see
+ * publisher.h, and gathered in batches of up to FORWARD_BATCH_SIZE bytes or
+ * FORWARD_BATCH_MS ms, optionally compressed with zlib. Each batch gets a
+ * sequence number and stays in a spool of bounded size until the aggregator
+ * acknowledges it, so that the batches in flight when the connection drops
+ * are sent again once it is back. A full spool loses its oldest batches.
+ *
+ * A connection starts with a struct forward_challenge sent by the
+ * aggregator, answered with a struct forward_hello followed by the host name.
+ * The hello carries the HMAC-SHA256 of the nonce of the challenge, the
+ * session and the host name, keyed with the secret both ends read from the
+ * --forward-secret file: only hosts knowing it are taken. The aggregator
+ * replies with the sequence number of the last batch it took from that
+ * session, as it does for every batch it takes afterwards. Every batch
+ * carries the HMAC-SHA256 of its header and data, keyed with a key derived
+ * from the MAC of the hello, so batches can neither be forged nor moved to
+ * another connection. Everything on the wire, the records included, is
+ * little endian.
+ */
+
+#define FORWARD_MAGIC          0x4c464233	/* "LFB3" */
+#define FORWARD_BATCH_SIZE     (64 * 1024)
+#define FORWARD_BATCH_MS       20
+#define FORWARD_MAX_BATCH      (2 * FORWARD_BATCH_SIZE)	/* on the wire, compressed or not */
+#define FORWARD_DEFAULT_SPOOL  (16 * 1024 * 1024)
+#define FORWARD_RETRY_MS       1000
+#define FORWARD_HELLO_MS       5000	/* to get the challenge of the aggregator */
+#define FORWARD_NONCE_LEN      32
+#define FORWARD_MAC_LEN        32
+#define FORWARD_MIN_SECRET     16	/* bytes */
+
+#define FORWARD_COMPRESSED     1	/* batch flag: the records are deflated */
+
+struct forward_challenge {
+	uint32_t magic;
+	uint32_t reserved;
+	unsigned char nonce[FORWARD_NONCE_LEN];	/* random, per connection */
+};
+
+struct forward_hello {
+	uint32_t magic;
+	uint32_t host_len;
+	uint64_t session;			/* tells the runs of a host apart, sequence numbers restart */
+	unsigned char mac[FORWARD_MAC_LEN];	/* see forward_mac() */
+};
+
+struct forward_batch {
+	uint32_t magic;
+	uint32_t flags;				/* FORWARD_COMPRESSED */
+	uint64_t seq;				/* from 1 within a session */
+	uint32_t count;				/* records */
+	uint32_t raw_len;			/* of the records once inflated */
+	uint32_t len;				/* of the data following this header */
+	uint32_t reserved;
+	unsigned char mac[FORWARD_MAC_LEN];	/* see forward_batch_mac() */
+};
+
+struct forward_stats {
+	int connected;
+	unsigned long long events;		/* events queued for forwarding */
+	unsigned long long acked;		/* events the aggregator took */
+	unsigned long long batches;
+	unsigned long long raw_bytes;	/* records, before compression */
+	unsigned long long wire_bytes;	/* batches, as sent */
+	unsigned long long resent;		/* batches sent again after a reconnection */
+	unsigned long long dropped;		/* events lost to the spool limit */
+	unsigned long long reconnects;
+	size_t spooled;					/* bytes waiting for an acknowledgement */
+	uint64_t lag_sum;				/* ms from the reading of events to their acknowledgement */
+	uint64_t lag_max;
+	uint64_t active_ms;				/* time spent connected */
+};
+
+void forward_record_order(struct publish_record *rec, int to_wire);
+int  forward_read_secret(const char *path);
+void forward_mac(const unsigned char *nonce, const struct forward_hello *h, const char *host, unsigned char *mac);
+void forward_batch_key(const unsigned char *hello_mac, unsigned char *key);
+void forward_batch_mac(const unsigned char *key, const struct forward_batch *b, const char *data, unsigned char *mac);
+
+int  forwarder_init(const char *address, size_t spool_size, int compress);
+int  forwarder_start(void);
+void forwarder_post(struct thread_info *list);
+void forwarder_get_stats(struct forward_stats *stats);
+
+#endif /* LISTENER_FORWARDER_H */
@@ -22,41 +22,93 @@
 #include "listener.h"
 #include "hashtable.h"
 
-static int hashtable_compare(const void *aa, const void *bb)
+static inline size_t hashtable_slot(int key, size_t mask)
 {
-	const watch_t *a = (const watch_t *) aa;
-	const watch_t *b = (const watch_t *) bb;
-	return a->wd < b->wd ? -1 : a->wd == b->wd ? 0 : 1;
+	return ((uint32_t) key * 2654435761u) & mask;
 }
 
-static unsigned long hashtable_compute_key(const void *entry)
+static struct hashslot *hashtable_find(struct hashtable *hash, int key)
 {
-	const watch_t *watch = (const watch_t *) entry;
-	unsigned long hash = watch->wd;
-	return hash;
+	size_t slot = hashtable_slot(key, hash->mask);
+
+	while (hash->slots[slot].count && hash->slots[slot].wd != key)
+		slot = (slot + 1) & hash->mask;
+	return &hash->slots[slot];
 }
 
-watch_t *hashtable_get(_LHASH *hash, int key)
+/* @key must be in the table; counts may be reset while it is filled */
+static struct hashslot *hashtable_find_wd(struct hashtable *hash, int key)
 {
-	watch_t obj = { .wd = key };
-	watch_t *entry = (watch_t *) lh_retrieve(hash, &obj);
-	return entry;
+	size_t slot = hashtable_slot(key, hash->mask);
+
+	while (hash->slots[slot].wd != key)
+		slot = (slot + 1) & hash->mask;
+	return &hash->slots[slot];
 }
 
-_LHASH *hashtable_create(watch_t *watch_list)
+/* the entries watching @key, NULL if none */
+watch_t **hashtable_get(struct hashtable *hash, int key, size_t *count)
 {
-	_LHASH *hash = lh_new(hashtable_compute_key, hashtable_compare);
-	for (watch_t *w = watch_list; w != NULL; w = w->next)
-		lh_insert(hash, w);
-	return hash;
+	struct hashslot *slot = hashtable_find(hash, key);
+
+	*count = slot->count;
+	return slot->count ? &hash->entries[slot->first] : NULL;
 }
 
-void hashtable_destroy(_LHASH *hash)
+/* rule records of trees, whose level 0 copies are watched, have no wd */
+struct hashtable *hashtable_create(watch_t **entries, size_t count)
 {
-	void hashtable_destroy_entry(void *entry) {
-		lh_delete(hash, entry);
+	struct hashtable *hash;
+	size_t size = 16, used = 0;
+
+	while (size < count * 2)
+		size <<= 1;
+
+	hash = (struct hashtable *) malloc(sizeof(struct hashtable));
+	if (! hash) {
+		perror("malloc");
+		return NULL;
+	}
+	hash->mask = size - 1;
+	hash->slots = (struct hashslot *) calloc(size, sizeof(struct hashslot));
+	hash->entries = (watch_t **) malloc((count ? count : 1) * sizeof(watch_t *));
+	if (! hash->slots || ! hash->entries) {
+		perror("calloc");
+		free(hash->slots);
+		free(hash->entries);
+		free(hash);
+		return NULL;
 	}
 
-	lh_doall(hash, hashtable_destroy_entry);
-	lh_free(hash);
+	/* counts the entries of each wd, then lays them out contiguously */
+	for (size_t i=0; i<count; ++i) {
+		struct hashslot *slot;
+		if (entries[i]->wd == 0)
+			continue;
+		slot = hashtable_find(hash, entries[i]->wd);
+		slot->wd = entries[i]->wd;
+		slot->count++;
+	}
+	for (size_t i=0; i<size; ++i) {
+		hash->slots[i].first = used;
+		used += hash->slots[i].count;
+		hash->slots[i].count = 0;
+	}
+	for (size_t i=0; i<count; ++i) {
+		struct hashslot *slot;
+		if (entries[i]->wd == 0)
+			continue;
+		slot = hashtable_find_wd(hash, entries[i]->wd);
+		hash->entries[slot->first + slot->count++] = entries[i];
+	}
+	return hash;
+}
+
+void hashtable_destroy(struct hashtable *hash)
+{
+	if (! hash)
+		return;
+	free(hash->slots);
+	free(hash->entries);
+	free(hash);
 }
@@ -21,10 +21,25 @@
 #ifndef __HASHTABLE_H
 #define __HASHTABLE_H
 
-#include <openssl/lhash.h>
+/*
+ * wd -> watch table of one published watch table version. It is never
+ * modified after hashtable_create(), so lookups need no locking. A directory
+ * watched by several rules has one entry per rule, all sharing its wd.
+ */
+struct hashslot {
+	int wd;
+	uint32_t first;		/* index in @entries */
+	uint32_t count;		/* 0 if the slot is free */
+};
+
+struct hashtable {
+	size_t mask;		/* number of slots - 1 */
+	struct hashslot *slots;
+	watch_t **entries;	/* grouped by watch descriptor, in table order */
+};
 
-_LHASH  *hashtable_create(watch_t *watch_list);
-void     hashtable_destroy(_LHASH *hash);
-watch_t *hashtable_get(_LHASH *hash, int key);
+struct hashtable *hashtable_create(watch_t **entries, size_t count);
+void      hashtable_destroy(struct hashtable *hash);
+watch_t **hashtable_get(struct hashtable *hash, int key, size_t *count);
 
 #endif /* __HASHTABLE_H */
@@ -0,0 +1,375 @@
+/*
+ * Listener - Listens for specific directories events and take actions
+ * based on rules specified by the user.
+ *
+ * Copyright (c) 2005-2017 Lucas C. Villa Real <lucasvr@gobolinux.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#include <sys/mman.h>
+#include <inttypes.h>
+#include "listener.h"
+#include "journal.h"
+#include "logger.h"
+
+#define JOURNAL_MAGIC    0x4e524a4c	/* "LJRN" */
+#define JOURNAL_PENDING  1
+#define JOURNAL_DONE     2
+
+struct journal_record {
+	uint32_t size;				/* record size including this header, written last */
+	uint32_t magic;
+	uint32_t state;				/* JOURNAL_PENDING or JOURNAL_DONE */
+	uint32_t attempts;			/* number of times the record has been replayed */
+	uint64_t seq;
+	int32_t rule_id;
+	uint32_t mask;
+	uint16_t dir_len;
+	uint16_t name_len;
+	uint32_t reserved;
+	char data[];				/* directory and entry name, both NUL terminated */
+};
+
+struct jsegment {
+	char path[PATH_MAX];
+	char *base;					/* mapping of the whole segment */
+	size_t used;				/* bytes taken by records */
+	int pending;				/* records not yet completed */
+	int active;					/* the segment receiving new records */
+	int dirty;					/* modified since the last flush */
+	struct jsegment *next;
+};
+
+static struct {
+	char dir[PATH_MAX];
+	pthread_mutex_t lock;
+	struct jsegment *segments;	/* oldest first */
+	struct jsegment *active;
+	uint64_t seq;
+	pthread_t flusher;
+} journal = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static inline size_t
+record_size(size_t dir_len, size_t name_len)
+{
+	size_t size = sizeof(struct journal_record) + dir_len + 1 + name_len + 1;
+	return (size + 7) & ~7;
+}
+
+static struct jsegment *
+segment_map(const char *path, int create)
+{
+	struct jsegment *seg;
+	int fd;
+
+	fd = open(path, O_RDWR | (create ? O_CREAT | O_EXCL : 0), 0600);
+	if (fd < 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+	if (ftruncate(fd, JOURNAL_SEGMENT_SIZE) < 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+
+	seg = (struct jsegment *) calloc(1, sizeof(struct jsegment));
+	snprintf(seg->path, sizeof(seg->path), "%s", path);
+	seg->base = mmap(NULL, JOURNAL_SEGMENT_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (seg->base == MAP_FAILED) {
+		perror("mmap");
+		free(seg);
+		return NULL;
+	}
+	return seg;
+}
+
+static void
+segment_release(struct jsegment *seg)
+{
+	munmap(seg->base, JOURNAL_SEGMENT_SIZE);
+	unlink(seg->path);
+	free(seg);
+}
+
+/* must be called with the journal lock held */
+static int
+segment_rotate(void)
+{
+	struct jsegment *seg, *last;
+	char path[PATH_MAX];
+
+	if (snprintf(path, sizeof(path), "%s/%016" PRIx64 ".journal", journal.dir, journal.seq) >= (int) sizeof(path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	seg = segment_map(path, 1);
+	if (! seg)
+		return -1;
+	seg->active = 1;
+
+	if (journal.active)
+		journal.active->active = 0;
+	journal.active = seg;
+
+	for (last=journal.segments; last && last->next; last=last->next)
+		;
+	if (last)
+		last->next = seg;
+	else
+		journal.segments = seg;
+	return 0;
+}
+
+/* walks the valid records of a segment, stopping at the first incomplete one */
+#define for_each_record(seg, rec) \
+	for (rec = (struct journal_record *) (seg)->base; \
+		(char *) rec + sizeof(*rec) <= (seg)->base + JOURNAL_SEGMENT_SIZE && \
+		rec->size >= sizeof(*rec) && rec->magic == JOURNAL_MAGIC && \
+		(char *) rec + rec->size <= (seg)->base + JOURNAL_SEGMENT_SIZE; \
+		rec = (struct journal_record *) ((char *) rec + rec->size))
+
+static void
+segment_scan(struct jsegment *seg)
+{
+	struct journal_record *rec;
+
+	for_each_record(seg, rec) {
+		if (rec->state == JOURNAL_PENDING)
+			seg->pending++;
+		if (rec->seq >= journal.seq)
+			journal.seq = rec->seq + 1;
+		seg->used = (char *) rec + rec->size - seg->base;
+	}
+}
+
+static void *
+journal_flusher(void *data)
+{
+	struct timespec interval = { 0, JOURNAL_FLUSH_MS * 1000000L };
+
+	while (2) {
+		nanosleep(&interval, NULL);
+
+		/*
+		 * Segments are only released by this thread, so they can be
+		 * synced without holding the lock.
+		 */
+		pthread_mutex_lock(&journal.lock);
+		struct jsegment *seg = journal.segments, *prev = NULL;
+		pthread_mutex_unlock(&journal.lock);
+
+		while (seg) {
+			size_t len;
+			int dirty, retire;
+
+			pthread_mutex_lock(&journal.lock);
+			dirty = seg->dirty;
+			seg->dirty = 0;
+			len = seg->used;
+			retire = seg->pending == 0 && ! seg->active;
+			if (retire) {
+				if (prev)
+					prev->next = seg->next;
+				else
+					journal.segments = seg->next;
+			}
+			pthread_mutex_unlock(&journal.lock);
+
+			if (retire) {
+				struct jsegment *next = seg->next;
+				segment_release(seg);
+				seg = next;
+				continue;
+			}
+			if (dirty && msync(seg->base, (len + 4095) & ~4095UL, MS_SYNC) < 0)
+				perror("msync");
+
+			pthread_mutex_lock(&journal.lock);
+			prev = seg;
+			seg = seg->next;
+			pthread_mutex_unlock(&journal.lock);
+		}
+	}
+	return NULL;
+}
+
+static int
+journal_filter(const struct dirent *entry)
+{
+	size_t len = strlen(entry->d_name);
+	return len > 8 && ! strcmp(&entry->d_name[len-8], ".journal");
+}
+
+int
+journal_open(const char *dir)
+{
+	struct dirent **entries;
+	char path[PATH_MAX];
+	int n;
+
+	snprintf(journal.dir, sizeof(journal.dir), "%s", dir);
+	if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+		fprintf(stderr, "%s: %s\n", dir, strerror(errno));
+		return -1;
+	}
+
+	/* segment names hold their first sequence number, so they sort in order */
+	n = scandir(dir, &entries, journal_filter, alphasort);
+	if (n < 0) {
+		fprintf(stderr, "%s: %s\n", dir, strerror(errno));
+		return -1;
+	}
+	for (int i=0; i<n; ++i) {
+		struct jsegment *seg, *last;
+
+		snprintf(path, sizeof(path), "%s/%s", dir, entries[i]->d_name);
+		free(entries[i]);
+		seg = segment_map(path, 0);
+		if (! seg)
+			continue;
+		segment_scan(seg);
+		for (last=journal.segments; last && last->next; last=last->next)
+			;
+		if (last)
+			last->next = seg;
+		else
+			journal.segments = seg;
+	}
+	free(entries);
+
+	pthread_mutex_lock(&journal.lock);
+	n = segment_rotate();
+	pthread_mutex_unlock(&journal.lock);
+	return n < 0 ? -1 : 0;
+}
+
+/*
+ * Hands the pending records of the previous run to @replay. Records that
+ * already failed JOURNAL_MAX_ATTEMPTS times are given up.
+ */
+void
+journal_replay(void (*replay)(const struct journal_event *ev, struct journal_ref *ref))
+{
+	struct journal_record *rec;
+	struct journal_event ev;
+	struct journal_ref ref;
+
+	for (struct jsegment *seg=journal.segments; seg != NULL && ! seg->active; seg=seg->next) {
+		for_each_record(seg, rec) {
+			if (rec->state != JOURNAL_PENDING)
+				continue;
+			ref.seg = seg;
+			ref.rec = rec;
+			if (rec->attempts >= JOURNAL_MAX_ATTEMPTS) {
+				log_printf(LOG_LEVEL_WARNING, "journal: giving up on %s/%s after %d attempts",
+					rec->data, &rec->data[rec->dir_len+1], rec->attempts);
+				journal_complete(&ref);
+				continue;
+			}
+			rec->attempts++;
+			seg->dirty = 1;
+
+			ev.rule_id = rec->rule_id;
+			ev.mask = rec->mask;
+			ev.dir = rec->data;
+			ev.name = &rec->data[rec->dir_len+1];
+			replay(&ev, &ref);
+		}
+	}
+}
+
+/* starts the flusher, after journal_replay() */
+int
+journal_start(void)
+{
+	if (pthread_create(&journal.flusher, NULL, journal_flusher, NULL) != 0) {
+		perror("pthread_create");
+		return -1;
+	}
+	pthread_detach(journal.flusher);
+	return 0;
+}
+
+int
+journal_append(const struct journal_event *ev, struct journal_ref *ref)
+{
+	size_t dir_len = strlen(ev->dir), name_len = strlen(ev->name);
+	size_t size = record_size(dir_len, name_len);
+	struct journal_record *rec;
+	struct jsegment *seg;
+
+	pthread_mutex_lock(&journal.lock);
+	seg = journal.active;
+	if (seg->used + size > JOURNAL_SEGMENT_SIZE) {
+		if (segment_rotate() < 0) {
+			pthread_mutex_unlock(&journal.lock);
+			return -1;
+		}
+		seg = journal.active;
+	}
+
+	rec = (struct journal_record *) (seg->base + seg->used);
+	rec->magic = JOURNAL_MAGIC;
+	rec->state = JOURNAL_PENDING;
+	rec->attempts = 0;
+	rec->seq = journal.seq++;
+	rec->rule_id = ev->rule_id;
+	rec->mask = ev->mask;
+	rec->dir_len = dir_len;
+	rec->name_len = name_len;
+	memcpy(rec->data, ev->dir, dir_len + 1);
+	memcpy(&rec->data[dir_len+1], ev->name, name_len + 1);
+	__atomic_store_n(&rec->size, size, __ATOMIC_RELEASE);
+
+	seg->used += size;
+	seg->pending++;
+	seg->dirty = 1;
+	pthread_mutex_unlock(&journal.lock);
+
+	ref->seg = seg;
+	ref->rec = rec;
+	return 0;
+}
+
+/* syncs every segment before exiting, the flusher may be halfway through its interval */
+void
+journal_flush(void)
+{
+	pthread_mutex_lock(&journal.lock);
+	for (struct jsegment *seg=journal.segments; seg; seg=seg->next) {
+		if (seg->dirty && msync(seg->base, (seg->used + 4095) & ~4095UL, MS_SYNC) < 0)
+			perror("msync");
+		seg->dirty = 0;
+	}
+	pthread_mutex_unlock(&journal.lock);
+}
+
+void
+journal_complete(struct journal_ref *ref)
+{
+	if (! ref->seg)
+		return;
+
+	pthread_mutex_lock(&journal.lock);
+	ref->rec->state = JOURNAL_DONE;
+	ref->seg->pending--;
+	ref->seg->dirty = 1;
+	pthread_mutex_unlock(&journal.lock);
+	ref->seg = NULL;
+}
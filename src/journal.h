@@ -0,0 +1,61 @@
+/*
+ * Listener - Listens for specific directories events and take actions
+ * based on rules specified by the user.
+ *
+ * Copyright (c) 2005-2017 Lucas C. Villa Real <lucasvr@gobolinux.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#ifndef LISTENER_JOURNAL_H
+#define LISTENER_JOURNAL_H 1
+
+/*
+ * Optional append-only journal of matched events. Records are appended to
+ * memory-mapped segment files and made durable by a flusher thread that
+ * calls msync() for all of them every JOURNAL_FLUSH_MS. A record is marked
+ * complete in place once its action succeeds. Segments without pending
+ * records are removed, and pending records found at startup are replayed.
+ * The flusher is started by journal_start(), once the replay is over: it
+ * removes segments that journal_replay() walks without the lock.
+ */
+
+#define JOURNAL_SEGMENT_SIZE  (4 * 1024 * 1024)
+#define JOURNAL_FLUSH_MS      20
+#define JOURNAL_MAX_ATTEMPTS  3
+
+struct jsegment;
+struct journal_record;
+
+/* identifies a journaled event, stored in the job that handles it */
+struct journal_ref {
+	struct jsegment *seg;
+	struct journal_record *rec;
+};
+
+struct journal_event {
+	int rule_id;
+	uint32_t mask;
+	const char *dir;
+	const char *name;
+};
+
+int  journal_open(const char *dir);
+void journal_replay(void (*replay)(const struct journal_event *ev, struct journal_ref *ref));
+int  journal_start(void);
+int  journal_append(const struct journal_event *ev, struct journal_ref *ref);
+void journal_complete(struct journal_ref *ref);
+void journal_flush(void);
+
+#endif /* LISTENER_JOURNAL_H */
@@ -0,0 +1,660 @@
+/*
+ * Listener - Listens for specific directories events and take actions
+ * based on rules specified by the user.
+ *
+ * Copyright (c) 2005-2017 Lucas C. Villa Real <lucasvr@gobolinux.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#include "listener.h"
+#include "linkindex.h"
+#include <openssl/lhash.h>
+
+#define LINKINDEX_MASK (IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO|IN_ONLYDIR|IN_DONT_FOLLOW)
+
+struct lnode;
+
+/* a reference from a symlink to the node of one of its target paths */
+struct lref {
+	struct link *link;
+	struct lnode *node;
+	struct lref *prev;
+	struct lref *next;
+};
+
+struct link {
+	char *path;					/* absolute path of the symlink */
+	unsigned int mark;			/* last query that collected this link */
+	int nrefs;
+	struct lref ref[2];			/* lexical and physical (realpath) targets */
+};
+
+/* one path component of a symlink target */
+struct lnode {
+	char *name;
+	struct lnode *parent;
+	struct lnode *child;
+	struct lnode *prev_sibling;
+	struct lnode *next_sibling;
+	struct lref *refs;			/* links whose target is exactly this path */
+};
+
+/* a watched directory of the index trees */
+struct ldir {
+	int wd;
+	char *path;
+};
+
+struct linkindex {
+	char **trees;
+	int ntrees;
+	int inotify_fd;
+	pthread_t tid;
+	pthread_mutex_t lock;
+	pthread_cond_t ready_cond;
+	int ready;					/* set once the initial crawl has finished */
+	unsigned int mark;
+	struct lnode root;
+	_LHASH *edges;				/* (parent, name) -> struct lnode */
+	_LHASH *links;				/* symlink path -> struct link */
+	_LHASH *dirs;				/* watch descriptor -> struct ldir */
+};
+
+static unsigned long
+edge_hash(const void *entry)
+{
+	const struct lnode *node = (const struct lnode *) entry;
+	return lh_strhash(node->name) ^ ((unsigned long) node->parent >> 4);
+}
+
+static int
+edge_compare(const void *aa, const void *bb)
+{
+	const struct lnode *a = (const struct lnode *) aa;
+	const struct lnode *b = (const struct lnode *) bb;
+	if (a->parent != b->parent)
+		return a->parent < b->parent ? -1 : 1;
+	return strcmp(a->name, b->name);
+}
+
+static unsigned long
+link_hash(const void *entry)
+{
+	return lh_strhash(((const struct link *) entry)->path);
+}
+
+static int
+link_compare(const void *a, const void *b)
+{
+	return strcmp(((const struct link *) a)->path, ((const struct link *) b)->path);
+}
+
+static unsigned long
+dir_hash(const void *entry)
+{
+	return ((const struct ldir *) entry)->wd;
+}
+
+static int
+dir_compare(const void *a, const void *b)
+{
+	return ((const struct ldir *) a)->wd - ((const struct ldir *) b)->wd;
+}
+
+/*
+ * Lexically resolves @target relative to the directory holding @linkpath,
+ * collapsing "." and ".." components.
+ */
+static void
+path_normalize(const char *linkpath, const char *target, char *out, size_t size)
+{
+	char buf[PATH_MAX*2], *component, *saveptr;
+	size_t len = 0;
+
+	if (target[0] == '/') {
+		snprintf(buf, sizeof(buf), "%s", target);
+	} else {
+		const char *slash = strrchr(linkpath, '/');
+		int dirlen = slash ? slash - linkpath : 0;
+		snprintf(buf, sizeof(buf), "%.*s/%s", dirlen, linkpath, target);
+	}
+
+	out[0] = '\0';
+	for (component=strtok_r(buf, "/", &saveptr); component; component=strtok_r(NULL, "/", &saveptr)) {
+		if (! strcmp(component, "."))
+			continue;
+		if (! strcmp(component, "..")) {
+			char *slash = strrchr(out, '/');
+			len = slash ? slash - out : 0;
+			out[len] = '\0';
+			continue;
+		}
+		len += snprintf(&out[len], size-len, "/%s", component);
+		if (len >= size) {
+			out[size-1] = '\0';
+			return;
+		}
+	}
+	if (! out[0])
+		snprintf(out, size, "/");
+}
+
+/* releases nodes that no longer lead to any link */
+static void
+node_prune(struct linkindex *index, struct lnode *node)
+{
+	while (node != &index->root && node->refs == NULL && node->child == NULL) {
+		struct lnode *parent = node->parent;
+
+		if (node->prev_sibling)
+			node->prev_sibling->next_sibling = node->next_sibling;
+		else
+			parent->child = node->next_sibling;
+		if (node->next_sibling)
+			node->next_sibling->prev_sibling = node->prev_sibling;
+
+		lh_delete(index->edges, node);
+		free(node->name);
+		free(node);
+		node = parent;
+	}
+}
+
+static struct lnode *
+node_lookup(struct linkindex *index, const char *path, int create)
+{
+	struct lnode *node = &index->root, *child, key;
+	char buf[PATH_MAX], *component, *saveptr;
+
+	snprintf(buf, sizeof(buf), "%s", path);
+	for (component=strtok_r(buf, "/", &saveptr); component; component=strtok_r(NULL, "/", &saveptr)) {
+		key.name = component;
+		key.parent = node;
+		child = (struct lnode *) lh_retrieve(index->edges, &key);
+		if (! child) {
+			if (! create)
+				return NULL;
+			child = (struct lnode *) calloc(1, sizeof(struct lnode));
+			if (! child || ! (child->name = strdup(component))) {
+				perror("calloc");
+				free(child);
+				node_prune(index, node);
+				return NULL;
+			}
+			child->parent = node;
+			child->next_sibling = node->child;
+			if (node->child)
+				node->child->prev_sibling = child;
+			node->child = child;
+			lh_insert(index->edges, child);
+		}
+		node = child;
+	}
+	return node;
+}
+
+static void
+link_attach(struct linkindex *index, struct link *link, const char *target)
+{
+	struct lnode *node = node_lookup(index, target, 1);
+	struct lref *ref;
+
+	if (! node)
+		return;
+	for (int i=0; i<link->nrefs; ++i) {
+		if (link->ref[i].node == node)
+			return;
+	}
+
+	ref = &link->ref[link->nrefs++];
+	ref->link = link;
+	ref->node = node;
+	ref->prev = NULL;
+	ref->next = ref->node->refs;
+	if (ref->next)
+		ref->next->prev = ref;
+	ref->node->refs = ref;
+}
+
+static void
+link_del(struct linkindex *index, const char *path)
+{
+	struct link key = { .path = (char *) path }, *link;
+
+	link = (struct link *) lh_delete(index->links, &key);
+	if (! link)
+		return;
+
+	for (int i=0; i<link->nrefs; ++i) {
+		struct lref *ref = &link->ref[i];
+		if (ref->prev)
+			ref->prev->next = ref->next;
+		else
+			ref->node->refs = ref->next;
+		if (ref->next)
+			ref->next->prev = ref->prev;
+		node_prune(index, ref->node);
+	}
+	free(link->path);
+	free(link);
+}
+
+static void
+link_add(struct linkindex *index, const char *path)
+{
+	char target[PATH_MAX], resolved[PATH_MAX], physical[PATH_MAX];
+	struct link *link;
+	ssize_t n;
+
+	n = readlink(path, target, sizeof(target)-1);
+	if (n < 0)
+		return;
+	target[n] = '\0';
+	path_normalize(path, target, resolved, sizeof(resolved));
+
+	link_del(index, path);
+	link = (struct link *) calloc(1, sizeof(struct link));
+	if (! link || ! (link->path = strdup(path))) {
+		perror("calloc");
+		free(link);
+		return;
+	}
+	lh_insert(index->links, link);
+
+	link_attach(index, link, resolved);
+	if (realpath(path, physical) && strcmp(physical, resolved))
+		link_attach(index, link, physical);
+}
+
+/* removes every link stored under directory @path */
+static void
+link_del_tree(struct linkindex *index, const char *path)
+{
+	size_t len = strlen(path), count, size = 0;
+	char **victims = NULL, **grown;
+	int full;
+
+	void collect(void *entry) {
+		struct link *link = (struct link *) entry;
+		if (full || strncmp(link->path, path, len) || link->path[len] != '/')
+			return;
+		if (count == size) {
+			grown = (char **) realloc(victims, (size ? size * 2 : 64) * sizeof(char *));
+			if (! grown) {
+				perror("realloc");
+				full = 1;
+				return;
+			}
+			victims = grown;
+			size = size ? size * 2 : 64;
+		}
+		victims[count++] = link->path;
+	}
+
+	/* a walk cut short for lack of memory is repeated once its victims are gone */
+	do {
+		count = 0;
+		full = 0;
+		lh_doall(index->links, collect);
+		for (size_t i=0; i<count; ++i)
+			link_del(index, victims[i]);
+	} while (full && count);
+	free(victims);
+}
+
+static void
+dir_watch(struct linkindex *index, const char *path)
+{
+	struct ldir *dir, *old;
+	int wd;
+
+	wd = inotify_add_watch(index->inotify_fd, path, LINKINDEX_MASK);
+	if (wd < 0) {
+		fprintf(stderr, "inotify_add_watch(%s): %s\n", path, strerror(errno));
+		return;
+	}
+	dir = (struct ldir *) calloc(1, sizeof(struct ldir));
+	if (! dir || ! (dir->path = strdup(path))) {
+		perror("calloc");
+		free(dir);
+		inotify_rm_watch(index->inotify_fd, wd);
+		return;
+	}
+	dir->wd = wd;
+	old = (struct ldir *) lh_insert(index->dirs, dir);
+	if (old) {
+		free(old->path);
+		free(old);
+	}
+}
+
+/* stops watching @path and the directories below it */
+static void
+dir_unwatch_tree(struct linkindex *index, const char *path)
+{
+	size_t len = strlen(path), count, size = 0;
+	struct ldir **victims = NULL, **grown;
+	int full;
+
+	void collect(void *entry) {
+		struct ldir *dir = (struct ldir *) entry;
+		if (full || strncmp(dir->path, path, len) || (dir->path[len] != '/' && dir->path[len] != '\0'))
+			return;
+		if (count == size) {
+			grown = (struct ldir **) realloc(victims, (size ? size * 2 : 64) * sizeof(struct ldir *));
+			if (! grown) {
+				perror("realloc");
+				full = 1;
+				return;
+			}
+			victims = grown;
+			size = size ? size * 2 : 64;
+		}
+		victims[count++] = dir;
+	}
+
+	do {
+		count = 0;
+		full = 0;
+		lh_doall(index->dirs, collect);
+		for (size_t i=0; i<count; ++i) {
+			lh_delete(index->dirs, victims[i]);
+			inotify_rm_watch(index->inotify_fd, victims[i]->wd);
+			free(victims[i]->path);
+			free(victims[i]);
+		}
+	} while (full && count);
+	free(victims);
+}
+
+/* forgets every link and watched directory, e.g. before crawling the trees again */
+static void
+linkindex_clear(struct linkindex *index)
+{
+	size_t count, size = 0;
+	void **victims = NULL, **grown;
+	int full;
+
+	void collect(void *entry) {
+		if (full)
+			return;
+		if (count == size) {
+			grown = (void **) realloc(victims, (size ? size * 2 : 64) * sizeof(void *));
+			if (! grown) {
+				perror("realloc");
+				full = 1;
+				return;
+			}
+			victims = grown;
+			size = size ? size * 2 : 64;
+		}
+		victims[count++] = entry;
+	}
+
+	/* walks cut short for lack of memory are repeated once their victims are gone */
+	do {
+		count = 0;
+		full = 0;
+		lh_doall(index->links, collect);
+		for (size_t i=0; i<count; ++i)
+			link_del(index, ((struct link *) victims[i])->path);
+	} while (full && count);
+
+	do {
+		count = 0;
+		full = 0;
+		lh_doall(index->dirs, collect);
+		for (size_t i=0; i<count; ++i) {
+			struct ldir *dir = (struct ldir *) victims[i];
+			lh_delete(index->dirs, dir);
+			inotify_rm_watch(index->inotify_fd, dir->wd);
+			free(dir->path);
+			free(dir);
+		}
+	} while (full && count);
+	free(victims);
+}
+
+/* directories are watched before their contents are read, so no link is missed */
+static void
+linkindex_crawl(struct linkindex *index, const char *tree)
+{
+	int crawl_entry(const char *file, const struct stat *sb, int flag, struct FTW *li) {
+		pthread_mutex_lock(&index->lock);
+		if (flag == FTW_D)
+			dir_watch(index, file);
+		else if (flag == FTW_SL)
+			link_add(index, file);
+		pthread_mutex_unlock(&index->lock);
+		return FTW_CONTINUE;
+	}
+
+	nftw(tree, crawl_entry, 1024, FTW_PHYS | FTW_ACTIONRETVAL);
+}
+
+static void
+linkindex_handle_event(struct linkindex *index, const struct inotify_event *ev)
+{
+	struct ldir key = { .wd = ev->wd }, *dir;
+	char path[PATH_MAX];
+	struct stat status;
+
+	if (ev->mask & IN_Q_OVERFLOW) {
+		/* we lost track of the trees, so start over */
+		pthread_mutex_lock(&index->lock);
+		linkindex_clear(index);
+		pthread_mutex_unlock(&index->lock);
+		for (int i=0; i<index->ntrees; ++i)
+			linkindex_crawl(index, index->trees[i]);
+		return;
+	}
+
+	pthread_mutex_lock(&index->lock);
+	dir = (struct ldir *) lh_retrieve(index->dirs, &key);
+	if (dir && (ev->mask & IN_IGNORED)) {
+		lh_delete(index->dirs, dir);
+		free(dir->path);
+		free(dir);
+		dir = NULL;
+	}
+	if (! dir || ! ev->len) {
+		pthread_mutex_unlock(&index->lock);
+		return;
+	}
+	snprintf(path, sizeof(path), "%s/%s", dir->path, ev->name);
+
+	if (ev->mask & (IN_DELETE|IN_MOVED_FROM)) {
+		if (ev->mask & IN_ISDIR) {
+			link_del_tree(index, path);
+			dir_unwatch_tree(index, path);
+		} else {
+			link_del(index, path);
+		}
+		pthread_mutex_unlock(&index->lock);
+		return;
+	}
+	pthread_mutex_unlock(&index->lock);
+
+	if (ev->mask & (IN_CREATE|IN_MOVED_TO)) {
+		if (ev->mask & IN_ISDIR) {
+			linkindex_crawl(index, path);
+		} else if (lstat(path, &status) == 0 && S_ISLNK(status.st_mode)) {
+			pthread_mutex_lock(&index->lock);
+			link_add(index, path);
+			pthread_mutex_unlock(&index->lock);
+		}
+	}
+}
+
+static void *
+linkindex_thread(void *data)
+{
+	struct linkindex *index = (struct linkindex *) data;
+	char buf[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	ssize_t n;
+
+	for (int i=0; i<index->ntrees; ++i)
+		linkindex_crawl(index, index->trees[i]);
+
+	pthread_mutex_lock(&index->lock);
+	index->ready = 1;
+	pthread_cond_broadcast(&index->ready_cond);
+	pthread_mutex_unlock(&index->lock);
+
+	while (2) {
+		n = read(index->inotify_fd, buf, sizeof(buf));
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		for (char *ptr=buf; ptr<buf+n; ptr+=sizeof(struct inotify_event)+ev->len) {
+			ev = (const struct inotify_event *) ptr;
+			linkindex_handle_event(index, ev);
+		}
+	}
+	return NULL;
+}
+
+struct linkindex *
+linkindex_create(char **trees, int ntrees)
+{
+	struct linkindex *index;
+
+	index = (struct linkindex *) calloc(1, sizeof(struct linkindex));
+	if (! index) {
+		perror("calloc");
+		return NULL;
+	}
+	index->trees = (char **) calloc(ntrees, sizeof(char *));
+	if (! index->trees) {
+		perror("calloc");
+		free(index);
+		return NULL;
+	}
+	for (int i=0; i<ntrees; ++i) {
+		index->trees[i] = strdup(trees[i]);
+		if (! index->trees[i]) {
+			perror("strdup");
+			while (i--)
+				free(index->trees[i]);
+			free(index->trees);
+			free(index);
+			return NULL;
+		}
+	}
+	index->ntrees = ntrees;
+	index->root.name = "";
+	index->inotify_fd = -1;
+	pthread_mutex_init(&index->lock, NULL);
+	pthread_cond_init(&index->ready_cond, NULL);
+	index->edges = lh_new(edge_hash, edge_compare);
+	index->links = lh_new(link_hash, link_compare);
+	index->dirs = lh_new(dir_hash, dir_compare);
+	return index;
+}
+
+/* crawls the index trees in the background and keeps them up to date */
+int
+linkindex_start(struct linkindex *index)
+{
+	index->inotify_fd = inotify_init();
+	if (index->inotify_fd < 0) {
+		perror("inotify_init");
+		return -1;
+	}
+	if (pthread_create(&index->tid, NULL, linkindex_thread, index) != 0) {
+		perror("pthread_create");
+		return -1;
+	}
+	pthread_detach(index->tid);
+	return 0;
+}
+
+/*
+ * Removes the broken links whose target is @prefix or a path below it.
+ * Returns the number of links removed.
+ */
+int
+linkindex_remove_broken(struct linkindex *index, const char *prefix)
+{
+	char normalized[PATH_MAX], **victims = NULL, **grown;
+	size_t count = 0, size = 0;
+	struct lnode *node, *top;
+	int removed = 0, full = 0;
+
+	path_normalize("/", prefix, normalized, sizeof(normalized));
+
+	pthread_mutex_lock(&index->lock);
+	while (! index->ready)
+		pthread_cond_wait(&index->ready_cond, &index->lock);
+
+	top = node_lookup(index, normalized, 0);
+	index->mark++;
+
+	/* preorder walk over the subtree rooted at @top */
+	for (node=top; node != NULL && ! full; ) {
+		for (struct lref *ref=node->refs; ref != NULL; ref=ref->next) {
+			if (ref->link->mark == index->mark)
+				continue;
+			if (count == size) {
+				/* the links gathered so far are still handled */
+				grown = (char **) realloc(victims, (size ? size * 2 : 64) * sizeof(char *));
+				if (! grown) {
+					perror("realloc");
+					full = 1;
+					break;
+				}
+				victims = grown;
+				size = size ? size * 2 : 64;
+			}
+			victims[count] = strdup(ref->link->path);
+			if (! victims[count]) {
+				perror("strdup");
+				continue;
+			}
+			ref->link->mark = index->mark;
+			count++;
+		}
+
+		if (node->child) {
+			node = node->child;
+			continue;
+		}
+		while (node != top && node->next_sibling == NULL)
+			node = node->parent;
+		node = node == top ? NULL : node->next_sibling;
+	}
+	pthread_mutex_unlock(&index->lock);
+
+	for (size_t i=0; i<count; ++i) {
+		struct stat status;
+
+		if (stat(victims[i], &status) == 0 || (errno != ENOENT && errno != ENOTDIR && errno != ELOOP)) {
+			/* not broken, e.g. the entry has been recreated */
+			free(victims[i]);
+			continue;
+		}
+		if (lstat(victims[i], &status) == 0 && S_ISLNK(status.st_mode) && unlink(victims[i]) == 0)
+			removed++;
+
+		pthread_mutex_lock(&index->lock);
+		link_del(index, victims[i]);
+		pthread_mutex_unlock(&index->lock);
+		free(victims[i]);
+	}
+	free(victims);
+	return removed;
+}
@@ -0,0 +1,37 @@
+/*
+ * Listener - Listens for specific directories events and take actions
+ * based on rules specified by the user.
+ *
+ * Copyright (c) 2005-2017 Lucas C. Villa Real <lucasvr@gobolinux.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#ifndef LISTENER_LINKINDEX_H
+#define LISTENER_LINKINDEX_H 1
+
+/*
+ * Reverse index from symlink targets to the symlinks that point to them.
+ * The index trees are crawled once and then kept up to date through their
+ * own inotify instance, so removing the links that point into a deleted
+ * directory costs O(affected links) rather than a scan of every tree.
+ */
+
+struct linkindex;
+
+struct linkindex *linkindex_create(char **trees, int ntrees);
+int               linkindex_start(struct linkindex *index);
+int               linkindex_remove_broken(struct linkindex *index, const char *prefix);
+
+#endif /* LISTENER_LINKINDEX_H */
@@ -0,0 +1,76 @@
+/*
+ * Listener - Listens for specific directories events and take actions
+ * based on rules specified by the user.
+ *
+ * Copyright (c) 2005-2017 Lucas C. Villa Real <lucasvr@gobolinux.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#ifndef LISTENER_PLUGIN_ABI_H
+#define LISTENER_PLUGIN_ABI_H 1
+
+/*
+ * C ABI for in-process action plugins. A rule using
+ *
+ *     "plugin": "/usr/lib/listener/foo.so:handler"
+ *
+ * makes the daemon dlopen() foo.so once and call handler() from the executor
+ * workers for every matched event. Handlers may run concurrently on several
+ * workers, so they must be thread-safe. The following symbols are optional:
+ *
+ *     handler_init   called once before the first event is dispatched
+ *     handler_fini   called once when the daemon shuts down
+ *     handler_batch  called instead of handler with a run of queued events
+ *                    for the same rule, in arrival order
+ *
+ * A rename inside the watched tree is a single event with both IN_MOVED_FROM
+ * and IN_MOVED_TO set in its mask. Under overload, rules using
+ * 'summarize_on_overload' get one event per directory, whose mask merges the
+ * masks of the events it stands for and whose summary counts them by type.
+ *
+ * Handlers return 0 on success. Pointers in struct listener_event are only
+ * valid during the call.
+ *
+ * Each plugin must use LISTENER_PLUGIN_ABI once, at file scope, to record
+ * the version of this header it was built against. Plugins built against
+ * another version, or without it, are refused at load time.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define LISTENER_PLUGIN_ABI_VERSION 3
+#define LISTENER_PLUGIN_ABI_SYMBOL  "listener_plugin_abi_version"
+
+#define LISTENER_PLUGIN_ABI \
+	const int listener_plugin_abi_version = LISTENER_PLUGIN_ABI_VERSION
+
+struct listener_event {
+	int rule_id;				/* 1-based index of the rule in the config file */
+	const char *rule;			/* rule description, or its target if not set */
+	uint32_t mask;				/* inotify event mask */
+	const char *root;			/* target of the rule */
+	const char *dir;			/* watched directory that received the event */
+	const char *entry;			/* entry name, relative to @dir */
+	const char *old_entry;		/* full path before a rename, NULL otherwise (ABI 2) */
+	const char *summary;		/* counts of a directory summary, @entry being ".", NULL otherwise (ABI 3) */
+};
+
+typedef int  (*listener_init_fn)(const char *rule, void **data);
+typedef void (*listener_fini_fn)(void *data);
+typedef int  (*listener_handler_fn)(const struct listener_event *ev, void *data);
+typedef int  (*listener_batch_fn)(const struct listener_event *ev, size_t count, void *data);
+
+#endif /* LISTENER_PLUGIN_ABI_H */
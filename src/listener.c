@@ -22,372 +22,3351 @@
 #include "listener.h"
 #include "hashtable.h"
 #include "rules.h"
+#include "executor.h"
+#include "plugin.h"
+#include "builtin.h"
+#include "journal.h"
+#include "ring.h"
+#include "pool.h"
+#include "rcu.h"
+#include "poller.h"
+#include "digest.h"
+#include "control.h"
+#include "logger.h"
+#include "uring.h"
+#include "feedback.h"
+#include "overload.h"
+#include "dirgraph.h"
+#include "publisher.h"
+#include "forwarder.h"
+#include "aggregator.h"
+#include <openssl/lhash.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
-struct listener_ctx {
-	watch_t *watch_list;
-	_LHASH *watch_hash;
+#define RING_STRUCTURAL          0
+#define RING_CONTENT             1
+#define RING_POLLED              2
+#define NUM_RINGS                3
+
+#define DISPATCH_BATCH           64
+#define DISPATCH_REBUILD_EVENTS  4096
+#define DISPATCH_PENDING         (2 * DISPATCH_BATCH)	/* events classified at once with io_uring */
+#define ORDER_SLOTS              4096	/* entries the reader keeps in order, see read_events() */
+
+#define EVENTS_PER_SLAB          64
+
+#define MOVE_PAIR_TIMEOUT        50		/* ms to wait for the MOVED_TO half of a rename */
+#define MAX_PENDING_MOVES        64
+
+#define CRAWL_CHUNK              256	/* directories crawled per hold of write_lock */
+#define CRAWL_PUBLISH_MS         250	/* longest wait of new entries of the initial crawl */
+#define MAX_PARKED_EVENTS        65536	/* see park_event() */
+#define MAX_TREE_CHANGES         1024	/* see note_tree_change() */
+#define BALANCE_INTERVAL_MS      10000	/* between trades of watches for busy polled directories */
+#define BALANCE_IDLE_MS          60000	/* see outranks() */
+
+/* crawl_roots() flags */
+#define CRAWL_VERBOSE            1
+#define CRAWL_BACKGROUND         2		/* the initial crawl, see crawl_shard() */
+
+/* growable array of watch entries */
+struct watch_vec {
+	watch_t **entries;
+	size_t count;
+	size_t size;
+};
+
+/*
+ * The watches of a shard are published as an immutable, versioned table.
+ * Dispatchers look events up inside an RCU read section without taking any
+ * lock. Writers build the next version, sharing the entries they keep, and
+ * swap it in; the old table and the dropped entries are freed once no reader
+ * can still see them.
+ */
+struct watch_table {
+	uint64_t version;
+	size_t count;
+	watch_t **entries;		/* rule roots and the subdirectories they watch */
+	struct hashtable *hash;	/* wd -> entry */
+};
+
+/* rule roots indexed by rule_id - 1, published like the watch tables */
+struct rule_set {
+	uint64_t version;
+	size_t count;
+	watch_t **rules;
+};
+
+/* MOVED_FROM event waiting for its MOVED_TO half, see route_event() */
+struct pending_move {
+	struct event_record ev;
+	uint64_t deadline;
+};
+
+/* a subdirectory created, removed or moved during the initial crawl, see reconcile_trees() */
+struct tree_change {
+	watch_t *root;
+	watch_t *entry;			/* of @root for @path in the table, if any */
+	int level;
+	char *old_path;			/* of renames, which also note their source */
+	char path[PATH_MAX];
+};
+
+/* an event waiting for the type of its entry, see classify_pending() */
+struct pending_event {
+	watch_t *watch;
+	struct thread_info *info;
+	int stat;					/* the entry type is filtered by lookat */
+	char path[PATH_MAX];
+};
+
+/*
+ * Rules are spread across several inotify instances. Each shard has its own
+ * kernel event queue and watch descriptor table. A reader thread copies its
+ * events into lock-free rings, and a dispatcher thread matches them against
+ * the rules. Actions from all shards go to the shared executor.
+ */
+struct listener_shard {
+	int id;
 	int inotify_fd;
+	struct watch_table *table;	/* current version, see publish_table() */
+	struct watch_vec staging;	/* entries added before the first publish_table() */
+	struct dirgraph *graph;		/* directories holding an inotify watch, see watch_directory() */
+	pthread_mutex_t write_lock;	/* serializes writers of @table */
+	struct watch_vec rebuild;	/* dispatcher only: rules to crawl again after the batch */
+	struct watch_vec expand;	/* dispatcher only: glob rules to expand again after the batch */
+	int promote;			/* set by the poller when evicted directories may get a watch */
+	int resync;				/* set by the control socket, see resync_rules() */
+	struct uring *uring;	/* --io-uring: dispatcher only, see classify_pending() */
+	struct pending_event *pending;
+	struct statx *statx;
+	size_t npending;
+	unsigned long long stat_calls;	/* synchronous stats of event entries */
+	struct pending_move moves[MAX_PENDING_MOVES];	/* dispatcher only, oldest first */
+	int nmoves;
+	unsigned long moves_paired;
+	unsigned long moves_unpaired;
+	unsigned long trees_rekeyed;	/* directory renames handled without a rebuild */
+	struct overload overload;	/* dispatcher only, see check_overload() */
+	struct watch_vec crawl;		/* crawler only: entries of the initial crawl */
+	size_t crawl_published;		/* entries of @crawl already in @table */
+	uint64_t crawl_publish_ms;	/* when @crawl was last published */
+	uint64_t crawl_publish_cost;	/* ms it took */
+	int crawling;				/* set until the initial crawl is published */
+	int settling;				/* dispatcher only: set until its changes are reconciled */
+	int balance;				/* dispatcher only: the watches need balance_watches() */
+	uint64_t balance_ms;		/* when it last ran */
+	struct event_record *parked;	/* dispatcher only: events on directories not in @table yet */
+	size_t nparked;
+	uint64_t parked_version;	/* of the table @parked was last looked up in */
+	struct tree_change *changes;	/* dispatcher only */
+	size_t nchanges;
+	unsigned long parked_handled;
+	unsigned long parked_dropped;
+	unsigned long overflows;	/* of the inotify queue, see handle_overflow() */
+	struct ring rings[NUM_RINGS];	/* events copied by the reader, per lane */
+	uint64_t lane_seq[NUM_RINGS];	/* dispatcher only: last event handled per lane */
+	int wake_fd;			/* eventfd used to wake up the dispatcher */
+	int sleeping;			/* set while the dispatcher waits on @wake_fd */
+	pthread_t reader;
+	pthread_t dispatcher;
+	pthread_t crawler;
+};
+
+struct listener_ctx {
+	struct listener_shard *shards;
+	int nshards;
 	int debug_mode;
+	int workers;
+	char *journal_dir;
+	struct pool event_pool;	/* struct thread_info records */
+	struct rule_set *rules;
+	struct watch_vec rule_staging;	/* rules read from the config file */
+	int watches;			/* inotify watches in use, all shards */
+	int max_watches;		/* --max-watches, 0 if unset */
+	int watch_limit;		/* see read_watch_limit() */
+	int watch_budget;		/* watches we expect to get, lowered on ENOSPC */
+	unsigned long evictions;	/* directories polled for lack of budget */
+	unsigned int poll_budget;	/* poller I/O operations per second */
+	char *control_path;		/* --control, see listen_on_shards() */
+	int io_uring;			/* --io-uring, see start_threads() */
+	int fanotify;			/* --fanotify, see feedback.h */
+	char *publish_path;		/* --publish, see publisher.h */
+	char *forward_address;	/* --forward, see forwarder.h */
+	char *aggregate_address;	/* --aggregate, see aggregator.h */
+	int draining;			/* new events are dropped while the executor drains */
+	int stopping;			/* the dispatchers exit, see suicide() */
+	uint64_t drain_start;
+	uint64_t start;			/* before the config file is read */
+	int crawlers;			/* shards whose initial crawl is running */
+	uint64_t ready_ms;		/* time the initial crawl took, 0 while it runs */
+};
+
+static struct listener_ctx ctx;
+
+#define debug_printf(fmt, args...)	log_printf(LOG_LEVEL_DEBUG, fmt, ##args)
+
+static int
+watch_vec_push(struct watch_vec *vec, watch_t *watch)
+{
+	if (vec->count == vec->size) {
+		size_t size = vec->size ? vec->size * 2 : 64;
+		watch_t **entries = (watch_t **) realloc(vec->entries, size * sizeof(watch_t *));
+		if (! entries) {
+			perror("realloc");
+			return -1;
+		}
+		vec->entries = entries;
+		vec->size = size;
+	}
+	vec->entries[vec->count++] = watch;
+	return 0;
+}
+
+static void
+free_watch(watch_t *watch)
+{
+	if (watch->regex_rule[0])
+		regfree(&watch->regex);
+	free(watch);
+}
+
+/* rcu_defer() callback releasing the entries dropped by a rebuild */
+static void
+free_watch_vec(void *data)
+{
+	struct watch_vec *vec = (struct watch_vec *) data;
+
+	for (size_t i=0; i<vec->count; ++i)
+		free_watch(vec->entries[i]);
+	free(vec->entries);
+	free(vec);
+}
+
+/* rcu_defer() callback releasing a table; its entries may still be shared */
+static void
+free_table(void *data)
+{
+	struct watch_table *table = (struct watch_table *) data;
+
+	hashtable_destroy(table->hash);
+	free(table->entries);
+	free(table);
+}
+
+/* makes @entries the current watch table of @shard; the caller owns write_lock */
+static void
+publish_table(struct listener_shard *shard, struct watch_vec *entries)
+{
+	struct watch_table *old = shard->table;
+	struct watch_table *table = (struct watch_table *) calloc(1, sizeof(struct watch_table));
+
+	if (! table || ! (table->hash = hashtable_create(entries->entries, entries->count))) {
+		fprintf(stderr, "shard %d: cannot publish the watch table\n", shard->id);
+		exit(EXIT_FAILURE);
+	}
+	table->version = old ? old->version + 1 : 1;
+	table->count = entries->count;
+	table->entries = entries->entries;
+	memset(entries, 0, sizeof(*entries));
+
+	rcu_assign_pointer(shard->table, table);
+	if (old)
+		rcu_defer(free_table, old);
+}
+
+static void
+publish_rules(struct watch_vec *rules)
+{
+	struct rule_set *old = ctx.rules;
+	struct rule_set *set = (struct rule_set *) calloc(1, sizeof(struct rule_set));
+
+	if (! set) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	set->version = old ? old->version + 1 : 1;
+	set->count = rules->count;
+	set->rules = rules->entries;
+	memset(rules, 0, sizeof(*rules));
+
+	rcu_assign_pointer(ctx.rules, set);
+	if (old)
+		rcu_defer(free, old);
+}
+
+static uint64_t
+monotonic_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* wakes up the dispatcher of @shard if it is waiting for events */
+static void
+wake_dispatcher(struct listener_shard *shard)
+{
+	uint64_t one = 1;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&shard->sleeping, __ATOMIC_RELAXED)) {
+		if (write(shard->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+			perror("write");
+	}
+}
+
+/*
+ * Stops the daemon the way the drain command does: no new action is started,
+ * and those in flight are waited for unless SIGINT or SIGTERM comes again.
+ * The dispatchers are stopped before the watch tables are released; those of
+ * shards still crawling are left to exit().
+ */
+static void
+suicide(void)
+{
+	struct timespec tick = { 0, CONTROL_TICK * 1000000L };
+	sigset_t stop;
+	int drained;
+
+	sigemptyset(&stop);
+	sigaddset(&stop, SIGINT);
+	sigaddset(&stop, SIGTERM);
+	__atomic_store_n(&ctx.draining, 1, __ATOMIC_RELAXED);
+	while (! (drained = executor_pending() == 0) && sigtimedwait(&stop, NULL, &tick) < 0)
+		;
+	if (! drained)
+		log_printf(LOG_LEVEL_WARNING, "exiting with %lu actions pending", executor_pending());
+
+	__atomic_store_n(&ctx.stopping, 1, __ATOMIC_RELEASE);
+	for (int i=0; i<ctx.nshards; ++i) {
+		wake_dispatcher(&ctx.shards[i]);
+		pthread_join(ctx.shards[i].dispatcher, NULL);
+	}
+	journal_flush();
+	publisher_stop();
+	if (drained)
+		plugin_fini_all();
+	log_flush();
+	if (! drained)
+		exit(EXIT_SUCCESS);
+
+	for (int i=0; i<ctx.nshards; ++i) {
+		struct listener_shard *shard = &ctx.shards[i];
+		struct watch_table *table;
+
+		pthread_mutex_lock(&shard->write_lock);
+		table = shard->table;
+		if (table && ! shard->crawling) {
+			hashtable_destroy(table->hash);
+			for (size_t n=0; n<table->count; ++n)
+				free_watch(table->entries[n]);
+		}
+		pthread_mutex_unlock(&shard->write_lock);
+	}
+	exit(EXIT_SUCCESS);
+}
+
+char *mask_name(int mask, char *buf, size_t size);
+
+/* the description of the event is only formatted at the debug log level */
+static void
+print_event(struct thread_info *info, const char *action, const char *detail)
+{
+	char mask[128], renamed[PATH_MAX+32] = "";
+
+	if (log_level < LOG_LEVEL_DEBUG)
+		return;
+	if (info->old_entry[0])
+		snprintf(renamed, sizeof(renamed), "-> renamed from: %s\n", info->old_entry);
+	log_printf(LOG_LEVEL_DEBUG, "-> %sevent on dir %s, watch %d\n%s"
+		"-> filename:    %s\n"
+		"-> event mask:  %#X (%s)\n"
+		"-> %s: %s\n",
+		info->summary[0] ? "summarized " : info->wd == 0 ? "replayed " : "", info->dir, info->wd, renamed,
+		info->offending_name,
+		info->mask, mask_name(info->mask, mask, sizeof(mask)),
+		action, detail);
+}
+
+/* a successful action completes the journal record of its event */
+static void
+release_job(struct thread_info *info)
+{
+	if (info->status == 0)
+		journal_complete(&info->journal);
+	pool_put(&ctx.event_pool, info);
+}
+
+/* events after which the entry may hold the same content as before */
+#define CONTENT_EVENTS (IN_MODIFY|IN_ATTRIB|IN_CLOSE_WRITE|IN_CREATE|IN_MOVED_TO)
+
+/* tells if the event can be dropped under the 'on_content_change_only' option */
+static int
+content_unchanged(struct thread_info *info)
+{
+	char path[PATH_MAX];
+	watch_t *rule = info->rule;
+
+	if (! rule->content_only || (info->mask & IN_ISDIR) || info->summary[0])
+		return 0;
+	/* too long a path to open, the action runs */
+	if (snprintf(path, sizeof(path), "%s/%s", info->dir, info->offending_name) >= (int) sizeof(path))
+		return 0;
+	if (info->old_entry[0])
+		digest_forget(rule->rule_id, info->old_entry);
+	if ((info->mask & IN_DELETE) || (info->mask & (IN_MOVED_FROM|IN_MOVED_TO)) == IN_MOVED_FROM) {
+		digest_forget(rule->rule_id, path);
+		return 0;
+	}
+	return (info->mask & CONTENT_EVENTS) && ! digest_changed(rule->rule_id, path);
+}
+
+/*
+ * Reads the output of an action until it exits, so that it never blocks on
+ * a full pipe. Only the tail is kept, and lines are logged at the info level.
+ */
+static void
+capture_output(watch_t *rule, int fd)
+{
+	char buf[4096], line[LOG_MAX_RECORD/2];
+	size_t len = 0;
+	ssize_t n;
+
+	while ((n = read(fd, buf, sizeof(buf))) != 0) {
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			break;
+		log_capture_append(rule->output, buf, n);
+		if (log_level < LOG_LEVEL_INFO)
+			continue;
+		for (ssize_t i=0; i<n; ++i) {
+			if (buf[i] != '\n' && len < sizeof(line)) {
+				line[len++] = buf[i];
+				continue;
+			}
+			log_printf(LOG_LEVEL_INFO, "rule %d: %.*s", rule->rule_id, (int) len, line);
+			len = 0;
+			if (buf[i] != '\n')
+				line[len++] = buf[i];
+		}
+	}
+	if (len)
+		log_printf(LOG_LEVEL_INFO, "rule %d: %.*s", rule->rule_id, (int) len, line);
+}
+
+/* the entries of the jobs are the rule's own while its action runs, see feedback.h */
+static void
+own_entries(struct thread_info *info, int running)
+{
+	char path[PATH_MAX];
+
+	if (! info->rule->ignore_own)
+		return;
+	for (; info; info = info->next) {
+		if (info->offending_name[0] == '/')
+			snprintf(path, sizeof(path), "%s", info->offending_name);
+		else if (snprintf(path, sizeof(path), "%s/%s", info->dir, info->offending_name) >= (int) sizeof(path))
+			continue;
+		if (running)
+			feedback_begin(info->rule->rule_id, path);
+		else
+			feedback_end(info->rule->rule_id, path);
+		if (info->old_entry[0] && running)
+			feedback_begin(info->rule->rule_id, info->old_entry);
+		else if (info->old_entry[0])
+			feedback_end(info->rule->rule_id, info->old_entry);
+	}
+}
+
+void
+perform_action(struct thread_info *info)
+{
+	pid_t pid;
+	int status;
+	watch_t *watch = info->rule;
+	struct thread_info **link = &info;
+	char *cmd = watch->spawn, spawn[LINE_MAX] = { 0 };
+	int len = strlen(cmd), skipped = 0;
+	int output[2] = { -1, -1 }, sync[2] = { -1, -1 };
+
+	while (*link) {
+		struct thread_info *job = *link;
+		if (content_unchanged(job)) {
+			*link = job->next;
+			print_event(job, "suppressed", "content unchanged");
+			job->status = 0;
+			release_job(job);
+		} else {
+			link = &job->next;
+		}
+	}
+	if (! info)
+		return;
+
+	/* rules may both publish or forward their events and act on them */
+	if (watch->publish)
+		publisher_post(info);
+	if (watch->forward)
+		forwarder_post(info);
+	if (! watch->spawn[0] && ! watch->plugin && ! watch->builtin) {
+		while (info) {
+			struct thread_info *next = info->next;
+			print_event(info, watch->publish ? "publish" : "forward",
+				(watch->publish ? ctx.publish_path : ctx.forward_address) ?: "nowhere");
+			info->status = 0;
+			release_job(info);
+			info = next;
+		}
+		return;
+	}
+	own_entries(info, 1);
+
+	if (watch->plugin || watch->builtin) {
+		if (watch->plugin)
+			plugin_dispatch(info);
+		else
+			builtin_dispatch(info);
+		own_entries(info, 0);
+		while (info) {
+			struct thread_info *next = info->next;
+			if (watch->plugin)
+				print_event(info, "plugin", watch->plugin->spec);
+			else
+				print_event(info, "builtin", watch->builtin->spec);
+			release_job(info);
+			info = next;
+		}
+		return;
+	}
+
+	/* the command is expanded here, the log writer doesn't exist in the child */
+	while (2) {
+		int skip_bytes = 0;
+		char *token = get_token(cmd, &skip_bytes, info->dir, info);
+		if (! token && skip_bytes)
+			goto too_long;
+		if (! token)
+			break;
+
+		cmd += skip_bytes;
+		skipped += skip_bytes;
+
+		if (strlen(spawn) + strlen(token) + 2 > sizeof(spawn)) {
+			free(token);
+			goto too_long;
+		}
+		strcat(spawn, token);
+		strcat(spawn, " ");
+		free(token);
+
+		if (skipped >= len)
+			break;
+	}
+	if (log_level >= LOG_LEVEL_DEBUG) {
+		char cmdline[LINE_MAX+16];
+		snprintf(cmdline, sizeof(cmdline), "/bin/sh -c '%s'", spawn);
+		print_event(info, "spawn", cmdline);
+	}
+	if (watch->output && pipe2(output, O_CLOEXEC) < 0) {
+		log_printf(LOG_LEVEL_WARNING, "pipe: %s", strerror(errno));
+		output[0] = output[1] = -1;
+	}
+	/* the child waits until its process group is known, see feedback_add_pid() */
+	if (watch->ignore_own && pipe2(sync, O_CLOEXEC) < 0)
+		sync[0] = sync[1] = -1;
+
+	pid = fork();
+	if (pid == 0) {
+		char *exec_array[] = { "/bin/sh", "-c", spawn, NULL };
+		sigset_t set;
+		char c;
+
+		if (watch->ignore_own) {
+			setpgid(0, 0);
+			if (sync[0] >= 0) {
+				close(sync[1]);
+				while (read(sync[0], &c, 1) < 0 && errno == EINTR)
+					;
+			}
+		}
+		if (output[1] >= 0) {
+			dup2(output[1], STDOUT_FILENO);
+			dup2(output[1], STDERR_FILENO);
+		}
+		executor_set_priority(watch->priority);
+		sigemptyset(&set);
+		sigprocmask(SIG_SETMASK, &set, NULL);
+		execvp(exec_array[0], exec_array);
+		_exit(EXIT_FAILURE);
+
+	} else if (pid > 0) {
+		if (watch->ignore_own) {
+			setpgid(pid, pid);
+			feedback_add_pid(pid);
+		}
+		if (sync[0] >= 0) {
+			close(sync[0]);
+			close(sync[1]);
+		}
+		if (output[1] >= 0) {
+			close(output[1]);
+			capture_output(watch, output[0]);
+			close(output[0]);
+		}
+		if (waitpid(pid, &status, 0) == pid && WIFEXITED(status))
+			info->status = WEXITSTATUS(status);
+		if (watch->ignore_own)
+			feedback_remove_pid(pid);
+	} else {
+		log_printf(LOG_LEVEL_ERROR, "fork: %s", strerror(errno));
+		if (output[1] >= 0) {
+			close(output[0]);
+			close(output[1]);
+		}
+		if (sync[0] >= 0) {
+			close(sync[0]);
+			close(sync[1]);
+		}
+	}
+
+	own_entries(info, 0);
+	release_job(info);
+	return;
+
+too_long:
+	log_printf(LOG_LEVEL_WARNING, "spawn: command of the event on %s/%s too long once expanded, dropped",
+		info->dir, info->offending_name);
+	own_entries(info, 0);
+	release_job(info);
+}
+
+/*
+ * Queues @info on the executor, unless its rule is paused. The lock of the
+ * pause keeps held events ahead of the ones that follow the resume.
+ */
+static void
+submit_job(struct thread_info *info)
+{
+	struct rule_pause *pause = __atomic_load_n(&info->rule->pause, __ATOMIC_ACQUIRE);
+
+	if (! pause) {
+		executor_submit(info);
+		return;
+	}
+	pthread_mutex_lock(&pause->lock);
+	if (pause->policy == PAUSE_NONE) {
+		executor_submit(info);
+	} else if (pause->policy == PAUSE_BUFFER && pause->held < PAUSE_MAX_HELD) {
+		info->next = NULL;
+		if (pause->tail)
+			pause->tail->next = info;
+		else
+			pause->head = info;
+		pause->tail = info;
+		pause->held++;
+	} else {
+		/* discarded on purpose, so not replayed from the journal either */
+		pause->discarded++;
+		info->status = 0;
+		release_job(info);
+	}
+	pthread_mutex_unlock(&pause->lock);
+}
+
+/* directories polled by the trees being rebuilt, see watch_directory() */
+struct polled_dir {
+	const char *target;
+	int wd;
+	int taken;
+};
+
+struct polled_set {
+	struct polled_dir *dirs;
+	size_t count;
+};
+
+static int
+compare_polled(const void *aa, const void *bb)
+{
+	return strcmp(((const struct polled_dir *) aa)->target, ((const struct polled_dir *) bb)->target);
+}
+
+static int
+keep_polled(struct polled_set *polled, watch_t *w)
+{
+	if ((polled->count & 63) == 0) {
+		struct polled_dir *dirs = (struct polled_dir *) realloc(polled->dirs, (polled->count + 64) * sizeof(struct polled_dir));
+		if (! dirs) {
+			perror("realloc");
+			return -1;
+		}
+		polled->dirs = dirs;
+	}
+	polled->dirs[polled->count++] = (struct polled_dir) { w->target, w->wd, 0 };
+	return 0;
+}
+
+/* hands over the poller registration of a directory that is still polled after a rebuild */
+static int
+reuse_polled(struct polled_set *polled, watch_t *w)
+{
+	struct polled_dir key = { .target = w->target }, *dir;
+
+	if (! polled || ! polled->count)
+		return 0;
+	dir = (struct polled_dir *) bsearch(&key, polled->dirs, polled->count, sizeof(key), compare_polled);
+	if (! dir || dir->taken)
+		return 0;
+	dir->taken = 1;
+	w->wd = dir->wd;
+	return 1;
+}
+
+/* the kernel limit is shared with every other process of the user */
+static int
+read_watch_limit(void)
+{
+	FILE *fp = fopen("/proc/sys/fs/inotify/max_user_watches", "r");
+	int limit = INT_MAX;
+
+	if (fp) {
+		if (fscanf(fp, "%d", &limit) != 1 || limit <= 0)
+			limit = INT_MAX;
+		fclose(fp);
+	}
+	if (ctx.max_watches > 0 && ctx.max_watches < limit)
+		limit = ctx.max_watches;
+	return limit;
+}
+
+/*
+ * Adds an inotify watch on the target of @w. Once the watch budget is spent
+ * the directory is handed to the poller instead, which is slower to notice
+ * changes but keeps the rule working.
+ */
+static int
+watch_directory(watch_t *w, uint32_t mask, struct polled_set *polled)
+{
+	struct stat st;
+	uint32_t shared;
+
+	if (w->rule && w->rule->ignore_own && ! w->scaffold)
+		feedback_watch_dir(w->target);
+	if (w->backend == BACKEND_POLL) {
+		if (reuse_polled(polled, w))
+			return 0;
+		return poller_add(w->target, mask, 0, w->shard, &w->wd);
+	}
+	/* crawled entries already know their inode */
+	if (! w->ino) {
+		if (stat(w->target, &st) < 0) {
+			fprintf(stderr, "stat(%s): %s\n", w->target, strerror(errno));
+			return -1;
+		}
+		w->dev = st.st_dev;
+		w->ino = st.st_ino;
+	}
+	/* the watch of a directory is shared by all the entries on it, and so is its mask */
+	shared = dirgraph_mask(w->shard->graph, w->dev, w->ino);
+	if (shared || __atomic_load_n(&ctx.watches, __ATOMIC_RELAXED) < __atomic_load_n(&ctx.watch_budget, __ATOMIC_RELAXED)) {
+		w->wd = inotify_add_watch(w->shard->inotify_fd, w->target, mask | shared);
+		if (w->wd >= 0) {
+			int depth = w->scaffold ? 0 : w->root->depth - w->level;
+			if (dirgraph_add(w->shard->graph, w->dev, w->ino, w, mask, depth) <= 1)
+				__atomic_add_fetch(&ctx.watches, 1, __ATOMIC_RELAXED);
+			return 0;
+		}
+		if (errno != ENOSPC) {
+			fprintf(stderr, "inotify_add_watch(%d, %s, %#x): %s\n", w->shard->inotify_fd, w->target, mask, strerror(errno));
+			return -1;
+		}
+		/* other processes are using part of the limit */
+		__atomic_store_n(&ctx.watch_budget, __atomic_load_n(&ctx.watches, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+	}
+	if (reuse_polled(polled, w))
+		return 0;
+	__atomic_add_fetch(&ctx.evictions, 1, __ATOMIC_RELAXED);
+	return poller_add(w->target, mask, POLL_EVICTED, w->shard, &w->wd);
+}
+
+static void
+unwatch_directory(watch_t *w)
+{
+	if (w->rule && w->rule->ignore_own && ! w->scaffold)
+		feedback_unwatch_dir(w->target);
+	if (w->wd < 0) {
+		poller_remove(w->wd);
+	} else if (dirgraph_remove(w->shard->graph, w->dev, w->ino, w) <= 0) {
+		/* the mask of a watch still in use isn't narrowed, the extra events are filtered */
+		inotify_rm_watch(w->shard->inotify_fd, w->wd);
+		__atomic_sub_fetch(&ctx.watches, 1, __ATOMIC_RELAXED);
+	}
+}
+
+/* copy of @w for a newer table, which drops @w */
+static watch_t *
+copy_entry(watch_t *w)
+{
+	watch_t *c = (watch_t *) malloc(sizeof(watch_t));
+
+	if (! c) {
+		perror("malloc");
+		return NULL;
+	}
+	memcpy(c, w, sizeof(*c));
+	if (c->regex_rule[0])
+		regcomp(&c->regex, c->regex_rule, REG_EXTENDED);
+	return c;
+}
+
+/*
+ * Moves the only inotify watch of @*watched to the evicted directory of
+ * @*polled, which is watched before the other one is handed to the poller.
+ * Both entries are replaced by copies and the originals go to @retired.
+ * Writers only, under write_lock.
+ */
+static int
+trade_watch(struct listener_shard *shard, watch_t **polled, watch_t **watched, struct watch_vec *retired)
+{
+	watch_t *p = *polled, *w = *watched, *np, *nw;
+	uint32_t mask = p->mask | SYS_MASK;
+
+	if (! (np = copy_entry(p)))
+		return -1;
+	if (! (nw = copy_entry(w))) {
+		free_watch(np);
+		return -1;
+	}
+	/* the other directory is polled before its watch goes away, so nothing is missed */
+	if (poller_add(w->target, w->mask | SYS_MASK, POLL_EVICTED, shard, &nw->wd) < 0) {
+		free_watch(np);
+		free_watch(nw);
+		return -1;
+	}
+	dirgraph_remove(shard->graph, w->dev, w->ino, w);
+	inotify_rm_watch(shard->inotify_fd, w->wd);
+	__atomic_sub_fetch(&ctx.watches, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&ctx.evictions, 1, __ATOMIC_RELAXED);
+	*watched = nw;
+	watch_vec_push(retired, w);
+
+	np->wd = inotify_add_watch(shard->inotify_fd, p->target, mask | dirgraph_mask(shard->graph, p->dev, p->ino));
+	if (np->wd < 0) {
+		debug_printf("inotify_add_watch(%d, %s, %#x): %s\n", shard->inotify_fd, p->target, mask, strerror(errno));
+		free_watch(np);
+		return -1;
+	}
+	if (dirgraph_add(shard->graph, p->dev, p->ino, np, mask, p->root->depth - p->level) <= 1)
+		__atomic_add_fetch(&ctx.watches, 1, __ATOMIC_RELAXED);
+	poller_remove(p->wd);
+	*polled = np;
+	watch_vec_push(retired, p);
+	return 0;
+}
+
+/* shallow directories first, then the ones with the most recent events */
+static int
+compare_rank(const void *aa, const void *bb)
+{
+	const watch_t *a = **(watch_t ** const *) aa, *b = **(watch_t ** const *) bb;
+	if (a->level != b->level)
+		return a->level - b->level;
+	return a->active_ms != b->active_ms ? (a->active_ms > b->active_ms ? -1 : 1) : 0;
+}
+
+/* a watch only moves to a directory as deep once it's been idle for a while, so they don't flap */
+static int
+outranks(const watch_t *polled, const watch_t *watched)
+{
+	if (polled->level != watched->level)
+		return polled->level < watched->level;
+	return polled->active_ms > watched->active_ms + BALANCE_IDLE_MS;
+}
+
+/*
+ * The crawl watches each directory before listing it, depth first, so once
+ * the budget runs out deep directories may hold watches that shallower ones
+ * reached later couldn't get. Trades them, so that shallow directories are
+ * watched first, and among directories as deep, those with recent events, as
+ * far as directories watched by a single entry go. Entries
+ * in @entries are replaced by copies and the originals go to @retired; the
+ * caller owns write_lock and publishes @entries. Returns the number of
+ * entries replaced.
+ */
+static int
+balance_watches(struct listener_shard *shard, struct watch_vec *entries, struct watch_vec *retired)
+{
+	watch_t ***polled, ***watched;
+	size_t npolled = 0, nwatched = 0, i = 0, j, replaced = retired->count;
+	int traded = 0;
+
+	if (! __atomic_load_n(&ctx.evictions, __ATOMIC_RELAXED))
+		return 0;
+	polled = (watch_t ***) malloc((entries->count + 1) * sizeof(watch_t **));
+	watched = (watch_t ***) malloc((entries->count + 1) * sizeof(watch_t **));
+	if (! polled || ! watched) {
+		perror("malloc");
+		free(polled);
+		free(watched);
+		return 0;
+	}
+	/* directories of trees only, the roots of rules without depth keep what they got */
+	for (size_t k=0; k<entries->count; ++k) {
+		watch_t **ptr = &entries->entries[k];
+		if (*ptr == (*ptr)->root || (*ptr)->scaffold || ! (*ptr)->depth || (*ptr)->backend == BACKEND_POLL)
+			continue;
+		if ((*ptr)->wd < 0)
+			polled[npolled++] = ptr;
+		else if (dirgraph_entries(shard->graph, (*ptr)->dev, (*ptr)->ino) == 1)
+			watched[nwatched++] = ptr;
+	}
+	qsort(polled, npolled, sizeof(watch_t **), compare_rank);
+	qsort(watched, nwatched, sizeof(watch_t **), compare_rank);
+	for (j=nwatched; i<npolled && j>0 && outranks(*polled[i], *watched[j-1]); ++i, --j) {
+		if (trade_watch(shard, polled[i], watched[j-1], retired) == 0)
+			traded++;
+	}
+	if (traded)
+		debug_printf("shard %d: %d watches handed to polled directories\n", shard->id, traded);
+	free(polled);
+	free(watched);
+	return retired->count - replaced;
+}
+
+/* runs balance_watches() on the current table of @shard; the caller owns write_lock */
+static void
+balance_table(struct listener_shard *shard)
+{
+	struct watch_table *table = shard->table;
+	struct watch_vec next = { 0 }, *retired = (struct watch_vec *) calloc(1, sizeof(struct watch_vec));
+
+	if (! retired) {
+		perror("calloc");
+		return;
+	}
+	for (size_t i=0; i<table->count; ++i)
+		watch_vec_push(&next, table->entries[i]);
+	if (balance_watches(shard, &next, retired)) {
+		publish_table(shard, &next);
+		rcu_defer(free_watch_vec, retired);
+		return;
+	}
+	free(next.entries);
+	free(retired);
+}
+
+/* a rule whose tree covers the directory being crawled, see crawl_roots() */
+struct crawl_tree {
+	size_t tree;				/* index of its root in the sorted roots */
+	int level;
 };
 
-static struct listener_ctx ctx;
+/* a directory already crawled for a rule, against symlink loops and aliases */
+struct crawled_dir {
+	dev_t dev;
+	ino_t ino;
+	watch_t *root;
+};
+
+static unsigned long
+crawled_hash(const void *data)
+{
+	const struct crawled_dir *c = (const struct crawled_dir *) data;
+	return (unsigned long) c->ino * 2654435761UL ^ (unsigned long) c->dev ^ ((unsigned long) c->root >> 4);
+}
+
+static int
+crawled_compare(const void *a, const void *b)
+{
+	const struct crawled_dir *x = (const struct crawled_dir *) a;
+	const struct crawled_dir *y = (const struct crawled_dir *) b;
+	return x->dev != y->dev || x->ino != y->ino || x->root != y->root;
+}
+
+static int
+compare_targets(const void *aa, const void *bb)
+{
+	return strcmp((*(watch_t * const *) aa)->target, (*(watch_t * const *) bb)->target);
+}
+
+/*
+ * Publishes the entries found so far by the initial crawl of @shard. Each
+ * version copies the table, so new entries wait until they make up half of
+ * it, or until CRAWL_PUBLISH_MS went by and publishing takes at most a tenth
+ * of the crawl. The caller owns write_lock.
+ */
+static void
+publish_crawl(struct listener_shard *shard, int force)
+{
+	struct watch_table *table = shard->table;
+	struct watch_vec next = { 0 };
+	size_t fresh = shard->crawl.count - shard->crawl_published;
+	uint64_t now = monotonic_ms();
+
+	if (! fresh || (! force && fresh < table->count / 2 &&
+		now - shard->crawl_publish_ms < CRAWL_PUBLISH_MS + 10 * shard->crawl_publish_cost))
+		return;
+	for (size_t i=0; i<table->count; ++i)
+		watch_vec_push(&next, table->entries[i]);
+	for (size_t i=shard->crawl_published; i<shard->crawl.count; ++i)
+		watch_vec_push(&next, shard->crawl.entries[i]);
+	publish_table(shard, &next);
+	shard->crawl_published = shard->crawl.count;
+	shard->crawl_publish_ms = monotonic_ms();
+	shard->crawl_publish_cost = shard->crawl_publish_ms - now;
+	/* its parked events may be found now */
+	wake_dispatcher(shard);
+}
+
+/*
+ * Watches the trees of the rules rooted at @roots, appending their
+ * subdirectories to @out. Trees are crawled together, so that a directory
+ * covered by several of them is listed once: a root met while crawling
+ * another tree joins the crawl there. Each directory is watched before it is
+ * listed, so that an entry created in between is either listed or reported.
+ * Entries for the level 0 of trees are copies of their roots, which stay
+ * unwatched. Returns the number of roots without depth whose target couldn't
+ * be watched.
+ *
+ * With CRAWL_BACKGROUND, @out is the initial crawl of the shard, which is
+ * published as it goes; write_lock is taken here and let go every
+ * CRAWL_CHUNK directories.
+ */
+static int
+crawl_roots(watch_t **roots, size_t nroots, struct watch_vec *out, struct polled_set *polled, int flags)
+{
+	struct listener_shard *shard = nroots ? roots[0]->shard : NULL;
+	size_t ntrees = 0, visited = 0;
+	watch_t **trees;
+	char *reached;
+	unsigned long *excluded;
+	_LHASH *crawled;
+	char path[PATH_MAX];
+	int failed = 0;
+
+	/* subdirectories of @path are appended to it, which is restored on return */
+	void crawl(size_t len, const struct crawl_tree *active, size_t nactive) {
+		struct crawl_tree next[nactive + ntrees];
+		size_t nnext = 0;
+		struct stat st;
+		struct dirent *de;
+		watch_t **found, key, *keyp = &key;
+		DIR *dir;
+
+		/* lets the control socket in, the dispatcher doesn't write meanwhile */
+		if ((flags & CRAWL_BACKGROUND) && ++visited % CRAWL_CHUNK == 0) {
+			publish_crawl(shard, 0);
+			pthread_mutex_unlock(&shard->write_lock);
+			sched_yield();
+			pthread_mutex_lock(&shard->write_lock);
+		}
+		if (stat(path, &st) < 0 || ! S_ISDIR(st.st_mode))
+			return;
+		for (size_t i=0; i<nactive; ++i)
+			next[nnext++] = active[i];
+
+		/* trees rooted here join the crawl */
+		snprintf(key.target, sizeof(key.target), "%s", path);
+		found = (watch_t **) bsearch(&keyp, trees, ntrees, sizeof(watch_t *), compare_targets);
+		for (; found && found > trees && ! strcmp(found[-1]->target, path); --found)
+			;
+		for (; found && found < trees + ntrees && ! strcmp((*found)->target, path); ++found) {
+			if (! reached[found - trees]) {
+				reached[found - trees] = 1;
+				next[nnext].tree = found - trees;
+				next[nnext++].level = 0;
+			}
+		}
+
+		nactive = nnext;
+		nnext = 0;
+		for (size_t i=0; i<nactive; ++i) {
+			watch_t *root = trees[next[i].tree], *w;
+			struct crawled_dir *c;
+
+			if (next[i].level && root->exclude && exclude_match(root, path, NULL)) {
+				excluded[next[i].tree]++;
+				continue;
+			}
+			if (! (c = (struct crawled_dir *) malloc(sizeof(struct crawled_dir))))
+				continue;
+			c->dev = st.st_dev;
+			c->ino = st.st_ino;
+			c->root = root;
+			if (lh_retrieve(crawled, c)) {
+				free(c);
+				continue;
+			}
+			lh_insert(crawled, c);
+
+			/*
+			 * replicate the parent's spawn, uses_entry_variable, mask, lookat,
+			 * regex and depth members
+			 */
+			w = (watch_t *) calloc(1, sizeof(watch_t));
+			if (! w)
+				continue;
+			memcpy(w, root, sizeof(*w));
+
+			/* only needs to differentiate on the target, regex and watch descriptor */
+			snprintf(w->target, sizeof(w->target), "%s", path);
+			if (strlen(w->regex_rule)) {
+				regcomp(&w->regex, w->regex_rule, REG_EXTENDED);
+			}
+			w->level = next[i].level;
+			w->queued = 0;
+			w->dev = st.st_dev;
+			w->ino = st.st_ino;
+			if (watch_directory(w, w->mask | SYS_MASK, polled) < 0) {
+				free_watch(w);
+				continue;
+			}
+			watch_vec_push(out, w);
+			if (flags & CRAWL_VERBOSE) { debug_printf("[recursive] %s %s on watch %d\n", w->wd < 0 ? "Polling" : "Monitoring", w->target, w->wd); }
+			if (next[i].level < root->depth) {
+				next[nnext].tree = next[i].tree;
+				next[nnext++].level = next[i].level + 1;
+			}
+		}
+		if (! nnext || ! (dir = opendir(path)))
+			return;
+
+		while ((de = readdir(dir)) != NULL) {
+			size_t n = strlen(de->d_name);
+			struct stat sub;
+
+			if (! strcmp(de->d_name, ".") || ! strcmp(de->d_name, ".."))
+				continue;
+			if (de->d_type != DT_DIR && de->d_type != DT_UNKNOWN && de->d_type != DT_LNK)
+				continue;
+			if (len + 1 + n >= sizeof(path))
+				continue;
+			path[len] = '/';
+			memcpy(&path[len+1], de->d_name, n + 1);
+			/* symbolic links to directories are followed, as nftw() did */
+			if (de->d_type == DT_DIR || (stat(path, &sub) == 0 && S_ISDIR(sub.st_mode)))
+				crawl(len + 1 + n, next, nnext);
+			path[len] = '\0';
+		}
+		closedir(dir);
+	}
+
+	void free_crawled(void *data) {
+		free(data);
+	}
+
+	if (! nroots)
+		return 0;
+	trees = (watch_t **) malloc((nroots + 1) * sizeof(watch_t *));
+	reached = (char *) calloc(nroots + 1, 1);
+	excluded = (unsigned long *) calloc(nroots + 1, sizeof(unsigned long));
+	crawled = lh_new(crawled_hash, crawled_compare);
+	if (! trees || ! reached || ! excluded || ! crawled) {
+		perror("calloc");
+		free(trees);
+		free(reached);
+		free(excluded);
+		if (crawled)
+			lh_free(crawled);
+		return nroots;
+	}
+	if (flags & CRAWL_BACKGROUND)
+		pthread_mutex_lock(&shard->write_lock);
+
+	/* roots without depth have no tree, only their target is watched */
+	for (size_t i=0; i<nroots; ++i) {
+		watch_t *root = roots[i];
+		if (root->depth) {
+			trees[ntrees++] = root;
+			continue;
+		}
+		if (watch_directory(root, root->mask, polled) < 0) {
+			failed++;
+			continue;
+		}
+		if (flags & CRAWL_VERBOSE) { debug_printf("%s %s on watch %d\n", root->wd < 0 ? "Polling" : "Monitoring", root->target, root->wd); }
+	}
+
+	/* shallow targets first, so that trees nested in others are reached by their crawl */
+	qsort(trees, ntrees, sizeof(watch_t *), compare_targets);
+	for (size_t i=0; i<ntrees; ++i) {
+		size_t len = snprintf(path, sizeof(path), "%s", trees[i]->target);
+		if (! reached[i] && len < sizeof(path))
+			crawl(len, NULL, 0);
+	}
+	for (size_t i=0; i<ntrees; ++i) {
+		if (trees[i]->exclude)
+			trees[i]->exclude->excluded_dirs = excluded[i];
+	}
+	if (flags & CRAWL_BACKGROUND)
+		pthread_mutex_unlock(&shard->write_lock);
+	lh_doall(crawled, free_crawled);
+	lh_free(crawled);
+	free(excluded);
+	free(reached);
+	free(trees);
+	return failed;
+}
+
+/* fails if @root has no depth and its target can't be watched */
+static int
+crawl_rule(watch_t *root, struct watch_vec *out, struct polled_set *polled, int flags)
+{
+	return crawl_roots(&root, 1, out, polled, flags) ? -1 : 0;
+}
+
+/* current expansion of a glob rule, see expand_pattern() */
+struct expansion {
+	watch_t *rule;
+	glob_t matches;		/* targets of the rule instances */
+	char *matched;		/* per match: its instance is already in the table */
+	glob_t scaffold;	/* directories whose changes may change @matches */
+	char *watched;		/* per scaffold directory: already in the table */
+};
+
+#define SCAFFOLD_MASK (IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO|IN_DELETE_SELF|IN_MOVE_SELF|IN_ONLYDIR)
+
+static int
+compare_paths(const void *a, const void *b)
+{
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+static int
+find_path(glob_t *paths, const char *path)
+{
+	char **found;
+
+	if (! paths->gl_pathc)
+		return -1;
+	found = (char **) bsearch(&path, paths->gl_pathv, paths->gl_pathc, sizeof(char *), compare_paths);
+	return found ? found - paths->gl_pathv : -1;
+}
+
+/*
+ * Expands the target of a glob rule. The scaffold holds the expansions of the
+ * prefixes of the pattern that are followed by a component at or after the
+ * first wildcard: "/Programs/x/Current/bin", with x a wildcard, is kept
+ * current by watching /Programs, every /Programs/x and every /Programs/x/Current.
+ */
+static void
+expand_pattern(struct expansion *x, watch_t *rule)
+{
+	const char *pattern = rule->target, *cut = strpbrk(pattern, "*?[");
+	char prefix[PATH_MAX];
+	int flags = GLOB_ONLYDIR;
+
+	memset(x, 0, sizeof(*x));
+	x->rule = rule;
+	glob(pattern, 0, NULL, &x->matches);
+
+	while (cut > pattern && *cut != '/')
+		cut--;
+	for (; cut; cut=strchr(cut+1, '/')) {
+		int len = cut - pattern;
+		snprintf(prefix, sizeof(prefix), "%.*s", len ? len : 1, len ? pattern : "/");
+		if (glob(prefix, flags, NULL, &x->scaffold) == 0)
+			flags |= GLOB_APPEND;
+	}
+
+	qsort(x->matches.gl_pathv, x->matches.gl_pathc, sizeof(char *), compare_paths);
+	qsort(x->scaffold.gl_pathv, x->scaffold.gl_pathc, sizeof(char *), compare_paths);
+	x->matched = (char *) calloc(x->matches.gl_pathc + 1, 1);
+	x->watched = (char *) calloc(x->scaffold.gl_pathc + 1, 1);
+}
+
+static void
+free_expansion(struct expansion *x)
+{
+	globfree(&x->matches);
+	globfree(&x->scaffold);
+	free(x->matched);
+	free(x->watched);
+}
+
+/* adds the instances and scaffold directories of @x that aren't in @out yet */
+static void
+add_expansion(struct expansion *x, struct watch_vec *out, struct polled_set *polled, int flags)
+{
+	watch_t *rule = x->rule, *w;
+	struct stat st;
+
+	for (size_t i=0; i<x->matches.gl_pathc; ++i) {
+		if (x->matched[i] || ! (w = (watch_t *) malloc(sizeof(watch_t))))
+			continue;
+		memcpy(w, rule, sizeof(*w));
+		snprintf(w->target, sizeof(w->target), "%s", x->matches.gl_pathv[i]);
+		if (w->regex_rule[0])
+			regcomp(&w->regex, w->regex_rule, REG_EXTENDED);
+		w->glob = 0;
+		w->queued = 0;
+		w->root = w;
+		watch_vec_push(out, w);
+		if (crawl_rule(w, out, polled, flags) < 0) {
+			out->count--;
+			free_watch(w);
+		}
+	}
+
+	for (size_t i=0; i<x->scaffold.gl_pathc; ++i) {
+		const char *dir = x->scaffold.gl_pathv[i];
+		if (x->watched[i] || stat(dir, &st) < 0 || ! S_ISDIR(st.st_mode))
+			continue;
+		if (! (w = (watch_t *) calloc(1, sizeof(watch_t))))
+			continue;
+		snprintf(w->target, sizeof(w->target), "%s", dir);
+		w->mask = SCAFFOLD_MASK;
+		w->scaffold = 1;
+		w->rule_id = rule->rule_id;
+		w->backend = rule->backend;
+		w->shard = rule->shard;
+		w->root = rule;
+		w->rule = rule;
+		if (flags & CRAWL_BACKGROUND)
+			pthread_mutex_lock(&rule->shard->write_lock);
+		if (watch_directory(w, SCAFFOLD_MASK, polled) < 0) {
+			free(w);
+			w = NULL;
+		} else {
+			watch_vec_push(out, w);
+		}
+		if (flags & CRAWL_BACKGROUND)
+			pthread_mutex_unlock(&rule->shard->write_lock);
+		if (w && (flags & CRAWL_VERBOSE)) { debug_printf("[glob] Watching %s on watch %d\n", w->target, w->wd); }
+	}
+}
+
+void
+select_on_inotify(struct listener_shard *shard)
+{
+	int ret;
+	fd_set read_fds;
+
+	FD_ZERO(&read_fds);
+	FD_SET(shard->inotify_fd, &read_fds);
+
+	ret = select(shard->inotify_fd + 1, &read_fds, NULL, NULL, NULL);
+	if (ret == -1)
+		perror("select");
+}
+
+static inline void
+mask_concat(char *buf, size_t size, const char *data)
+{
+	size_t offset = strlen(buf);
+	if (offset == 0) {
+		strncat(buf, data, size);
+	} else {
+		char *start = &buf[offset];
+		snprintf(start, size-offset-1, " | %s", data);
+	}
+}
+
+char *
+mask_name(int mask, char *buf, size_t size)
+{
+	buf[0] = '\0';
+
+	if (mask & IN_ACCESS)
+		mask_concat(buf, size, "access");
+	if (mask & IN_MODIFY)
+		mask_concat(buf, size, "modify");
+	if (mask & IN_ATTRIB)
+		mask_concat(buf, size, "attrib");
+	if (mask & IN_CLOSE_WRITE)
+		mask_concat(buf, size, "close write");
+	if (mask & IN_CLOSE_NOWRITE)
+		mask_concat(buf, size, "close nowrite");
+	if (mask & IN_OPEN)
+		mask_concat(buf, size, "open");
+	if (mask & IN_MOVED_FROM)
+		mask_concat(buf, size, "moved from");
+	if (mask & IN_MOVED_TO)
+		mask_concat(buf, size, "moved to");
+	if (mask & IN_CREATE)
+		mask_concat(buf, size, "create");
+	if (mask & IN_DELETE)
+		mask_concat(buf, size, "delete");
+	if (mask & IN_DELETE_SELF)
+		mask_concat(buf, size, "delete self");
+	if (mask & IN_MOVE_SELF)
+		mask_concat(buf, size, "move self");
+	if (! buf[0]) {
+		char unknown[64];
+		snprintf(unknown, sizeof(unknown)-1, "unknown (%#x)", mask);
+		mask_concat(buf, size, unknown);
+	}
+
+	return buf;
+}
+
+/* the rebuild and expand vectors of a shard hold each root or rule once */
+#define QUEUED_REBUILD  1
+#define QUEUED_EXPAND   2
+
+static inline int
+rebuild_requested(watch_t *root)
+{
+	return root->queued & QUEUED_REBUILD;
+}
+
+static void
+request_rebuild(struct listener_shard *shard, watch_t *root)
+{
+	if (root->queued & QUEUED_REBUILD)
+		return;
+	root->queued |= QUEUED_REBUILD;
+	watch_vec_push(&shard->rebuild, root);
+}
+
+/* instances of glob rules may go away before their rebuild */
+static void
+forget_rebuild(struct listener_shard *shard, watch_t *root)
+{
+	if (! (root->queued & QUEUED_REBUILD))
+		return;
+	root->queued &= ~QUEUED_REBUILD;
+	for (size_t i=0; i<shard->rebuild.count; ++i) {
+		if (shard->rebuild.entries[i] == root) {
+			shard->rebuild.entries[i] = shard->rebuild.entries[--shard->rebuild.count];
+			return;
+		}
+	}
+}
+
+static void
+request_expansion(struct listener_shard *shard, watch_t *rule)
+{
+	if (rule->queued & QUEUED_EXPAND)
+		return;
+	rule->queued |= QUEUED_EXPAND;
+	watch_vec_push(&shard->expand, rule);
+}
+
+/* timestamp of the events sent to subscribers */
+static uint64_t
+realtime_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Tells if @ev changes the shape of the tree of @watch. The parent's event
+ * covers the subdirectory that moved or went away, so the self events of
+ * subdirectories don't count.
+ */
+static inline int
+tree_changed(watch_t *watch, const struct event_record *ev)
+{
+	if (! watch->depth)
+		return 0;
+	if ((ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO)))
+		return 1;
+	return (ev->mask & (IN_DELETE_SELF|IN_MOVE_SELF)) && watch->level == 0;
+}
+
+/*
+ * Filters the entry of an event by its type. @error is the errno of the
+ * failed stat, 0 if it succeeded.
+ */
+static int
+wanted_entry(watch_t *watch, const char *path, int error, mode_t mode)
+{
+	if (error && watch->uses_entry_variable && ! (watch->mask & IN_DELETE || watch->mask & IN_DELETE_SELF)) {
+		log_printf(LOG_LEVEL_WARNING, "stat %s: %s", path, strerror(error));
+		return 0;
+	}
+	if (!(FILTER_DIRS(watch->lookat) && S_ISDIR(mode)) &&
+			!(FILTER_FILES(watch->lookat) && S_ISREG(mode)) &&
+			!(FILTER_SYMLINKS(watch->lookat) && S_ISLNK(mode)) &&
+			! error) {
+		const char *fsobj = S_ISDIR(mode) ? "DIRS" : S_ISREG(mode) ? "FILES" : "SYMLINKS";
+		debug_printf("watch %d doesn't want to process %s, skipping event\n", watch->wd, fsobj);
+		return 0;
+	}
+	return 1;
+}
+
+/* journals the event of @info and hands it to the executor */
+static void
+queue_event(watch_t *watch, struct thread_info *info)
+{
+	if (ctx.journal_dir) {
+		struct journal_event jev = {
+			.rule_id = watch->rule_id,
+			.mask = info->mask,
+			.dir = info->dir,
+			.name = info->offending_name,
+		};
+		journal_append(&jev, &info->journal);
+	}
+	submit_job(info);
+}
+
+static void
+release_uring(void *data)
+{
+	uring_destroy((struct uring *) data);
+}
+
+/*
+ * Stats the entries of the events deferred by handle_events() with a single
+ * io_uring submission, then queues the wanted ones in their arrival order.
+ * Must be called inside the RCU read section of the batch.
+ */
+static void
+classify_pending(struct listener_shard *shard)
+{
+	const char *paths[DISPATCH_PENDING];
+	int results[DISPATCH_PENDING];
+	size_t nstat = 0;
+
+	for (size_t i=0; i<shard->npending; ++i) {
+		struct pending_event *p = &shard->pending[i];
+		if (p->stat)
+			paths[nstat++] = p->path;
+	}
+	if (nstat && uring_statx(shard->uring, paths, shard->statx, results, nstat) < 0) {
+		/* the shard keeps to the synchronous path from now on, see dump_stats() */
+		struct uring *ring = shard->uring;
+		log_printf(LOG_LEVEL_WARNING, "shard %d: io_uring: %s, using synchronous calls", shard->id, strerror(errno));
+		rcu_assign_pointer(shard->uring, NULL);
+		rcu_defer(release_uring, ring);
+		for (size_t k=0; k<nstat; ++k) {
+			results[k] = statx(AT_FDCWD, paths[k], 0, STATX_TYPE|STATX_MODE, &shard->statx[k]) < 0 ? -errno : 0;
+			shard->stat_calls++;
+		}
+	}
+
+	nstat = 0;
+	for (size_t i=0; i<shard->npending; ++i) {
+		struct pending_event *p = &shard->pending[i];
+		if (p->stat) {
+			int error = results[nstat] < 0 ? -results[nstat] : 0;
+			mode_t mode = error ? 0 : shard->statx[nstat].stx_mode;
+			nstat++;
+			if (! wanted_entry(p->watch, p->path, error, mode)) {
+				pool_put(&ctx.event_pool, p->info);
+				continue;
+			}
+		}
+		queue_event(p->watch, p->info);
+	}
+	shard->npending = 0;
+}
+
+static void
+defer_event(struct listener_shard *shard, watch_t *watch, struct thread_info *info, const char *path)
+{
+	struct pending_event *p;
+
+	if (shard->npending == DISPATCH_PENDING)
+		classify_pending(shard);
+	p = &shard->pending[shard->npending++];
+	p->watch = watch;
+	p->info = info;
+	p->stat = path != NULL;
+	if (path)
+		snprintf(p->path, sizeof(p->path), "%s", path);
+}
+
+/*
+ * Keeps a subdirectory that changed during the initial crawl for
+ * reconcile_trees(), instead of rebuilding its tree right away: the crawl
+ * most likely saw the change.
+ */
+static void
+note_tree_change(struct listener_shard *shard, watch_t *watch, const char *name, const char *old_path)
+{
+	struct tree_change *c;
+
+	if (! shard->changes)
+		shard->changes = (struct tree_change *) malloc(MAX_TREE_CHANGES * sizeof(struct tree_change));
+	if (! shard->changes || shard->nchanges == MAX_TREE_CHANGES) {
+		request_rebuild(shard, watch->root);
+		return;
+	}
+	c = &shard->changes[shard->nchanges];
+	if (snprintf(c->path, sizeof(c->path), "%s/%s", watch->target, name) >= (int) sizeof(c->path)) {
+		request_rebuild(shard, watch->root);
+		return;
+	}
+	shard->nchanges++;
+	c->root = watch->root;
+	c->entry = NULL;
+	c->level = watch->level + 1;
+	c->old_path = old_path ? strdup(old_path) : NULL;
+}
+
+/*
+ * Handles @ev for the rule entry @watch. Must be called inside an RCU read
+ * section; the watch is only valid there. @old_entry is set for renames,
+ * whose tree maintenance is already done.
+ */
+static void
+handle_entry(struct listener_shard *shard, watch_t *watch, const struct event_record *ev, const char *old_entry)
+{
+	struct thread_info *info;
+	struct stat status;
+	char stat_target[PATH_MAX], offending_name[PATH_MAX];
+	const char *stat_path = NULL;
+	int ret;
+
+	/* scaffold directories only tell when the matches of a glob rule may have changed */
+	if (watch->scaffold) {
+		if (ev->mask & (IN_ISDIR|IN_DELETE_SELF|IN_MOVE_SELF))
+			request_expansion(shard, watch->rule);
+		return;
+	}
+
+	/* excluded entries are dropped before any other work */
+	if (watch->exclude && ev->len && exclude_match(watch, watch->target, ev->name)) {
+		watch->exclude->excluded_events++;
+		return;
+	}
+
+	/* busy directories are watched first, see balance_watches() */
+	watch->active_ms = monotonic_ms();
+	if (watch->wd < 0 && watch->backend != BACKEND_POLL)
+		shard->balance = 1;
+
+	/* the tree is rebuilt once the whole batch is handled, see rebuild_pending_trees() */
+	if (! old_entry && tree_changed(watch, ev)) {
+		if (shard->settling && (ev->mask & IN_ISDIR))
+			note_tree_change(shard, watch, ev->name, NULL);
+		else
+			request_rebuild(shard, watch->root);
+	}
+
+	/* the tree is kept up to date, but the rule doesn't act on its own changes */
+	if (watch->rule->ignore_own) {
+		char own_path[PATH_MAX];
+		int len;
+		if (ev->len && ! (ev->mask & (IN_DELETE_SELF|IN_MOVE_SELF)))
+			len = snprintf(own_path, sizeof(own_path), "%s/%s", watch->target, ev->name);
+		else
+			len = snprintf(own_path, sizeof(own_path), "%s", watch->target);
+		if (len < (int) sizeof(own_path) && feedback_own_event(watch->rule_id, own_path)) {
+			debug_printf("dropped own event on %s\n", own_path);
+			return;
+		}
+	}
+
+	/*
+	 * first, check against the watch mask, since a given entry can be
+	 * watched twice or even more times
+	 */
+	if (! (watch->mask & ev->mask)) {
+		if (log_level >= LOG_LEVEL_DEBUG) {
+			char wa_mask[128], ev_mask[128];
+			debug_printf("watch mask mismatch on %d: watch=%s, event=%s\n", watch->wd,
+				mask_name(watch->mask, wa_mask, sizeof(wa_mask)),
+				mask_name(ev->mask, ev_mask, sizeof(ev_mask)));
+		}
+		return;
+	}
+
+	if (! (ev->mask & (IN_DELETE_SELF|IN_MOVE_SELF))) {
+		snprintf(offending_name, sizeof(offending_name), "%s", ev->len ? ev->name : "");
+		if (watch->regex_rule[0]) {
+			/* verify against regex if we want to handle this event or not */
+			ret = regexec(&watch->regex, offending_name, 0, NULL, 0);
+			if (ret != 0) {
+				//debug_printf("event from watch %d, but path '%s' doesn't match regex\n", watch->wd, offending_name);
+				return;
+			}
+		}
+
+		/* no such entry can be looked at or acted upon */
+		if (snprintf(stat_target, sizeof(stat_target), "%s/%s", watch->target, offending_name) >= (int) sizeof(stat_target)) {
+			debug_printf("%s/%s: path too long, event dropped\n", watch->target, offending_name);
+			return;
+		}
+		stat_path = stat_target;
+	} else {
+		snprintf(offending_name, sizeof(offending_name), "%s", watch->target);
+	}
+
+	/* the daemon is about to exit, see drain_pending() */
+	if (__atomic_load_n(&ctx.draining, __ATOMIC_RELAXED))
+		return;
+
+	/* the entries aren't even stat'ed, see check_overload() */
+	if (shard->overload.active && watch->rule->summarize &&
+		overload_add(&shard->overload, watch->rule, watch->target, ev->mask) == 0)
+		return;
+
+	/* queue the event on the executor */
+	info = (struct thread_info *) pool_get(&ctx.event_pool);
+	if (! info)
+		return;
+	info->rule = watch->rule;
+	info->mask = ev->mask;
+	info->wd = watch->wd;
+	info->status = -1;
+	info->cookie = ev->cookie;
+	info->time = realtime_ns();
+	info->journal.seg = NULL;
+	snprintf(info->dir, sizeof(info->dir), "%s", watch->target);
+	snprintf(info->offending_name, sizeof(info->offending_name), "%s", offending_name);
+	snprintf(info->old_entry, sizeof(info->old_entry), "%s", old_entry ? old_entry : "");
+	info->summary[0] = '\0';
+	info->host[0] = '\0';
+
+	/* the entries of the whole batch are stat'ed at once, see classify_pending() */
+	if (shard->uring) {
+		defer_event(shard, watch, info, stat_path);
+		return;
+	}
+	if (stat_path) {
+		shard->stat_calls++;
+		ret = stat(stat_path, &status);
+		if (! wanted_entry(watch, stat_path, ret < 0 ? errno : 0, status.st_mode)) {
+			pool_put(&ctx.event_pool, info);
+			return;
+		}
+	}
+	queue_event(watch, info);
+
+	/* event handled, that's all! */
+}
+
+/*
+ * Holds an event whose watch was added by the initial crawl but isn't
+ * published yet, until retry_parked() finds it in a newer table.
+ */
+static void
+park_event(struct listener_shard *shard, const struct event_record *ev)
+{
+	if (! shard->parked)
+		shard->parked = (struct event_record *) malloc(MAX_PARKED_EVENTS * sizeof(struct event_record));
+	if (! shard->parked || shard->nparked == MAX_PARKED_EVENTS) {
+		shard->parked_dropped++;
+		return;
+	}
+	shard->parked[shard->nparked++] = *ev;
+}
+
+/* tells if a newer table may hold the parked events, or if the initial crawl is over */
+static inline int
+crawl_due(struct listener_shard *shard)
+{
+	if (! shard->settling)
+		return 0;
+	return ! __atomic_load_n(&shard->crawling, __ATOMIC_ACQUIRE) ||
+		(shard->nparked && rcu_dereference(shard->table)->version != shard->parked_version);
+}
+
+static void handle_rename(struct listener_shard *shard, const struct event_record *from, const struct event_record *to);
+
+/*
+ * Looks the parked events up again. Those still unknown once the initial
+ * crawl is over belong to directories that went away meanwhile, and are
+ * dropped. Must be called inside an RCU read section.
+ */
+static void
+retry_parked(struct listener_shard *shard)
+{
+	int done = ! __atomic_load_n(&shard->crawling, __ATOMIC_ACQUIRE);
+	struct watch_table *table = rcu_dereference(shard->table);
+	size_t kept = 0;
+
+	shard->parked_version = table->version;
+	for (size_t i=0; i<shard->nparked; ++i) {
+		const struct event_record *ev = &shard->parked[i];
+		size_t count;
+		watch_t **watches = hashtable_get(table->hash, ev->wd, &count);
+
+		/* both halves of a rename are parked together, and paired again */
+		if ((ev->mask & IN_MOVED_FROM) && ev->cookie && i+1 < shard->nparked &&
+			(ev[1].mask & IN_MOVED_TO) && ev[1].cookie == ev->cookie) {
+			size_t ndst;
+
+			hashtable_get(table->hash, ev[1].wd, &ndst);
+			if (count || ndst) {
+				handle_rename(shard, &ev[0], &ev[1]);
+				shard->parked_handled += 2;
+			} else if (done) {
+				shard->parked_dropped += 2;
+			} else {
+				shard->parked[kept++] = ev[0];
+				shard->parked[kept++] = ev[1];
+			}
+			i++;
+			continue;
+		}
+		for (size_t n=0; n<count; ++n)
+			handle_entry(shard, watches[n], ev, NULL);
+		if (count)
+			shard->parked_handled++;
+		else if (done)
+			shard->parked_dropped++;
+		else
+			shard->parked[kept++] = *ev;
+	}
+	shard->nparked = kept;
+	if (done) {
+		free(shard->parked);
+		shard->parked = NULL;
+	}
+}
+
+/*
+ * Parked events found in a newer table are older than the events read since,
+ * so they are handled first to keep the order of the events of each entry.
+ */
+static inline void
+flush_parked(struct listener_shard *shard)
+{
+	if (shard->nparked && rcu_dereference(shard->table)->version != shard->parked_version)
+		retry_parked(shard);
+}
+
+/* a directory watched by several rules has an entry per rule, each one sees the event */
+void
+handle_events(struct listener_shard *shard, const struct event_record *ev, const char *old_entry)
+{
+	int crawling = __atomic_load_n(&shard->crawling, __ATOMIC_ACQUIRE);
+	size_t count;
+	watch_t **watches;
+
+	flush_parked(shard);
+	watches = hashtable_get(rcu_dereference(shard->table)->hash, ev->wd, &count);
+
+	if (! count && crawling)
+		park_event(shard, ev);
+	for (size_t i=0; i<count; ++i)
+		handle_entry(shard, watches[i], ev, old_entry);
+}
+
+/*
+ * A directory renamed inside its tree keeps its inotify watches, which follow
+ * the inode. The next table version only gets copies of the moved entries
+ * with their paths re-keyed from @old_path to @new_path.
+ */
+static void
+rekey_tree(struct listener_shard *shard, watch_t *root, const char *old_path, const char *new_path)
+{
+	struct watch_table *table;
+	struct watch_vec next = { 0 }, *retired;
+	size_t len = strlen(old_path);
+
+	retired = (struct watch_vec *) calloc(1, sizeof(struct watch_vec));
+	if (! retired) {
+		perror("calloc");
+		return;
+	}
+
+	pthread_mutex_lock(&shard->write_lock);
+	table = shard->table;
+	for (size_t i=0; i<table->count; ++i) {
+		watch_t *ptr = table->entries[i], *w;
+
+		if (ptr->root != root || ptr == root || strncmp(ptr->target, old_path, len) ||
+			(ptr->target[len] != '/' && ptr->target[len] != '\0') ||
+			! (w = (watch_t *) malloc(sizeof(watch_t)))) {
+			watch_vec_push(&next, ptr);
+			continue;
+		}
+		memcpy(w, ptr, sizeof(*w));
+		snprintf(w->target, sizeof(w->target), "%s%s", new_path, &ptr->target[len]);
+		if (w->regex_rule[0])
+			regcomp(&w->regex, w->regex_rule, REG_EXTENDED);
+		if (w->wd < 0)
+			poller_move(w->wd, w->target);
+		else
+			dirgraph_replace(shard->graph, w->dev, w->ino, ptr, w);
+		watch_vec_push(&next, w);
+		watch_vec_push(retired, ptr);
+	}
+	publish_table(shard, &next);
+	pthread_mutex_unlock(&shard->write_lock);
+
+	rcu_defer(free_watch_vec, retired);
+	shard->trees_rekeyed++;
+}
+
+static int
+compare_changes(const void *aa, const void *bb)
+{
+	return strcmp(((const struct tree_change *) aa)->path, ((const struct tree_change *) bb)->path);
+}
+
+static int
+compare_change_path(const void *key, const void *bb)
+{
+	return strcmp((const char *) key, ((const struct tree_change *) bb)->path);
+}
+
+static struct tree_change *
+find_change(struct tree_change *changes, size_t n, watch_t *root, const char *path)
+{
+	struct tree_change *c = (struct tree_change *) bsearch(path, changes, n, sizeof(struct tree_change), compare_change_path);
+
+	for (; c && c > changes && ! strcmp(c[-1].path, path); --c)
+		;
+	for (; c && c < changes + n && ! strcmp(c->path, path); ++c) {
+		if (c->root == root)
+			return c;
+	}
+	return NULL;
+}
+
+/*
+ * Checks the subdirectories that changed during the initial crawl against
+ * the table. A change the crawl saw is consistent with it; a directory renamed
+ * after it was listed has its tree re-keyed; any other change it missed
+ * leaves the tree out of date, and only then is the tree rebuilt. Must be
+ * called inside an RCU read section.
+ */
+static void
+reconcile_trees(struct listener_shard *shard)
+{
+	struct watch_table *table = rcu_dereference(shard->table);
+	struct tree_change *changes = shard->changes;
+	size_t n = shard->nchanges;
+
+	qsort(changes, n, sizeof(struct tree_change), compare_changes);
+	for (size_t i=0; i<table->count && n; ++i) {
+		watch_t *ptr = table->entries[i];
+		struct tree_change *c;
+
+		if (ptr == ptr->root || ptr->scaffold)
+			continue;
+		if ((c = find_change(changes, n, ptr->root, ptr->target)))
+			c->entry = ptr;
+	}
+	for (size_t i=0; i<n; ++i) {
+		struct tree_change *c = &changes[i], *from;
+		struct stat st;
+
+		if (! c->old_path || c->entry || ! (from = find_change(changes, n, c->root, c->old_path)) ||
+			! from->entry || stat(c->path, &st) < 0 ||
+			from->entry->dev != st.st_dev || from->entry->ino != st.st_ino)
+			continue;
+		rekey_tree(shard, c->root, c->old_path, c->path);
+		c->entry = from->entry;
+		from->entry = NULL;
+	}
+	for (size_t i=0; i<n; ++i) {
+		struct tree_change *c = &changes[i];
+		struct stat st;
+		int wanted = stat(c->path, &st) == 0 && S_ISDIR(st.st_mode) && c->level <= c->root->depth &&
+			! (c->root->exclude && exclude_match(c->root, c->path, NULL));
+
+		if (wanted ? ! c->entry || c->entry->dev != st.st_dev || c->entry->ino != st.st_ino : c->entry != NULL)
+			request_rebuild(shard, c->root);
+		free(c->old_path);
+	}
+	free(changes);
+	shard->changes = NULL;
+	shard->nchanges = 0;
+}
+
+/*
+ * Handles the parked events found in a newer table and, once the initial
+ * crawl is over, reconciles the trees that changed meanwhile. Must be called
+ * inside an RCU read section.
+ */
+static void
+settle_crawl(struct listener_shard *shard)
+{
+	int done = ! __atomic_load_n(&shard->crawling, __ATOMIC_ACQUIRE);
+
+	if (shard->nparked)
+		retry_parked(shard);
+	if (done) {
+		reconcile_trees(shard);
+		shard->settling = 0;
+		shard->balance = 1;
+	}
+}
+
+/*
+ * Publishes a new version of the watch table of @shard in which the trees of
+ * the rules queued by handle_events() are crawled again, and the glob rules
+ * queued there are expanded again. Entries of the other rules are shared
+ * with the current version.
+ */
+void
+rebuild_pending_trees(struct listener_shard *shard)
+{
+	struct watch_table *table;
+	struct watch_vec next = { 0 }, *retired;
+	struct polled_set polled = { 0 };
+	struct expansion *xs;
+	size_t nx = shard->expand.count;
+
+	/* trees changed during the initial crawl wait for reconcile_trees() */
+	if ((! shard->rebuild.count && ! nx) || shard->settling)
+		return;
+	retired = (struct watch_vec *) calloc(1, sizeof(struct watch_vec));
+	xs = (struct expansion *) calloc(nx + 1, sizeof(struct expansion));
+	if (! retired || ! xs) {
+		perror("calloc");
+		free(retired);
+		free(xs);
+		return;
+	}
+	for (size_t k=0; k<nx; ++k)
+		expand_pattern(&xs[k], shard->expand.entries[k]);
+
+	pthread_mutex_lock(&shard->write_lock);
+	table = shard->table;
+	for (size_t i=0; i<table->count; ++i) {
+		watch_t *ptr = table->entries[i];
+		struct expansion *x = NULL;
+		int drop = ptr != ptr->root && rebuild_requested(ptr->root);
+
+		for (size_t k=0; k<nx && ptr->rule != ptr && (ptr->rule->queued & QUEUED_EXPAND); ++k)
+			x = xs[k].rule == ptr->rule ? &xs[k] : x;
+		if (x && ptr->scaffold) {
+			int index = find_path(&x->scaffold, ptr->target);
+			if (index < 0)
+				drop = 1;
+			else
+				x->watched[index] = 1;
+		} else if (x) {
+			/* entries of an instance go away with its target */
+			int index = find_path(&x->matches, ptr->root->target);
+			if (index < 0) {
+				drop = 1;
+				if (ptr == ptr->root)
+					forget_rebuild(shard, ptr);
+			} else if (ptr == ptr->root) {
+				x->matched[index] = 1;
+			}
+		}
+
+		if (drop) {
+			if (ptr->wd >= 0 || keep_polled(&polled, ptr) < 0)
+				unwatch_directory(ptr);
+			watch_vec_push(retired, ptr);
+		} else {
+			watch_vec_push(&next, ptr);
+		}
+	}
+	qsort(polled.dirs, polled.count, sizeof(struct polled_dir), compare_polled);
+	for (size_t i=0; i<shard->rebuild.count; ++i)
+		shard->rebuild.entries[i]->queued &= ~QUEUED_REBUILD;
+	crawl_roots(shard->rebuild.entries, shard->rebuild.count, &next, &polled, 0);
+	for (size_t k=0; k<nx; ++k) {
+		xs[k].rule->queued &= ~QUEUED_EXPAND;
+		add_expansion(&xs[k], &next, &polled, 0);
+		free_expansion(&xs[k]);
+	}
+	free(xs);
+	for (size_t i=0; i<polled.count; ++i) {
+		if (! polled.dirs[i].taken)
+			poller_remove(polled.dirs[i].wd);
+	}
+	free(polled.dirs);
+	balance_watches(shard, &next, retired);
+	publish_table(shard, &next);
+	pthread_mutex_unlock(&shard->write_lock);
+
+	rcu_defer(free_watch_vec, retired);
+	shard->rebuild.count = 0;
+	shard->expand.count = 0;
+}
+
+/*
+ * Handles both halves of a rename as a single event reported on the
+ * destination, with both IN_MOVED_FROM and IN_MOVED_TO set, for each tree
+ * that holds both directories. Must be called inside an RCU read section.
+ */
+static void
+handle_rename(struct listener_shard *shard, const struct event_record *from, const struct event_record *to)
+{
+	int crawling = __atomic_load_n(&shard->crawling, __ATOMIC_ACQUIRE);
+	struct watch_table *table = rcu_dereference(shard->table);
+	size_t nsrc, ndst;
+	watch_t **src = hashtable_get(table->hash, from->wd, &nsrc);
+	watch_t **dst = hashtable_get(table->hash, to->wd, &ndst);
+	char paired[nsrc + 1];
+	int npaired = 0;
+
+	if (! nsrc && ! ndst && crawling) {
+		park_event(shard, from);
+		park_event(shard, to);
+		return;
+	}
+	memset(paired, 0, sizeof(paired));
+	for (size_t d=0; d<ndst; ++d) {
+		char old_entry[PATH_MAX], new_entry[PATH_MAX];
+		struct event_record rename;
+		size_t s;
+
+		for (s=0; s<nsrc && src[s]->root != dst[d]->root; ++s)
+			;
+		if (s == nsrc) {
+			/* moved in from another tree, it only sees this half */
+			handle_entry(shard, dst[d], to, NULL);
+			continue;
+		}
+		/* paths too long to be renamed as one are handled as two halves */
+		if (snprintf(old_entry, sizeof(old_entry), "%s/%s", src[s]->target, from->name) >= (int) sizeof(old_entry) ||
+			snprintf(new_entry, sizeof(new_entry), "%s/%s", dst[d]->target, to->name) >= (int) sizeof(new_entry)) {
+			handle_entry(shard, dst[d], to, NULL);
+			continue;
+		}
+		paired[s] = 1;
+		npaired++;
+
+		/* a move to another level changes which subdirectories are within depth */
+		if (tree_changed(dst[d], to) && shard->settling) {
+			note_tree_change(shard, src[s], from->name, NULL);
+			if (src[s]->level == dst[d]->level && ! dst[d]->exclude)
+				note_tree_change(shard, dst[d], to->name, old_entry);
+			else
+				note_tree_change(shard, dst[d], to->name, NULL);
+		} else if (tree_changed(dst[d], to) && ! rebuild_requested(dst[d]->root)) {
+			if (src[s]->level == dst[d]->level && ! dst[d]->exclude)
+				rekey_tree(shard, dst[d]->root, old_entry, new_entry);
+			else
+				request_rebuild(shard, dst[d]->root);
+		}
+
+		rename = *to;
+		rename.mask |= IN_MOVED_FROM;
+		handle_entry(shard, dst[d], &rename, old_entry);
+	}
+	for (size_t s=0; s<nsrc; ++s) {
+		if (! paired[s])
+			handle_entry(shard, src[s], from, NULL);
+	}
+	if (npaired)
+		shard->moves_paired++;
+	else
+		shard->moves_unpaired++;
+}
+
+/* MOVED_FROM halves whose MOVED_TO didn't show up in time are handled on their own */
+static void
+expire_moves(struct listener_shard *shard, uint64_t now)
+{
+	int expired = 0;
+
+	while (expired < shard->nmoves && shard->moves[expired].deadline <= now) {
+		handle_events(shard, &shard->moves[expired].ev, NULL);
+		shard->moves_unpaired++;
+		expired++;
+	}
+	if (expired) {
+		shard->nmoves -= expired;
+		memmove(&shard->moves[0], &shard->moves[expired], shard->nmoves * sizeof(struct pending_move));
+	}
+}
+
+/*
+ * The inotify queue of @shard overflowed and its events since are lost: the
+ * shard summarizes what follows, which is likely a flood, and its trees are
+ * crawled again as linkindex_handle_event() does for its own queue.
+ */
+static void
+handle_overflow(struct listener_shard *shard)
+{
+	struct watch_table *table;
+	struct rule_set *set;
+
+	/* those that follow during the same overload are only counted */
+	if (overload_force(&shard->overload, monotonic_ms()) == OVERLOAD_ENTERED)
+		log_printf(LOG_LEVEL_WARNING, "shard %d: inotify queue overflowed, events were lost: "
+			"summarizing events per directory and rescanning its trees", shard->id);
+	shard->overflows++;
+
+	set = rcu_dereference(ctx.rules);
+	for (size_t i=0; i<set->count; ++i) {
+		watch_t *rule = set->rules[i];
+		if (rule->shard == shard && rule->glob && rule->backend != BACKEND_REMOTE)
+			request_expansion(shard, rule);
+	}
+	/* roots without depth have no tree to crawl */
+	table = rcu_dereference(shard->table);
+	for (size_t i=0; i<table->count; ++i) {
+		watch_t *ptr = table->entries[i];
+		if (ptr == ptr->root && ptr->depth)
+			request_rebuild(shard, ptr);
+	}
+}
+
+/* pairs the halves of renames by cookie before they reach handle_events() */
+static void
+route_event(struct listener_shard *shard, const struct event_record *ev)
+{
+	flush_parked(shard);
+	if (ev->mask & IN_Q_OVERFLOW) {
+		handle_overflow(shard);
+		return;
+	}
+	if ((ev->mask & IN_MOVED_FROM) && ev->cookie) {
+		if (shard->nmoves == MAX_PENDING_MOVES)
+			expire_moves(shard, shard->moves[0].deadline);
+		shard->moves[shard->nmoves].ev = *ev;
+		shard->moves[shard->nmoves].deadline = monotonic_ms() + MOVE_PAIR_TIMEOUT;
+		shard->nmoves++;
+		return;
+	}
+	if ((ev->mask & IN_MOVED_TO) && ev->cookie) {
+		for (int i=0; i<shard->nmoves; ++i) {
+			if (shard->moves[i].ev.cookie == ev->cookie) {
+				struct event_record from = shard->moves[i].ev;
+				shard->nmoves--;
+				memmove(&shard->moves[i], &shard->moves[i+1], (shard->nmoves - i) * sizeof(struct pending_move));
+				handle_rename(shard, &from, ev);
+				return;
+			}
+		}
+		shard->moves_unpaired++;
+	}
+	handle_events(shard, ev, NULL);
+}
+
+/*
+ * Rebuilds the trees with polled directories, which get inotify watches where
+ * the budget allows. Rules without depth keep polling their only directory.
+ */
+static void
+promote_polled_trees(struct listener_shard *shard)
+{
+	struct watch_table *table;
+
+	ctx.watch_limit = read_watch_limit();
+	__atomic_store_n(&ctx.watch_budget, ctx.watch_limit, __ATOMIC_RELAXED);
+	/* the kernel has room, but --max-watches doesn't */
+	if (__atomic_load_n(&ctx.watches, __ATOMIC_RELAXED) >= ctx.watch_limit)
+		return;
+
+	rcu_read_lock();
+	table = rcu_dereference(shard->table);
+	for (size_t i=0; i<table->count; ++i) {
+		watch_t *ptr = table->entries[i];
+		if (ptr->wd < 0 && ptr->depth && ptr->backend != BACKEND_POLL)
+			request_rebuild(shard, ptr->root);
+	}
+	rcu_read_unlock();
+}
+
+/* queues the trees of the rules of @shard flagged by the resync command */
+static void
+resync_rules(struct listener_shard *shard)
+{
+	struct watch_table *table;
+	struct rule_set *set;
+	char *wanted;
+	size_t count = 0;
+
+	rcu_read_lock();
+	set = rcu_dereference(ctx.rules);
+	if (! (wanted = (char *) calloc(set->count, 1))) {
+		rcu_read_unlock();
+		return;
+	}
+	for (size_t i=0; i<set->count; ++i) {
+		watch_t *rule = set->rules[i];
+		if (rule->shard != shard || ! __atomic_exchange_n(&rule->resync, 0, __ATOMIC_ACQ_REL) ||
+			rule->backend == BACKEND_REMOTE)
+			continue;
+		wanted[i] = 1;
+		count++;
+		if (rule->glob)
+			request_expansion(shard, rule);
+	}
+
+	/* roots without depth have no tree to crawl */
+	table = rcu_dereference(shard->table);
+	for (size_t i=0; i<table->count && count; ++i) {
+		watch_t *ptr = table->entries[i];
+		if (ptr == ptr->root && ptr->depth && wanted[ptr->rule_id - 1])
+			request_rebuild(shard, ptr);
+	}
+	rcu_read_unlock();
+	free(wanted);
+}
+
+/* slot of the entry @name of @wd in the table of read_events() */
+static inline unsigned int
+entry_slot(int wd, const char *name)
+{
+	uint32_t h = 2166136261u ^ (uint32_t) wd;
+
+	for (; name && *name; ++name)
+		h = (h ^ (unsigned char) *name) * 16777619u;
+	return h & (ORDER_SLOTS - 1);
+}
+
+/*
+ * The reader does nothing but drain the inotify queue into the rings of its
+ * shard, so that the kernel queue doesn't fill up while userspace is busy.
+ * Each event is tagged with the last one of its entry sent to the other
+ * lane, see dispatch_head(). Entries are told apart by a hash of their name
+ * and watch, and a collision only costs an event being handled earlier.
+ */
+void *
+read_events(void *data)
+{
+	struct listener_shard *shard = (struct listener_shard *) data;
+	struct timespec backoff = { 0, 100000 };
+	ssize_t n;
+	char *ptr;
+	char buf[65536] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *event = NULL;
+	uint64_t last[NUM_RINGS][ORDER_SLOTS], seq = 0;
+
+	memset(last, 0, sizeof(last));
+
+	while (2) {
+		select_on_inotify(shard);
+		n = read(shard->inotify_fd, buf, sizeof(buf));
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+
+		for (ptr=buf; ptr<buf+n; ptr+=sizeof(struct inotify_event)+event->len) {
+			int lane, other;
+			unsigned int slot;
+
+			event = (const struct inotify_event *) ptr;
+			lane = STRUCTURAL_EVENT(event) ? RING_STRUCTURAL : RING_CONTENT;
+			other = lane == RING_STRUCTURAL ? RING_CONTENT : RING_STRUCTURAL;
+			slot = entry_slot(event->wd, event->len ? event->name : NULL);
+			last[lane][slot] = ++seq;
+			while (ring_push(&shard->rings[lane], seq, last[other][slot], event->wd, event->mask, event->cookie,
+				event->len ? event->name : NULL) < 0) {
+				wake_dispatcher(shard);
+				nanosleep(&backoff, NULL);
+			}
+		}
+		wake_dispatcher(shard);
+	}
+	return NULL;
+}
+
+/* poller hook, called from the poller thread: the only producer of the polled ring */
+static void
+emit_polled_event(void *owner, int wd, uint32_t mask, uint32_t cookie, const char *name)
+{
+	struct listener_shard *shard = (struct listener_shard *) owner;
+	struct timespec backoff = { 0, 100000 };
+
+	while (ring_push(&shard->rings[RING_POLLED], 0, 0, wd, mask, cookie, name) < 0) {
+		wake_dispatcher(shard);
+		nanosleep(&backoff, NULL);
+	}
+	wake_dispatcher(shard);
+}
+
+/* poller hook, called from the poller thread */
+static void
+promote_polled(void *owner)
+{
+	struct listener_shard *shard = (struct listener_shard *) owner;
+
+	/* nothing to gain while the configured limit is what keeps them polled */
+	if (__atomic_load_n(&ctx.watches, __ATOMIC_RELAXED) >= ctx.watch_limit)
+		return;
+	__atomic_store_n(&shard->promote, 1, __ATOMIC_RELEASE);
+	wake_dispatcher(shard);
+}
+
+static const struct poller_ops poller_ops = {
+	.emit = emit_polled_event,
+	.promote = promote_polled,
+};
+
+/* overload_flush() hook: queues the summary of a directory as a single event */
+static void
+emit_summary(watch_t *rule, const char *dir, uint32_t mask, const char *counts, unsigned long events, void *data)
+{
+	struct thread_info *info;
+
+	log_printf(LOG_LEVEL_INFO, "rule %d: %lu events summarized on %s: %s", rule->rule_id, events, dir, counts);
+	if (__atomic_load_n(&ctx.draining, __ATOMIC_RELAXED))
+		return;
+	info = (struct thread_info *) pool_get(&ctx.event_pool);
+	if (! info)
+		return;
+	info->rule = rule;
+	info->mask = mask;
+	info->wd = 0;
+	info->status = -1;
+	info->cookie = 0;
+	info->time = realtime_ns();
+	info->journal.seg = NULL;
+	info->old_entry[0] = '\0';
+	info->host[0] = '\0';
+	snprintf(info->dir, sizeof(info->dir), "%s", dir);
+	snprintf(info->offending_name, sizeof(info->offending_name), ".");
+	snprintf(info->summary, sizeof(info->summary), "%s", counts);
+	queue_event(rule, info);
+}
+
+/*
+ * The load of a shard is what its dispatcher has yet to handle: the events in
+ * its rings and the unread inotify queue. Actions waiting for a worker count
+ * too, since the executor is shared by all the shards.
+ */
+static void
+check_overload(struct listener_shard *shard)
+{
+	struct overload *o = &shard->overload;
+	uint64_t now = monotonic_ms(), since = o->since;
+	size_t queued = 0, pending;
+	int unread = 0;
+
+	if (now < o->next_check)
+		return;
+	for (int r=0; r<NUM_RINGS; ++r)
+		queued += ring_occupancy(&shard->rings[r]);
+	if (ioctl(shard->inotify_fd, FIONREAD, &unread) < 0)
+		unread = 0;
+	pending = executor_pending();
+
+	/* an event takes at least a header and a padded name */
+	queued += unread / (sizeof(struct inotify_event) + 16);
+	switch (overload_update(o, queued > pending ? queued : pending, now)) {
+		case OVERLOAD_ENTERED:
+			log_printf(LOG_LEVEL_WARNING, "shard %d: overloaded with %zu events queued, %zu actions pending: "
+				"summarizing events per directory", shard->id, queued, pending);
+			break;
+		case OVERLOAD_LEFT:
+			overload_flush(o, emit_summary, NULL);
+			log_printf(LOG_LEVEL_WARNING, "shard %d: back to per-event dispatch after %llu ms, peak load %zu",
+				shard->id, (unsigned long long) (now - since), o->peak);
+			break;
+	}
+	if (o->active && now >= o->next_flush) {
+		overload_flush(o, emit_summary, NULL);
+		o->next_flush = now + OVERLOAD_INTERVAL;
+	}
+}
+
+/* blocks until a producer pushes new events to the rings of @shard */
+static void
+wait_for_events(struct listener_shard *shard)
+{
+	struct pollfd pfd = { .fd = shard->wake_fd, .events = POLLIN };
+	uint64_t count, now;
+	int timeout = -1, due;
+
+	/* pending renames are given up on after MOVE_PAIR_TIMEOUT */
+	if (shard->nmoves) {
+		now = monotonic_ms();
+		timeout = shard->moves[0].deadline > now ? shard->moves[0].deadline - now : 0;
+	}
+	/* summaries are due, and the load must be seen falling */
+	if (shard->overload.active) {
+		now = monotonic_ms();
+		if (timeout < 0 || timeout > OVERLOAD_CHECK)
+			timeout = OVERLOAD_CHECK;
+	}
+	/* busy polled directories wait for the next balance_watches() */
+	if (shard->balance) {
+		uint64_t next = shard->balance_ms + BALANCE_INTERVAL_MS;
+		now = monotonic_ms();
+		if (timeout < 0 || (uint64_t) timeout > (next > now ? next - now : 0))
+			timeout = next > now ? next - now : 0;
+	}
+
+	__atomic_store_n(&shard->sleeping, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	rcu_read_lock();
+	due = crawl_due(shard);
+	rcu_read_unlock();
+	if (! ring_peek(&shard->rings[RING_STRUCTURAL]) && ! ring_peek(&shard->rings[RING_CONTENT]) &&
+		! ring_peek(&shard->rings[RING_POLLED]) && ! __atomic_load_n(&shard->promote, __ATOMIC_ACQUIRE) &&
+		! __atomic_load_n(&shard->resync, __ATOMIC_ACQUIRE) && ! due &&
+		! __atomic_load_n(&ctx.stopping, __ATOMIC_ACQUIRE)) {
+		if (poll(&pfd, 1, timeout) > 0 && read(shard->wake_fd, &count, sizeof(count)) < 0 && errno != EINTR)
+			perror("read");
+	}
+	__atomic_store_n(&shard->sleeping, 0, __ATOMIC_RELAXED);
+}
+
+/*
+ * Handles the first event of @lane, after the events of the same entry the
+ * reader sent earlier to the other lane: lanes only reorder the events of
+ * different entries. Returns the number of events handled.
+ */
+static unsigned int
+dispatch_head(struct listener_shard *shard, int lane)
+{
+	int other = lane == RING_CONTENT ? RING_STRUCTURAL : RING_CONTENT;
+	struct event_record *rec = ring_peek(&shard->rings[lane]), *first;
+	unsigned int handled = 1;
+
+	/* those of the other lane up to @rec->after went in before @rec */
+	while (rec->after > shard->lane_seq[other] && (first = ring_peek(&shard->rings[other])) &&
+		first->seq <= rec->after) {
+		route_event(shard, first);
+		shard->lane_seq[other] = first->seq;
+		ring_release(&shard->rings[other]);
+		handled++;
+	}
+	route_event(shard, rec);
+	shard->lane_seq[lane] = rec->seq;
+	ring_release(&shard->rings[lane]);
+	return handled;
+}
+
+/*
+ * Structural events are handled first so that tree maintenance isn't
+ * delayed by bulk traffic, unless an earlier event of the same entry waits
+ * in the content lane. Trees are rebuilt once the rings are drained, or
+ * after DISPATCH_REBUILD_EVENTS events under sustained load.
+ */
+void *
+dispatch_events(void *data)
+{
+	struct listener_shard *shard = (struct listener_shard *) data;
+	unsigned int handled = 0;
+
+	while (! __atomic_load_n(&ctx.stopping, __ATOMIC_ACQUIRE)) {
+		int idle = 1;
 
-#define debug_printf(fmt, args...)	if(ctx.debug_mode) printf(fmt, ##args)
+		rcu_read_lock();
+		while (ring_peek(&shard->rings[RING_STRUCTURAL])) {
+			handled += dispatch_head(shard, RING_STRUCTURAL);
+			idle = 0;
+		}
+		for (int i=0; i<DISPATCH_BATCH && ring_peek(&shard->rings[RING_CONTENT]); ++i) {
+			handled += dispatch_head(shard, RING_CONTENT);
+			idle = 0;
+		}
+		for (int i=0; i<DISPATCH_BATCH && ring_peek(&shard->rings[RING_POLLED]); ++i) {
+			handled += dispatch_head(shard, RING_POLLED);
+			idle = 0;
+		}
+		if (shard->nmoves)
+			expire_moves(shard, monotonic_ms());
+		if (shard->npending)
+			classify_pending(shard);
+		if (crawl_due(shard))
+			settle_crawl(shard);
+		rcu_read_unlock();
+		check_overload(shard);
 
-void
-suicide(int signum)
-{
-	/* Hashtable must be destroyed first */
-	hashtable_destroy(ctx.watch_hash);
+		if (__atomic_exchange_n(&shard->promote, 0, __ATOMIC_ACQ_REL))
+			promote_polled_trees(shard);
+		if (__atomic_exchange_n(&shard->resync, 0, __ATOMIC_ACQ_REL))
+			resync_rules(shard);
+		if (shard->balance && ! shard->settling && monotonic_ms() - shard->balance_ms >= BALANCE_INTERVAL_MS) {
+			shard->balance = 0;
+			pthread_mutex_lock(&shard->write_lock);
+			balance_table(shard);
+			pthread_mutex_unlock(&shard->write_lock);
+			shard->balance_ms = monotonic_ms();
+		}
 
-	for (watch_t *ptr=ctx.watch_list; ptr != NULL; ptr=ptr->next) {
-		if (ptr->regex_rule[0])
-			regfree(&ptr->regex);
+		if (idle || handled >= DISPATCH_REBUILD_EVENTS) {
+			rebuild_pending_trees(shard);
+			handled = 0;
+		}
+		if (idle) {
+			rcu_reclaim();
+			wait_for_events(shard);
+		}
 	}
-	free(ctx.watch_list);
+	return NULL;
+}
 
-	close(ctx.inotify_fd);
-	exit(EXIT_SUCCESS);
+/* the part of the target of @rule before any wildcard, resolved if it exists */
+static void
+rule_prefix(watch_t *rule, char *buf, size_t size)
+{
+	char resolved[PATH_MAX], *slash;
+	size_t len = rule->glob ? strcspn(rule->target, "*?[") : strlen(rule->target);
+
+	snprintf(buf, size, "%.*s", (int) len, rule->target);
+	if (rule->glob && (slash = strrchr(buf, '/')))
+		*(slash == buf ? slash + 1 : slash) = '\0';
+	if (realpath(buf, resolved))
+		snprintf(buf, size, "%s", resolved);
 }
 
-void *
-perform_action(void *thread_info)
+/* tells if one of @a and @b is a directory holding the other */
+static int
+nested_paths(const char *a, const char *b)
 {
-	pid_t pid;
-	char target[PATH_MAX];
-	struct thread_info *info = (struct thread_info *) thread_info;
-	watch_t *watch = info->watch;
+	size_t la = strlen(a), lb = strlen(b), len = la < lb ? la : lb;
 
-	snprintf(target, sizeof(target), "%s/%s", watch->target, info->offending_name);
+	if (strncmp(a, b, len))
+		return 0;
+	return la == lb || (la < lb ? (b[la] == '/' || a[la-1] == '/') : (a[lb] == '/' || b[lb-1] == '/'));
+}
 
-	pid = fork();
-	if (pid == 0) {
-		char **exec_array, *cmd = watch->spawn;
-		char spawn[LINE_MAX] = { 0 };
-		int len = strlen(cmd);
-		int skipped = 0;
-
-		while (2) {
-			int skip_bytes = 0;
-			char *token = get_token(cmd, &skip_bytes, watch->target, info);
-			if (! token)
-				break;
+/* shard of the first rule whose tree may overlap the tree of @rule, NULL if none */
+static struct listener_shard *
+overlapping_shard(watch_t *rule)
+{
+	char mine[PATH_MAX], theirs[PATH_MAX];
 
-			cmd += skip_bytes;
-			skipped += skip_bytes;
+	rule_prefix(rule, mine, sizeof(mine));
+	for (size_t i=0; i<ctx.rule_staging.count; ++i) {
+		watch_t *other = ctx.rule_staging.entries[i];
+		if (other->backend == BACKEND_REMOTE)
+			continue;
+		rule_prefix(other, theirs, sizeof(theirs));
+		if (nested_paths(mine, theirs))
+			return other->shard;
+	}
+	return NULL;
+}
 
-			strcat(spawn, token);
-			strcat(spawn, " ");
-			free(token);
+/* adds a rule read from the config file; tables are published by main() */
+watch_t *
+monitor_directory(int i, watch_t *watch)
+{
+	/* rules sharing directories share a shard, so that each directory is watched once */
+	if (! watch->shard && watch->backend != BACKEND_REMOTE)
+		watch->shard = overlapping_shard(watch);
+	if (! watch->shard)
+		watch->shard = &ctx.shards[(watch->rule_id - 1) % ctx.nshards];
+	watch->root = watch; //pointer to root diretory
+	watch->rule = watch;
 
-			if (skipped >= len)
-				break;
-		}
-		exec_array = (char **) malloc(4 * sizeof(char *));
-		exec_array[0] = "/bin/sh";
-		exec_array[1] = "-c";
-		exec_array[2] = strdup(spawn);
-		exec_array[3] = NULL;
-		debug_printf("%s-> spawn: /bin/sh -c '%s'\n\n", info->event_msg, spawn);
+	/* trees are crawled once all the rules are known, see watch_rules() */
+	watch_vec_push(&ctx.rule_staging, watch);
+	return watch;
+}
 
-		free(info->event_msg);
-		free(info->watch);
-		free(info);
-		execvp(exec_array[0], exec_array);
+/*
+ * Watches the targets of the rules without depth, which must exist. Trees
+ * and glob rules are left to the initial crawl of their shard, which runs
+ * while events are handled, see crawl_shard().
+ */
+static void
+watch_rules(void)
+{
+	struct watch_vec roots = { 0 };
 
-	} else if (pid > 0) {
-		waitpid(pid, NULL, WUNTRACED);
-	} else {
-		perror("fork");
+	for (int n=0; n<ctx.nshards; ++n) {
+		struct listener_shard *shard = &ctx.shards[n];
+
+		roots.count = 0;
+		for (size_t i=0; i<ctx.rule_staging.count; ++i) {
+			watch_t *rule = ctx.rule_staging.entries[i];
+			if (rule->shard != shard || rule->backend == BACKEND_REMOTE)
+				continue;
+			if (rule->glob || rule->depth)
+				shard->crawling = 1;
+			/* glob rules stay out of the table, only their instances are watched */
+			if (rule->glob)
+				continue;
+			watch_vec_push(&shard->staging, rule);
+			if (! rule->depth)
+				watch_vec_push(&roots, rule);
+		}
+		if (crawl_roots(roots.entries, roots.count, &shard->staging, NULL, CRAWL_VERBOSE))
+			exit(1);
+		shard->settling = shard->crawling;
+		ctx.crawlers += shard->crawling;
 	}
+	free(roots.entries);
+}
+
+/* rule roots are never freed, so they can be used outside the read section */
+watch_t *
+find_rule(int rule_id)
+{
+	watch_t *rule = NULL;
+	struct rule_set *set;
 
-	pthread_exit(NULL);
+	rcu_read_lock();
+	set = rcu_dereference(ctx.rules);
+	if (set && rule_id > 0 && (size_t) rule_id <= set->count)
+		rule = set->rules[rule_id-1];
+	rcu_read_unlock();
+	return rule;
 }
 
+/* queues an event left pending by a previous run */
 void
-rebuild_tree(watch_t *start, watch_t *watch)
+replay_event(const struct journal_event *ev, struct journal_ref *ref)
 {
-	watch_t *ptr, *prev;
-	watch_t *root = watch->root; 
+	struct thread_info *info;
+	watch_t *root;
+	size_t len;
 
-	/* free all entries from this directory tree */
-	prev = NULL;
-	for (ptr = start; ptr != NULL; ptr = ptr->next) {
-		if(ptr == root) {
-			prev = ptr;
-			continue;
-		}
-			
-		if (ptr->root == root) {
-			prev->next = ptr->next;
-			inotify_rm_watch(ctx.inotify_fd, ptr->wd);
-			if (ptr->regex_rule[0])
-				regfree(&ptr->regex);
-			free(ptr);
-			ptr = prev;
-		} else {
-			prev = ptr;
-		}
+	root = find_rule(ev->rule_id);
+	len = root ? strlen(root->target) : 0;
+	/* the target itself or a directory below it, not a sibling sharing its prefix */
+	if (! root || (root->glob ? fnmatch(root->target, ev->dir, FNM_PATHNAME|FNM_LEADING_DIR) :
+			strncmp(ev->dir, root->target, len) ||
+			(ev->dir[len] != '\0' && ev->dir[len] != '/' && (! len || root->target[len-1] != '/')))) {
+		/* the rule is gone or has changed */
+		journal_complete(ref);
+		return;
 	}
-	
-	monitor_directory(0, root);
+
+	info = (struct thread_info *) pool_get(&ctx.event_pool);
+	if (! info)
+		return;
+	info->rule = root;
+	info->mask = ev->mask;
+	info->wd = 0;
+	info->status = -1;
+	info->cookie = 0;
+	info->time = realtime_ns();
+	info->journal = *ref;
+	info->old_entry[0] = '\0';
+	info->summary[0] = '\0';
+	info->host[0] = '\0';
+	snprintf(info->dir, sizeof(info->dir), "%s", ev->dir);
+	snprintf(info->offending_name, sizeof(info->offending_name), "%s", ev->name);
+
+	executor_submit(info);
 }
 
-void
-select_on_inotify(void)
+/*
+ * Tells if an event forwarded from the directory @dir matches the REMOTE rule
+ * @rule. Entries can't be stat'ed here, so directories are told apart by
+ * IN_ISDIR, and the other entries count both as FILES and as SYMLINKS.
+ */
+static int
+remote_match(watch_t *rule, const struct aggregate_event *ev)
 {
-	int ret;
-	fd_set read_fds;
+	char dir[PATH_MAX];
 
-	FD_ZERO(&read_fds);
-	FD_SET(ctx.inotify_fd, &read_fds);
+	if (! (rule->mask & ev->mask))
+		return 0;
+	if ((ev->mask & IN_ISDIR) ? ! FILTER_DIRS(rule->lookat) : FILTER_DIRS(rule->lookat))
+		return 0;
+	if (rule->regex_rule[0] && regexec(&rule->regex, ev->name, 0, NULL, 0) != 0)
+		return 0;
 
-	ret = select(ctx.inotify_fd + 1, &read_fds, NULL, NULL, NULL);
-	if (ret == -1)
-		perror("select");
+	/* the target, or one of the ancestors of @dir within the depth of the rule */
+	snprintf(dir, sizeof(dir), "%s", ev->dir);
+	for (int level=0; level<=rule->depth; ++level) {
+		char *slash;
+		if (rule->glob ? fnmatch(rule->target, dir, FNM_PATHNAME) == 0 : strcmp(rule->target, dir) == 0)
+			return rule->glob || ! rule->exclude || ! exclude_match(rule, ev->dir, ev->name);
+		if (! (slash = strrchr(dir, '/')) || slash == dir)
+			break;
+		*slash = '\0';
+	}
+	return 0;
 }
 
-static inline void
-mask_concat(char *buf, size_t size, const char *data)
+/* aggregator_start() hook: runs the REMOTE rules matching a forwarded event */
+static void
+remote_event(const struct aggregate_event *ev)
 {
-	size_t offset = strlen(buf);
-	if (offset == 0) {
-		strncat(buf, data, size);
-	} else {
-		char *start = &buf[offset];
-		snprintf(start, size-offset-1, " | %s", data);
+	struct rule_set *set;
+
+	if (__atomic_load_n(&ctx.draining, __ATOMIC_RELAXED))
+		return;
+	rcu_read_lock();
+	set = rcu_dereference(ctx.rules);
+	for (size_t i=0; i<set->count; ++i) {
+		watch_t *rule = set->rules[i];
+		struct thread_info *info;
+
+		if (rule->backend != BACKEND_REMOTE || ! remote_match(rule, ev))
+			continue;
+		if (! (info = (struct thread_info *) pool_get(&ctx.event_pool)))
+			break;
+		info->rule = rule;
+		info->mask = ev->mask;
+		info->wd = 0;
+		info->status = -1;
+		info->cookie = ev->cookie;
+		info->time = ev->time;
+		info->journal.seg = NULL;
+		snprintf(info->dir, sizeof(info->dir), "%s", ev->dir);
+		snprintf(info->offending_name, sizeof(info->offending_name), "%s", ev->name);
+		snprintf(info->old_entry, sizeof(info->old_entry), "%s", ev->old_entry);
+		snprintf(info->summary, sizeof(info->summary), "%s", ev->summary);
+		snprintf(info->host, sizeof(info->host), "%s", ev->host);
+		queue_event(rule, info);
 	}
+	rcu_read_unlock();
 }
 
-char *
-mask_name(int mask)
+/* threads don't survive fork(), so they are started by the process that listens for events */
+int
+start_threads(void)
 {
-	char buf[128] = { 0 };
+	sigset_t set;
 
-	if (mask & IN_ACCESS)
-		mask_concat(buf, sizeof(buf), "access");
-	if (mask & IN_MODIFY)
-		mask_concat(buf, sizeof(buf), "modify");
-	if (mask & IN_ATTRIB)
-		mask_concat(buf, sizeof(buf), "attrib");
-	if (mask & IN_CLOSE_WRITE)
-		mask_concat(buf, sizeof(buf), "close write");
-	if (mask & IN_CLOSE_NOWRITE)
-		mask_concat(buf, sizeof(buf), "close nowrite");
-	if (mask & IN_OPEN)
-		mask_concat(buf, sizeof(buf), "open");
-	if (mask & IN_MOVED_FROM)
-		mask_concat(buf, sizeof(buf), "moved from");
-	if (mask & IN_MOVED_TO)
-		mask_concat(buf, sizeof(buf), "moved to");
-	if (mask & IN_CREATE)
-		mask_concat(buf, sizeof(buf), "create");
-	if (mask & IN_DELETE)
-		mask_concat(buf, sizeof(buf), "delete");
-	if (mask & IN_DELETE_SELF)
-		mask_concat(buf, sizeof(buf), "delete self");
-	if (mask & IN_MOVE_SELF)
-		mask_concat(buf, sizeof(buf), "move self");
-	if (! strlen(buf)) {
-		char unknown[64];
-		snprintf(unknown, sizeof(unknown)-1, "unknown (%#x)", mask);
-		mask_concat(buf, sizeof(buf), unknown);
+	/* signals are handled by the main thread, see listen_on_shards() */
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	if (log_start() < 0 || feedback_start() < 0 || publisher_start() < 0 || forwarder_start() < 0)
+		return -1;
+	for (int i=0; i<ctx.nshards && ctx.io_uring; ++i) {
+		struct listener_shard *shard = &ctx.shards[i];
+		shard->pending = (struct pending_event *) calloc(DISPATCH_PENDING, sizeof(struct pending_event));
+		shard->statx = (struct statx *) calloc(DISPATCH_PENDING, sizeof(struct statx));
+		if (! shard->pending || ! shard->statx || ! (shard->uring = uring_create(URING_ENTRIES))) {
+			fprintf(stderr, "io_uring: %s, using synchronous calls\n", strerror(errno));
+			break;
+		}
+	}
+	if (executor_init(ctx.workers, perform_action) < 0)
+		return -1;
+	if (poller_start(&poller_ops, ctx.poll_budget) < 0)
+		return -1;
+	if (plugin_init_all() < 0 || builtin_init_all() < 0)
+		return -1;
+	if (ctx.journal_dir) {
+		if (journal_open(ctx.journal_dir) < 0)
+			return -1;
+		journal_replay(replay_event);
+		if (journal_start() < 0)
+			return -1;
+	}
+	if (aggregator_start(remote_event) < 0)
+		return -1;
+	return 0;
+}
+
+int
+create_shards(int nshards)
+{
+	if (nshards < 1 || nshards > MAX_SHARDS) {
+		fprintf(stderr, "%d: invalid number of shards\n", nshards);
+		return -1;
 	}
+	ctx.shards = (struct listener_shard *) calloc(nshards, sizeof(struct listener_shard));
+	ctx.nshards = nshards;
+
+	for (int i=0; i<nshards; ++i) {
+		struct listener_shard *shard = &ctx.shards[i];
 
-	return strdup(buf);
+		shard->id = i;
+		pthread_mutex_init(&shard->write_lock, NULL);
+		if (! (shard->graph = dirgraph_create())) {
+			perror("calloc");
+			return -1;
+		}
+		shard->inotify_fd = inotify_init();
+		if (shard->inotify_fd < 0) {
+			perror("inotify_init");
+			return -1;
+		}
+		shard->wake_fd = eventfd(0, 0);
+		if (shard->wake_fd < 0) {
+			perror("eventfd");
+			return -1;
+		}
+		for (int r=0; r<NUM_RINGS; ++r) {
+			if (ring_init(&shard->rings[r], RING_DEFAULT_SLOTS) < 0)
+				return -1;
+		}
+	}
+	return 0;
 }
 
-void
-handle_events(const struct inotify_event *ev)
+/*
+ * Reports how much of each rule tree was left out by its exclude patterns,
+ * to @fp or to the log if it's NULL.
+ */
+static void
+dump_excludes(FILE *fp, int events)
 {
-	pthread_t tid;
-	regmatch_t match;
-	struct thread_info *info;
-	struct stat status;
-	char stat_target[PATH_MAX], offending_name[PATH_MAX];
-	watch_t *watch = NULL;
-	char *mask;
-	int ret, need_rebuild_tree = 0;
+	struct rule_set *set;
+	char line[512];
 
-	watch = hashtable_get(ctx.watch_hash, ev->wd);
-	if (! watch) {
-		/* Couldn't find watch descriptor, so this is not a valid event */
-		return;
+	rcu_read_lock();
+	set = rcu_dereference(ctx.rules);
+	for (size_t i=0; i<set->count; ++i) {
+		watch_t *rule = set->rules[i];
+		int n;
+		if (! rule->exclude)
+			continue;
+		n = snprintf(line, sizeof(line), "rule %d (%s): %lu directories excluded", rule->rule_id,
+			rule->description ? rule->description : rule->target, rule->exclude->excluded_dirs);
+		if (events && n >= 0 && n < (int) sizeof(line))
+			snprintf(line + n, sizeof(line) - n, ", %lu events dropped", rule->exclude->excluded_events);
+		if (fp)
+			fprintf(fp, "%s\n", line);
+		else
+			log_printf(LOG_LEVEL_INFO, "%s", line);
 	}
+	rcu_read_unlock();
+}
 
-	/*
-	 * first, check against the watch mask, since a given entry can be
-	 * watched twice or even more times
-	 */
-	if (! (watch->mask & ev->mask)) {
-		if (ctx.debug_mode) {
-			char *wa_mask = mask_name(watch->mask);
-			char *ev_mask = mask_name(ev->mask);
-			debug_printf("watch mask mismatch on %d: watch=%s, event=%s\n", watch->wd, wa_mask, ev_mask);
-			free(wa_mask);
-			free(ev_mask);
+void
+dump_stats(FILE *fp)
+{
+	const char *lanes[NUM_RINGS] = { "structural", "content", "polled" };
+	struct poller_stats poll;
+	struct digest_stats digest;
+	struct feedback_stats feedback;
+	struct publish_stats publish;
+	struct forward_stats forward;
+	struct aggregate_stats aggregate;
+	struct log_stats log;
+
+	rcu_read_lock();
+	for (int i=0; i<ctx.nshards; ++i) {
+		struct listener_shard *shard = &ctx.shards[i];
+		struct watch_table *table = rcu_dereference(shard->table);
+		struct dirgraph_stats graph;
+
+		fprintf(fp, "shard %d watch table: version %llu, %zu entries\n",
+			shard->id, (unsigned long long) table->version, table->count);
+		pthread_mutex_lock(&shard->write_lock);
+		dirgraph_get_stats(shard->graph, &graph);
+		pthread_mutex_unlock(&shard->write_lock);
+		fprintf(fp, "shard %d directories: %zu nodes, %zu rule entries, %zu shared\n",
+			shard->id, graph.nodes, graph.refs, graph.shared);
+		fprintf(fp, "shard %d initial crawl: %s, %zu entries published, %lu parked events handled, %lu dropped\n",
+			shard->id, __atomic_load_n(&shard->crawling, __ATOMIC_ACQUIRE) ? "running" : "done",
+			shard->crawl_published, shard->parked_handled, shard->parked_dropped);
+		fprintf(fp, "shard %d moves: %lu renames paired, %lu halves unpaired, %lu trees re-keyed\n",
+			shard->id, shard->moves_paired, shard->moves_unpaired, shard->trees_rekeyed);
+		fprintf(fp, "shard %d inotify queue: %lu overflows\n", shard->id, shard->overflows);
+		struct uring *ring = rcu_dereference(shard->uring);
+		if (ring) {
+			struct uring_stats us;
+			uring_get_stats(ring, &us);
+			fprintf(fp, "shard %d classification: %llu statx in %llu batches, %llu io_uring_enter calls, %llu stat calls\n",
+				shard->id, us.ops, us.batches, us.enters, shard->stat_calls);
+		} else {
+			fprintf(fp, "shard %d classification: %llu stat calls\n", shard->id, shard->stat_calls);
 		}
-		return;
+		fprintf(fp, "shard %d overload: %s, entered %lu times, left %lu times, "
+			"%llu events in %llu summaries, %zu directories pending\n",
+			shard->id, shard->overload.active ? "active" : "inactive", shard->overload.entered,
+			shard->overload.left, shard->overload.summarized, shard->overload.summaries,
+			overload_dirs(&shard->overload));
+		for (int r=0; r<NUM_RINGS; ++r) {
+			struct ring *ring = &shard->rings[r];
+			fprintf(fp, "shard %d %s ring: %zu/%zu slots used, high water %zu, %llu events, %llu full\n",
+				shard->id, lanes[r], ring_occupancy(ring), ring->size, ring->high_water,
+				(unsigned long long) ring->pushed, (unsigned long long) ring->full);
+		}
+	}
+	rcu_read_unlock();
+	dump_excludes(fp, 1);
+	poller_get_stats(&poll);
+	fprintf(fp, "watches: %d in use, budget %d of %d, %lu directories evicted\n",
+		__atomic_load_n(&ctx.watches, __ATOMIC_RELAXED), __atomic_load_n(&ctx.watch_budget, __ATOMIC_RELAXED),
+		ctx.watch_limit, __atomic_load_n(&ctx.evictions, __ATOMIC_RELAXED));
+	fprintf(fp, "poller: %zu directories (%zu evicted), %llu scans, %llu deferred, %llu events, %llu promotions\n",
+		poll.dirs, poll.evicted, poll.scans, poll.deferred, poll.events, poll.promotions);
+	digest_get_stats(&digest);
+	if (digest.hits || digest.hashed) {
+		double secs = digest.usecs / 1e6;
+		fprintf(fp, "digests: %zu cached, %llu unchanged by stat, %llu hashed (%llu in parallel), "
+			"%llu unchanged by digest, %llu evicted, %.1f MB hashed at %.1f MB/s\n",
+			digest.entries, digest.hits, digest.hashed, digest.parallel, digest.unchanged,
+			digest.evictions, digest.bytes / 1e6, secs > 0 ? digest.bytes / 1e6 / secs : 0.0);
+	}
+	feedback_get_stats(&feedback);
+	if (feedback.window_drops || feedback.fanotify_events || feedback.dirs)
+		fprintf(fp, "own events: %llu dropped by entry, %llu dropped by fanotify (%llu seen, %zu directories marked)\n",
+			feedback.window_drops, feedback.fanotify_drops, feedback.fanotify_events, feedback.dirs);
+	if (ctx.publish_path) {
+		publisher_get_stats(&publish);
+		fprintf(fp, "publish: %zu subscribers, %llu records in %llu sends, %llu dropped, %llu disconnected\n",
+			publish.subscribers, publish.records, publish.sends, publish.dropped, publish.disconnected);
+	}
+	if (ctx.forward_address) {
+		forwarder_get_stats(&forward);
+		fprintf(fp, "forward: %s, %llu events in %llu batches (%.1f MB, %.1f MB sent), %llu acknowledged, "
+			"%llu batches sent again, %llu events dropped, %llu reconnections, %zu bytes spooled\n",
+			forward.connected ? "connected" : "disconnected", forward.events, forward.batches,
+			forward.raw_bytes / 1e6, forward.wire_bytes / 1e6, forward.acked, forward.resent,
+			forward.dropped, forward.reconnects, forward.spooled);
+		fprintf(fp, "forward: %.0f events/s while connected, lag %.1f ms average, %llu ms max\n",
+			forward.active_ms ? forward.acked * 1000.0 / forward.active_ms : 0.0,
+			forward.acked ? (double) forward.lag_sum / forward.acked : 0.0, (unsigned long long) forward.lag_max);
+	}
+	if (ctx.aggregate_address) {
+		aggregator_get_stats(&aggregate);
+		fprintf(fp, "aggregate: %zu streams, %llu events in %llu batches (%.1f MB), %llu batches received again, "
+			"lag %.1f ms average, %llu ms max\n",
+			aggregate.streams, aggregate.events, aggregate.batches, aggregate.wire_bytes / 1e6, aggregate.duplicates,
+			aggregate.events ? (double) aggregate.lag_sum / aggregate.events : 0.0,
+			(unsigned long long) aggregate.lag_max);
 	}
+	log_get_stats(&log);
+	fprintf(fp, "log: %llu records, %llu dropped\n", log.records, log.dropped);
+	fprintf(fp, "event pool: %zu records in use, %zu slabs of %zu\n",
+		ctx.event_pool.in_use, ctx.event_pool.nslabs, ctx.event_pool.per_slab);
+	fflush(fp);
+}
 
-	if (! (ev->mask & (IN_DELETE_SELF|IN_MOVE_SELF))) {
-		if (watch->regex_rule[0]) {
-			/* verify against regex if we want to handle this event or not */
-			memset(offending_name, 0, sizeof(offending_name));
-			snprintf(offending_name, ev->len, "%s", ev->name);
-			ret = regexec(&watch->regex, offending_name, 1, &match, 0);
-			if (ret != 0) {
-				//debug_printf("event from watch %d, but path '%s' doesn't match regex\n", watch->wd, offending_name);
-				return;
-			}
-		}
+/* control command: rules with their watches and approximate table footprint */
+static void
+list_rules(FILE *out)
+{
+	static const char *policies[] = { "", "buffering", "discarding" };
+	struct rule_set *set;
 
-		/* filter the entry by its type (dir|file) */
-		snprintf(stat_target, sizeof(stat_target), "%s/%s", watch->target, offending_name);
-		ret = stat(stat_target, &status);
-		if (ret < 0 && watch->uses_entry_variable && ! (watch->mask & IN_DELETE || watch->mask & IN_DELETE_SELF)) {
-			fprintf(stderr, "stat %s: %s\n", stat_target, strerror(errno));
-			return;
+	rcu_read_lock();
+	set = rcu_dereference(ctx.rules);
+	for (size_t i=0; i<set->count; ++i) {
+		watch_t *rule = set->rules[i];
+		struct watch_table *table = rcu_dereference(rule->shard->table);
+		struct rule_pause *pause = rule->pause;
+		size_t watched = 0, polled = 0;
+
+		for (size_t n=0; n<table->count; ++n) {
+			watch_t *w = table->entries[n];
+			if (w->wd == 0)
+				continue;	/* the rule record of a tree, its level 0 copy is watched */
+			if (w->rule == rule && w->wd < 0)
+				polled++;
+			else if (w->rule == rule)
+				watched++;
 		}
-		if (!(FILTER_DIRS(watch->lookat) && S_ISDIR(status.st_mode)) &&
-				!(FILTER_FILES(watch->lookat) && S_ISREG(status.st_mode)) &&
-				!(FILTER_SYMLINKS(watch->lookat) && S_ISLNK(status.st_mode)) &&
-				ret == 0) {
-			const char *fsobj = S_ISDIR(status.st_mode) ? "DIRS" :
-				S_ISREG(status.st_mode) ? "FILES" : "SYMLINKS";
-			debug_printf("watch %d doesn't want to process %s, skipping event\n", watch->wd, fsobj);
-			return;
+		fprintf(out, "rule %d (%s): shard %d, %zu watched, %zu polled, %zu KiB",
+			rule->rule_id, rule->description ? rule->description : rule->target, rule->shard->id,
+			watched, polled, ((watched + polled) * (sizeof(watch_t) + 2 * sizeof(watch_t *)) + 1023) / 1024);
+		if (pause) {
+			pthread_mutex_lock(&pause->lock);
+			if (pause->policy != PAUSE_NONE)
+				fprintf(out, ", paused %s", policies[pause->policy]);
+			if (pause->held || pause->discarded)
+				fprintf(out, ", %zu events held, %lu discarded", pause->held, pause->discarded);
+			pthread_mutex_unlock(&pause->lock);
 		}
-	} else {
-		strncpy(offending_name, watch->target, sizeof(offending_name)-1);
+		fprintf(out, "\n");
 	}
+	rcu_read_unlock();
+}
 
-	if (watch->depth && ((SYS_MASK) & ev->mask))
-		need_rebuild_tree = 1;
-
-	/* launch a thread to deal with the event */
-	info = (struct thread_info *) malloc(sizeof(struct thread_info));
-	info->watch = (watch_t *) malloc(sizeof(watch_t));
-	memcpy(info->watch, watch, sizeof(watch_t));
-	snprintf(info->offending_name, sizeof(info->offending_name), "%s", offending_name);
+/* control command: the watch descriptor table of every shard */
+static void
+list_watches(FILE *out, watch_t *only)
+{
+	rcu_read_lock();
+	for (int i=0; i<ctx.nshards; ++i) {
+		struct watch_table *table = rcu_dereference(ctx.shards[i].table);
+		for (size_t n=0; n<table->count; ++n) {
+			watch_t *w = table->entries[n];
+			if (w->wd == 0 || (only && w->rule != only))
+				continue;
+			fprintf(out, "shard %d wd %d rule %d: %s%s\n", i, w->wd, w->rule_id, w->target,
+				w->scaffold ? " (glob)" : w->wd < 0 ? " (polled)" : "");
+		}
+	}
+	rcu_read_unlock();
+}
 
-	mask = mask_name(ev->mask);
-	asprintf(&info->event_msg,
-		"-> event on dir %s, watch %d\n"
-		"-> filename:    %s\n"
-		"-> event mask:  %#X (%s)\n",
-		watch->target, watch->wd,
-		offending_name,
-		ev->mask, mask);
-	free(mask);
+static int
+pause_rule(watch_t *rule, int policy)
+{
+	struct rule_pause *pause = rule->pause;
 
-	pthread_create(&tid, NULL, perform_action, (void *) info);
+	/* only the control loop creates them */
+	if (! pause) {
+		pause = (struct rule_pause *) calloc(1, sizeof(struct rule_pause));
+		if (! pause)
+			return -1;
+		pthread_mutex_init(&pause->lock, NULL);
+		__atomic_store_n(&rule->pause, pause, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_lock(&pause->lock);
+	pause->policy = policy;
+	pthread_mutex_unlock(&pause->lock);
+	return 0;
+}
 
-	/* event handled, that's all! */
+/* submits the events held while the rule was paused; returns their number */
+static size_t
+resume_rule(watch_t *rule)
+{
+	struct rule_pause *pause = rule->pause;
+	size_t held;
 
-	if (need_rebuild_tree) {
-		hashtable_destroy(ctx.watch_hash);
-		rebuild_tree(ctx.watch_list, watch);
-		ctx.watch_hash = hashtable_create(ctx.watch_list);
+	if (! pause)
+		return 0;
+	pthread_mutex_lock(&pause->lock);
+	while (pause->head) {
+		struct thread_info *info = pause->head;
+		pause->head = info->next;
+		executor_submit(info);
 	}
+	held = pause->held;
+	pause->tail = NULL;
+	pause->held = 0;
+	pause->policy = PAUSE_NONE;
+	pthread_mutex_unlock(&pause->lock);
+	return held;
 }
 
-void
-listen_for_events(void)
+/* control hook, run once the drain command waited for the events in flight */
+static int
+drain_pending(FILE *out)
 {
-	size_t n;
-	char *ptr;
-	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
-	const struct inotify_event *event = NULL;
+	unsigned long pending = executor_pending();
 
-	while (2) {
-		select_on_inotify();
-		n = read(ctx.inotify_fd, buf, sizeof(buf));
-		if (n <= 0)
-			break;
+	if (monotonic_ms() - ctx.drain_start < CONTROL_TICK || pending)
+		return CONTROL_PENDING;
+	fprintf(out, "drained\nok\n");
+	return CONTROL_EXIT;
+}
 
-		for (ptr=buf; ptr<buf+n; ptr+=sizeof(struct inotify_event)+event->len) {
-			event = (const struct inotify_event *) ptr;
-			handle_events(event);
+static int
+run_command(int argc, char **argv, FILE *out)
+{
+	watch_t *rule = NULL;
+
+	if (argc > 1 && ! (rule = find_rule(atoi(argv[1])))) {
+		fprintf(out, "error: %s: no such rule\n", argv[1]);
+		return CONTROL_DONE;
+	}
+
+	if (! strcmp(argv[0], "rules")) {
+		list_rules(out);
+	} else if (! strcmp(argv[0], "watches")) {
+		list_watches(out, rule);
+	} else if (! strcmp(argv[0], "stats")) {
+		dump_stats(out);
+	} else if (! strcmp(argv[0], "output") && rule) {
+		if (! rule->output) {
+			fprintf(out, "error: the output of rule %d isn't captured\n", rule->rule_id);
+			return CONTROL_DONE;
 		}
+		log_capture_dump(rule->output, out);
+		fprintf(out, "\n");
+	} else if (! strcmp(argv[0], "pause") && rule) {
+		int policy = argc < 3 || ! strcmp(argv[2], "buffer") ? PAUSE_BUFFER :
+			! strcmp(argv[2], "discard") ? PAUSE_DISCARD : PAUSE_NONE;
+		if (policy == PAUSE_NONE) {
+			fprintf(out, "error: %s: policy must be 'buffer' or 'discard'\n", argv[2]);
+			return CONTROL_DONE;
+		}
+		if (pause_rule(rule, policy) < 0) {
+			fprintf(out, "error: %s\n", strerror(errno));
+			return CONTROL_DONE;
+		}
+	} else if (! strcmp(argv[0], "resume") && rule) {
+		fprintf(out, "%zu held events submitted\n", resume_rule(rule));
+	} else if (! strcmp(argv[0], "resync") && rule) {
+		__atomic_store_n(&rule->resync, 1, __ATOMIC_RELEASE);
+		__atomic_store_n(&rule->shard->resync, 1, __ATOMIC_RELEASE);
+		wake_dispatcher(rule->shard);
+	} else if (! strcmp(argv[0], "ready")) {
+		uint64_t ready_ms = __atomic_load_n(&ctx.ready_ms, __ATOMIC_ACQUIRE);
+		if (ready_ms)
+			fprintf(out, "ready, set up in %llu ms\n", (unsigned long long) ready_ms);
+		else
+			fprintf(out, "crawling for %llu ms\n", (unsigned long long) (monotonic_ms() - ctx.start));
+	} else if (! strcmp(argv[0], "drain")) {
+		ctx.drain_start = monotonic_ms();
+		__atomic_store_n(&ctx.draining, 1, __ATOMIC_RELAXED);
+		return CONTROL_PENDING;
+	} else {
+		fprintf(out, "error: usage: rules | watches [RULE] | stats | output RULE |"
+			" pause RULE [buffer|discard] | resume RULE | resync RULE | ready | drain\n");
+		return CONTROL_DONE;
 	}
+	fprintf(out, "ok\n");
+	return CONTROL_DONE;
 }
 
-watch_t *
-monitor_directory(int i, watch_t *watch)
+static int
+handle_signal(int signum)
 {
-	uint32_t mask, current_mask, my_root_mask;
-	watch_t *ptr, *my_root;
+	if (signum == SIGINT || signum == SIGTERM) {
+		log_printf(LOG_LEVEL_INFO, "%s: draining %lu pending actions before exiting", strsignal(signum),
+			executor_pending());
+		return CONTROL_EXIT;
+	}
+	dump_stats(stdout);
+	return CONTROL_DONE;
+}
 
-	int walk_tree(const char *file, const struct stat *sb, int flag, struct FTW *li) {
-		watch_t *w;
+static const struct control_ops control_ops = {
+	.command = run_command,
+	.pending = drain_pending,
+	.signal = handle_signal,
+};
 
-		if (flag != FTW_D) /* isn't a subdirectory */
-			return 0;
-		if (li->level > my_root->depth)
-			return FTW_SKIP_SUBTREE;
-
-		/*
-		 * replicate the parent's spawn, uses_entry_variable, mask, lookat,
-		 * regex and depth members
-		 */
-		w = (watch_t *) calloc(1, sizeof(watch_t));
-		memcpy(w, my_root, sizeof(*w));
-
-		/* only needs to differentiate on the target, regex and watch descriptor */
-		snprintf(w->target, sizeof(w->target), "%s", file);
-		if (strlen(w->regex_rule)) {
-			regcomp(&w->regex, w->regex_rule, REG_EXTENDED);
-		}
-		w->wd = inotify_add_watch(ctx.inotify_fd, file, my_root_mask | SYS_MASK);
-		if (w->wd < 0) {
-			perror("inotify_add_watch");
-			exit(1);
-		}
+/*
+ * Every directory of the rules is watched: the time it took is logged and
+ * reported by the ready command, and systemd is notified when it started
+ * the daemon as a service of Type=notify.
+ */
+static void
+announce_ready(void)
+{
+	const char *socket_path = getenv("NOTIFY_SOCKET");
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	size_t watched = 0, len;
+	uint64_t elapsed = monotonic_ms() - ctx.start;
+	int fd;
 
-		my_root->next = w;
-		my_root = w;
+	rcu_read_lock();
+	for (int i=0; i<ctx.nshards; ++i)
+		watched += rcu_dereference(ctx.shards[i].table)->count;
+	log_printf(LOG_LEVEL_INFO, "%zu directories of %zu rules set up in %llu ms", watched,
+		rcu_dereference(ctx.rules)->count, (unsigned long long) elapsed);
+	rcu_read_unlock();
+	__atomic_store_n(&ctx.ready_ms, elapsed ? elapsed : 1, __ATOMIC_RELEASE);
+	dump_excludes(NULL, 0);
 
-		if (i) { debug_printf("[recursive] Monitoring %s on watch %d\n", w->target, w->wd); }
-		return FTW_CONTINUE;
+	/* an abstract socket starts with '@' */
+	if (! socket_path || (socket_path[0] != '/' && socket_path[0] != '@') ||
+		(len = strlen(socket_path)) >= sizeof(addr.sun_path))
+		return;
+	memcpy(addr.sun_path, socket_path, len);
+	if (addr.sun_path[0] == '@')
+		addr.sun_path[0] = '\0';
+	if ((fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0 ||
+		sendto(fd, "READY=1", 7, 0, (struct sockaddr *) &addr, offsetof(struct sockaddr_un, sun_path) + len) < 0)
+		log_printf(LOG_LEVEL_WARNING, "%s: %s", socket_path, strerror(errno));
+	if (fd >= 0)
+		close(fd);
+}
+
+/*
+ * Initial crawl of the trees and glob rules of @shard. Events are handled
+ * meanwhile: those of directories watched but not published yet are parked
+ * by the dispatcher, and the directories they create, remove or rename are
+ * checked against the crawl once it is over, see reconcile_trees().
+ */
+static void *
+crawl_shard(void *data)
+{
+	struct listener_shard *shard = (struct listener_shard *) data;
+	struct watch_vec roots = { 0 }, globs = { 0 };
+	struct rule_set *set;
+
+	rcu_read_lock();
+	set = rcu_dereference(ctx.rules);
+	for (size_t i=0; i<set->count; ++i) {
+		watch_t *rule = set->rules[i];
+		if (rule->shard != shard || rule->backend == BACKEND_REMOTE)
+			continue;
+		if (rule->glob)
+			watch_vec_push(&globs, rule);
+		else if (rule->depth)
+			watch_vec_push(&roots, rule);
 	}
+	rcu_read_unlock();
 
-	/* 
-	 * Check for the existing entries if this directory is already being listened.
-	 * If we have a match, then we must append a new mask instead of replacing the
-	 * current one.
-	 */
-	for (current_mask=0, ptr=ctx.watch_list; ptr != NULL; ptr=ptr->next) {
-		if (! strcmp(ptr->target, watch->target))
-			current_mask |= ptr->mask;
+	crawl_roots(roots.entries, roots.count, &shard->crawl, NULL, CRAWL_VERBOSE | CRAWL_BACKGROUND);
+	for (size_t i=0; i<globs.count; ++i) {
+		struct expansion x;
+		expand_pattern(&x, globs.entries[i]);
+		add_expansion(&x, &shard->crawl, NULL, CRAWL_VERBOSE | CRAWL_BACKGROUND);
+		debug_printf("Expanded %s to %zu targets\n", globs.entries[i]->target, x.matches.gl_pathc);
+		free_expansion(&x);
 	}
 
-	mask = watch->mask | current_mask;
-	watch->root = watch; //pointer to root diretory
-	
-	if (watch->depth) {
-		my_root = watch;
-		my_root_mask = mask;
-		nftw(watch->target, walk_tree, 1024, FTW_ACTIONRETVAL);
-		watch = my_root;
-	} else {
-		watch->wd = inotify_add_watch(ctx.inotify_fd, watch->target, mask);
-		if (watch->wd < 0) {
-			fprintf(stderr, "inotify_add_watch(%d, %s, %#x): %s\n", ctx.inotify_fd, watch->target, mask, strerror(errno));
-			exit(1);
+	pthread_mutex_lock(&shard->write_lock);
+	publish_crawl(shard, 1);
+	__atomic_store_n(&shard->crawling, 0, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&shard->write_lock);
+	/* for the parked events and the rebuilds held meanwhile */
+	wake_dispatcher(shard);
+
+	free(shard->crawl.entries);
+	memset(&shard->crawl, 0, sizeof(shard->crawl));
+	free(roots.entries);
+	free(globs.entries);
+	if (__atomic_sub_fetch(&ctx.crawlers, 1, __ATOMIC_ACQ_REL) == 0)
+		announce_ready();
+	return NULL;
+}
+
+/*
+ * Runs the reader, dispatcher and crawler threads of every shard. The main
+ * thread is left serving the control socket and SIGUSR1, which dumps the statistics
+ * to stdout, and SIGINT and SIGTERM, which stop the daemon.
+ */
+void
+listen_on_shards(void)
+{
+	sigset_t set;
+	char name[16];
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+
+	for (int i=0; i<ctx.nshards; ++i) {
+		struct listener_shard *shard = &ctx.shards[i];
+		if (pthread_create(&shard->dispatcher, NULL, dispatch_events, shard) != 0 ||
+			pthread_create(&shard->reader, NULL, read_events, shard) != 0) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
 		}
-		if (i) { debug_printf("Monitoring %s on watch %d\n", watch->target, watch->wd); }
+		/* as shown by top -H, and told apart by tests/alloc-test.sh */
+		snprintf(name, sizeof(name), "dispatch/%d", shard->id);
+		pthread_setname_np(shard->dispatcher, name);
+		snprintf(name, sizeof(name), "reader/%d", shard->id);
+		pthread_setname_np(shard->reader, name);
 	}
-	return watch;
+
+	/* trees are crawled once their events can be handled */
+	if (! ctx.crawlers)
+		announce_ready();
+	for (int i=0; i<ctx.nshards; ++i) {
+		struct listener_shard *shard = &ctx.shards[i];
+		if (shard->crawling && pthread_create(&shard->crawler, NULL, crawl_shard, shard) != 0) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (control_loop(ctx.control_path, &control_ops, &set) < 0)
+		exit(EXIT_FAILURE);
+	suicide();
 }
 
 void
 show_usage(char *program_name)
 {
 	fprintf(stderr, "Usage: %s [options]\n\nAvailable options are:\n"
+			"  -b, --publish-buffer SIZE  Hold up to SIZE bytes of records per subscriber\n"
+			"                       (default: %d)\n"
+			"  -a, --aggregate [HOST:]PORT  Run the rules using the REMOTE backend on the\n"
+			"                       events forwarded to PORT by the hosts sharing the\n"
+			"                       --forward-secret; listens on 127.0.0.1 only\n"
+			"                       unless HOST is given, '*' for every interface\n"
 			"  -c, --config FILE    Take config options from FILE\n"
 			"  -d, --debug          Run in the foreground\n"
-			"  -h, --help           This help\n", program_name);
+			"  -D, --publish-policy POLICY  What becomes of a subscriber whose buffer is\n"
+			"                       full: drop (its records, the default) or disconnect\n"
+			"  -f, --forward HOST:PORT  Send the events of rules using 'forward' to the\n"
+			"                       aggregator at HOST:PORT\n"
+			"  -F, --fanotify       Recognise any change made by the actions of rules\n"
+			"                       ignoring their own events (needs CAP_SYS_ADMIN)\n"
+			"  -h, --help           This help\n"
+			"  -j, --journal DIR    Journal matched events to DIR and replay them on restart\n"
+			"  -k, --forward-secret FILE  Authenticate forwarders with the secret held in\n"
+			"                       FILE, required by --forward and --aggregate. Any\n"
+			"                       holder of it may run the REMOTE rules of the\n"
+			"                       aggregator on names of its choosing\n"
+			"  -l, --log TARGET     Log to the file TARGET, or to syslog if TARGET is 'syslog'\n"
+			"                       (default: stdout in debug mode, nowhere otherwise)\n"
+			"  -L, --log-level LEVEL  One of none, error, warning, info or debug\n"
+			"                       (default: debug in debug mode, info otherwise)\n"
+			"  -O, --forward-spool SIZE  Keep up to SIZE bytes of events not acknowledged\n"
+			"                       by the aggregator (default: %d)\n"
+			"  -P, --poll-budget NUM  Let the poller read or stat at most NUM entries\n"
+			"                       per second (default: %d)\n"
+			"  -p, --publish PATH   Send the events of rules using 'publish' to the\n"
+			"                       subscribers of the Unix socket PATH\n"
+			"  -S, --control PATH   Accept control commands on the Unix socket PATH\n"
+			"  -s, --shards NUM     Spread rules across NUM inotify instances (default: 1)\n"
+			"  -U, --io-uring       Stat the entries of batches of events through io_uring\n"
+			"  -W, --max-watches NUM  Poll directories beyond NUM inotify watches\n"
+			"                       (default: fs.inotify.max_user_watches)\n"
+			"  -w, --workers NUM    Run actions on NUM worker threads per priority\n"
+			"                       (high, normal and low; default: %d)\n"
+			"  -z, --forward-compress  Compress the batches of forwarded events\n",
+			program_name, PUBLISH_DEFAULT_BUFFER, FORWARD_DEFAULT_SPOOL, POLL_DEFAULT_BUDGET,
+			EXECUTOR_DEFAULT_WORKERS);
 }
 
 void
@@ -405,14 +3384,42 @@ close_standard_descriptors()
 int
 main(int argc, char **argv)
 {
-	int c, index;
+	int c, index, nshards = 1;
 	char *config_file = strdup(LISTENER_RULES);
 
-	char short_opts[] = "c:dh";
+	ctx.workers = EXECUTOR_DEFAULT_WORKERS;
+	pool_init(&ctx.event_pool, sizeof(struct thread_info), EVENTS_PER_SLAB);
+
+	ctx.poll_budget = POLL_DEFAULT_BUDGET;
+
+	char short_opts[] = "a:b:c:dD:f:Fhj:k:l:L:O:P:p:S:s:Uw:W:z";
+	char *forward_secret = NULL;
+	char *log_target = NULL;
+	int level = -2, publish_policy = PUBLISH_DROP;
+	long publish_buffer = PUBLISH_DEFAULT_BUFFER, forward_spool = FORWARD_DEFAULT_SPOOL;
+	int forward_compress = 0;
 	struct option long_options[] = {
+		{"aggregate", required_argument, NULL, 'a'},
 		{"config", required_argument, NULL, 'c'},
 		{"debug",        no_argument, NULL, 'd'},
+		{"fanotify",     no_argument, NULL, 'F'},
+		{"forward",  required_argument, NULL, 'f'},
+		{"forward-compress", no_argument, NULL, 'z'},
+		{"forward-secret", required_argument, NULL, 'k'},
+		{"forward-spool", required_argument, NULL, 'O'},
 		{"help",         no_argument, NULL, 'h'},
+		{"io-uring",     no_argument, NULL, 'U'},
+		{"journal",  required_argument, NULL, 'j'},
+		{"log",      required_argument, NULL, 'l'},
+		{"log-level", required_argument, NULL, 'L'},
+		{"poll-budget", required_argument, NULL, 'P'},
+		{"publish",  required_argument, NULL, 'p'},
+		{"publish-buffer", required_argument, NULL, 'b'},
+		{"publish-policy", required_argument, NULL, 'D'},
+		{"control",  required_argument, NULL, 'S'},
+		{"shards",   required_argument, NULL, 's'},
+		{"workers",  required_argument, NULL, 'w'},
+		{"max-watches", required_argument, NULL, 'W'},
 		{0, 0, 0, 0}
 	};
 
@@ -422,6 +3429,15 @@ main(int argc, char **argv)
 			case 0:
 			case '?':
 				return 1;
+			case 'a':
+				ctx.aggregate_address = strdup(optarg);
+				break;
+			case 'b':
+				if ((publish_buffer = atol(optarg)) < 4096) {
+					fprintf(stderr, "%s: invalid publish buffer size\n", optarg);
+					return 1;
+				}
+				break;
 			case 'c':
 				free(config_file);
 				config_file = strdup(optarg);
@@ -430,45 +3446,141 @@ main(int argc, char **argv)
 				printf("Running in debug mode\n");
 				ctx.debug_mode = 1;
 				break;
+			case 'D':
+				if (! strcasecmp(optarg, "drop"))
+					publish_policy = PUBLISH_DROP;
+				else if (! strcasecmp(optarg, "disconnect"))
+					publish_policy = PUBLISH_DISCONNECT;
+				else {
+					fprintf(stderr, "%s: invalid publish policy\n", optarg);
+					return 1;
+				}
+				break;
+			case 'f':
+				ctx.forward_address = strdup(optarg);
+				break;
+			case 'F':
+				ctx.fanotify = 1;
+				break;
 			case 'h':
 				show_usage(argv[0]);
 				return 0;
+			case 'j':
+				ctx.journal_dir = strdup(optarg);
+				break;
+			case 'k':
+				forward_secret = strdup(optarg);
+				break;
+			case 'l':
+				log_target = strdup(optarg);
+				break;
+			case 'L':
+				if ((level = log_parse_level(optarg)) == -2) {
+					fprintf(stderr, "%s: invalid log level\n", optarg);
+					return 1;
+				}
+				break;
+			case 'O':
+				if ((forward_spool = atol(optarg)) < 2 * FORWARD_MAX_BATCH) {
+					fprintf(stderr, "%s: invalid forward spool size\n", optarg);
+					return 1;
+				}
+				break;
+			case 'P':
+				ctx.poll_budget = atoi(optarg) > 0 ? atoi(optarg) : POLL_DEFAULT_BUDGET;
+				break;
+			case 'p':
+				ctx.publish_path = strdup(optarg);
+				break;
+			case 'S':
+				ctx.control_path = strdup(optarg);
+				break;
+			case 's':
+				nshards = atoi(optarg);
+				break;
+			case 'U':
+				ctx.io_uring = 1;
+				break;
+			case 'w':
+				ctx.workers = atoi(optarg);
+				break;
+			case 'W':
+				ctx.max_watches = atoi(optarg);
+				break;
+			case 'z':
+				forward_compress = 1;
+				break;
 			default:
 				printf("invalid option %d\n", c);
 				show_usage (argv[0]);
 		}
 	}
 
-	/* opens the inotify device */
-	ctx.inotify_fd = inotify_init();
-	if (ctx.inotify_fd < 0) {
-		perror("inotify_init");
+	if (level == -2)
+		level = ctx.debug_mode ? LOG_LEVEL_DEBUG : log_target ? LOG_LEVEL_INFO : LOG_LEVEL_NONE;
+	if ((log_target || ctx.debug_mode) && log_open(log_target, level) < 0)
+		exit(EXIT_FAILURE);
+
+	ctx.watch_limit = read_watch_limit();
+	ctx.watch_budget = ctx.watch_limit;
+
+	/* the directories of the rules are marked as they are watched */
+	if (feedback_init(ctx.fanotify) < 0)
+		fprintf(stderr, "fanotify unavailable, only the entries of the actions are ignored\n");
+
+	if (ctx.publish_path && publisher_init(ctx.publish_path, publish_buffer, publish_policy) < 0)
+		exit(EXIT_FAILURE);
+	if ((ctx.forward_address || ctx.aggregate_address) && ! forward_secret) {
+		fprintf(stderr, "--forward and --aggregate need the --forward-secret option\n");
 		exit(EXIT_FAILURE);
 	}
+	if (forward_secret && forward_read_secret(forward_secret) < 0)
+		exit(EXIT_FAILURE);
+	if (ctx.forward_address && forwarder_init(ctx.forward_address, forward_spool, forward_compress) < 0)
+		exit(EXIT_FAILURE);
+	if (ctx.aggregate_address && aggregator_init(ctx.aggregate_address) < 0)
+		exit(EXIT_FAILURE);
+
+	/* opens the inotify devices */
+	if (create_shards(nshards) < 0)
+		exit(EXIT_FAILURE);
 
 	/* read rules from listener.rules */
-	ctx.watch_list = read_config(config_file);
-	if (! ctx.watch_list) {
+	ctx.start = monotonic_ms();
+	if (! read_config(config_file)) {
 		free(config_file);
 		exit(EXIT_FAILURE);
 	}
 	free(config_file);
+	for (size_t i=0; i<ctx.rule_staging.count; ++i) {
+		watch_t *rule = ctx.rule_staging.entries[i];
+		if (rule->publish && ! ctx.publish_path)
+			fprintf(stderr, "rule %d: 'publish' needs the --publish option, events are dropped\n", rule->rule_id);
+		if (rule->forward && ! ctx.forward_address)
+			fprintf(stderr, "rule %d: 'forward' needs the --forward option, events are dropped\n", rule->rule_id);
+		if (rule->backend == BACKEND_REMOTE && ! ctx.aggregate_address)
+			fprintf(stderr, "rule %d: the REMOTE backend needs the --aggregate option\n", rule->rule_id);
+	}
 
-	ctx.watch_hash = hashtable_create(ctx.watch_list);
-	if (! ctx.watch_hash)
-		exit(EXIT_FAILURE);
-
-	/* install a signal handler to clean up memory */
-	signal(SIGINT, suicide);
+	watch_rules();
+	for (int i=0; i<ctx.nshards; ++i)
+		publish_table(&ctx.shards[i], &ctx.shards[i].staging);
+	publish_rules(&ctx.rule_staging);
+	debug_printf("%zu rules read in %llu ms, %d shards crawling their trees\n", ctx.rules->count,
+		(unsigned long long) (monotonic_ms() - ctx.start), ctx.crawlers);
 
-	if (ctx.debug_mode)
-		listen_for_events();
-	else {
+	if (ctx.debug_mode) {
+		if (start_threads() < 0)
+			exit(EXIT_FAILURE);
+		listen_on_shards();
+	} else {
 		close_standard_descriptors();
 		pid_t id = fork();
-		if (id == 0)
-			listen_for_events();
-		else if (id < 0 ){
+		if (id == 0) {
+			if (start_threads() < 0)
+				exit(EXIT_FAILURE);
+			listen_on_shards();
+		} else if (id < 0 ){
 			perror("fork");
 			exit(EXIT_FAILURE);
 		}
@@ -36,16 +36,23 @@
 #include <limits.h>
 #include <regex.h>
 #include <ftw.h>
+#include <fnmatch.h>
+#include <glob.h>
 #include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/ioctl.h>
 #include <sys/select.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 #define _GNU_SOURCE
 #include <getopt.h>
 #include "inotify.h"
 #include "inotify-syscalls.h"
+#include "journal.h"
 
 #ifndef SYSCONFDIR
 #define SYSCONFDIR      "/System/Settings"
@@ -59,32 +66,105 @@
 #define FILTER_SYMLINKS(m) S_ISLNK(m)
 
 #define MAX_RECUSIVE_DEPTH	127
+#define MAX_SHARDS			64
+
+/* event sources, see the 'backend' rule option */
+#define BACKEND_INOTIFY    0
+#define BACKEND_POLL       1
+#define BACKEND_REMOTE     2	/* events forwarded by other hosts, see aggregator.h */
+
+/* action priorities, see the 'priority' rule option */
+#define PRIORITY_NORMAL    0
+#define PRIORITY_HIGH      1
+#define PRIORITY_LOW       2
+#define NUM_PRIORITIES     3
+
+/* what becomes of the events of a rule paused through the control socket */
+#define PAUSE_NONE         0
+#define PAUSE_BUFFER       1	/* held until the rule is resumed */
+#define PAUSE_DISCARD      2
+#define PAUSE_MAX_HELD     4096	/* events held per rule, later ones are discarded */
 
 /* we need this mask to detect changes in subdirs */
 #define SYS_MASK IN_MOVED_FROM|IN_MOVED_TO|IN_CREATE|IN_DELETE|IN_DELETE_SELF|IN_MOVE_SELF
 
+/* events that may change the shape of the watched tree */
+#define STRUCTURAL_EVENT(ev) \
+	(((ev)->mask & (IN_DELETE_SELF|IN_MOVE_SELF|IN_IGNORED|IN_Q_OVERFLOW)) || \
+	 (((ev)->mask & IN_ISDIR) && ((ev)->mask & (IN_MOVED_FROM|IN_MOVED_TO|IN_CREATE|IN_DELETE))))
+
 typedef struct watch_entry {
-	char target[PATH_MAX];		/* the pathname being listened */
+	char target[PATH_MAX];		/* the pathname being listened, or a shell pattern if @glob */
 	int mask;					/* CLOSE_WRITE, MOVED_TO, MOVED_FROM or DELETE */
 	char spawn[LINE_MAX];		/* shell command to spawn when triggered */
 	regex_t regex;				/* regular expression used to filter {file,dir} names */
 	char regex_rule[LINE_MAX];	/* the rule in text form */
 	int depth;					/* depth level */
+	int level;					/* depth of @target below the rule target */
+	int priority;				/* executor lane, one of PRIORITY_* */
+	int backend;				/* event source, one of BACKEND_* */
 
-	int wd;						/* @target watch file descriptor */
+	int wd;						/* @target watch file descriptor, negative when polled */
+	dev_t dev;					/* inode of @target once watched, see dirgraph.h */
+	ino_t ino;
 	int lookat;					/* while reading the directory, only look at this kind of entries */
 	int uses_entry_variable;	/* tells if @spawn uses the $ENTRY variable */
+	struct plugin *plugin;		/* in-process action used instead of @spawn, if set */
+	struct builtin *builtin;	/* action implemented by the daemon, used instead of @spawn */
+	char *description;			/* the rule description, shared by all entries of the rule */
+	struct exclude *exclude;	/* subtrees left out of the rule, shared by all entries */
+	int rule_id;				/* 1-based position of the rule in the config file */
+	int glob;					/* rule only: @target is expanded, see expand_pattern() */
+	int scaffold;				/* parent of glob matches, only drives their expansion */
+	int queued;					/* dispatcher only: waiting for a rebuild or an expansion */
+	int content_only;			/* actions only run when the file content changed, see digest.h */
+	struct rule_pause *pause;	/* rule only: set once paused through the control socket */
+	int resync;					/* rule only: crawl requested through the control socket */
+	struct log_capture *output;	/* rule only: tail of the output of the actions, if captured */
+	int ignore_own;				/* rule only: drops the events caused by its actions, see feedback.h */
+	int summarize;				/* rule only: events are summarized per directory under overload, see overload.h */
+	int publish;				/* rule only: events are sent to subscribers, see publisher.h */
+	int forward;				/* rule only: events are sent to an aggregator, see forwarder.h */
+	uint64_t active_ms;			/* dispatcher only: when it last had an event, see balance_watches() */
 
-	struct watch_entry *root;
-	struct watch_entry *next;
+	struct listener_shard *shard;	/* inotify instance holding @wd */
+	struct watch_entry *root;	/* root of the tree; instances of glob rules come and go */
+	struct watch_entry *rule;	/* the config rule, lives as long as the daemon */
 } watch_t;
 
+/* event records are taken from a pool, see handle_events() */
 struct thread_info {
-	struct watch_entry *watch;		/* the struct watch_entry */
-	char *event_msg;                /* event message to be shown in the console */
+	struct watch_entry *rule;		/* the config rule of the event, never freed */
+	uint32_t mask;					/* the inotify event mask */
+	int wd;							/* watch that received the event, 0 when replayed */
+	int status;						/* result of the action, 0 on success */
+	uint32_t cookie;				/* the inotify cookie, 0 if none */
+	uint64_t time;					/* ns since the epoch, when the event was read */
+	struct journal_ref journal;		/* journal record of the event, if journaling */
+	struct thread_info *next;		/* next job queued on the same executor shard */
+	char dir[PATH_MAX];				/* the watched directory that received the event */
 	char offending_name[PATH_MAX];	/* the file/directory entry we're dealing with */
+	char old_entry[PATH_MAX];		/* full path before a rename, empty otherwise */
+	char summary[256];				/* event counts of a directory summary, empty otherwise */
+	char host[HOST_NAME_MAX+1];		/* host that forwarded the event, empty if local */
 };
 
+/* events of a paused rule, see submit_job() */
+struct rule_pause {
+	pthread_mutex_t lock;
+	int policy;						/* PAUSE_* */
+	struct thread_info *head;		/* held events, oldest first */
+	struct thread_info *tail;
+	size_t held;
+	unsigned long discarded;
+};
+
+struct plugin;
+struct builtin;
+struct log_capture;
+struct exclude;
+struct listener_shard;
+
 /* function prototypes */
 watch_t *monitor_directory(int i, watch_t *watch);
 
@@ -0,0 +1,358 @@
+/*
+ * Listener - Listens for specific directories events and take actions
+ * based on rules specified by the user.
+ *
+ * Copyright (c) 2005-2017 Lucas C. Villa Real <lucasvr@gobolinux.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#include "listener.h"
+#include "logger.h"
+#include <stdarg.h>
+#include <syslog.h>
+#include <time.h>
+
+struct record_header {
+	uint64_t usecs;				/* wall clock time of the record */
+	uint32_t len;				/* bytes of text following the header */
+	int32_t level;
+	pid_t tid;
+};
+
+/* records of one thread */
+struct log_buffer {
+	char *data;
+	pid_t tid;
+	struct log_buffer *next;
+	size_t head __attribute__((aligned(64)));	/* owned by the producer */
+	unsigned long long records;
+	unsigned long long dropped;
+	size_t tail __attribute__((aligned(64)));	/* owned by the writer */
+	size_t limit;				/* writer only: head seen at the start of the pass */
+};
+
+int log_level = LOG_LEVEL_NONE;
+
+static struct {
+	FILE *fp;
+	int syslog;
+	int started;
+	int wake_fd;
+	pthread_t tid;
+	pthread_mutex_t lock;		/* registration, and records written before log_start() */
+	pthread_mutex_t drain_lock;
+	struct log_buffer *buffers;
+	unsigned long long sync_records;
+} logger = {
+	.wake_fd = -1,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.drain_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static __thread struct log_buffer *local;
+
+static const char *level_names[] = { "error", "warning", "info", "debug" };
+static const int syslog_priorities[] = { LOG_ERR, LOG_WARNING, LOG_INFO, LOG_DEBUG };
+
+static void
+copy_in(struct log_buffer *b, size_t pos, const void *src, size_t len)
+{
+	size_t offset = pos & (LOG_BUFFER_SIZE - 1), first = LOG_BUFFER_SIZE - offset;
+
+	if (first > len)
+		first = len;
+	memcpy(b->data + offset, src, first);
+	memcpy(b->data, (const char *) src + first, len - first);
+}
+
+static void
+copy_out(struct log_buffer *b, size_t pos, void *dst, size_t len)
+{
+	size_t offset = pos & (LOG_BUFFER_SIZE - 1), first = LOG_BUFFER_SIZE - offset;
+
+	if (first > len)
+		first = len;
+	memcpy(dst, b->data + offset, first);
+	memcpy((char *) dst + first, b->data, len - first);
+}
+
+static uint64_t
+realtime_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+emit(const struct record_header *hdr, const char *text)
+{
+	char stamp[32];
+	time_t secs = hdr->usecs / 1000000;
+	struct tm tm;
+
+	if (logger.syslog) {
+		syslog(syslog_priorities[hdr->level], "%.*s", (int) hdr->len, text);
+		return;
+	}
+	strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime_r(&secs, &tm));
+	fprintf(logger.fp, "%s.%03u %s [%d] %.*s\n", stamp, (unsigned) (hdr->usecs / 1000 % 1000),
+		level_names[hdr->level], hdr->tid, (int) hdr->len, text);
+}
+
+static struct log_buffer *
+register_buffer(void)
+{
+	struct log_buffer *b = (struct log_buffer *) calloc(1, sizeof(struct log_buffer));
+
+	if (! b || ! (b->data = (char *) malloc(LOG_BUFFER_SIZE))) {
+		free(b);
+		return NULL;
+	}
+	b->tid = syscall(SYS_gettid);
+	pthread_mutex_lock(&logger.lock);
+	b->next = logger.buffers;
+	__atomic_store_n(&logger.buffers, b, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&logger.lock);
+	return local = b;
+}
+
+void
+log_write(int level, const char *fmt, ...)
+{
+	char text[LOG_MAX_RECORD];
+	struct record_header hdr;
+	struct log_buffer *b;
+	size_t head, used, size;
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(text, sizeof(text), fmt, ap);
+	va_end(ap);
+	if (n < 0)
+		return;
+	if (n >= (int) sizeof(text))
+		n = sizeof(text) - 1;
+	while (n && text[n-1] == '\n')
+		n--;
+	hdr.usecs = realtime_us();
+	hdr.len = n;
+	hdr.level = level;
+	hdr.tid = local ? local->tid : syscall(SYS_gettid);
+
+	/* single threaded until then */
+	if (! __atomic_load_n(&logger.started, __ATOMIC_ACQUIRE)) {
+		pthread_mutex_lock(&logger.lock);
+		emit(&hdr, text);
+		if (logger.fp)
+			fflush(logger.fp);
+		logger.sync_records++;
+		pthread_mutex_unlock(&logger.lock);
+		return;
+	}
+
+	if (! (b = local) && ! (b = register_buffer()))
+		return;
+	head = b->head;
+	used = head - __atomic_load_n(&b->tail, __ATOMIC_ACQUIRE);
+	size = sizeof(hdr) + n;
+	if (used + size > LOG_BUFFER_SIZE) {
+		b->dropped++;
+		return;
+	}
+	copy_in(b, head, &hdr, sizeof(hdr));
+	copy_in(b, head + sizeof(hdr), text, n);
+	__atomic_store_n(&b->head, head + size, __ATOMIC_RELEASE);
+	b->records++;
+
+	/* don't wait for the next pass once half full */
+	if (used < LOG_BUFFER_SIZE / 2 && used + size >= LOG_BUFFER_SIZE / 2) {
+		uint64_t one = 1;
+		if (write(logger.wake_fd, &one, sizeof(one)) < 0) {}
+	}
+}
+
+/* writes the records found in the buffers, oldest first */
+static void
+drain_buffers(void)
+{
+	struct log_buffer *buffers = __atomic_load_n(&logger.buffers, __ATOMIC_ACQUIRE), *b;
+	char text[LOG_MAX_RECORD];
+
+	pthread_mutex_lock(&logger.drain_lock);
+	for (b=buffers; b; b=b->next)
+		b->limit = __atomic_load_n(&b->head, __ATOMIC_ACQUIRE);
+
+	while (2) {
+		struct record_header hdr, best_hdr;
+		struct log_buffer *best = NULL;
+
+		for (b=buffers; b; b=b->next) {
+			if (b->tail == b->limit)
+				continue;
+			copy_out(b, b->tail, &hdr, sizeof(hdr));
+			if (! best || hdr.usecs < best_hdr.usecs) {
+				best = b;
+				best_hdr = hdr;
+			}
+		}
+		if (! best)
+			break;
+		copy_out(best, best->tail + sizeof(best_hdr), text, best_hdr.len);
+		emit(&best_hdr, text);
+		__atomic_store_n(&best->tail, best->tail + sizeof(best_hdr) + best_hdr.len, __ATOMIC_RELEASE);
+	}
+	if (logger.fp)
+		fflush(logger.fp);
+	pthread_mutex_unlock(&logger.drain_lock);
+}
+
+static void *
+writer_main(void *data)
+{
+	struct pollfd pfd = { .fd = logger.wake_fd, .events = POLLIN };
+	uint64_t count;
+
+	while (2) {
+		if (poll(&pfd, 1, LOG_FLUSH_INTERVAL) > 0 && read(logger.wake_fd, &count, sizeof(count)) < 0) {}
+		drain_buffers();
+	}
+	return NULL;
+}
+
+/* levels by name, -2 if unknown */
+int
+log_parse_level(const char *name)
+{
+	if (! strcasecmp(name, "none"))
+		return LOG_LEVEL_NONE;
+	for (int i=0; i<(int) (sizeof(level_names)/sizeof(level_names[0])); ++i) {
+		if (! strcasecmp(name, level_names[i]))
+			return i;
+	}
+	return -2;
+}
+
+/* logs to @target: "syslog", a file name, or stdout if NULL */
+int
+log_open(const char *target, int level)
+{
+	if (! target) {
+		logger.fp = stdout;
+	} else if (! strcmp(target, "syslog")) {
+		openlog("listener", LOG_PID, LOG_DAEMON);
+		logger.syslog = 1;
+	} else if (! (logger.fp = fopen(target, "ae"))) {
+		perror(target);
+		return -1;
+	}
+	log_level = level;
+	return 0;
+}
+
+/* records are written by a thread of their own from now on */
+int
+log_start(void)
+{
+	if (log_level == LOG_LEVEL_NONE)
+		return 0;
+	logger.wake_fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	if (logger.wake_fd < 0) {
+		perror("eventfd");
+		return -1;
+	}
+	if (pthread_create(&logger.tid, NULL, writer_main, NULL) != 0) {
+		perror("pthread_create");
+		return -1;
+	}
+	__atomic_store_n(&logger.started, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* writes the pending records from the calling thread, before exiting */
+void
+log_flush(void)
+{
+	if (__atomic_load_n(&logger.started, __ATOMIC_ACQUIRE))
+		drain_buffers();
+}
+
+void
+log_get_stats(struct log_stats *stats)
+{
+	struct log_buffer *b;
+
+	stats->records = logger.sync_records;
+	stats->dropped = 0;
+	for (b=__atomic_load_n(&logger.buffers, __ATOMIC_ACQUIRE); b; b=b->next) {
+		stats->records += __atomic_load_n(&b->records, __ATOMIC_RELAXED);
+		stats->dropped += __atomic_load_n(&b->dropped, __ATOMIC_RELAXED);
+	}
+}
+
+struct log_capture *
+log_capture_create(size_t size)
+{
+	struct log_capture *capture = (struct log_capture *) calloc(1, sizeof(struct log_capture));
+
+	if (! capture || ! (capture->data = (char *) malloc(size))) {
+		perror("malloc");
+		free(capture);
+		return NULL;
+	}
+	pthread_mutex_init(&capture->lock, NULL);
+	capture->size = size;
+	return capture;
+}
+
+/* keeps the last bytes of the output, overwriting the oldest ones */
+void
+log_capture_append(struct log_capture *capture, const char *data, size_t len)
+{
+	pthread_mutex_lock(&capture->lock);
+	capture->total += len;
+	if (len > capture->size) {
+		data += len - capture->size;
+		len = capture->size;
+	}
+	while (len) {
+		size_t pos = (capture->start + capture->len) % capture->size;
+		size_t n = capture->size - pos < len ? capture->size - pos : len;
+
+		memcpy(capture->data + pos, data, n);
+		if (capture->len + n > capture->size) {
+			capture->start = (capture->start + capture->len + n - capture->size) % capture->size;
+			capture->len = capture->size;
+		} else {
+			capture->len += n;
+		}
+		data += n;
+		len -= n;
+	}
+	pthread_mutex_unlock(&capture->lock);
+}
+
+void
+log_capture_dump(struct log_capture *capture, FILE *out)
+{
+	size_t first;
+
+	pthread_mutex_lock(&capture->lock);
+	first = capture->size - capture->start < capture->len ? capture->size - capture->start : capture->len;
+	fwrite(capture->data + capture->start, 1, first, out);
+	fwrite(capture->data, 1, capture->len - first, out);
+	pthread_mutex_unlock(&capture->lock);
+}
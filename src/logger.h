@@ -0,0 +1,76 @@
+/*
+ * Listener - Listens for specific directories events and take actions
+ * based on rules specified by the user.
+ *
+ * Copyright (c) 2005-2017 Lucas C. Villa Real <lucasvr@gobolinux.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#ifndef LISTENER_LOGGER_H
+#define LISTENER_LOGGER_H 1
+
+/*
+ * Asynchronous logging. Every thread formats its records into a buffer of
+ * its own, a single-producer single-consumer byte ring, and never waits:
+ * records that don't fit are counted and dropped. A writer thread merges the
+ * buffers by timestamp and writes them to stdout, a file or syslog. Records
+ * above the log level cost a comparison, their arguments aren't evaluated.
+ *
+ * Rules may also keep the tail of the output of their actions in a bounded
+ * buffer, see the 'capture_output' rule option.
+ */
+
+#define LOG_LEVEL_NONE     -1
+#define LOG_LEVEL_ERROR    0
+#define LOG_LEVEL_WARNING  1
+#define LOG_LEVEL_INFO     2
+#define LOG_LEVEL_DEBUG    3
+
+#define LOG_BUFFER_SIZE    (64 << 10)	/* bytes of records per thread, a power of two */
+#define LOG_MAX_RECORD     4096
+#define LOG_FLUSH_INTERVAL 100			/* ms between passes of the writer */
+
+extern int log_level;
+
+#define log_printf(level, fmt, args...) \
+	do { if ((level) <= log_level) log_write(level, fmt, ##args); } while (0)
+
+struct log_stats {
+	unsigned long long records;
+	unsigned long long dropped;		/* records that found their buffer full */
+};
+
+/* tail of the output of the actions of a rule */
+struct log_capture {
+	pthread_mutex_t lock;
+	char *data;
+	size_t size;
+	size_t start;
+	size_t len;
+	unsigned long long total;		/* bytes captured so far */
+};
+
+int  log_open(const char *target, int level);
+int  log_start(void);
+int  log_parse_level(const char *name);
+void log_write(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void log_flush(void);
+void log_get_stats(struct log_stats *stats);
+
+struct log_capture *log_capture_create(size_t size);
+void log_capture_append(struct log_capture *capture, const char *data, size_t len);
+void log_capture_dump(struct log_capture *capture, FILE *out);
+
+#endif /* LISTENER_LOGGER_H */
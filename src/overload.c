@@ -0,0 +1,218 @@
+/*
+ * Listener - Listens for specific directories events and take actions
+ * based on rules specified by the user.
+ *
+ * Copyright (c) 2005-2017 Lucas C. Villa Real <lucasvr@gobolinux.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#include "listener.h"
+#include "overload.h"
+#include <openssl/lhash.h>
+
+/* the events of a directory since its last summary */
+struct summary {
+	watch_t *rule;
+	char *dir;
+	uint32_t mask;
+	unsigned long events;
+	unsigned long counts[32];	/* per mask bit */
+	struct summary *next;		/* in order of arrival */
+};
+
+struct overload_table {
+	_LHASH *dirs;				/* (rule, dir) -> struct summary */
+	struct summary *head;
+	struct summary *tail;
+	size_t count;
+};
+
+static const struct {
+	uint32_t mask;
+	const char *name;
+} mask_names[] = {
+	{ IN_ACCESS, "ACCESS" },
+	{ IN_MODIFY, "MODIFY" },
+	{ IN_ATTRIB, "ATTRIB" },
+	{ IN_CLOSE_WRITE, "CLOSE_WRITE" },
+	{ IN_CLOSE_NOWRITE, "CLOSE_NOWRITE" },
+	{ IN_OPEN, "OPEN" },
+	{ IN_MOVED_FROM, "MOVED_FROM" },
+	{ IN_MOVED_TO, "MOVED_TO" },
+	{ IN_CREATE, "CREATE" },
+	{ IN_DELETE, "DELETE" },
+	{ IN_DELETE_SELF, "DELETE_SELF" },
+	{ IN_MOVE_SELF, "MOVE_SELF" },
+	{ 0, NULL }
+};
+
+static unsigned long
+summary_hash(const void *data)
+{
+	const struct summary *s = (const struct summary *) data;
+	return lh_strhash(s->dir) ^ (unsigned long) s->rule->rule_id;
+}
+
+static int
+summary_compare(const void *a, const void *b)
+{
+	const struct summary *x = (const struct summary *) a;
+	const struct summary *y = (const struct summary *) b;
+	return x->rule != y->rule ? x->rule->rule_id - y->rule->rule_id : strcmp(x->dir, y->dir);
+}
+
+static int
+enter(struct overload *o, size_t load, uint64_t now)
+{
+	o->active = 1;
+	o->since = now;
+	o->calm_since = 0;
+	o->next_flush = now + OVERLOAD_INTERVAL;
+	o->peak = load;
+	o->entered++;
+	return OVERLOAD_ENTERED;
+}
+
+/*
+ * Measures the load of the shard every OVERLOAD_CHECK ms. Returns
+ * OVERLOAD_ENTERED or OVERLOAD_LEFT when the mode changes, 0 otherwise.
+ */
+int
+overload_update(struct overload *o, size_t load, uint64_t now)
+{
+	if (now < o->next_check)
+		return 0;
+	o->next_check = now + OVERLOAD_CHECK;
+
+	if (! o->active) {
+		if (load < OVERLOAD_ENTER_EVENTS)
+			return 0;
+		return enter(o, load, now);
+	}
+
+	if (load > o->peak)
+		o->peak = load;
+	if (load > OVERLOAD_LEAVE_EVENTS) {
+		o->calm_since = 0;
+		return 0;
+	}
+	if (! o->calm_since)
+		o->calm_since = now;
+	if (now - o->calm_since < OVERLOAD_COOLDOWN)
+		return 0;
+	o->active = 0;
+	o->since = now;
+	o->left++;
+	return OVERLOAD_LEFT;
+}
+
+/*
+ * Enters the overload mode whatever the load, for when events were lost and
+ * a flood is on its way. An active one starts its cooldown over.
+ */
+int
+overload_force(struct overload *o, uint64_t now)
+{
+	if (o->active) {
+		o->calm_since = 0;
+		return 0;
+	}
+	return enter(o, 0, now);
+}
+
+/* counts an event of @rule in @dir; fails if it must be dispatched on its own */
+int
+overload_add(struct overload *o, watch_t *rule, const char *dir, uint32_t mask)
+{
+	struct overload_table *t = o->table;
+	struct summary key, *s;
+
+	if (! t) {
+		if (! (t = (struct overload_table *) calloc(1, sizeof(struct overload_table))))
+			return -1;
+		if (! (t->dirs = lh_new(summary_hash, summary_compare))) {
+			free(t);
+			return -1;
+		}
+		o->table = t;
+	}
+
+	key.rule = rule;
+	key.dir = (char *) dir;
+	s = (struct summary *) lh_retrieve(t->dirs, &key);
+	if (! s) {
+		if (t->count == OVERLOAD_MAX_DIRS)
+			return -1;
+		s = (struct summary *) calloc(1, sizeof(struct summary));
+		if (! s || ! (s->dir = strdup(dir))) {
+			free(s);
+			return -1;
+		}
+		s->rule = rule;
+		lh_insert(t->dirs, s);
+		if (t->tail)
+			t->tail->next = s;
+		else
+			t->head = s;
+		t->tail = s;
+		t->count++;
+	}
+
+	s->mask |= mask;
+	s->events++;
+	for (int bit=0; bit<32; ++bit) {
+		if (mask & (1U << bit))
+			s->counts[bit]++;
+	}
+	o->summarized++;
+	return 0;
+}
+
+/* emits and forgets the summaries of all directories, oldest first */
+void
+overload_flush(struct overload *o, overload_emit_fn emit, void *data)
+{
+	struct overload_table *t = o->table;
+	struct summary *s, *next;
+
+	if (! t)
+		return;
+	for (s=t->head; s; s=next) {
+		char counts[256] = "";
+		size_t len = 0;
+
+		for (int i=0; mask_names[i].name; ++i) {
+			int bit = __builtin_ctz(mask_names[i].mask);
+			if (s->counts[bit] && len < sizeof(counts))
+				len += snprintf(counts + len, sizeof(counts) - len, "%s%s=%lu",
+					len ? "," : "", mask_names[i].name, s->counts[bit]);
+		}
+		emit(s->rule, s->dir, s->mask, counts, s->events, data);
+		o->summaries++;
+
+		next = s->next;
+		lh_delete(t->dirs, s);
+		free(s->dir);
+		free(s);
+	}
+	t->head = t->tail = NULL;
+	t->count = 0;
+}
+
+size_t
+overload_dirs(struct overload *o)
+{
+	return o->table ? o->table->count : 0;
+}
@@ -0,0 +1,70 @@
+/*
+ * Listener - Listens for specific directories events and take actions
+ * based on rules specified by the user.
+ *
+ * Copyright (c) 2005-2017 Lucas C. Villa Real <lucasvr@gobolinux.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#ifndef LISTENER_OVERLOAD_H
+#define LISTENER_OVERLOAD_H 1
+
+/*
+ * Overload mode of a shard. When the events queued in its rings and in the
+ * inotify queue, or the actions waiting for a worker, go past
+ * OVERLOAD_ENTER_EVENTS, rules using 'summarize_on_overload' stop getting one
+ * action per event. Their events are counted per directory instead, and each
+ * directory gets a single action every OVERLOAD_INTERVAL ms. The shard goes
+ * back to per-event dispatch once the load stays below OVERLOAD_LEAVE_EVENTS
+ * for OVERLOAD_COOLDOWN ms. Dispatcher only, no locking.
+ */
+
+#define OVERLOAD_ENTER_EVENTS  4096
+#define OVERLOAD_LEAVE_EVENTS  256
+#define OVERLOAD_COOLDOWN      2000	/* ms */
+#define OVERLOAD_INTERVAL      1000	/* ms between the summaries of a directory */
+#define OVERLOAD_CHECK         50	/* ms between load measures */
+#define OVERLOAD_MAX_DIRS      65536	/* directories summarized at once */
+
+#define OVERLOAD_ENTERED  1
+#define OVERLOAD_LEFT    -1
+
+struct overload_table;
+
+struct overload {
+	int active;
+	uint64_t since;				/* start of the current mode */
+	uint64_t calm_since;		/* overloaded: load below the leave mark since, 0 if not */
+	uint64_t next_check;
+	uint64_t next_flush;
+	size_t peak;				/* highest load of the current overload */
+	struct overload_table *table;
+	unsigned long entered;
+	unsigned long left;
+	unsigned long long summarized;	/* events folded into summaries */
+	unsigned long long summaries;	/* actions run for summaries */
+};
+
+/* called for each summarized directory, @counts reads like "CREATE=12,MODIFY=3" */
+typedef void (*overload_emit_fn)(watch_t *rule, const char *dir, uint32_t mask,
+	const char *counts, unsigned long events, void *data);
+
+int    overload_update(struct overload *o, size_t load, uint64_t now);
+int    overload_force(struct overload *o, uint64_t now);
+int    overload_add(struct overload *o, watch_t *rule, const char *dir, uint32_t mask);
+void   overload_flush(struct overload *o, overload_emit_fn emit, void *data);
+size_t overload_dirs(struct overload *o);
+
+#endif /* LISTENER_OVERLOAD_H */
@@ -0,0 +1,158 @@
+/*
+ * Listener - Listens for specific directories events and take actions
+ * based on rules specified by the user.
+ *
+ * Copyright (c) 2005-2017 Lucas C. Villa Real <lucasvr@gobolinux.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#include <dlfcn.h>
+#include "listener.h"
+#include "plugin.h"
+#include "logger.h"
+
+static struct plugin *plugin_list;
+
+static void *
+plugin_symbol(struct plugin *plugin, const char *symbol, const char *suffix)
+{
+	char name[LINE_MAX];
+	snprintf(name, sizeof(name), "%s%s", symbol, suffix);
+	return dlsym(plugin->handle, name);
+}
+
+struct plugin *
+plugin_load(const char *spec)
+{
+	struct plugin *plugin;
+	const int *abi;
+	char *symbol;
+
+	plugin = (struct plugin *) calloc(1, sizeof(struct plugin));
+	if (! plugin) {
+		perror("calloc");
+		return NULL;
+	}
+	snprintf(plugin->spec, sizeof(plugin->spec), "%s", spec);
+
+	symbol = strrchr(plugin->spec, ':');
+	if (! symbol || symbol == plugin->spec || ! symbol[1]) {
+		fprintf(stderr, "%s: expected /path/to/plugin.so:symbol\n", spec);
+		free(plugin);
+		return NULL;
+	}
+	*symbol++ = '\0';
+
+	plugin->handle = dlopen(plugin->spec, RTLD_NOW | RTLD_LOCAL);
+	if (! plugin->handle) {
+		fprintf(stderr, "%s\n", dlerror());
+		free(plugin);
+		return NULL;
+	}
+
+	/* struct listener_event is laid out as the plugin expects, see listener-plugin.h */
+	abi = (const int *) dlsym(plugin->handle, LISTENER_PLUGIN_ABI_SYMBOL);
+	if (! abi || *abi != LISTENER_PLUGIN_ABI_VERSION) {
+		if (abi)
+			fprintf(stderr, "%s: built for plugin ABI %d, this daemon has ABI %d\n", plugin->spec, *abi, LISTENER_PLUGIN_ABI_VERSION);
+		else
+			fprintf(stderr, "%s: no LISTENER_PLUGIN_ABI, rebuild it against listener-plugin.h\n", plugin->spec);
+		dlclose(plugin->handle);
+		free(plugin);
+		return NULL;
+	}
+
+	plugin->handler = (listener_handler_fn) plugin_symbol(plugin, symbol, "");
+	if (! plugin->handler) {
+		fprintf(stderr, "%s: symbol %s not found\n", plugin->spec, symbol);
+		dlclose(plugin->handle);
+		free(plugin);
+		return NULL;
+	}
+	plugin->init = (listener_init_fn) plugin_symbol(plugin, symbol, "_init");
+	plugin->fini = (listener_fini_fn) plugin_symbol(plugin, symbol, "_fini");
+	plugin->batch = (listener_batch_fn) plugin_symbol(plugin, symbol, "_batch");
+
+	/* restore the spec so that it can be shown in messages */
+	symbol[-1] = ':';
+
+	plugin->next = plugin_list;
+	plugin_list = plugin;
+	return plugin;
+}
+
+/* runs in the daemon process, once the configuration has been read */
+int
+plugin_init_all(void)
+{
+	for (struct plugin *plugin=plugin_list; plugin != NULL; plugin=plugin->next) {
+		if (plugin->init && plugin->init(plugin->rule, &plugin->data) != 0) {
+			fprintf(stderr, "%s: init hook failed\n", plugin->spec);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void
+plugin_fini_all(void)
+{
+	for (struct plugin *plugin=plugin_list; plugin != NULL; plugin=plugin->next) {
+		if (plugin->fini)
+			plugin->fini(plugin->data);
+	}
+}
+
+static void
+plugin_fill_event(struct listener_event *ev, struct thread_info *info)
+{
+	watch_t *rule = info->rule;
+
+	ev->rule_id = rule->rule_id;
+	ev->rule = rule->plugin->rule;
+	ev->mask = info->mask;
+	ev->root = rule->target;
+	ev->dir = info->dir;
+	ev->entry = info->offending_name;
+	ev->old_entry = info->old_entry[0] ? info->old_entry : NULL;
+	ev->summary = info->summary[0] ? info->summary : NULL;
+}
+
+/* @list holds one or more jobs of the same rule, linked through their next member */
+void
+plugin_dispatch(struct thread_info *list)
+{
+	struct plugin *plugin = list->rule->plugin;
+	struct listener_event ev[PLUGIN_MAX_BATCH];
+	size_t count = 0;
+
+	if (plugin->batch) {
+		for (struct thread_info *info=list; info != NULL; info=info->next)
+			plugin_fill_event(&ev[count++], info);
+		int status = plugin->batch(ev, count, plugin->data);
+		if (status != 0)
+			log_printf(LOG_LEVEL_ERROR, "%s: batch handler failed on %zu events", plugin->spec, count);
+		for (struct thread_info *info=list; info != NULL; info=info->next)
+			info->status = status;
+		return;
+	}
+
+	for (struct thread_info *info=list; info != NULL; info=info->next) {
+		plugin_fill_event(&ev[0], info);
+		info->status = plugin->handler(&ev[0], plugin->data);
+		if (info->status != 0)
+			log_printf(LOG_LEVEL_ERROR, "%s: handler failed on %s/%s", plugin->spec, ev[0].dir, ev[0].entry);
+	}
+}
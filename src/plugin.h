@@ -0,0 +1,45 @@
+/*
+ * Listener - Listens for specific directories events and take actions
+ * based on rules specified by the user.
+ *
+ * Copyright (c) 2005-2017 Lucas C. Villa Real <lucasvr@gobolinux.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#ifndef LISTENER_PLUGIN_H
+#define LISTENER_PLUGIN_H 1
+
+#include "listener-plugin.h"
+
+#define PLUGIN_MAX_BATCH 64
+
+struct plugin {
+	char spec[LINE_MAX];		/* "/path/to/file.so:symbol", as given in the config */
+	void *handle;				/* dlopen() handle */
+	const char *rule;			/* rule name passed to the init hook */
+	void *data;					/* private data returned by the init hook */
+	listener_init_fn init;
+	listener_fini_fn fini;
+	listener_handler_fn handler;
+	listener_batch_fn batch;
+	struct plugin *next;
+};
+
+struct plugin *plugin_load(const char *spec);
+int            plugin_init_all(void);
+void           plugin_fini_all(void);
+void           plugin_dispatch(struct thread_info *list);
+
+#endif /* LISTENER_PLUGIN_H */
@@ -0,0 +1,677 @@
+/*
+ * Listener - Listens for specific directories events and take actions
+ * based on rules specified by the user.
+ *
+ * Copyright (c) 2005-2017 Lucas C. Villa Real <lucasvr@gobolinux.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#include "listener.h"
+#include "poller.h"
+
+#define CONTENT_MASK (IN_MODIFY|IN_CLOSE_WRITE|IN_ATTRIB)
+
+#define POLL_TICK          100		/* ms */
+#define POLL_COOKIE_BASE   0x80000000	/* keeps our cookies apart from the kernel ones */
+#define POLL_WD_QUARANTINE 1024			/* see release_wd() */
+
+struct linux_dirent64 {
+	ino64_t d_ino;
+	off64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+struct poll_entry {
+	char *name;
+	ino_t ino;
+	mode_t type;
+	struct timespec mtime;
+	off_t size;
+};
+
+struct poll_dir {
+	int wd;
+	char *path;
+	uint32_t mask;
+	int flags;
+	void *owner;
+	struct timespec mtime;			/* of the directory itself, at the last scan */
+	struct poll_entry *entries;		/* sorted by name */
+	size_t count;
+	struct poll_entry *partial;		/* read so far by a scan cut short, see read_entries() */
+	size_t npartial;
+	size_t partial_size;
+	off64_t resume;					/* directory offset the scan goes on from, 0 if none */
+	unsigned int interval;			/* ms, see adjust_interval() */
+	uint64_t next_scan;
+	int busy;						/* being scanned without the lock held */
+	int removed;					/* freed by the poller thread on its next tick */
+	char *moved_to;					/* poller_move() was called while busy */
+	int gone;						/* the directory no longer exists */
+	struct poll_dir *next;
+};
+
+static pthread_mutex_t poller_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct poll_dir *poll_dirs;
+static struct poll_dir **wd_dirs;	/* indexed by -2 - wd, NULL once removed */
+static size_t wd_size;
+static int next_wd = -2;			/* -1 is the wd of IN_Q_OVERFLOW events */
+static int *free_wds;				/* of freed directories, oldest first, see poller_add() */
+static size_t free_head, nfree;
+static struct poller_stats stats;
+static struct poller_stats scanned;	/* poller thread only, added to @stats under the lock */
+static const struct poller_ops *poller_ops;
+static int probe_fd = -1;
+static pthread_t poller_thread;
+static unsigned int io_per_tick;	/* directory listings plus stats allowed per tick */
+static uint32_t next_cookie;
+
+static uint64_t
+now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int
+compare_entries(const void *aa, const void *bb)
+{
+	const struct poll_entry *a = (const struct poll_entry *) aa;
+	const struct poll_entry *b = (const struct poll_entry *) bb;
+	return strcmp(a->name, b->name);
+}
+
+static void
+free_entries(struct poll_entry *entries, size_t count)
+{
+	for (size_t i=0; i<count; ++i)
+		free(entries[i].name);
+	free(entries);
+}
+
+/* forgets the listing of a scan cut short by the I/O budget */
+static void
+drop_partial(struct poll_dir *dir)
+{
+	free_entries(dir->partial, dir->npartial);
+	dir->partial = NULL;
+	dir->npartial = 0;
+	dir->partial_size = 0;
+	dir->resume = 0;
+}
+
+/*
+ * Reads the entries of @dir with getdents64, which fetches many entries per
+ * round trip on network file systems. File attributes are only looked at if
+ * the rule wants content events. At most @budget I/O operations are spent:
+ * once they are, the listing is kept in @dir along with the offset to resume
+ * from, and @done is left unset. Otherwise the sorted listing is moved to
+ * @out and @count. Returns the number of I/O operations, or -1.
+ */
+static int
+read_entries(struct poll_dir *dir, unsigned int budget, struct poll_entry **out, size_t *count, int *done)
+{
+	char buf[32768] __attribute__((aligned(8)));
+	unsigned int ops = 0, progress = 0;
+	off64_t pos = dir->resume;
+	int fd;
+	long nread;
+
+	*done = 0;
+	fd = open(dir->path, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (fd < 0) {
+		drop_partial(dir);
+		return -1;
+	}
+	if (pos && lseek(fd, pos, SEEK_SET) < 0) {
+		close(fd);
+		drop_partial(dir);
+		return -1;
+	}
+	while ((nread = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0) {
+		ops++;
+		for (long off=0; off<nread; ) {
+			struct linux_dirent64 *de = (struct linux_dirent64 *) &buf[off];
+			struct poll_entry *entry;
+			struct stat st;
+
+			/* the entries read so far are kept, the next tick goes on from @pos */
+			if (ops >= budget && progress) {
+				dir->resume = pos;
+				close(fd);
+				return ops;
+			}
+			off += de->d_reclen;
+			pos = de->d_off;
+			progress++;
+			if (! strcmp(de->d_name, ".") || ! strcmp(de->d_name, ".."))
+				continue;
+			if (dir->npartial == dir->partial_size) {
+				size_t size = dir->partial_size ? dir->partial_size * 2 : 32;
+				entry = (struct poll_entry *) realloc(dir->partial, size * sizeof(struct poll_entry));
+				if (! entry) {
+					perror("realloc");
+					goto out;
+				}
+				dir->partial = entry;
+				dir->partial_size = size;
+			}
+			entry = &dir->partial[dir->npartial];
+			memset(entry, 0, sizeof(*entry));
+			entry->ino = de->d_ino;
+			entry->type = de->d_type == DT_DIR ? S_IFDIR : de->d_type == DT_LNK ? S_IFLNK : S_IFREG;
+			if ((dir->mask & CONTENT_MASK) || de->d_type == DT_UNKNOWN) {
+				ops++;
+				if (fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+					continue;
+				entry->type = st.st_mode & S_IFMT;
+				entry->mtime = st.st_mtim;
+				entry->size = st.st_size;
+			}
+			/* an entry without a name can't be sorted nor reported */
+			entry->name = strdup(de->d_name);
+			if (! entry->name) {
+				perror("strdup");
+				continue;
+			}
+			dir->npartial++;
+		}
+	}
+out:
+	close(fd);
+
+	qsort(dir->partial, dir->npartial, sizeof(struct poll_entry), compare_entries);
+	/* a name renamed between two parts of a scan may have been seen twice */
+	if (dir->npartial) {
+		size_t k = 1;
+		for (size_t i=1; i<dir->npartial; ++i) {
+			if (strcmp(dir->partial[i].name, dir->partial[k-1].name)) {
+				dir->partial[k++] = dir->partial[i];
+				continue;
+			}
+			free(dir->partial[k-1].name);
+			dir->partial[k-1] = dir->partial[i];
+		}
+		dir->npartial = k;
+	}
+	*out = dir->partial;
+	*count = dir->npartial;
+	*done = 1;
+	dir->partial = NULL;
+	dir->npartial = 0;
+	dir->partial_size = 0;
+	dir->resume = 0;
+	return ops;
+}
+
+static void
+emit(struct poll_dir *dir, uint32_t mask, uint32_t cookie, const struct poll_entry *entry)
+{
+	if (S_ISDIR(entry->type))
+		mask |= IN_ISDIR;
+	poller_ops->emit(dir->owner, dir->wd, mask, cookie, entry->name);
+	scanned.events++;
+}
+
+/*
+ * Reports the differences between two sorted listings and returns the number
+ * of changes. An inode that disappears under a name and shows up under
+ * another one is reported as a MOVED_FROM/MOVED_TO pair sharing a cookie.
+ */
+static int
+diff_entries(struct poll_dir *dir, struct poll_entry *old, size_t nold, struct poll_entry *cur, size_t ncur)
+{
+	struct poll_entry **gone, **born;
+	size_t i = 0, j = 0, ngone = 0, nborn = 0;
+	int changes = 0;
+
+	gone = (struct poll_entry **) malloc((nold + 1) * sizeof(struct poll_entry *));
+	born = (struct poll_entry **) malloc((ncur + 1) * sizeof(struct poll_entry *));
+	if (! gone || ! born) {
+		perror("malloc");
+		free(gone);
+		free(born);
+		return 0;
+	}
+
+	while (i < nold || j < ncur) {
+		int cmp = i == nold ? 1 : j == ncur ? -1 : strcmp(old[i].name, cur[j].name);
+
+		if (cmp < 0) {
+			gone[ngone++] = &old[i++];
+		} else if (cmp > 0) {
+			born[nborn++] = &cur[j++];
+		} else {
+			if (old[i].ino != cur[j].ino || (old[i].type != cur[j].type)) {
+				gone[ngone++] = &old[i];
+				born[nborn++] = &cur[j];
+			} else if ((dir->mask & CONTENT_MASK) && S_ISREG(cur[j].type) &&
+				(old[i].size != cur[j].size ||
+				 old[i].mtime.tv_sec != cur[j].mtime.tv_sec ||
+				 old[i].mtime.tv_nsec != cur[j].mtime.tv_nsec)) {
+				emit(dir, IN_MODIFY|IN_CLOSE_WRITE, 0, &cur[j]);
+				changes++;
+			}
+			i++;
+			j++;
+		}
+	}
+
+	for (i=0; i<ngone; ++i) {
+		for (j=0; j<nborn; ++j) {
+			if (born[j] && born[j]->ino == gone[i]->ino && born[j]->type == gone[i]->type) {
+				uint32_t cookie = POLL_COOKIE_BASE | (next_cookie++ & ~POLL_COOKIE_BASE);
+				emit(dir, IN_MOVED_FROM, cookie, gone[i]);
+				emit(dir, IN_MOVED_TO, cookie, born[j]);
+				gone[i] = born[j] = NULL;
+				changes++;
+				break;
+			}
+		}
+	}
+	for (i=0; i<ngone; ++i) {
+		if (gone[i]) {
+			emit(dir, IN_DELETE, 0, gone[i]);
+			changes++;
+		}
+	}
+	for (j=0; j<nborn; ++j) {
+		if (born[j]) {
+			emit(dir, IN_CREATE, 0, born[j]);
+			changes++;
+		}
+	}
+	free(gone);
+	free(born);
+	return changes;
+}
+
+/* directories that change are scanned often, idle ones back off */
+static void
+adjust_interval(struct poll_dir *dir, int changes)
+{
+	if (changes)
+		dir->interval = POLL_MIN_INTERVAL;
+	else if (dir->interval < POLL_MAX_INTERVAL)
+		dir->interval = dir->interval * 2 > POLL_MAX_INTERVAL ? POLL_MAX_INTERVAL : dir->interval * 2;
+	dir->next_scan = now_ms() + dir->interval;
+}
+
+/*
+ * Called without poller_lock held; @dir is protected by its busy flag.
+ * Spends about @budget I/O operations, a directory whose listing takes more
+ * is left due and its scan goes on at the next tick. Returns the number of
+ * I/O operations spent.
+ */
+static int
+scan_dir(struct poll_dir *dir, unsigned int budget)
+{
+	struct poll_entry *entries;
+	struct stat st;
+	size_t count;
+	int changes = 0, ops, done;
+
+	if (! dir->resume)
+		scanned.scans++;
+	if (stat(dir->path, &st) < 0 || ! S_ISDIR(st.st_mode)) {
+		poller_ops->emit(dir->owner, dir->wd, IN_DELETE_SELF, 0, NULL);
+		scanned.events++;
+		dir->gone = 1;
+		drop_partial(dir);
+		return 1;
+	}
+
+	/* without content events, an unchanged directory mtime means nothing happened */
+	if (! (dir->mask & CONTENT_MASK) && ! dir->resume &&
+		st.st_mtim.tv_sec == dir->mtime.tv_sec && st.st_mtim.tv_nsec == dir->mtime.tv_nsec) {
+		adjust_interval(dir, 0);
+		return 1;
+	}
+	dir->mtime = st.st_mtim;
+
+	ops = read_entries(dir, budget > 1 ? budget - 1 : 1, &entries, &count, &done);
+	if (ops >= 0 && ! done) {
+		scanned.deferred++;
+		return 1 + ops;
+	}
+	if (ops >= 0) {
+		changes = diff_entries(dir, dir->entries, dir->count, entries, count);
+		free_entries(dir->entries, dir->count);
+		dir->entries = entries;
+		dir->count = count;
+	}
+	adjust_interval(dir, changes);
+	return 1 + (ops > 0 ? ops : 0);
+}
+
+/* the most overdue directories are scanned first */
+static int
+compare_due(const void *aa, const void *bb)
+{
+	const struct poll_dir *a = *(const struct poll_dir **) aa;
+	const struct poll_dir *b = *(const struct poll_dir **) bb;
+	return a->next_scan < b->next_scan ? -1 : a->next_scan > b->next_scan;
+}
+
+static void
+free_dir(struct poll_dir *dir)
+{
+	free_entries(dir->entries, dir->count);
+	free_entries(dir->partial, dir->npartial);
+	free(dir->moved_to);
+	free(dir->path);
+	free(dir);
+}
+
+/* doubles the wd index and the queue of free wds, with the poller lock held */
+static int
+grow_wds(void)
+{
+	size_t size = wd_size ? wd_size * 2 : 1024;
+	struct poll_dir **dirs = (struct poll_dir **) realloc(wd_dirs, size * sizeof(struct poll_dir *));
+	int *wds = (int *) malloc(size * sizeof(int));
+
+	if (dirs)
+		wd_dirs = dirs;
+	if (! dirs || ! wds) {
+		perror("realloc");
+		free(wds);
+		return -1;
+	}
+	for (size_t i=0; i<nfree; ++i)
+		wds[i] = free_wds[(free_head + i) % wd_size];
+	free(free_wds);
+	free_wds = wds;
+	free_head = 0;
+	wd_size = size;
+	return 0;
+}
+
+/*
+ * The wd of a freed directory is handed out again once POLL_WD_QUARANTINE
+ * others were freed after it, so that the events still queued for it don't
+ * reach a directory added meanwhile. Called with the poller lock held.
+ */
+static void
+release_wd(int wd)
+{
+	free_wds[(free_head + nfree) % wd_size] = wd;
+	nfree++;
+}
+
+/* tells the owners of evicted directories when the kernel accepts new watches again */
+static void
+probe_watches(void)
+{
+	void *owners[MAX_SHARDS];
+	int nowners = 0, wd = -1;
+
+	pthread_mutex_lock(&poller_lock);
+	for (struct poll_dir *dir=poll_dirs; dir; dir=dir->next) {
+		if (! (dir->flags & POLL_EVICTED) || dir->gone || dir->removed)
+			continue;
+		if (wd < 0) {
+			wd = inotify_add_watch(probe_fd, dir->path, IN_CREATE);
+			if (wd < 0)
+				break;
+			inotify_rm_watch(probe_fd, wd);
+		}
+		int known = 0;
+		for (int i=0; i<nowners; ++i)
+			known |= owners[i] == dir->owner;
+		if (! known && nowners < MAX_SHARDS)
+			owners[nowners++] = dir->owner;
+	}
+	stats.promotions += nowners;
+	pthread_mutex_unlock(&poller_lock);
+
+	for (int i=0; i<nowners; ++i)
+		poller_ops->promote(owners[i]);
+}
+
+void *
+poller_main(void *data)
+{
+	struct timespec tick = { 0, POLL_TICK * 1000000 };
+	uint64_t next_probe = now_ms() + POLL_PROBE_INTERVAL;
+
+	struct poll_dir **due = NULL;
+	size_t size = 0;
+
+	while (2) {
+		struct poll_dir **ptr;
+		uint64_t now = now_ms();
+		size_t ndue = 0, evicted;
+
+		/*
+		 * Due directories are scanned without the lock, so that slow file
+		 * systems don't block writers. Busy directories are never freed.
+		 */
+		pthread_mutex_lock(&poller_lock);
+		for (struct poll_dir *dir=poll_dirs; dir; dir=dir->next) {
+			if (dir->gone || dir->removed || dir->next_scan > now)
+				continue;
+			if (ndue == size) {
+				size_t n = size ? size * 2 : 64;
+				ptr = (struct poll_dir **) realloc(due, n * sizeof(struct poll_dir *));
+				if (! ptr)
+					break;
+				due = ptr;
+				size = n;
+			}
+			dir->busy = 1;
+			due[ndue++] = dir;
+		}
+		pthread_mutex_unlock(&poller_lock);
+
+		/*
+		 * Scans are bounded by the I/O budget of the tick. Directories left
+		 * over stay due and go first on the next tick, so a burst of work is
+		 * spread over time instead of stalling the file server.
+		 */
+		qsort(due, ndue, sizeof(struct poll_dir *), compare_due);
+		for (size_t i=0, spent=0; i<ndue; ++i) {
+			if (spent >= io_per_tick) {
+				scanned.deferred += ndue - i;
+				break;
+			}
+			spent += scan_dir(due[i], io_per_tick - spent);
+		}
+
+		pthread_mutex_lock(&poller_lock);
+		for (ptr=&poll_dirs; *ptr; ) {
+			struct poll_dir *dir = *ptr;
+			dir->busy = 0;
+			if (dir->removed) {
+				*ptr = dir->next;
+				release_wd(dir->wd);
+				free_dir(dir);
+				continue;
+			}
+			if (dir->moved_to) {
+				free(dir->path);
+				dir->path = dir->moved_to;
+				dir->moved_to = NULL;
+				dir->gone = 0;
+				dir->next_scan = 0;
+				drop_partial(dir);
+			}
+			ptr = &dir->next;
+		}
+		stats.scans += scanned.scans;
+		stats.events += scanned.events;
+		stats.deferred += scanned.deferred;
+		evicted = stats.evicted;
+		pthread_mutex_unlock(&poller_lock);
+		memset(&scanned, 0, sizeof(scanned));
+
+		if (evicted && now >= next_probe) {
+			probe_watches();
+			next_probe = now + POLL_PROBE_INTERVAL;
+		}
+		nanosleep(&tick, NULL);
+	}
+	return NULL;
+}
+
+/* @budget is the number of directory reads and stats allowed per second */
+int
+poller_start(const struct poller_ops *ops, unsigned int budget)
+{
+	poller_ops = ops;
+	io_per_tick = budget * POLL_TICK / 1000;
+	if (io_per_tick == 0)
+		io_per_tick = 1;
+	probe_fd = inotify_init();
+	if (probe_fd < 0) {
+		perror("inotify_init");
+		return -1;
+	}
+	if (pthread_create(&poller_thread, NULL, poller_main, NULL) != 0) {
+		perror("pthread_create");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Starts polling @path on behalf of @owner, which receives its events through
+ * the emit hook. The current contents are taken as the baseline, so nothing
+ * is reported for them. On success, stores the pseudo watch descriptor in @wd.
+ */
+int
+poller_add(const char *path, uint32_t mask, int flags, void *owner, int *wd)
+{
+	struct poll_dir *dir = (struct poll_dir *) calloc(1, sizeof(struct poll_dir));
+	struct stat st;
+	int done;
+
+	if (! dir) {
+		perror("calloc");
+		return -1;
+	}
+	if (stat(path, &st) < 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		free(dir);
+		return -1;
+	}
+	dir->path = strdup(path);
+	if (! dir->path) {
+		perror("strdup");
+		free(dir);
+		return -1;
+	}
+	dir->mask = mask;
+	dir->flags = flags;
+	dir->owner = owner;
+	dir->mtime = st.st_mtim;
+	dir->interval = POLL_MIN_INTERVAL;
+	/* directories added together don't come due together */
+	dir->next_scan = now_ms() + dir->interval + (uint64_t) random() % POLL_MIN_INTERVAL;
+	if (read_entries(dir, UINT_MAX, &dir->entries, &dir->count, &done) < 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		free_dir(dir);
+		return -1;
+	}
+
+	pthread_mutex_lock(&poller_lock);
+	if (nfree > POLL_WD_QUARANTINE) {
+		dir->wd = free_wds[free_head];
+		free_head = (free_head + 1) % wd_size;
+		nfree--;
+	} else {
+		if ((size_t) (-2 - next_wd) == wd_size && grow_wds() < 0) {
+			pthread_mutex_unlock(&poller_lock);
+			free_dir(dir);
+			return -1;
+		}
+		dir->wd = next_wd--;
+	}
+	wd_dirs[-2 - dir->wd] = dir;
+	dir->next = poll_dirs;
+	poll_dirs = dir;
+	stats.dirs++;
+	if (flags & POLL_EVICTED)
+		stats.evicted++;
+	pthread_mutex_unlock(&poller_lock);
+
+	*wd = dir->wd;
+	return 0;
+}
+
+/* must be called with the poller lock held */
+static struct poll_dir *
+lookup_wd(int wd)
+{
+	if (wd > -2 || (size_t) (-2 - wd) >= wd_size)
+		return NULL;
+	return wd_dirs[-2 - wd];
+}
+
+/* the directory is freed by the poller thread, which walks the list anyway */
+void
+poller_remove(int wd)
+{
+	struct poll_dir *dir;
+
+	pthread_mutex_lock(&poller_lock);
+	if ((dir = lookup_wd(wd))) {
+		wd_dirs[-2 - wd] = NULL;
+		dir->removed = 1;
+		stats.dirs--;
+		if (dir->flags & POLL_EVICTED)
+			stats.evicted--;
+	}
+	pthread_mutex_unlock(&poller_lock);
+}
+
+/*
+ * The directory of @wd was renamed to @path along with its parent tree. The
+ * path of a directory being scanned is only replaced once the scan is over.
+ * A scan that ran between the rename and this call found the directory gone,
+ * so it is scanned again under its new path.
+ */
+void
+poller_move(int wd, const char *path)
+{
+	struct poll_dir *dir;
+	char *copy;
+
+	pthread_mutex_lock(&poller_lock);
+	if ((dir = lookup_wd(wd)) && (copy = strdup(path))) {
+		if (dir->busy) {
+			free(dir->moved_to);
+			dir->moved_to = copy;
+		} else {
+			free(dir->path);
+			dir->path = copy;
+			dir->gone = 0;
+			dir->next_scan = 0;
+			drop_partial(dir);
+		}
+	}
+	pthread_mutex_unlock(&poller_lock);
+}
+
+void
+poller_get_stats(struct poller_stats *out)
+{
+	pthread_mutex_lock(&poller_lock);
+	*out = stats;
+	pthread_mutex_unlock(&poller_lock);
+}
@@ -0,0 +1,62 @@
+/*
+ * Listener - Listens for specific directories events and take actions
+ * based on rules specified by the user.
+ *
+ * Copyright (c) 2005-2017 Lucas C. Villa Real <lucasvr@gobolinux.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#ifndef LISTENER_POLLER_H
+#define LISTENER_POLLER_H 1
+
+/*
+ * Directory scanner used where inotify can't be relied upon: directories
+ * beyond the watch budget, and rules using the poll backend because their
+ * target lives on NFS or FUSE, where inotify misses remote changes. Each
+ * polled directory gets a negative pseudo watch descriptor and its changes
+ * are reported as inotify events, so they go through the same watch table
+ * lookup and rule matching as the kernel ones.
+ */
+
+#define POLL_EVICTED         0x01	/* no inotify watch could be afforded, see the promote hook */
+
+#define POLL_MIN_INTERVAL    500	/* ms between scans of a changing directory */
+#define POLL_MAX_INTERVAL    30000	/* ms between scans of an idle directory */
+#define POLL_PROBE_INTERVAL  10000	/* ms between checks for a free inotify watch */
+#define POLL_DEFAULT_BUDGET  2000	/* directory reads and stats per second */
+
+struct poller_ops {
+	/* called from the poller thread for each change found */
+	void (*emit)(void *owner, int wd, uint32_t mask, uint32_t cookie, const char *name);
+	/* called from the poller thread once inotify watches can be added again */
+	void (*promote)(void *owner);
+};
+
+struct poller_stats {
+	size_t dirs;					/* directories being polled */
+	size_t evicted;					/* ... of which only because of the watch budget */
+	unsigned long long scans;
+	unsigned long long events;
+	unsigned long long promotions;
+	unsigned long long deferred;	/* due scans postponed by the I/O budget */
+};
+
+int  poller_start(const struct poller_ops *ops, unsigned int budget);
+int  poller_add(const char *path, uint32_t mask, int flags, void *owner, int *wd);
+void poller_remove(int wd);
+void poller_move(int wd, const char *path);
+void poller_get_stats(struct poller_stats *stats);
+
+#endif /* LISTENER_POLLER_H */
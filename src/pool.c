@@ -0,0 +1,79 @@
+/*
+ * Listener - Listens for specific directories events and take actions
+ * based on rules specified by the user.
+ *
+ * Copyright (c) 2005-2017 Lucas C. Villa Real <lucasvr@gobolinux.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#include "listener.h"
+#include "pool.h"
+
+void
+pool_init(struct pool *pool, size_t objsize, size_t per_slab)
+{
+	pthread_mutex_init(&pool->lock, NULL);
+	pool->objsize = objsize < sizeof(void *) ? sizeof(void *) : objsize;
+	pool->per_slab = per_slab;
+	pool->free_list = NULL;
+	pool->nslabs = 0;
+	pool->in_use = 0;
+}
+
+/* must be called with the pool lock held */
+static int
+pool_grow(struct pool *pool)
+{
+	char *slab = (char *) malloc(pool->objsize * pool->per_slab);
+	if (! slab) {
+		perror("malloc");
+		return -1;
+	}
+	for (size_t i=0; i<pool->per_slab; ++i) {
+		void **obj = (void **) &slab[i * pool->objsize];
+		*obj = pool->free_list;
+		pool->free_list = obj;
+	}
+	pool->nslabs++;
+	return 0;
+}
+
+/* objects are handed out uninitialized */
+void *
+pool_get(struct pool *pool)
+{
+	void **obj;
+
+	pthread_mutex_lock(&pool->lock);
+	if (! pool->free_list && pool_grow(pool) < 0) {
+		pthread_mutex_unlock(&pool->lock);
+		return NULL;
+	}
+	obj = (void **) pool->free_list;
+	pool->free_list = *obj;
+	pool->in_use++;
+	pthread_mutex_unlock(&pool->lock);
+	return obj;
+}
+
+void
+pool_put(struct pool *pool, void *obj)
+{
+	pthread_mutex_lock(&pool->lock);
+	*(void **) obj = pool->free_list;
+	pool->free_list = obj;
+	pool->in_use--;
+	pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,43 @@
+/*
+ * Listener - Listens for specific directories events and take actions
+ * based on rules specified by the user.
+ *
+ * Copyright (c) 2005-2017 Lucas C. Villa Real <lucasvr@gobolinux.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#ifndef LISTENER_POOL_H
+#define LISTENER_POOL_H 1
+
+/*
+ * Fixed-size object pool. Objects are carved from slabs that are never
+ * returned to the system, so once the pool has grown to the peak number of
+ * objects in flight, getting and putting objects doesn't touch the heap.
+ */
+
+struct pool {
+	pthread_mutex_t lock;
+	size_t objsize;
+	size_t per_slab;
+	void *free_list;			/* released objects, linked through their first word */
+	size_t nslabs;
+	size_t in_use;
+};
+
+void  pool_init(struct pool *pool, size_t objsize, size_t per_slab);
+void *pool_get(struct pool *pool);
+void  pool_put(struct pool *pool, void *obj);
+
+#endif /* LISTENER_POOL_H */
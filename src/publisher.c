@@ -0,0 +1,326 @@
+/*
+ * Listener - Listens for specific directories events and take actions
+ * based on rules specified by the user.
+ *
+ * Copyright (c) 2005-2017 Lucas C. Villa Real <lucasvr@gobolinux.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#include "listener.h"
+#include "publisher.h"
+#include "control.h"
+#include "logger.h"
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+struct subscriber {
+	int fd;						/* -1 if the slot is free */
+	int closing;				/* too slow, closed by the publisher thread */
+	char *buf;					/* ring of bytes not sent yet */
+	size_t head;
+	size_t len;
+	uint32_t dropped;			/* records lost since the last one queued */
+};
+
+static struct {
+	pthread_mutex_t lock;
+	struct subscriber subs[PUBLISH_MAX_SUBSCRIBERS];
+	size_t size;				/* of the buffer of each subscriber */
+	int policy;					/* PUBLISH_* */
+	int listen_fd;				/* -1 if not publishing */
+	int wake_fd;				/* eventfd, written when a buffer gets data */
+	char *path;
+	pthread_t thread;
+	struct publish_stats stats;
+} pub = { .lock = PTHREAD_MUTEX_INITIALIZER, .listen_fd = -1, .wake_fd = -1 };
+
+/* must be called with the lock held */
+static void
+drop_subscriber(struct subscriber *s)
+{
+	close(s->fd);
+	free(s->buf);
+	memset(s, 0, sizeof(*s));
+	s->fd = -1;
+	pub.stats.subscribers--;
+}
+
+static void
+accept_subscriber(void)
+{
+	int fd = accept4(pub.listen_fd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC);
+	char *buf;
+
+	if (fd < 0)
+		return;
+	if (! (buf = (char *) malloc(pub.size))) {
+		close(fd);
+		return;
+	}
+	pthread_mutex_lock(&pub.lock);
+	for (int i=0; i<PUBLISH_MAX_SUBSCRIBERS; ++i) {
+		struct subscriber *s = &pub.subs[i];
+		if (s->fd < 0) {
+			s->fd = fd;
+			s->buf = buf;
+			pub.stats.subscribers++;
+			pthread_mutex_unlock(&pub.lock);
+			return;
+		}
+	}
+	pthread_mutex_unlock(&pub.lock);
+	log_printf(LOG_LEVEL_WARNING, "publish: too many subscribers");
+	free(buf);
+	close(fd);
+}
+
+/* copies @len bytes of @data to the ring of @s, which has room for them */
+static void
+ring_append(struct subscriber *s, const void *data, size_t len)
+{
+	size_t tail = (s->head + s->len) % pub.size;
+	size_t first = tail + len > pub.size ? pub.size - tail : len;
+
+	memcpy(s->buf + tail, data, first);
+	memcpy(s->buf, (const char *) data + first, len - first);
+	s->len += len;
+}
+
+/*
+ * Sends the pending bytes of @s, both parts of the ring at once. Records are
+ * only appended meanwhile, so the lock isn't held while sending.
+ */
+static void
+send_pending(struct subscriber *s)
+{
+	struct iovec iov[2];
+	struct msghdr msg = { .msg_iov = iov };
+	ssize_t n;
+
+	pthread_mutex_lock(&pub.lock);
+	iov[0].iov_base = s->buf + s->head;
+	iov[0].iov_len = s->head + s->len > pub.size ? pub.size - s->head : s->len;
+	iov[1].iov_base = s->buf;
+	iov[1].iov_len = s->len - iov[0].iov_len;
+	msg.msg_iovlen = iov[1].iov_len ? 2 : 1;
+	pthread_mutex_unlock(&pub.lock);
+
+	n = sendmsg(s->fd, &msg, MSG_NOSIGNAL|MSG_DONTWAIT);
+	pthread_mutex_lock(&pub.lock);
+	if (n < 0 && errno != EAGAIN && errno != EINTR) {
+		drop_subscriber(s);
+	} else if (n > 0) {
+		s->head = (s->head + n) % pub.size;
+		s->len -= n;
+		pub.stats.sends++;
+	}
+
+	/* records lost while no others follow are told by a record of their own */
+	if (s->fd >= 0 && s->dropped && s->len + sizeof(struct publish_record) <= pub.size) {
+		struct publish_record gap = { .length = sizeof(gap), .dropped = s->dropped };
+		ring_append(s, &gap, sizeof(gap));
+		s->dropped = 0;
+	}
+	pthread_mutex_unlock(&pub.lock);
+}
+
+static void *
+publish_events(void *data)
+{
+	struct pollfd pfds[PUBLISH_MAX_SUBSCRIBERS+2];
+	struct subscriber *polled[PUBLISH_MAX_SUBSCRIBERS+2];
+
+	while (2) {
+		int n = 2;
+
+		pfds[0] = (struct pollfd) { .fd = pub.wake_fd, .events = POLLIN };
+		pfds[1] = (struct pollfd) { .fd = pub.listen_fd, .events = POLLIN };
+		pthread_mutex_lock(&pub.lock);
+		for (int i=0; i<PUBLISH_MAX_SUBSCRIBERS; ++i) {
+			struct subscriber *s = &pub.subs[i];
+			if (s->fd >= 0 && s->closing) {
+				drop_subscriber(s);
+			} else if (s->fd >= 0) {
+				polled[n] = s;
+				pfds[n++] = (struct pollfd) { .fd = s->fd, .events = POLLIN | (s->len ? POLLOUT : 0) };
+			}
+		}
+		pthread_mutex_unlock(&pub.lock);
+
+		if (poll(pfds, n, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			log_printf(LOG_LEVEL_ERROR, "poll: %s", strerror(errno));
+			return NULL;
+		}
+		if (pfds[0].revents & POLLIN) {
+			uint64_t count;
+			if (read(pub.wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+				log_printf(LOG_LEVEL_WARNING, "publish: %s", strerror(errno));
+		}
+		if (pfds[1].revents & POLLIN)
+			accept_subscriber();
+
+		for (int i=2; i<n; ++i) {
+			struct subscriber *s = polled[i];
+			char discard[512];
+
+			/* subscribers don't talk, only their hangup matters */
+			if (pfds[i].revents & (POLLIN|POLLHUP|POLLERR)) {
+				ssize_t got = recv(s->fd, discard, sizeof(discard), MSG_DONTWAIT);
+				if (got == 0 || (got < 0 && errno != EAGAIN && errno != EINTR)) {
+					pthread_mutex_lock(&pub.lock);
+					drop_subscriber(s);
+					pthread_mutex_unlock(&pub.lock);
+					continue;
+				}
+			}
+			if (s->len)
+				send_pending(s);
+		}
+	}
+	return NULL;
+}
+
+/* the header and strings of the record of @info, returns its length, 0 if over @size */
+size_t
+publish_encode(struct thread_info *info, char *out, size_t size)
+{
+	struct publish_record *rec = (struct publish_record *) out;
+	size_t dir_len = strlen(info->dir), name_len = strlen(info->offending_name);
+	size_t old_len = strlen(info->old_entry), summary_len = strlen(info->summary);
+	size_t len = sizeof(*rec) + dir_len + name_len + old_len + summary_len;
+	char *p = out + sizeof(*rec);
+
+	len = (len + 7) & ~(size_t) 7;
+	if (len > size)
+		return 0;
+	memset(out, 0, len);
+	rec->length = len;
+	rec->rule_id = info->rule->rule_id;
+	rec->time = info->time;
+	rec->mask = info->mask;
+	rec->cookie = info->cookie;
+	rec->dir_len = dir_len;
+	rec->name_len = name_len;
+	rec->old_len = old_len;
+	rec->summary_len = summary_len;
+	memcpy(p, info->dir, dir_len);
+	memcpy(p += dir_len, info->offending_name, name_len);
+	memcpy(p += name_len, info->old_entry, old_len);
+	memcpy(p += old_len, info->summary, summary_len);
+	return len;
+}
+
+/* queues a record per job of @list to every subscriber */
+void
+publisher_post(struct thread_info *list)
+{
+	char out[PUBLISH_MAX_RECORD];
+	int wake = 0;
+
+	if (pub.listen_fd < 0)
+		return;
+	for (struct thread_info *info=list; info; info=info->next) {
+		struct publish_record *rec = (struct publish_record *) out;
+		size_t len = publish_encode(info, out, sizeof(out));
+
+		if (! len)
+			continue;
+		pthread_mutex_lock(&pub.lock);
+		for (int i=0; i<PUBLISH_MAX_SUBSCRIBERS; ++i) {
+			struct subscriber *s = &pub.subs[i];
+
+			if (s->fd < 0 || s->closing)
+				continue;
+			if (s->len + len > pub.size) {
+				if (pub.policy == PUBLISH_DISCONNECT) {
+					s->closing = 1;
+					pub.stats.disconnected++;
+					log_printf(LOG_LEVEL_WARNING, "publish: disconnecting a slow subscriber");
+				} else {
+					s->dropped++;
+					pub.stats.dropped++;
+				}
+				wake = 1;
+				continue;
+			}
+			rec->dropped = s->dropped;
+			s->dropped = 0;
+			wake |= s->len == 0;
+			ring_append(s, out, len);
+			pub.stats.records++;
+		}
+		pthread_mutex_unlock(&pub.lock);
+	}
+	if (wake) {
+		uint64_t one = 1;
+		if (write(pub.wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+			log_printf(LOG_LEVEL_WARNING, "publish: %s", strerror(errno));
+	}
+}
+
+/* creates the socket at @path, so that errors are reported before daemonizing */
+int
+publisher_init(const char *path, size_t buffer_size, int policy)
+{
+	int fd;
+
+	for (int i=0; i<PUBLISH_MAX_SUBSCRIBERS; ++i)
+		pub.subs[i].fd = -1;
+	if ((fd = control_listen(path, "publish")) < 0)
+		return -1;
+	pub.wake_fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	if (pub.wake_fd < 0) {
+		perror("eventfd");
+		close(fd);
+		unlink(path);
+		return -1;
+	}
+	pub.listen_fd = fd;
+	pub.path = strdup(path);
+	pub.size = buffer_size;
+	pub.policy = policy;
+	return 0;
+}
+
+int
+publisher_start(void)
+{
+	if (pub.listen_fd < 0)
+		return 0;
+	if (pthread_create(&pub.thread, NULL, publish_events, NULL) != 0) {
+		perror("pthread_create");
+		return -1;
+	}
+	return 0;
+}
+
+void
+publisher_stop(void)
+{
+	if (pub.listen_fd < 0)
+		return;
+	close(pub.listen_fd);
+	unlink(pub.path);
+}
+
+void
+publisher_get_stats(struct publish_stats *stats)
+{
+	pthread_mutex_lock(&pub.lock);
+	*stats = pub.stats;
+	pthread_mutex_unlock(&pub.lock);
+}
@@ -0,0 +1,77 @@
+/*
+ * Listener - Listens for specific directories events and take actions
+ * based on rules specified by the user.
+ *
+ * Copyright (c) 2005-2017 Lucas C. Villa Real <lucasvr@gobolinux.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#ifndef LISTENER_PUBLISHER_H
+#define LISTENER_PUBLISHER_H 1
+
+/*
+ * Event stream of the rules using 'publish'. Subscribers connect to a Unix
+ * stream socket and read a record per matched event; anything they send is
+ * ignored. Each record is a struct publish_record followed by the watched
+ * directory, the entry name, the old entry of renames and the counts of
+ * summaries, none of them NUL terminated, and padded to a multiple of 8 bytes. Integers are in host
+ * byte order.
+ *
+ * Records are copied to a bounded buffer per subscriber, from which the
+ * publisher thread sends as many as are pending with a single sendmsg().
+ * A subscriber that falls behind until its buffer is full either loses the
+ * records that don't fit, counted in the 'dropped' field of the next record
+ * it gets, or is disconnected, see the --publish-policy option. A record
+ * with a 'rule_id' of 0 only tells about lost records.
+ */
+
+#define PUBLISH_DROP            0
+#define PUBLISH_DISCONNECT      1
+
+#define PUBLISH_MAX_SUBSCRIBERS 16
+#define PUBLISH_DEFAULT_BUFFER  (256 * 1024)
+#define PUBLISH_MAX_BATCH       64	/* jobs of a rule that only publishes, handed out together */
+#define PUBLISH_MAX_RECORD      (sizeof(struct publish_record) + 3*PATH_MAX + 256 + 8)
+
+struct publish_record {
+	uint32_t length;			/* of the record, this header and padding included */
+	uint32_t rule_id;
+	uint64_t time;				/* ns since the epoch, when the event was read */
+	uint32_t mask;				/* inotify mask, IN_MOVED_FROM|IN_MOVED_TO for renames */
+	uint32_t cookie;			/* inotify cookie, 0 for events without one */
+	uint32_t dropped;			/* records lost by the subscriber before this one */
+	uint16_t dir_len;
+	uint16_t name_len;
+	uint16_t old_len;			/* 0 unless renamed */
+	uint16_t summary_len;		/* 0 unless summarized, see 'summarize_on_overload' */
+	uint32_t reserved;
+};
+
+struct publish_stats {
+	size_t subscribers;
+	unsigned long long records;		/* records queued, counted once per subscriber */
+	unsigned long long sends;		/* sendmsg() calls */
+	unsigned long long dropped;
+	unsigned long long disconnected;	/* subscribers dropped for being too slow */
+};
+
+size_t publish_encode(struct thread_info *info, char *out, size_t size);
+int    publisher_init(const char *path, size_t buffer_size, int policy);
+int    publisher_start(void);
+void   publisher_post(struct thread_info *list);
+void   publisher_stop(void);
+void   publisher_get_stats(struct publish_stats *stats);
+
+#endif /* LISTENER_PUBLISHER_H */
@@ -0,0 +1,141 @@
+/*
+ * Listener - Listens for specific directories events and take actions
+ * based on rules specified by the user.
+ *
+ * Copyright (c) 2005-2017 Lucas C. Villa Real <lucasvr@gobolinux.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#include "listener.h"
+#include "rcu.h"
+
+struct rcu_slot {
+	uint64_t epoch;				/* epoch at read_lock time, 0 when quiescent */
+	int nesting;
+} __attribute__((aligned(64)));
+
+struct rcu_retired {
+	void (*release)(void *);
+	void *ptr;
+	uint64_t epoch;
+	struct rcu_retired *next;
+};
+
+static struct rcu_slot slots[RCU_MAX_THREADS];
+static int nslots;
+static uint64_t global_epoch = 1;
+static __thread struct rcu_slot *my_slot;
+
+static pthread_mutex_t retired_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct rcu_retired *retired;
+
+static struct rcu_slot *
+rcu_slot(void)
+{
+	if (! my_slot) {
+		int index = __atomic_fetch_add(&nslots, 1, __ATOMIC_SEQ_CST);
+		if (index >= RCU_MAX_THREADS) {
+			fprintf(stderr, "rcu: too many reader threads\n");
+			abort();
+		}
+		my_slot = &slots[index];
+	}
+	return my_slot;
+}
+
+void
+rcu_read_lock(void)
+{
+	struct rcu_slot *slot = rcu_slot();
+
+	if (slot->nesting++ == 0) {
+		__atomic_store_n(&slot->epoch, __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	}
+}
+
+void
+rcu_read_unlock(void)
+{
+	struct rcu_slot *slot = my_slot;
+
+	if (--slot->nesting == 0)
+		__atomic_store_n(&slot->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/* oldest epoch still observed by a reader, or UINT64_MAX */
+static uint64_t
+rcu_min_epoch(void)
+{
+	uint64_t min = UINT64_MAX;
+	int count = __atomic_load_n(&nslots, __ATOMIC_SEQ_CST);
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	for (int i=0; i<count && i<RCU_MAX_THREADS; ++i) {
+		uint64_t epoch = __atomic_load_n(&slots[i].epoch, __ATOMIC_SEQ_CST);
+		if (epoch && epoch < min)
+			min = epoch;
+	}
+	return min;
+}
+
+void
+rcu_reclaim(void)
+{
+	struct rcu_retired *ready = NULL, **ptr;
+	uint64_t min = rcu_min_epoch();
+
+	pthread_mutex_lock(&retired_lock);
+	for (ptr=&retired; *ptr; ) {
+		struct rcu_retired *entry = *ptr;
+		if (entry->epoch < min) {
+			*ptr = entry->next;
+			entry->next = ready;
+			ready = entry;
+		} else {
+			ptr = &entry->next;
+		}
+	}
+	pthread_mutex_unlock(&retired_lock);
+
+	while (ready) {
+		struct rcu_retired *next = ready->next;
+		ready->release(ready->ptr);
+		free(ready);
+		ready = next;
+	}
+}
+
+/* must be called after the new version has been published */
+void
+rcu_defer(void (*release)(void *), void *ptr)
+{
+	struct rcu_retired *entry = (struct rcu_retired *) malloc(sizeof(struct rcu_retired));
+
+	if (! entry) {
+		perror("malloc");
+		return;
+	}
+	entry->release = release;
+	entry->ptr = ptr;
+
+	pthread_mutex_lock(&retired_lock);
+	entry->epoch = __atomic_fetch_add(&global_epoch, 1, __ATOMIC_SEQ_CST);
+	entry->next = retired;
+	retired = entry;
+	pthread_mutex_unlock(&retired_lock);
+
+	rcu_reclaim();
+}
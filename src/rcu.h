@@ -0,0 +1,42 @@
+/*
+ * Listener - Listens for specific directories events and take actions
+ * based on rules specified by the user.
+ *
+ * Copyright (c) 2005-2017 Lucas C. Villa Real <lucasvr@gobolinux.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#ifndef LISTENER_RCU_H
+#define LISTENER_RCU_H 1
+
+/*
+ * Epoch-based reclamation for data published as immutable snapshots.
+ * Readers bracket their accesses with rcu_read_lock() and rcu_read_unlock(),
+ * which only store to a per-thread slot. Writers build a new version, swap
+ * the published pointer and hand the old version to rcu_defer(), which frees
+ * it once no reader that may have seen it is still inside a read section.
+ */
+
+#define RCU_MAX_THREADS 512
+
+void rcu_read_lock(void);
+void rcu_read_unlock(void);
+void rcu_defer(void (*release)(void *), void *ptr);
+void rcu_reclaim(void);
+
+#define rcu_dereference(p)     __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+#endif /* LISTENER_RCU_H */
@@ -0,0 +1,69 @@
+/*
+ * Listener - Listens for specific directories events and take actions
+ * based on rules specified by the user.
+ *
+ * Copyright (c) 2005-2017 Lucas C. Villa Real <lucasvr@gobolinux.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#include "listener.h"
+#include "ring.h"
+
+int
+ring_init(struct ring *ring, size_t size)
+{
+	if (size == 0 || (size & (size - 1))) {
+		fprintf(stderr, "%zu: ring size must be a power of two\n", size);
+		return -1;
+	}
+	memset(ring, 0, sizeof(*ring));
+	ring->slots = (struct event_record *) calloc(size, sizeof(struct event_record));
+	if (! ring->slots) {
+		perror("calloc");
+		return -1;
+	}
+	ring->size = size;
+	return 0;
+}
+
+/* returns -1 if the ring is full */
+int
+ring_push(struct ring *ring, uint64_t seq, uint64_t after, int wd, uint32_t mask, uint32_t cookie, const char *name)
+{
+	size_t head = ring->head, occupancy;
+	struct event_record *rec;
+
+	occupancy = head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	if (occupancy == ring->size) {
+		ring->full++;
+		return -1;
+	}
+
+	rec = &ring->slots[head & (ring->size - 1)];
+	rec->seq = seq;
+	rec->after = after;
+	rec->wd = wd;
+	rec->mask = mask;
+	rec->cookie = cookie;
+	rec->len = name ? strlen(name) + 1 : 0;
+	if (rec->len)
+		memcpy(rec->name, name, rec->len);
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+	ring->pushed++;
+	if (occupancy + 1 > ring->high_water)
+		ring->high_water = occupancy + 1;
+	return 0;
+}
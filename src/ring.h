@@ -0,0 +1,81 @@
+/*
+ * Listener - Listens for specific directories events and take actions
+ * based on rules specified by the user.
+ *
+ * Copyright (c) 2005-2017 Lucas C. Villa Real <lucasvr@gobolinux.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#ifndef LISTENER_RING_H
+#define LISTENER_RING_H 1
+
+/*
+ * Single-producer, single-consumer ring of copied inotify events. The
+ * producer and the consumer only synchronize through the head and tail
+ * indexes, so neither side ever takes a lock.
+ *
+ * A producer feeding several rings numbers its events in a single sequence,
+ * and tags each one with the sequence number of the last earlier event of
+ * the same entry it pushed to another ring, so that the consumer can drain
+ * the rings in any order without reordering the events of an entry.
+ */
+
+#define RING_DEFAULT_SLOTS 8192
+
+struct event_record {
+	uint64_t seq;				/* 0 if the producer doesn't number its events */
+	uint64_t after;				/* earlier event of the same entry in another ring, 0 if none */
+	int wd;
+	uint32_t mask;
+	uint32_t cookie;
+	uint32_t len;				/* size of @name, including the terminating NUL */
+	char name[NAME_MAX+1];
+};
+
+struct ring {
+	struct event_record *slots;
+	size_t size;				/* number of slots, a power of two */
+	size_t head __attribute__((aligned(64)));	/* next slot to write, owned by the producer */
+	size_t high_water;			/* largest occupancy seen by the producer */
+	uint64_t pushed;
+	uint64_t full;				/* pushes that found the ring full */
+	size_t tail __attribute__((aligned(64)));	/* next slot to read, owned by the consumer */
+};
+
+int  ring_init(struct ring *ring, size_t size);
+int  ring_push(struct ring *ring, uint64_t seq, uint64_t after, int wd, uint32_t mask, uint32_t cookie, const char *name);
+
+static inline struct event_record *
+ring_peek(struct ring *ring)
+{
+	size_t tail = ring->tail;
+	if (tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))
+		return NULL;
+	return &ring->slots[tail & (ring->size - 1)];
+}
+
+static inline void
+ring_release(struct ring *ring)
+{
+	__atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+}
+
+static inline size_t
+ring_occupancy(struct ring *ring)
+{
+	return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+#endif /* LISTENER_RING_H */
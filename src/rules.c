@@ -22,17 +22,76 @@
 #include <json-c/json.h>
 #include "listener.h"
 #include "rules.h"
+#include "plugin.h"
+#include "builtin.h"
+#include "logger.h"
 
 #define TRUE 1
 #define FALSE 0
 #define MIN(x,y) (((x)<(y)) ? (x):(y))
 
+#define MAX_CAPTURE_SIZE (16 << 20)
+
+/* appends @value to @out, single-quoted for the shell */
+static size_t
+quote_value(char *out, size_t size, size_t len, const char *value)
+{
+	if (len < size)
+		out[len] = '\'';
+	len++;
+	for (; *value; ++value) {
+		const char *chunk = *value == '\'' ? "'\\''" : NULL;
+		size_t n = chunk ? 4 : 1;
+		if (len + n < size)
+			memcpy(out + len, chunk ? chunk : value, n);
+		len += n;
+	}
+	if (len < size)
+		out[len] = '\'';
+	return len + 1;
+}
+
+/*
+ * Replaces the variables of @line with their values in a single pass, so
+ * that variables held by the values themselves aren't expanded. The values
+ * come from file names and forwarded events: they are quoted for the shell.
+ */
+static int
+expand_variables(char *line, size_t size, const char **variables, const char **values)
+{
+	char work_line[LINE_MAX];
+	size_t len = 0;
+	const char *p;
+	int i;
+
+	for (p = line; *p; ) {
+		for (i = 0; *p == '$' && variables[i]; ++i) {
+			if (! strncmp(p, variables[i], strlen(variables[i])))
+				break;
+		}
+		if (*p == '$' && variables[i]) {
+			len = quote_value(work_line, sizeof(work_line), len, values[i]);
+			p += strlen(variables[i]);
+		} else {
+			if (len < sizeof(work_line))
+				work_line[len] = *p;
+			len++;
+			p++;
+		}
+	}
+	/* a truncated value would leave its quote open */
+	if (len >= sizeof(work_line) || len >= size)
+		return -1;
+	work_line[len] = '\0';
+	memcpy(line, work_line, len + 1);
+	return 0;
+}
+
 char *
 get_token(char *cmd, int *skip_bytes, char *target, struct thread_info *info)
 {
-	int wi, j, i=0, skip=0;
-	char line[LINE_MAX], work_line[LINE_MAX];
-	char *entry_ptr, *ptr;
+	int i=0, skip=0;
+	char line[LINE_MAX];
 
 	if (! cmd || ! strlen(cmd)) {
 		*skip_bytes = 0;
@@ -40,7 +99,6 @@ get_token(char *cmd, int *skip_bytes, char *target, struct thread_info *info)
 	}
 
 	memset(line, 0, sizeof(line));
-	memset(work_line, 0, sizeof(work_line));
 
 	while (isblank(*cmd)) {
 		cmd++;
@@ -52,31 +110,28 @@ get_token(char *cmd, int *skip_bytes, char *target, struct thread_info *info)
 	}
 	*skip_bytes = skip;
 
-	if ((entry_ptr = strstr(line, "$ENTRY_RELATIVE"))) {
-		for (wi=0, ptr=line; ptr != entry_ptr; ptr++)
-			work_line[wi++] = (*ptr)++;
-		for (j=0; j<strlen(info->offending_name); ++j)
-			work_line[wi++] = info->offending_name[j];
-
-		/* skip '$ENTRY_RELATIVE' and copy the remaining data */
-		for (ptr+=15; *ptr; ptr++)
-			work_line[wi++] = (*ptr)++;
-		strcpy(line, work_line);
-	}
-
-	if ((entry_ptr = strstr(line, "$ENTRY"))) {
-		for (wi=0, ptr=line; ptr != entry_ptr; ptr++)
-			work_line[wi++] = (*ptr)++;
-		for (j=0; j<strlen(target); ++j)
-			work_line[wi++] = target[j];
-		work_line[wi++] = '/';
-		for (j=0; j<strlen(info->offending_name); ++j)
-			work_line[wi++] = info->offending_name[j];
-
-		/* skip '$ENTRY' and copy the remaining data */
-		for (ptr+=6; *ptr; ptr++)
-			work_line[wi++] = (*ptr)++;
-		strcpy(line, work_line);
+	if (strchr(line, '$')) {
+		/* longer names first, $ENTRY is a prefix of $ENTRY_RELATIVE */
+		const char *variables[] = { "$ENTRY_RELATIVE", "$ENTRY", "$OLD_ENTRY", "$NEW_ENTRY",
+			"$SUMMARY", "$HOST", NULL };
+		const char *values[6];
+		char entry[2 * PATH_MAX], host[HOST_NAME_MAX+1] = "localhost";
+
+		snprintf(entry, sizeof(entry), "%s/%s", target, info->offending_name);
+		/* forwarded events, see aggregator.h */
+		if (! info->host[0] && strstr(line, "$HOST") && gethostname(host, sizeof(host)) == 0)
+			host[sizeof(host)-1] = '\0';
+
+		values[0] = info->offending_name;
+		values[1] = entry;
+		/* renames, see handle_rename() */
+		values[2] = info->old_entry;
+		values[3] = entry;
+		/* directory summaries, see overload.h */
+		values[4] = info->summary;
+		values[5] = info->host[0] ? info->host : host;
+		if (expand_variables(line, sizeof(line), variables, values) < 0)
+			return NULL;
 	}
 	return strdup(line);
 }
@@ -142,6 +197,11 @@ void print_json_value(json_object *jobj)
 static json_bool
 map_description(char *key, json_object *val, watch_t *watch)
 {
+	const char *strval = json_object_get_string(val);
+	if (strval) {
+		free(watch->description);
+		watch->description = strdup(strval);
+	}
 	return TRUE;
 }
 
@@ -156,6 +216,7 @@ map_target(char *key, json_object *val, watch_t *watch)
 			return FALSE;
 		}
 		watch->target[n] = '\0';
+		watch->glob = strpbrk(watch->target, "*?[") ? 1 : 0;
 		return TRUE;
 	}
 	return FALSE;
@@ -193,6 +254,28 @@ map_spawn(char *key, json_object *val, watch_t *watch)
 	return FALSE;
 }
 
+static json_bool
+map_plugin(char *key, json_object *val, watch_t *watch)
+{
+	const char *strval = json_object_get_string(val);
+	if (strval) {
+		watch->plugin = plugin_load(strval);
+		return watch->plugin ? TRUE : FALSE;
+	}
+	return FALSE;
+}
+
+static json_bool
+map_builtin(char *key, json_object *val, watch_t *watch)
+{
+	const char *strval = json_object_get_string(val);
+	if (strval) {
+		watch->builtin = builtin_load(strval);
+		return watch->builtin ? TRUE : FALSE;
+	}
+	return FALSE;
+}
+
 static json_bool
 map_lookat(char *key, json_object *val, watch_t *watch)
 {
@@ -236,6 +319,100 @@ map_regex(char *key, json_object *val, watch_t *watch)
 	return FALSE;
 }
 
+static struct exclude *
+rule_exclude(watch_t *watch)
+{
+	if (! watch->exclude) {
+		watch->exclude = (struct exclude *) calloc(1, sizeof(struct exclude));
+		if (! watch->exclude)
+			perror("calloc");
+	}
+	return watch->exclude;
+}
+
+static json_bool
+map_exclude(char *key, json_object *val, watch_t *watch)
+{
+	const char *strval = json_object_get_string(val);
+	struct exclude *exclude = rule_exclude(watch);
+	char *patterns, *glob, *saveptr = NULL;
+
+	if (! strval || ! exclude)
+		return FALSE;
+
+	patterns = strdup(strval);
+	for (glob=strtok_r(patterns, " \t", &saveptr); glob; glob=strtok_r(NULL, " \t", &saveptr)) {
+		char **globs = (char **) realloc(exclude->globs, (exclude->nglobs + 1) * sizeof(char *));
+		if (! globs) {
+			perror("realloc");
+			free(patterns);
+			return FALSE;
+		}
+		exclude->globs = globs;
+		exclude->globs[exclude->nglobs++] = strdup(glob);
+	}
+	free(patterns);
+	return TRUE;
+}
+
+static json_bool
+map_exclude_regex(char *key, json_object *val, watch_t *watch)
+{
+	const char *strval = json_object_get_string(val);
+	struct exclude *exclude = rule_exclude(watch);
+
+	if (strval && exclude) {
+		int n = snprintf(exclude->regex_rule, sizeof(exclude->regex_rule)-1, "%s", strval);
+		if (n < 0) {
+			fprintf(stderr, "%s: failed to format string\n", strval);
+			return FALSE;
+		}
+
+		n = regcomp(&exclude->regex, exclude->regex_rule, REG_EXTENDED|REG_NOSUB);
+		if (n != 0) {
+			char err_msg[256];
+			regerror(n, &exclude->regex, err_msg, sizeof(err_msg) - 1);
+			fprintf(stderr, "\"%s\": %s\n", exclude->regex_rule, err_msg);
+			return FALSE;
+		}
+		return TRUE;
+	}
+	return FALSE;
+}
+
+/*
+ * Tells if @path, or its entry @name when set, is excluded from the rule of
+ * @watch. Globs without a slash are matched against the entry name, other
+ * globs and the regex against the path relative to the rule target.
+ */
+int
+exclude_match(const watch_t *watch, const char *path, const char *name)
+{
+	const struct exclude *exclude = watch->exclude;
+	const char *rel, *base;
+	char buf[PATH_MAX];
+
+	rel = path + strlen(watch->root->target);
+	while (*rel == '/')
+		rel++;
+	if (name) {
+		snprintf(buf, sizeof(buf), "%s%s%s", rel, *rel ? "/" : "", name);
+		rel = buf;
+		base = name;
+	} else {
+		base = strrchr(rel, '/') ? strrchr(rel, '/') + 1 : rel;
+	}
+
+	for (int i=0; i<exclude->nglobs; ++i) {
+		const char *glob = exclude->globs[i];
+		if (strchr(glob, '/') ? fnmatch(glob, rel, FNM_PATHNAME) == 0 : fnmatch(glob, base, 0) == 0)
+			return 1;
+	}
+	if (exclude->regex_rule[0] && regexec(&exclude->regex, rel, 0, NULL, 0) == 0)
+		return 1;
+	return 0;
+}
+
 static json_bool
 map_depth(char *key, json_object *val, watch_t *watch)
 {
@@ -251,6 +428,111 @@ map_depth(char *key, json_object *val, watch_t *watch)
 	return FALSE;
 }
 
+static json_bool
+map_priority(char *key, json_object *val, watch_t *watch)
+{
+	const char *strval = json_object_get_string(val);
+	if (strval) {
+		if (! strcasecmp(strval, "HIGH"))
+			watch->priority = PRIORITY_HIGH;
+		else if (! strcasecmp(strval, "NORMAL"))
+			watch->priority = PRIORITY_NORMAL;
+		else if (! strcasecmp(strval, "LOW"))
+			watch->priority = PRIORITY_LOW;
+		else {
+			fprintf(stderr, "%s: invalid value for 'priority' option\n", strval);
+			return FALSE;
+		}
+		return TRUE;
+	}
+	return FALSE;
+}
+
+static json_bool
+map_backend(char *key, json_object *val, watch_t *watch)
+{
+	const char *strval = json_object_get_string(val);
+	if (strval) {
+		if (! strcasecmp(strval, "INOTIFY"))
+			watch->backend = BACKEND_INOTIFY;
+		else if (! strcasecmp(strval, "POLL"))
+			watch->backend = BACKEND_POLL;
+		else if (! strcasecmp(strval, "REMOTE"))
+			watch->backend = BACKEND_REMOTE;
+		else {
+			fprintf(stderr, "%s: invalid value for 'backend' option\n", strval);
+			return FALSE;
+		}
+		return TRUE;
+	}
+	return FALSE;
+}
+
+/* TRUE/YES or FALSE/NO options, stored in @field */
+static json_bool
+map_boolean(char *key, json_object *val, int *field)
+{
+	const char *strval = json_object_get_string(val);
+	if (strval) {
+		if (! strcasecmp(strval, "TRUE") || ! strcasecmp(strval, "YES"))
+			*field = 1;
+		else if (! strcasecmp(strval, "FALSE") || ! strcasecmp(strval, "NO"))
+			*field = 0;
+		else {
+			fprintf(stderr, "%s: invalid value for '%s' option\n", strval, key);
+			return FALSE;
+		}
+		return TRUE;
+	}
+	return FALSE;
+}
+
+static json_bool
+map_content_only(char *key, json_object *val, watch_t *watch)
+{
+	return map_boolean(key, val, &watch->content_only);
+}
+
+static json_bool
+map_ignore_own(char *key, json_object *val, watch_t *watch)
+{
+	return map_boolean(key, val, &watch->ignore_own);
+}
+
+static json_bool
+map_summarize(char *key, json_object *val, watch_t *watch)
+{
+	return map_boolean(key, val, &watch->summarize);
+}
+
+static json_bool
+map_publish(char *key, json_object *val, watch_t *watch)
+{
+	return map_boolean(key, val, &watch->publish);
+}
+
+static json_bool
+map_forward(char *key, json_object *val, watch_t *watch)
+{
+	return map_boolean(key, val, &watch->forward);
+}
+
+static json_bool
+map_capture_output(char *key, json_object *val, watch_t *watch)
+{
+	const char *strval = json_object_get_string(val);
+	if (strval) {
+		long size = atol(strval);
+		if (size <= 0 || size > MAX_CAPTURE_SIZE) {
+			fprintf(stderr, "%s: invalid value for 'capture_output' option\n", strval);
+			return FALSE;
+		}
+		watch->output = log_capture_create(size);
+		return watch->output ? TRUE : FALSE;
+	}
+	return FALSE;
+}
+
 static json_bool
 map_keyvalue(int rulenr, char *key, json_object *val, watch_t *watch)
 {
@@ -263,9 +545,21 @@ map_keyvalue(int rulenr, char *key, json_object *val, watch_t *watch)
 		{ "target",      map_target },
 		{ "watches",     map_watches },
 		{ "spawn",       map_spawn },
+		{ "plugin",      map_plugin },
+		{ "builtin",     map_builtin },
 		{ "lookat",      map_lookat },
 		{ "regex",       map_regex },
 		{ "depth",       map_depth },
+		{ "exclude",     map_exclude },
+		{ "exclude_regex", map_exclude_regex },
+		{ "priority",    map_priority },
+		{ "backend",     map_backend },
+		{ "on_content_change_only", map_content_only },
+		{ "capture_output", map_capture_output },
+		{ "ignore_own_events", map_ignore_own },
+		{ "summarize_on_overload", map_summarize },
+		{ "publish",     map_publish },
+		{ "forward",     map_forward },
 		{ NULL,          NULL }
 	}, *ptr;
 
@@ -294,14 +588,22 @@ watch_sanity_check(watch_t *watch)
 		fprintf(stderr, "Config file error: 'watches' option is not set\n");
 		return FALSE;
 	}
-	if (!watch->spawn[0]) {
-		fprintf(stderr, "Config file error: 'spawn' option is not set\n");
+	if (!watch->spawn[0] && !watch->plugin && !watch->builtin && !watch->publish && !watch->forward) {
+		fprintf(stderr, "Config file error: no action set, one of 'spawn', 'plugin', 'builtin', 'publish' or 'forward' is required\n");
+		return FALSE;
+	}
+	if ((watch->spawn[0] ? 1 : 0) + (watch->plugin ? 1 : 0) + (watch->builtin ? 1 : 0) > 1) {
+		fprintf(stderr, "Config file error: 'spawn', 'plugin' and 'builtin' are mutually exclusive\n");
 		return FALSE;
 	}
 	if (!watch->lookat) {
 		fprintf(stderr, "Config file error: 'lookat' option is not set\n");
 		return FALSE;
 	}
+	if (watch->backend == BACKEND_REMOTE && (watch->content_only || watch->ignore_own)) {
+		fprintf(stderr, "Config file error: rules with a REMOTE backend can't look at their entries\n");
+		return FALSE;
+	}
 #if 0
 	if (!watch->regex_rule[0]) {
 		fprintf(stderr, "Config file error: 'regex' option is not set\n");
@@ -335,6 +637,8 @@ read_json_object(int rulenr, json_object *jobj, watch_t *watch)
 	}
 	if (ret == TRUE)
 		ret = watch_sanity_check(watch);
+	if (ret == TRUE && watch->plugin)
+		watch->plugin->rule = watch->description ? watch->description : watch->target;
 	return ret;
 }
 
@@ -342,7 +646,7 @@ static watch_t *
 read_json_array(json_object *jobj, char *key)
 {
 	json_object *jarray = jobj;
-	watch_t *head = NULL, *prev = NULL;
+	watch_t *head = NULL;
 
 	if (key && !json_object_object_get_ex(jobj, key, &jarray))
 		return NULL;
@@ -361,15 +665,15 @@ read_json_array(json_object *jobj, char *key)
 			perror("calloc");
 			return NULL;
 		}
-		if (prev)
-			prev->next = watch;
 		if (head == NULL)
 			head = watch;
 
+		watch->rule_id = i+1;
 		if (read_json_object(i+1, entry, watch) == FALSE)
 			return NULL;
 
-		prev = monitor_directory(i+1, watch);
+		/* adds the rule to the watch table of its shard */
+		monitor_directory(i+1, watch);
 	}
 
 	return head;
@@ -21,6 +21,17 @@
 #ifndef LISTENER_RULES_H
 #define LISTENER_RULES_H 1
 
+/* subtrees left out of a rule, see the 'exclude' and 'exclude_regex' options */
+struct exclude {
+	char **globs;
+	int nglobs;
+	regex_t regex;
+	char regex_rule[LINE_MAX];
+	unsigned long excluded_dirs;	/* directories skipped by the last crawl of the rule */
+	unsigned long excluded_events;	/* events dropped by handle_events() */
+};
+
+int      exclude_match(const watch_t *watch, const char *path, const char *name);
 char    *get_token(char *cmd, int *skip_bytes, char *pathname, struct thread_info *info);
 watch_t *read_config(char *config_file);
 
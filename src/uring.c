@@ -0,0 +1,202 @@
+/*
+ * Listener - Listens for specific directories events and take actions
+ * based on rules specified by the user.
+ *
+ * Copyright (c) 2005-2017 Lucas C. Villa Real <lucasvr@gobolinux.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#include "listener.h"
+#include "uring.h"
+#include <sys/mman.h>
+#include <linux/io_uring.h>
+
+struct uring {
+	int fd;
+	unsigned int entries;
+	char *sq;					/* mappings, released by uring_destroy() */
+	char *cq;
+	size_t sq_size;
+	size_t cq_size;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+	struct uring_stats stats;
+};
+
+static inline int
+io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(SYS_io_uring_setup, entries, p);
+}
+
+static inline int
+io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+	return syscall(SYS_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+/* returns NULL, with errno set, if io_uring can't be used */
+struct uring *
+uring_create(unsigned int entries)
+{
+	struct io_uring_params p = { 0 };
+	struct uring *ring = (struct uring *) calloc(1, sizeof(struct uring));
+	size_t sq_size, cq_size;
+	char *sq, *cq;
+
+	if (! ring)
+		return NULL;
+	ring->fd = io_uring_setup(entries, &p);
+	if (ring->fd < 0)
+		goto fail;
+
+	sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+
+	sq = mmap(NULL, sq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		goto fail_fd;
+	cq = sq;
+	if (! (p.features & IORING_FEAT_SINGLE_MMAP)) {
+		cq = mmap(NULL, cq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED)
+			goto fail_fd;
+	}
+	ring->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ|PROT_WRITE,
+		MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto fail_fd;
+
+	ring->sq = sq;
+	ring->cq = cq;
+	ring->sq_size = sq_size;
+	ring->cq_size = cq_size;
+	ring->entries = p.sq_entries;
+	ring->sq_head = (unsigned int *) (sq + p.sq_off.head);
+	ring->sq_tail = (unsigned int *) (sq + p.sq_off.tail);
+	ring->sq_mask = (unsigned int *) (sq + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned int *) (sq + p.sq_off.array);
+	ring->cq_head = (unsigned int *) (cq + p.cq_off.head);
+	ring->cq_tail = (unsigned int *) (cq + p.cq_off.tail);
+	ring->cq_mask = (unsigned int *) (cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+	return ring;
+
+fail_fd:
+	close(ring->fd);
+fail:
+	free(ring);
+	return NULL;
+}
+
+/* moves the completions to @results; returns how many were found */
+static size_t
+reap(struct uring *ring, int *results)
+{
+	unsigned int head = *ring->cq_head, tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	size_t count = 0;
+
+	for (; head != tail; ++head, ++count) {
+		struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+		results[cqe->user_data] = cqe->res;
+	}
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	return count;
+}
+
+/*
+ * Stats @count paths, following symlinks as stat(2) does. Each result is 0
+ * or a negative errno. Returns -1 if the requests couldn't be submitted; the
+ * ones the kernel took have completed by then, so @bufs can be reused, but
+ * the ring may still hold the others and must be destroyed.
+ */
+int
+uring_statx(struct uring *ring, const char **paths, struct statx *bufs, int *results, size_t count)
+{
+	int error;
+
+	ring->stats.batches++;
+	for (size_t done=0; done<count; ) {
+		unsigned int tail = *ring->sq_tail, n = 0, submitted = 0;
+		size_t completed = 0;
+
+		for (; n < ring->entries && done + n < count; ++n, ++tail) {
+			unsigned int index = tail & *ring->sq_mask;
+			struct io_uring_sqe *sqe = &ring->sqes[index];
+
+			memset(sqe, 0, sizeof(*sqe));
+			sqe->opcode = IORING_OP_STATX;
+			sqe->fd = AT_FDCWD;
+			sqe->addr = (unsigned long) paths[done+n];
+			sqe->len = STATX_TYPE|STATX_MODE;
+			sqe->off = (unsigned long) &bufs[done+n];
+			sqe->user_data = done + n;
+			ring->sq_array[index] = index;
+		}
+		__atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+		while (completed < n) {
+			int ret = io_uring_enter(ring->fd, n - submitted, n - completed, IORING_ENTER_GETEVENTS);
+			ring->stats.enters++;
+			if (ret < 0 && errno != EINTR)
+				goto drain;
+			if (ret > 0)
+				submitted += ret;
+			completed += reap(ring, results);
+		}
+		ring->stats.ops += n;
+		done += n;
+		continue;
+
+drain:
+		error = errno;
+		/* the kernel posts their completions even if it won't take new requests */
+		while (completed < submitted) {
+			struct timespec pause = { 0, 1000000 };
+			if (io_uring_enter(ring->fd, 0, submitted - completed, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)
+				nanosleep(&pause, NULL);
+			completed += reap(ring, results);
+		}
+		errno = error;
+		return -1;
+	}
+	return 0;
+}
+
+void
+uring_destroy(struct uring *ring)
+{
+	munmap(ring->sqes, ring->entries * sizeof(struct io_uring_sqe));
+	if (ring->cq != ring->sq)
+		munmap(ring->cq, ring->cq_size);
+	munmap(ring->sq, ring->sq_size);
+	close(ring->fd);
+	free(ring);
+}
+
+void
+uring_get_stats(struct uring *ring, struct uring_stats *stats)
+{
+	*stats = ring->stats;
+}
@@ -0,0 +1,47 @@
+/*
+ * Listener - Listens for specific directories events and take actions
+ * based on rules specified by the user.
+ *
+ * Copyright (c) 2005-2017 Lucas C. Villa Real <lucasvr@gobolinux.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#ifndef LISTENER_URING_H
+#define LISTENER_URING_H 1
+
+/*
+ * Minimal io_uring client, used by the dispatchers to stat the entries of a
+ * whole batch of events with a single system call. It talks to the kernel
+ * through the raw system calls, so no liburing is needed; uring_create()
+ * fails where the kernel lacks io_uring or has it disabled, and callers then
+ * keep to the synchronous calls.
+ */
+
+#define URING_ENTRIES 128
+
+struct uring;
+
+struct uring_stats {
+	unsigned long long batches;		/* uring_statx() calls */
+	unsigned long long ops;			/* statx requests completed */
+	unsigned long long enters;		/* io_uring_enter system calls */
+};
+
+struct uring *uring_create(unsigned int entries);
+int  uring_statx(struct uring *ring, const char **paths, struct statx *bufs, int *results, size_t count);
+void uring_get_stats(struct uring *ring, struct uring_stats *stats);
+void uring_destroy(struct uring *ring);
+
+#endif /* LISTENER_URING_H */
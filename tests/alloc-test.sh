@@ -0,0 +1,86 @@
+#!/bin/sh
+# Checks that the reader and dispatcher threads make no heap allocation per
+# event once warmed up, see src/pool.h. The daemon runs with alloccount.so
+# preloaded; the counts of its threads are taken after two bursts of events,
+# which grow the pools to their peak, and again after a third burst half the
+# size of the first. The rules publish every event, and spawn an action for
+# the files matching a regex, so the stat, regex and executor paths of the
+# dispatcher are all taken. The pools may still grab a slab when more events
+# happen to be in flight than before, so each thread is allowed MAX_SLABS
+# allocations in all. Run by "make check".
+
+top=$(cd "$(dirname "$0")/.." && pwd)
+tmp=$(mktemp -d)
+events=${EVENTS:-5000}
+max_slabs=4
+pid=
+
+cleanup() {
+	[ -n "$pid" ] && kill "$pid" 2>/dev/null
+	rm -rf "$tmp"
+}
+trap cleanup EXIT
+
+burst() {
+	i=0
+	while [ $i -lt "$1" ]; do
+		: > "$tmp/w/f$i"
+		i=$((i + 1))
+	done
+	rm -f "$tmp"/w/f*
+	sleep 1
+	# the actions are over once the workers have no child left
+	while pgrep -P "$pid" > /dev/null; do
+		sleep 0.1
+	done
+}
+
+snapshot() {
+	kill -USR2 "$pid"
+	sleep 0.2
+}
+
+${CC:-cc} -shared -fPIC -O2 -o "$tmp/alloccount.so" "$top/tests/alloccount.c" || exit 1
+mkdir "$tmp/w"
+cat > "$tmp/listener.conf" <<CONF
+{ "rules": [ {
+    "target":  "$tmp/w",
+    "watches": "CREATE|CLOSE_WRITE|DELETE",
+    "lookat":  "FILES",
+    "publish": "TRUE"
+  }, {
+    "target":  "$tmp/w",
+    "watches": "CLOSE_WRITE",
+    "lookat":  "FILES",
+    "regex":   "^f[0-9]*0\$",
+    "spawn":   "true \$ENTRY"
+} ] }
+CONF
+
+ALLOC_REPORT="$tmp/report" LD_PRELOAD="$tmp/alloccount.so" \
+	"$top/bin/listener" -d -L none -c "$tmp/listener.conf" -p "$tmp/publish.sock" > /dev/null 2>&1 &
+pid=$!
+while [ ! -S "$tmp/publish.sock" ]; do
+	kill -0 "$pid" 2>/dev/null || { echo "alloc-test: listener didn't start"; exit 1; }
+	sleep 0.1
+done
+
+burst $((events * 2)); burst $((events * 2)); snapshot
+burst $events; snapshot
+
+# three events (CREATE, CLOSE_WRITE, DELETE) per file
+awk -v events=$((events * 3)) -v max_slabs=$max_slabs '
+	/^--$/ { snap++; next }
+	{ count[snap, $1] = $2; names[$1] = 1 }
+	END {
+		for (name in names) {
+			delta = count[2, name] - count[1, name]
+			printf "alloc-test: %-12s %d allocations for %d events\n", name, delta, events
+			if (name ~ /^(reader|dispatch)\// && delta > max_slabs)
+				failed = 1
+		}
+		exit failed
+	}' "$tmp/report"
+status=$?
+[ $status -eq 0 ] && echo "alloc-test: PASS" || echo "alloc-test: FAIL"
+exit $status
@@ -0,0 +1,163 @@
+/*
+ * Listener - Listens for specific directories events and take actions
+ * based on rules specified by the user.
+ *
+ * Copyright (c) 2005-2017 Lucas C. Villa Real <lucasvr@gobolinux.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * LD_PRELOAD library counting the heap allocations made by each thread, see
+ * alloc-test.sh. On SIGUSR2 it appends a snapshot of the counts, one
+ * "NAME COUNT" line per thread after a "--" line, to the file named by the
+ * ALLOC_REPORT environment variable. Only async-signal-safe calls are made
+ * from the handler.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#define MAX_THREADS 256
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+struct counter {
+	pid_t tid;
+	unsigned long count;
+};
+
+static struct counter counters[MAX_THREADS];
+static int ncounters;
+static __thread struct counter *mine;
+
+static void
+count(void)
+{
+	if (! mine) {
+		int i = __atomic_fetch_add(&ncounters, 1, __ATOMIC_RELAXED);
+		if (i >= MAX_THREADS)
+			return;
+		mine = &counters[i];
+		mine->tid = syscall(SYS_gettid);
+	}
+	__atomic_store_n(&mine->count, mine->count + 1, __ATOMIC_RELAXED);
+}
+
+void *
+malloc(size_t size)
+{
+	count();
+	return __libc_malloc(size);
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+	count();
+	return __libc_calloc(nmemb, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+	count();
+	return __libc_realloc(ptr, size);
+}
+
+int
+posix_memalign(void **ptr, size_t alignment, size_t size)
+{
+	count();
+	*ptr = __libc_memalign(alignment, size);
+	return *ptr ? 0 : ENOMEM;
+}
+
+void *
+aligned_alloc(size_t alignment, size_t size)
+{
+	count();
+	return __libc_memalign(alignment, size);
+}
+
+/* writes @n in decimal after @p, returns the end of the digits */
+static char *
+format_ulong(char *p, unsigned long n)
+{
+	char digits[24];
+	int len = 0;
+
+	do {
+		digits[len++] = '0' + n % 10;
+		n /= 10;
+	} while (n);
+	while (len)
+		*p++ = digits[--len];
+	return p;
+}
+
+static void
+report(int signum)
+{
+	const char *path = getenv("ALLOC_REPORT");
+	int fd, n = __atomic_load_n(&ncounters, __ATOMIC_RELAXED);
+
+	if (! path || (fd = open(path, O_WRONLY|O_CREAT|O_APPEND, 0644)) < 0)
+		return;
+	if (write(fd, "--\n", 3) < 0)
+		n = 0;
+	for (int i=0; i<n && i<MAX_THREADS; ++i) {
+		char line[64], proc[64] = "/proc/self/task/", *p;
+		ssize_t len;
+		int comm;
+
+		p = format_ulong(proc + strlen(proc), counters[i].tid);
+		strcpy(p, "/comm");
+		if ((comm = open(proc, O_RDONLY)) < 0)
+			continue;
+		len = read(comm, line, 16);
+		close(comm);
+		if (len <= 0)
+			continue;
+		p = line + len - 1;
+		*p++ = ' ';
+		p = format_ulong(p, __atomic_load_n(&counters[i].count, __ATOMIC_RELAXED));
+		*p++ = '\n';
+		if (write(fd, line, p - line) < 0)
+			break;
+	}
+	close(fd);
+}
+
+__attribute__((constructor))
+static void
+setup(void)
+{
+	struct sigaction sa;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = report;
+	sa.sa_flags = SA_RESTART;
+	sigaction(SIGUSR2, &sa, NULL);
+}
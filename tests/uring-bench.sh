@@ -0,0 +1,70 @@
+#!/bin/sh
+# Compares the synchronous stat() of event entries with the --io-uring
+# batches. For each mode the daemon watches a depth-2 tree with a rule that
+# looks at directories only, so that every event needs its entry stat'ed,
+# while FILES files are created in it. Reported are the classification
+# counters of the statistics and the CPU time of the daemon in clock ticks,
+# read from /proc. The page cache is warm on both runs.
+#
+# usage: tests/uring-bench.sh [FILES] (default: 60000)
+
+top=$(cd "$(dirname "$0")/.." && pwd)
+tmp=$(mktemp -d)
+files=${1:-60000}
+dirs=20
+pid=
+
+cleanup() {
+	[ -n "$pid" ] && kill "$pid" 2>/dev/null
+	rm -rf "$tmp"
+}
+trap cleanup EXIT
+
+cpu_ticks() {
+	# utime and stime, after the parenthesized command name
+	sed 's/.*) //' "/proc/$1/stat" | awk '{ print $12 + $13 }'
+}
+
+
+run() {
+	mode=$1; shift
+	rm -rf "$tmp/tree" "$tmp/stats"
+	for d in $(seq $dirs); do
+		mkdir -p "$tmp/tree/$d"
+	done
+	"$top/bin/listener" -d -L none -s 1 "$@" -c "$tmp/listener.conf" > "$tmp/stats" 2>&1 &
+	pid=$!
+	sleep 1
+	start=$(cpu_ticks $pid)
+	for d in $(seq $dirs); do
+		seq -f "$tmp/tree/$d/f%g" $((files / dirs))
+	done | xargs touch
+	# the daemon is done once it stops using CPU
+	ticks=-1
+	while [ "$ticks" != "$(cpu_ticks $pid)" ]; do
+		ticks=$(cpu_ticks $pid)
+		sleep 1
+	done
+	ticks=$((ticks - start))
+	kill -USR1 "$pid"
+	sleep 0.5
+	kill "$pid"
+	wait "$pid" 2>/dev/null
+	pid=
+	printf "%-5s %5d CPU ticks, " "$mode:" "$ticks"
+	grep "classification" "$tmp/stats" | tail -1 | sed 's/^shard 0 classification: //'
+}
+
+cat > "$tmp/listener.conf" <<CONF
+{ "rules": [ {
+    "target":  "$tmp/tree",
+    "watches": "CREATE|CLOSE_WRITE|ATTRIB",
+    "spawn":   "true",
+    "lookat":  "DIRS",
+    "depth":   "2"
+} ] }
+CONF
+
+echo "$files files in $dirs directories"
+run sync
+run -U -U